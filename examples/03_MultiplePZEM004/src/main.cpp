@@ -116,10 +116,10 @@ void setup(){
 
     // obtain a reference to Metrics structure of a specific PZEM instance,
     // it is required to cast it to structure for the specific model
-    const auto *m =(const pz004::metrics*)meters->getMetrics(PZEM_ID_1);
+    auto m = std::static_pointer_cast<const pz004::metrics>(meters->getMetrics(PZEM_ID_1));
 
     if (m){ // sanity check - make sure that a requested PZEM ID is valid and we have a real struct reference
-        Serial.printf("Power value for '%s' is %f watts\n", meters->getDescr(PZEM_ID_1), m->asFloat(meter_t::pwr));
+        Serial.printf("Power value for '%s' is %f watts\n", meters->getDescr(PZEM_ID_1).get(), m->asFloat(meter_t::pwr));
     }
 
     //    Run autopollig in background for all devs in pool
@@ -169,7 +169,7 @@ void loop(){
 void mycallback(uint8_t id, const RX_msg* m){
 
     // Here I can get the id of PZEM (might get handy if have more than one attached)
-    Serial.printf("\nTime: %ld - Callback triggered for PZEM ID: %d, name: %s\n", millis(), id,  meters->getDescr(id));
+    Serial.printf("\nTime: %ld - Callback triggered for PZEM ID: %d, name: %s\n", millis(), id,  meters->getDescr(id).get());
 
 /*
     //So now we have a notification that pzem device with ID 'id' has been updated, we can print (or send somewhere new data)
@@ -177,7 +177,7 @@ void mycallback(uint8_t id, const RX_msg* m){
     if (meters->getState(id)->dataStale())
         return;   // something is wrong, message is either bad or not a data packet
 
-    auto s = (const pz004::state*)meters->getState(id);
+    auto s = std::static_pointer_cast<const pz004::state>(meters->getState(id));
     Serial.printf("===\nPower alarm: %s\n", s->alarm ? "present" : "absent");
 
     Serial.printf("Voltage:\t%d dV\t~ %.1f volts\n", s->data.voltage, s->data.asFloat(pzmbus::meter_t::vol));
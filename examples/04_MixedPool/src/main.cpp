@@ -161,10 +161,10 @@ void setup(){
 
     // obtain a reference to Metrics structure of a specific PZEM instance,
     // it is reuired to cast it to structure for the specific model
-    const auto *m1 =(const pz004::metrics*)meters->getMetrics(PZEM_ID_1);
+    auto m1 = std::static_pointer_cast<const pz004::metrics>(meters->getMetrics(PZEM_ID_1));
 
     if (m1){ // sanity check - make sure that a requested PZEM ID is valid and we have a real struct reference
-        Serial.printf("Power value for '%s' is %f watts\n", meters->getDescr(PZEM_ID_1), m1->asFloat(meter_t::pwr));
+        Serial.printf("Power value for '%s' is %f watts\n", meters->getDescr(PZEM_ID_1).get(), m1->asFloat(meter_t::pwr));
     }
 
 
@@ -172,10 +172,10 @@ void setup(){
 
     // obtain a reference to Metrics structure of a specific PZEM instance,
     // it is reuired to cast it to structure for the specific model
-    const auto *m4 =(const pz003::metrics*)meters->getMetrics(PZEM_ID_4);
+    auto m4 = std::static_pointer_cast<const pz003::metrics>(meters->getMetrics(PZEM_ID_4));
 
     if (m4){ // sanity check - make sure that a requested PZEM ID is valid and we have a real struct reference
-        Serial.printf("Voltage for '%s' is %d volts\n", meters->getDescr(PZEM_ID_1), m4->voltage);
+        Serial.printf("Voltage for '%s' is %d volts\n", meters->getDescr(PZEM_ID_1).get(), m4->voltage);
     }
 
 
@@ -225,7 +225,7 @@ void loop(){
  * @param m - this will be the struct with PZEM data (not only metrics, but any one)
  */
 void mycallback(uint8_t id, const RX_msg* m){
-    Serial.printf("\nTime: %ld / Heap: %d - Callback triggered for PZEM ID: %d, name: %s\n", millis(), ESP.getFreeHeap(), id,  meters->getDescr(id));
+    Serial.printf("\nTime: %ld / Heap: %d - Callback triggered for PZEM ID: %d, name: %s\n", millis(), ESP.getFreeHeap(), id,  meters->getDescr(id).get());
 
 /*
     Since we have mexed pool of PZEM devies, we need to find out wich device in particular we've got this message from,
@@ -236,7 +236,7 @@ void mycallback(uint8_t id, const RX_msg* m){
             pz004::rx_msg_prettyp(m);       // parse incoming message and print some nice info
 
             // or we can access struct data for the updated object (an example)
-            auto *s = (const pz004::state*)meters->getState(id);
+            auto s = std::static_pointer_cast<const pz004::state>(meters->getState(id));
             Serial.printf("===\nPower alarm: %s\n", s->alarm ? "present" : "absent");
             Serial.printf("Power factor: %d\n", s->data.pf);
             Serial.printf("Current value: %f\n", s->data.asFloat(meter_t::cur));
@@ -246,7 +246,7 @@ void mycallback(uint8_t id, const RX_msg* m){
             pz003::rx_msg_prettyp(m);       // parse incoming message and print some nice info
 
             // or we can access struct data for the updated object
-            auto *s = (const pz003::state*)meters->getState(id);
+            auto s = std::static_pointer_cast<const pz003::state>(meters->getState(id));
             Serial.printf("===\nPower high alarm: %s\n", s->alarmh ? "present" : "absent");
             Serial.printf("Power low alarm: %s\n", s->alarml ? "present" : "absent");
             Serial.printf("Energy: %d\n", s->data.energy);
@@ -0,0 +1,2 @@
+#pragma once
+#include "../linux_port.h"
@@ -0,0 +1,147 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Minimal FreeRTOS/ESP-IDF API shim for running pzem-edl on a Linux host.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "linux_port.h"
+#include "driver/uart.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <time.h>
+
+namespace {
+
+// counting semaphore, mutex and binary semaphore are special cases
+struct sem_t {
+    std::mutex m;
+    std::condition_variable cv;
+    UBaseType_t count;
+    UBaseType_t max;
+    bool dyn = true;                    // allocated by xSemaphoreCreate*(), not a static one
+
+    sem_t(UBaseType_t _max, UBaseType_t initial) : count(initial), max(_max) {}
+};
+
+static_assert(sizeof(sem_t) <= sizeof(StaticSemaphore_t), "StaticSemaphore_t is too small");
+
+SemaphoreHandle_t sem_static(StaticSemaphore_t *buf, UBaseType_t max, UBaseType_t initial){
+    if (!buf)
+        return nullptr;
+    sem_t *s = new (buf) sem_t(max, initial);
+    s->dyn = false;
+    return s;
+}
+
+}   // namespace
+
+// tasks, no scheduler
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t *h){
+    if (h) *h = nullptr;
+    return pdFAIL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t f, const char *n, uint32_t s, void *p, UBaseType_t pr, TaskHandle_t *h, BaseType_t){
+    return xTaskCreate(f, n, s, p, pr, h);
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, StackType_t*, StaticTask_t*){ return nullptr; }
+
+void vTaskDelete(TaskHandle_t){}
+
+void vTaskDelay(TickType_t t){ std::this_thread::sleep_for(std::chrono::milliseconds(t)); }
+
+TickType_t xTaskGetTickCount(){ return esp_timer_get_time() / 1000; }
+
+// queues are only used by UartQ
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t){ return nullptr; }
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t){ return pdFALSE; }
+BaseType_t xQueueSendToBack(QueueHandle_t, const void*, TickType_t){ return pdFALSE; }
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t){ return pdFALSE; }
+BaseType_t xQueueReset(QueueHandle_t){ return pdPASS; }
+QueueHandle_t xQueueCreateStatic(UBaseType_t, UBaseType_t, uint8_t*, StaticQueue_t*){ return nullptr; }
+void vQueueDelete(QueueHandle_t){}
+
+// semaphores
+SemaphoreHandle_t xSemaphoreCreateBinary(){ return new sem_t(1, 0); }
+SemaphoreHandle_t xSemaphoreCreateMutex(){ return new sem_t(1, 1); }
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial){ return new sem_t(max, initial); }
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf){ return sem_static(buf, 1, 0); }
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buf){ return sem_static(buf, 1, 1); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t h, TickType_t t){
+    if (!h)
+        return pdFALSE;
+
+    sem_t *s = static_cast<sem_t*>(h);
+    std::unique_lock<std::mutex> lock(s->m);
+    auto ready = [s]{ return s->count > 0; };
+    if (t == portMAX_DELAY)
+        s->cv.wait(lock, ready);
+    else if (!s->cv.wait_for(lock, std::chrono::milliseconds(t), ready))
+        return pdFALSE;
+
+    --s->count;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t h){
+    if (!h)
+        return pdFALSE;
+
+    sem_t *s = static_cast<sem_t*>(h);
+    std::lock_guard<std::mutex> lock(s->m);
+    if (s->count >= s->max)
+        return pdFALSE;
+    ++s->count;
+    s->cv.notify_one();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t h){
+    sem_t *s = static_cast<sem_t*>(h);
+    if (s && s->dyn)
+        delete s;
+    else if (s)
+        s->~sem_t();
+}
+
+// timers, no timer service task
+TimerHandle_t xTimerCreate(const char*, TickType_t, UBaseType_t, void*, TimerCallbackFunction_t){ return nullptr; }
+BaseType_t xTimerIsTimerActive(TimerHandle_t){ return pdFALSE; }
+BaseType_t xTimerStart(TimerHandle_t, TickType_t){ return pdFAIL; }
+BaseType_t xTimerStop(TimerHandle_t, TickType_t){ return pdFAIL; }
+BaseType_t xTimerDelete(TimerHandle_t, TickType_t){ return pdFAIL; }
+BaseType_t xTimerChangePeriod(TimerHandle_t, TickType_t, TickType_t){ return pdFAIL; }
+TickType_t xTimerGetPeriod(TimerHandle_t){ return 0; }
+void* pvTimerGetTimerID(TimerHandle_t){ return nullptr; }
+
+int64_t esp_timer_get_time(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void* heap_caps_malloc(size_t size, uint32_t caps){ return caps & MALLOC_CAP_SPIRAM ? nullptr : malloc(size); }
+void heap_caps_free(void *p){ free(p); }
+size_t heap_caps_get_free_size(uint32_t caps){ return 0; }
+size_t esp_psram_get_size(){ return 0; }
+
+// UART driver, not available
+esp_err_t uart_param_config(uart_port_t, const uart_config_t*){ return ESP_FAIL; }
+esp_err_t uart_set_pin(uart_port_t, int, int, int, int){ return ESP_FAIL; }
+esp_err_t uart_driver_install(uart_port_t, int, int, int, QueueHandle_t *q, int){ if (q) *q = nullptr; return ESP_FAIL; }
+esp_err_t uart_driver_delete(uart_port_t){ return ESP_OK; }
+esp_err_t uart_flush_input(uart_port_t){ return ESP_OK; }
+esp_err_t uart_get_buffered_data_len(uart_port_t, size_t *len){ *len = 0; return ESP_FAIL; }
+int uart_read_bytes(uart_port_t, void*, uint32_t, TickType_t){ return -1; }
+int uart_write_bytes(uart_port_t, const void*, size_t){ return -1; }
+esp_err_t uart_wait_tx_done(uart_port_t, TickType_t){ return ESP_FAIL; }
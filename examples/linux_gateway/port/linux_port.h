@@ -0,0 +1,113 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Minimal FreeRTOS/ESP-IDF API shim for running pzem-edl on a Linux host.
+
+Mutexes and semaphores are real, but there is no scheduler: tasks can't be created and
+timers never fire, so TX/RX tasks of UartQ and pool/meter autopoll are not available.
+Ports must be serviced by PollLoop and polling must be driven by PollLoop::every().
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int esp_err_t;
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERROR_CHECK(x)      (void)(x)
+
+// FreeRTOS
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void* TaskHandle_t;
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TimerHandle_t;
+typedef void (*TaskFunction_t)(void*);
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+typedef uint8_t StackType_t;
+
+// storage for statically allocated objects, sized to fit shim's own structures
+typedef struct { alignas(16) uint8_t opaque[192]; } StaticSemaphore_t;
+typedef struct { void *opaque[4]; } StaticQueue_t;
+typedef struct { void *opaque[4]; } StaticTask_t;
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define pdFAIL                  0
+#define portMAX_DELAY           0xffffffff
+#define configTICK_RATE_HZ      1000
+#define portTICK_PERIOD_MS      1
+#define pdMS_TO_TICKS(x)        (x)
+#define pdTICKS_TO_MS(x)        (x)
+#define tskIDLE_PRIORITY        0
+#define tskNO_AFFINITY          0x7fffffff
+
+BaseType_t xTaskCreate(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, TaskHandle_t*, BaseType_t);
+TaskHandle_t xTaskCreateStatic(TaskFunction_t, const char*, uint32_t, void*, UBaseType_t, StackType_t*, StaticTask_t*);
+void vTaskDelete(TaskHandle_t);
+void vTaskDelay(TickType_t);
+TickType_t xTaskGetTickCount();
+
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t);
+BaseType_t xQueueReceive(QueueHandle_t, void*, TickType_t);
+BaseType_t xQueueSendToBack(QueueHandle_t, const void*, TickType_t);
+BaseType_t xQueueSend(QueueHandle_t, const void*, TickType_t);
+BaseType_t xQueueReset(QueueHandle_t);
+QueueHandle_t xQueueCreateStatic(UBaseType_t, UBaseType_t, uint8_t*, StaticQueue_t*);
+void vQueueDelete(QueueHandle_t);
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t*);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t*);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t);
+void vSemaphoreDelete(SemaphoreHandle_t);
+
+TimerHandle_t xTimerCreate(const char*, TickType_t, UBaseType_t, void*, TimerCallbackFunction_t);
+BaseType_t xTimerIsTimerActive(TimerHandle_t);
+BaseType_t xTimerStart(TimerHandle_t, TickType_t);
+BaseType_t xTimerStop(TimerHandle_t, TickType_t);
+BaseType_t xTimerDelete(TimerHandle_t, TickType_t);
+BaseType_t xTimerChangePeriod(TimerHandle_t, TickType_t, TickType_t);
+TickType_t xTimerGetPeriod(TimerHandle_t);
+void* pvTimerGetTimerID(TimerHandle_t);
+
+// esp_timer
+int64_t esp_timer_get_time();
+
+// heap caps, there is no PSRAM on host
+#define MALLOC_CAP_SPIRAM       (1<<10)
+#define MALLOC_CAP_8BIT         (1<<2)
+#define MALLOC_CAP_INTERNAL     (1<<11)
+#define MALLOC_CAP_DEFAULT      (1<<12)
+void* heap_caps_malloc(size_t, uint32_t);
+void heap_caps_free(void*);
+size_t heap_caps_get_free_size(uint32_t);
+size_t esp_psram_get_size();
+
+// log
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL         2       // warnings and errors
+#endif
+#define ESP_LOG_AT(lvl, c, tag, fmt, ...) do { if (lvl <= LOG_LOCAL_LEVEL) fprintf(stderr, c " (%s) " fmt "\n", tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGE(tag, fmt, ...) ESP_LOG_AT(1, "E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) ESP_LOG_AT(2, "W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) ESP_LOG_AT(3, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) ESP_LOG_AT(4, "D", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) ESP_LOG_AT(5, "V", tag, fmt, ##__VA_ARGS__)
@@ -0,0 +1,10 @@
+#pragma once
+// lwIP BSD sockets API is provided by the host libc
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
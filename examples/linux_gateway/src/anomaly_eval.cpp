@@ -0,0 +1,287 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+anomaly::Detector evaluation over recorded bus traffic.
+Reads a BusCapture stream, decodes PZEM004/PZEM003 metrics replies and feeds selected metric of every meter
+to it's own detector, printing raised events. Sample time is taken from capture timestamps, or from the sample
+number times polling interval if -i is given.
+Without a capture file a synthetic one is recorded: meters with a daily load profile and noise, spikes, drops
+and stuck values injected at known samples, it could be saved with -o. Events are matched against injected
+anomalies and exit code is non-zero if recall or false positive rate is out of limits.
+
+ anomaly_eval [-f capture] [-i interval] [-z threshold] [-a season alpha] [-F flat count] [-m meters] [-n samples] [-s seed] [-o file] [-v]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "anomaly.hpp"
+#include "capture.hpp"
+#include <getopt.h>
+#include <map>
+#include <random>
+#include <vector>
+
+#define EVAL_INTERVAL           60      // s, synthetic capture polling interval
+#define EVAL_SPIKE_LEN          3       // samples
+#define EVAL_DROP_LEN           5       // samples
+#define EVAL_FLAT_CNT           30      // equal samples to detect a stuck value
+#define EVAL_GAP                1500    // samples between injected anomalies of a meter
+#define EVAL_MIN_RECALL         0.9
+#define EVAL_MAX_FP             1.0     // false positive events per 1000 samples
+
+using anomaly::evt_t;
+
+// injected anomaly, samples [begin, end) of a meter
+struct injected_t {
+    uint8_t addr;
+    uint32_t begin;
+    uint32_t end;
+    const char *kind;
+    bool detected = false;
+};
+
+struct meter_t {
+    std::unique_ptr<anomaly::Detector> det;
+    uint32_t samples = 0;
+    uint32_t events = 0;
+};
+
+static bool verbose = false;
+
+static const char* evt_name(evt_t e){
+    switch (e){
+        case evt_t::high : return "high";
+        case evt_t::low : return "low";
+        case evt_t::seasonal_high : return "seasonal_high";
+        case evt_t::seasonal_low : return "seasonal_low";
+        case evt_t::flat : return "flat";
+        case evt_t::cleared : return "cleared";
+        default : return "none";
+    }
+}
+
+// RIR reply with PZEM004 registers for power value
+static void record_sample(BusCapture &cap, uint8_t addr, uint32_t power){
+    uint8_t regs[PZ004_RIR_RESP_LEN] = {};
+    regs[0] = 2300 >> 8; regs[1] = 2300 & 0xff;                 // voltage
+    regs[PZ004_RIR_POWER_L * 2] = (power >> 8) & 0xff;
+    regs[PZ004_RIR_POWER_L * 2 + 1] = power & 0xff;
+    regs[PZ004_RIR_POWER_H * 2] = power >> 24;
+    regs[PZ004_RIR_POWER_H * 2 + 1] = (power >> 16) & 0xff;
+    regs[PZ004_RIR_FREQUENCY * 2 + 1] = 50;
+    RX_msg *m = pzmbus::create_reply(CMD_RIR, regs, sizeof(regs), addr);
+    if (m){
+        cap.record(false, m->rawdata, m->len);
+        delete m;
+    }
+}
+
+/**
+ * @brief record synthetic capture, power follows a daily profile with gaussian noise
+ * every meter gets a spike, a drop and a stuck value in turn, EVAL_GAP samples apart
+ */
+static void synthesize(BusCapture &cap, std::vector<injected_t> &truth, int meters, uint32_t samples, uint32_t flat, unsigned seed){
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> noise(0, 0.02);
+    std::vector<uint32_t> stuck(meters);
+
+    for (int a = 1; a <= meters; ++a){
+        uint32_t phase = EVAL_GAP / 2 + a * 97;
+        for (int k = 0; phase + flat * 2 < samples; ++k, phase += EVAL_GAP){
+            switch (k % 3){
+                case 0 : truth.push_back({static_cast<uint8_t>(a), phase, phase + EVAL_SPIKE_LEN, "spike"}); break;
+                case 1 : truth.push_back({static_cast<uint8_t>(a), phase, phase + EVAL_DROP_LEN, "drop"}); break;
+                default : truth.push_back({static_cast<uint8_t>(a), phase, phase + flat * 3 / 2, "stuck"});
+            }
+        }
+    }
+
+    for (uint32_t n = 0; n != samples; ++n){
+        float hour = (n * EVAL_INTERVAL % 86400) / 3600.0;
+        for (int a = 1; a <= meters; ++a){
+            float base = 1000.0 * a * (1.2 + std::sin((hour - 8) * M_PI / 12) * 0.4);
+            float v = base * (1 + noise(rng));
+            for (const auto &t : truth){
+                if (t.addr != a || n < t.begin || n >= t.end)
+                    continue;
+                if (*t.kind == 's' && t.kind[1] == 'p')
+                    v = base * 3;
+                else if (*t.kind == 'd')
+                    v = base * 0.1;
+                else {
+                    if (n == t.begin)
+                        stuck[a - 1] = v * 10;
+                    v = stuck[a - 1] / 10.0;
+                }
+            }
+            record_sample(cap, a, v * 10);
+        }
+    }
+}
+
+static std::vector<uint8_t> load(const char *fname){
+    std::vector<uint8_t> data;
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return data;
+    uint8_t b[4096];
+    size_t n;
+    while ((n = fread(b, 1, sizeof(b), f)) > 0)
+        data.insert(data.end(), b, b + n);
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char *argv[]){
+    const char *fname = nullptr;
+    const char *oname = nullptr;
+    uint32_t interval = 0;
+    float z = ANOMALY_Z_THRESHOLD;
+    float salpha = ANOMALY_SEASON_ALPHA;
+    uint32_t flat = 0;
+    int meters = 8;
+    uint32_t samples = 20000;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:i:z:a:F:m:n:s:o:vh")) != -1){
+        switch (opt){
+            case 'f' : fname = optarg; break;
+            case 'i' : interval = atoi(optarg); break;
+            case 'z' : z = atof(optarg); break;
+            case 'a' : salpha = atof(optarg); break;
+            case 'F' : flat = atoi(optarg); break;
+            case 'm' : meters = atoi(optarg); break;
+            case 'n' : samples = atoi(optarg); break;
+            case 's' : seed = strtoul(optarg, NULL, 0); break;
+            case 'o' : oname = optarg; break;
+            case 'v' : verbose = true; break;
+            default :
+                fprintf(stderr, "usage: %s [-f capture] [-i interval] [-z threshold] [-a season alpha] [-F flat count] [-m meters] [-n samples] [-s seed] [-o file] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (meters < 1 || meters > 247 || !samples)
+        return 1;
+
+    std::vector<uint8_t> file;
+    std::vector<injected_t> truth;
+    std::unique_ptr<BusCapture> cap;
+    const uint8_t *stream;
+    size_t len;
+    if (fname){
+        file = load(fname);
+        stream = file.data();
+        len = file.size();
+    } else {
+        // ~30 bytes per frame
+        cap.reset(new BusCapture(CAPTURE_HDR_LEN + static_cast<size_t>(samples) * meters * 32));
+        if (!flat)
+            flat = EVAL_FLAT_CNT;
+        synthesize(*cap, truth, meters, samples, flat, seed);
+        stream = cap->data();
+        len = cap->length();
+        if (!interval)
+            interval = EVAL_INTERVAL;
+        printf("synthetic capture: meters %d, samples %u, frames %u, %zu bytes, injected anomalies %zu\n",
+            meters, samples, cap->getFrames(), len, truth.size());
+
+        FILE *o = oname ? fopen(oname, "wb") : nullptr;
+        if (o){
+            fwrite(stream, 1, len, o);
+            fclose(o);
+        }
+    }
+
+    CaptureReader rd(stream, len);
+    if (!rd.valid()){
+        fprintf(stderr, "not a capture stream\n");
+        return 1;
+    }
+
+    std::map<uint8_t, meter_t> meter;
+    uint32_t false_pos = 0, total = 0, frames = 0;
+    capture_frame_t f;
+    int64_t t = esp_timer_get_time();
+    while (rd.next(f)){
+        ++frames;
+        if (f.tx || f.len < 5)
+            continue;
+
+        uint8_t *b = msgbuf_alloc(f.len);
+        if (!b)
+            continue;
+        memcpy(b, f.data, f.len);
+        RX_msg msg(b, f.len);
+        if (!msg.valid || msg.cmd != CMD_RIR)
+            continue;
+
+        std::unique_ptr<pzmbus::metrics> m;
+        if (f.data[2] == PZ004_RIR_RESP_LEN)
+            m.reset(new pz004::metrics());
+        else if (f.data[2] == PZ003_RIR_RESP_LEN)
+            m.reset(new pz003::metrics());
+        if (!m || !m->parse_rx_msg(&msg))
+            continue;
+
+        meter_t &mt = meter[msg.addr];
+        if (!mt.det){
+            mt.det.reset(new anomaly::Detector(msg.addr));
+            mt.det->zthreshold = z;
+            mt.det->season_alpha = salpha;
+            if (flat)
+                mt.det->flat_cnt = flat;
+            mt.det->attach_callback([&mt, &truth, &false_pos, &frames](uint8_t id, evt_t evt, float value, float score){
+                if (evt == evt_t::cleared)
+                    return;
+                ++mt.events;
+                bool matched = false;
+                for (auto &a : truth){
+                    // an event could follow the last anomalous sample, i.e. a 'low' after a spike
+                    if (a.addr == id && mt.samples >= a.begin && mt.samples <= a.end){
+                        a.detected = matched = true;
+                    }
+                }
+                if (!truth.empty() && !matched)
+                    ++false_pos;
+                if (verbose || truth.empty())
+                    printf("frame %u, meter %u, sample %u: %s, value %.1f, score %.1f\n", frames, id, mt.samples, evt_name(evt), value, score);
+            });
+        }
+        uint32_t time = interval ? mt.samples * interval : (rd.getStartTime() + f.time_us) / 1000000;
+        mt.det->push(*m, time);
+        ++mt.samples;
+        ++total;
+    }
+    int64_t elapsed = esp_timer_get_time() - t;
+
+    printf("frames %u, samples %u, meters %zu, %.2f us per sample\n", frames, total, meter.size(), total ? static_cast<double>(elapsed) / total : 0);
+    for (const auto &m : meter)
+        printf("meter %u: samples %u, events %u\n", m.first, m.second.samples, m.second.events);
+
+    if (truth.empty())
+        return 0;
+
+    size_t detected = 0;
+    std::map<std::string, std::pair<int, int>> kinds;
+    for (const auto &a : truth){
+        auto &k = kinds[a.kind];
+        ++k.second;
+        if (a.detected){
+            ++detected;
+            ++k.first;
+        }
+    }
+    for (const auto &k : kinds)
+        printf("%s: detected %d of %d\n", k.first.c_str(), k.second.first, k.second.second);
+
+    double recall = static_cast<double>(detected) / truth.size();
+    double fp = total ? 1000.0 * false_pos / total : 0;
+    printf("recall %.3f, false positives %u, %.2f per 1000 samples\n", recall, false_pos, fp);
+
+    bool ok = recall >= EVAL_MIN_RECALL && fp <= EVAL_MAX_FP;
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+CBOR encoder/decoder check.
+Round-trips metrics, state and TimeSeries ranges (typed and delta columns) through cbor::Writer and
+cbor::Reader, checks overflow and truncated input handling, then compares payload size and encoding
+time of a full series against JSON produced by JsonWriter. Exits with non-zero code on any failure.
+
+ cbor_check [-n samples] [-r repeats] [-s seed]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "cbor.hpp"
+#include "jsonw.hpp"
+#include <getopt.h>
+#include <random>
+
+#define CHECK_BUF_SIZE          (128 * 1024)
+
+static int failures = 0;
+static uint8_t buf[CHECK_BUF_SIZE];
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+static void random_metrics(std::mt19937 &rng, pz004::metrics &m, uint32_t &energy){
+    m.voltage = 2300 + rng() % 40 - 20;
+    m.current = 1000 + rng() % 300;
+    m.power = 2200 + rng() % 500;
+    energy += rng() % 2;
+    m.energy = energy;
+    m.freq = 499 + rng() % 3;
+    m.pf = 90 + rng() % 5;
+    m.alarm = rng() % 2;
+}
+
+static bool same(const pzmbus::metrics &a, const pzmbus::metrics &b, uint8_t mask){
+    for (uint8_t i = 0; i != 8; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        if (a.decimals(meter) < 0 || !textfmt::selected(mask, meter))
+            continue;
+        if (a.asRaw(meter) != b.asRaw(meter))
+            return false;
+    }
+    return true;
+}
+
+static void metrics_roundtrip(std::mt19937 &rng){
+    uint32_t energy = 0;
+    bool ok = true;
+    for (int i = 0; i != 1000 && ok; ++i){
+        pz004::metrics m, d;
+        random_metrics(rng, m, energy);
+        m.energy = rng();               // full range, 5 byte CBOR integer
+        cbor::Writer w(buf, sizeof(buf));
+        cbor::encode(w, m);
+        cbor::Reader r(buf, w.size());
+        ok &= w.good() && cbor::decode(r, d) && same(m, d, TEXTFMT_METERS_ALL) && r.position() == w.size();
+    }
+    check(ok, "pz004 metrics");
+
+    pz003::metrics m3, d3;
+    m3.voltage = 12345; m3.current = 500; m3.power = 61728; m3.energy = 7; m3.alarmh = 1; m3.alarml = 0;
+    cbor::Writer w(buf, sizeof(buf));
+    cbor::encode(w, m3);
+    cbor::Reader r(buf, w.size());
+    check(cbor::decode(r, d3) && same(m3, d3, TEXTFMT_METERS_ALL), "pz003 metrics");
+
+    // masked fields are not written
+    pz004::metrics m;
+    random_metrics(rng, m, energy);
+    uint8_t mask = 1 << static_cast<uint8_t>(pzmbus::meter_t::vol) | 1 << static_cast<uint8_t>(pzmbus::meter_t::pwr);
+    w.reset();
+    cbor::encode(w, m, mask);
+    uint32_t vals[8] = {};
+    uint8_t got = 0;
+    cbor::Reader rm(buf, w.size());
+    check(cbor::decode(rm, vals, got) && got == mask && vals[0] == m.voltage && vals[2] == m.power, "masked metrics");
+}
+
+static void state_roundtrip(){
+    pz004::state st;
+    st.addr = 0x21;
+    st.update_us = esp_timer_get_time() - 1500000;
+    pz004::metrics m;
+    m.voltage = 2301;
+    m.power = 99999;
+    cbor::Writer w(buf, sizeof(buf));
+    cbor::encode(w, st, m);
+
+    pzmbus::pzmodel_t model;
+    uint8_t addr, mask;
+    pzmbus::pzem_err_t err;
+    uint32_t age, vals[8] = {};
+    cbor::Reader r(buf, w.size());
+    check(cbor::decode(r, model, addr, err, age, vals, mask) && model == pzmbus::pzmodel_t::pzem004v3 && addr == 0x21
+        && age >= 1500 && age < 2500 && vals[0] == 2301 && vals[2] == 99999, "state");
+}
+
+static bool series_match(const TimeSeries<pz004::metrics> &ts, const cbor::series_t &s, uint32_t (*col)[1024], int from){
+    for (size_t k = 0; k != s.cnt; ++k){
+        const pz004::metrics *m = ts.at(from + k);
+        for (uint8_t i = 0; i != 8; ++i){
+            auto meter = static_cast<pzmbus::meter_t>(i);
+            if (m->decimals(meter) < 0)
+                continue;
+            if (!(s.mask & (1 << i)) || col[i][k] != m->asRaw(meter))
+                return false;
+        }
+    }
+    return true;
+}
+
+static void series_roundtrip(const TimeSeries<pz004::metrics> &ts){
+    static uint32_t col[8][1024];
+    for (int delta = 0; delta != 2; ++delta){
+        // full range and a few partial ones
+        const int ranges[][2] = { {0, -1}, {0, 1}, {10, 50}, {ts.getSize() - 1, 1}, {ts.getSize(), 0} };
+        bool ok = true;
+        for (const auto &rg : ranges){
+            cbor::Writer w(buf, sizeof(buf));
+            cbor::encode(w, ts, TEXTFMT_METERS_ALL, delta, rg[0], rg[1]);
+            cbor::series_t s;
+            for (uint8_t i = 0; i != 8; ++i)
+                s.col[i] = col[i];
+            s.max = 1024;
+            cbor::Reader r(buf, w.size());
+            size_t expect = rg[1] < 0 ? ts.getSize() - rg[0] : rg[1];
+            uint32_t tstamp = ts.getTstamp() - (ts.getSize() - rg[0] - expect) * ts.getInterval();
+            ok &= w.good() && cbor::decode(r, s) && s.cnt == expect && s.delta == (delta != 0) && s.tstamp == tstamp
+                && s.interval == ts.getInterval() && series_match(ts, s, col, rg[0]);
+        }
+        check(ok, delta ? "series, delta columns" : "series, typed columns");
+    }
+
+    // destination arrays too short, values are cut at max and cnt reports the full range, skipped columns are consumed
+    cbor::Writer w(buf, sizeof(buf));
+    cbor::encode(w, ts);
+    cbor::series_t s;
+    s.col[0] = col[0];
+    s.max = ts.getSize() / 2;
+    col[0][s.max] = 0;
+    cbor::Reader r(buf, w.size());
+    check(cbor::decode(r, s) && s.cnt == static_cast<size_t>(ts.getSize()) && s.mask == 1 && col[0][s.max - 1] == ts.at(s.max - 1)->voltage
+        && !col[0][s.max] && r.position() == w.size(), "series, short destination");
+}
+
+// overflow is sticky, truncated input is rejected at any cut
+static void bounds(const TimeSeries<pz004::metrics> &ts){
+    cbor::Writer full(buf, sizeof(buf));
+    cbor::encode(full, ts, TEXTFMT_METERS_ALL, true);
+    size_t len = full.size();
+
+    static uint8_t small[256];
+    cbor::Writer w(small, sizeof(small));
+    cbor::encode(w, ts);
+    check(!w.good() && w.size() <= sizeof(small), "writer overflow");
+
+    static uint32_t col[8][1024];
+    bool ok = true;
+    for (size_t cut = 0; cut < len; cut += 1 + cut / 16){
+        cbor::series_t s;
+        for (uint8_t i = 0; i != 8; ++i)
+            s.col[i] = col[i];
+        s.max = 1024;
+        cbor::Reader r(buf, cut);
+        ok &= !cbor::decode(r, s);
+    }
+    check(ok, "truncated input");
+}
+
+static void compare(const TimeSeries<pz004::metrics> &ts, int repeats){
+    static char js[CHECK_BUF_SIZE * 4];
+    size_t jlen = 0;
+    int64_t t = esp_timer_get_time();
+    for (int i = 0; i != repeats; ++i){
+        jlen = 0;
+        JsonWriter w([&jlen](const char *data, size_t n){
+            if (jlen + n > sizeof(js))
+                return false;
+            memcpy(&js[jlen], data, n);
+            jlen += n;
+            return true;
+        });
+        jsonw::write(w, ts);
+        w.flush();
+    }
+    double json_us = static_cast<double>(esp_timer_get_time() - t) / repeats;
+
+    size_t clen[2];
+    double cbor_us[2];
+    for (int delta = 0; delta != 2; ++delta){
+        cbor::Writer w(buf, sizeof(buf));
+        t = esp_timer_get_time();
+        for (int i = 0; i != repeats; ++i){
+            w.reset();
+            cbor::encode(w, ts, TEXTFMT_METERS_ALL, delta);
+        }
+        cbor_us[delta] = static_cast<double>(esp_timer_get_time() - t) / repeats;
+        clen[delta] = w.size();
+    }
+
+    printf("series of %d samples, all fields:\n", ts.getSize());
+    printf("  JSON        %7zu bytes %8.1f us\n", jlen, json_us);
+    printf("  CBOR typed  %7zu bytes %8.1f us\n", clen[0], cbor_us[0]);
+    printf("  CBOR delta  %7zu bytes %8.1f us\n", clen[1], cbor_us[1]);
+    check(clen[1] < clen[0] && clen[0] < jlen, "payload size");
+}
+
+int main(int argc, char *argv[]){
+    int samples = 300;
+    int repeats = 100;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:h")) != -1){
+        switch (opt){
+            case 'n' : samples = atoi(optarg); break;
+            case 'r' : repeats = atoi(optarg); break;
+            case 's' : seed = strtoul(optarg, NULL, 0); break;
+            default :
+                fprintf(stderr, "usage: %s [-n samples] [-r repeats] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (samples < 60 || samples > 1024 || repeats < 1)
+        return 1;
+
+    std::mt19937 rng(seed);
+    metrics_roundtrip(rng);
+    state_roundtrip();
+
+    TimeSeries<pz004::metrics> ts(1, samples, 1000, 10, "ts");
+    pz004::metrics m;
+    uint32_t energy = 12345;
+    for (int k = 0; k != samples; ++k){
+        random_metrics(rng, m, energy);
+        ts.push(m, 1000 + k * 10);
+    }
+    series_roundtrip(ts);
+    bounds(ts);
+    compare(ts, repeats);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
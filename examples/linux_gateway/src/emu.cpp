@@ -0,0 +1,189 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+PZEM-004Tv3 bus emulator on pseudo-terminals, used to benchmark the gateway without hardware.
+Creates a number of pty pairs, prints slave device names to stdout, one per line,
+and answers Modbus requests to meters with addresses 1..N on each of them.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "modbus_crc16.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define EMU_BUF_SIZE            64
+#define EMU_STATS_PERIOD        10      // seconds
+
+struct bus_t {
+    int master;
+    int slave;                          // kept open, so master does not hang up when gateway reconnects
+    size_t len = 0;
+    uint8_t buf[EMU_BUF_SIZE];
+    uint8_t reply[32];
+    size_t rlen = 0;
+    int64_t due_us = 0;                 // delayed reply send time, 0 - nothing pending
+};
+
+static int64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void put16(uint8_t *p, uint16_t v){ p[0] = v >> 8; p[1] = v & 0xff; }
+
+// craft a reply to a request, returns reply length, 0 if there is nothing to reply
+static size_t answer(const uint8_t *rq, size_t len, uint8_t maxaddr, uint8_t *r){
+    uint8_t addr = rq[0];
+    if (!addr || addr > maxaddr)
+        return 0;
+
+    r[0] = addr;
+    r[1] = rq[1];
+    switch (rq[1]){
+        case 0x04 : {   // RIR, 10 registers of metrics
+            if (len != 8)
+                return 0;
+            uint32_t jitter = rand() % 20;
+            uint16_t regs[10] = {
+                static_cast<uint16_t>(2300 + jitter),   // voltage, 0.1V
+                static_cast<uint16_t>(1000 + addr), 0,  // current, mA
+                static_cast<uint16_t>(2300 + addr), 0,  // power, 0.1W
+                static_cast<uint16_t>(addr * 100), 0,   // energy, Wh
+                500,                                    // frequency, 0.1Hz
+                95,                                     // power factor, 0.01
+                0                                       // alarm
+            };
+            r[2] = 20;
+            for (int i = 0; i != 10; ++i)
+                put16(&r[3 + i * 2], regs[i]);
+            modbus::setcrc16(r, 25);
+            return 25;
+        }
+        case 0x03 : {   // RHR, alarm threshold and address
+            if (len != 8)
+                return 0;
+            r[2] = 4;
+            put16(&r[3], 2300);
+            put16(&r[5], addr);
+            modbus::setcrc16(r, 9);
+            return 9;
+        }
+        case 0x06 :     // WSR, echo
+            memcpy(r, rq, 8);
+            return 8;
+        case 0x42 :     // energy reset, echo
+            memcpy(r, rq, 4);
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-p ports] [-m meters per port] [-d reply delay ms]\n", name);
+}
+
+int main(int argc, char *argv[]){
+    int ports = 16, meters = 32, delay = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:d:h")) != -1){
+        switch (opt){
+            case 'p' : ports = atoi(optarg); break;
+            case 'm' : meters = atoi(optarg); break;
+            case 'd' : delay = atoi(optarg); break;
+            default : usage(argv[0]); return 1;
+        }
+    }
+    if (ports < 1 || meters < 1 || meters > 247){
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int efd = epoll_create1(0);
+    std::vector<bus_t> buses(ports);
+
+    for (auto &b : buses){
+        b.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (b.master < 0 || grantpt(b.master) || unlockpt(b.master)){
+            perror("pty");
+            return 1;
+        }
+        const char *name = ptsname(b.master);
+        b.slave = open(name, O_RDWR | O_NOCTTY);
+        struct termios tio;
+        tcgetattr(b.slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(b.slave, TCSANOW, &tio);
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &b;
+        epoll_ctl(efd, EPOLL_CTL_ADD, b.master, &ev);
+        printf("%s\n", name);
+    }
+    fflush(stdout);
+
+    uint64_t served = 0, last = 0;
+    int64_t stats_us = now_us() + EMU_STATS_PERIOD * 1000000LL;
+
+    for (;;){
+        int64_t now = now_us();
+        int timeout = 1000;
+        for (const auto &b : buses){
+            if (b.due_us)
+                timeout = std::min<int>(timeout, b.due_us > now ? (b.due_us - now + 999) / 1000 : 0);
+        }
+
+        struct epoll_event evs[64];
+        int n = epoll_wait(efd, evs, 64, timeout);
+        for (int i = 0; i < n; ++i){
+            bus_t &b = *static_cast<bus_t*>(evs[i].data.ptr);
+            ssize_t r = read(b.master, b.buf + b.len, sizeof(b.buf) - b.len);
+            if (r <= 0)
+                continue;
+            b.len += r;
+
+            // requests are 8 bytes except energy reset
+            size_t flen = (b.len >= 4 && b.buf[1] == 0x42) ? 4 : 8;
+            if (b.len < flen)
+                continue;
+            if (modbus::checkcrc16(b.buf, flen)){
+                b.rlen = answer(b.buf, flen, meters, b.reply);
+                b.due_us = b.rlen ? now_us() + delay * 1000LL : 0;
+            }
+            b.len = 0;
+        }
+
+        now = now_us();
+        for (auto &b : buses){
+            if (!b.due_us || b.due_us > now)
+                continue;
+            if (write(b.master, b.reply, b.rlen) == static_cast<ssize_t>(b.rlen))
+                ++served;
+            b.due_us = 0;
+        }
+
+        if (now >= stats_us){
+            fprintf(stderr, "emu: %llu replies/s\n", static_cast<unsigned long long>((served - last) / EMU_STATS_PERIOD));
+            last = served;
+            stats_us += EMU_STATS_PERIOD * 1000000LL;
+        }
+    }
+}
@@ -0,0 +1,270 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Linux gateway daemon, polls meters on many serial buses from a single epoll loop
+and serves their metrics over a local unix socket.
+
+ pzem_gw [-s socket] [-i interval ms] [-b baud] device[:first[-last]] ...
+
+i.e. 'pzem_gw /dev/ttyUSB0:1-30 /dev/ttyUSB1:1-12' polls PZEM004 meters with addresses 1..30 on the first bus
+and 1..12 on the second one.
+
+Socket API, send a command line and read the reply until the connection is closed:
+ json   - metrics of all meters, {"pools":[{"meters":[...]}, ...]}
+ stats  - gateway and per-port counters
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "pollq.hpp"
+#include "pzem_edl.hpp"
+#include "jsonw.hpp"
+#include <getopt.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define GW_SOCKET               "/tmp/pzem-gw.sock"
+#define GW_INTERVAL             1000    // ms, poll interval
+#define GW_POOL_MAX             250     // max meters per pool, PZEM ids are 8 bit
+#define GW_STATS_PERIOD         10000   // ms, stats report to stderr
+#define GW_CMD_MAX              32
+
+static const char *TAG_GW __attribute__((unused)) = "pzem_gw";
+
+struct port_t {
+    const char *dev;
+    PollQ *q;                           // owned by pool's PZPort
+};
+
+struct pool_t {
+    std::unique_ptr<PZPool> pool;
+    uint8_t ports = 0;
+    uint8_t meters = 0;
+};
+
+static std::vector<pool_t> pools;
+static std::vector<port_t> ports;
+static size_t meters = 0;
+static PollLoop loop;
+
+// parse 'device[:first[-last]]'
+static bool add_bus(char *arg, uint32_t baud){
+    int first = 1, last = 1;
+    char *range = strchr(arg, ':');
+    if (range){
+        *range++ = 0;
+        if (sscanf(range, "%d-%d", &first, &last) == 1)
+            last = first;
+    }
+    if (first < ADDR_MIN || last > ADDR_MAX || first > last){
+        fprintf(stderr, "bad address range for %s\n", arg);
+        return false;
+    }
+    size_t cnt = last - first + 1;
+
+    // start a new pool if this bus does not fit into the current one
+    if (pools.empty() || pools.back().meters + cnt > GW_POOL_MAX){
+        pools.emplace_back();
+        pools.back().pool.reset(new PZPool());
+    }
+    pool_t &p = pools.back();
+
+    PollQ *q = new PollQ(arg, baud, cnt + tx_msg_q_DEPTH);     // whole bus is polled at once
+    if (!q->good() || !loop.add(q)){
+        delete q;
+        return false;
+    }
+
+    uint8_t port_id = ++p.ports;
+    p.pool->addPort(std::make_shared<PZPort>(port_id, q, arg));
+    for (int a = first; a <= last; ++a)
+        p.pool->addPZEM(port_id, ++p.meters, a, pzmbus::pzmodel_t::pzem004v3);
+
+    ports.push_back({arg, q});
+    meters += cnt;
+    return true;
+}
+
+static size_t fresh(){
+    size_t n = 0;
+    for (const auto &p : pools){
+        p.pool->forEachPZEM([&n](const PZEM *pz){
+            if (!pz->getState()->dataStale())
+                ++n;
+            return true;
+        });
+    }
+    return n;
+}
+
+static void api_json(JsonWriter &w){
+    w.beginObject();
+    w.key("pools").beginArray();
+    for (const auto &p : pools)
+        jsonw::write(w, *p.pool);
+    w.endArray();
+    w.endObject();
+}
+
+static void api_stats(JsonWriter &w){
+    w.beginObject();
+    w.key("meters").value(static_cast<uint32_t>(meters));
+    w.key("fresh").value(static_cast<uint32_t>(fresh()));
+    w.key("ports").beginArray();
+    for (const auto &p : ports){
+        const msgq_stats_t &s = p.q->getStats();
+        w.beginObject();
+        w.key("dev").value(p.dev);
+        w.key("tx").value(s.tx);
+        w.key("rx").value(s.rx);
+        w.key("rx_err").value(s.rx_err);
+        w.key("tx_drop").value(s.tx_drop);
+        w.endObject();
+    }
+    w.endArray();
+    w.endObject();
+}
+
+static void api_client(int fd){
+    char cmd[GW_CMD_MAX];
+    ssize_t n = read(fd, cmd, sizeof(cmd) - 1);
+    loop.unwatch(fd);
+    if (n < 0)
+        n = 0;
+    cmd[n] = 0;
+    cmd[strcspn(cmd, "\r\n ")] = 0;
+
+    // reply is written synchronously, the socket is local and replies are small
+    JsonWriter w([fd](const char *data, size_t len){
+        while (len){
+            ssize_t r = write(fd, data, len);
+            if (r <= 0)
+                return false;
+            data += r;
+            len -= r;
+        }
+        return true;
+    });
+
+    if (!*cmd || !strcmp(cmd, "json"))
+        api_json(w);
+    else if (!strcmp(cmd, "stats"))
+        api_stats(w);
+    else {
+        const char err[] = "unknown command\n";
+        write(fd, err, sizeof(err) - 1);
+    }
+    w.flush();
+    close(fd);
+}
+
+static int api_listen(const char *path){
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return -1;
+
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(s, 8) != 0){
+        close(s);
+        return -1;
+    }
+
+    loop.watch(s, [s](uint32_t){
+        int c = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if (c >= 0)
+            loop.watch(c, [c](uint32_t){ api_client(c); });
+    });
+    return s;
+}
+
+static int64_t cpu_us(){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void report(){
+    static int64_t wall = 0;
+    static int64_t cpu = 0;
+    static uint64_t rx = 0;
+
+    int64_t now = esp_timer_get_time();
+    int64_t c = cpu_us();
+    uint64_t r = 0, err = 0, drop = 0;
+    for (const auto &p : ports){
+        r += p.q->getStats().rx;
+        err += p.q->getStats().rx_err;
+        drop += p.q->getStats().tx_drop;
+    }
+
+    if (wall){
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "meters %zu/%zu fresh, %.1f replies/s, rx_err %llu, tx_drop %llu, cpu %.1f%%, rss %ld KiB\n",
+            fresh(), meters, (r - rx) * 1e6 / (now - wall), static_cast<unsigned long long>(err), static_cast<unsigned long long>(drop),
+            (c - cpu) * 100.0 / (now - wall), ru.ru_maxrss);
+    }
+
+    wall = now;
+    cpu = c;
+    rx = r;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "usage: %s [-s socket] [-i interval ms] [-b baud] device[:first[-last]] ...\n", name);
+}
+
+int main(int argc, char *argv[]){
+    const char *path = GW_SOCKET;
+    uint32_t interval = GW_INTERVAL;
+    uint32_t baud = PZEM_BAUD_RATE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:i:b:h")) != -1){
+        switch (opt){
+            case 's' : path = optarg; break;
+            case 'i' : interval = atoi(optarg); break;
+            case 'b' : baud = atoi(optarg); break;
+            default : usage(argv[0]); return 1;
+        }
+    }
+    if (optind == argc || interval < POLLER_MIN_PERIOD){
+        usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = optind; i < argc; ++i){
+        if (!add_bus(argv[i], baud))
+            return 1;
+    }
+
+    if (api_listen(path) < 0){
+        fprintf(stderr, "can't listen on %s\n", path);
+        return 1;
+    }
+
+    fprintf(stderr, "polling %zu meters on %zu ports in %zu pools, api at %s\n", meters, ports.size(), pools.size(), path);
+
+    // there is no timer task on host, loop drives polling
+    loop.every(interval, [](){
+        for (auto &p : pools)
+            p.pool->updateMetrics();
+    });
+    report();                           // take a baseline
+    loop.every(GW_STATS_PERIOD, report);
+    loop.run();
+
+    return 0;
+}
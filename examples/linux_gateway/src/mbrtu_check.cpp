@@ -0,0 +1,131 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+MBMaster/MBReadPlanner check on a synchronous queue.
+NullQ delivers TX messages to a slave emulator that feeds replies back from within txenqueue(),
+so replies re-enter MBMaster::rx_sink() while submit() is still running. Checks that direct submits and
+coalesced planner reads complete without deadlock and failed submits leave nothing in flight.
+Process is killed by an alarm if it hangs. Exits with non-zero code on any failure.
+
+ mbrtu_check [-r requests]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mbplan.hpp"
+#include <getopt.h>
+#include <unistd.h>
+
+#define CHECK_ADDR              0x0A
+#define CHECK_DEADLINE          10      // s, process is killed by SIGALRM if it hangs
+
+static int failures = 0;
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// holding register value is it's address
+static void slave(NullQ *q, TX_msg *t){
+    const uint8_t *d = t->data;
+    if (d[0] != CHECK_ADDR)
+        return;                 // no reply
+
+    uint16_t reg = d[2] << 8 | d[3];
+    uint16_t cnt = d[4] << 8 | d[5];
+    size_t len = d[1] == MBRTU_FC_READ_HOLDING ? 5 + cnt * 2 : 8;
+    uint8_t *buf = msgbuf_alloc(len);
+    if (!buf)
+        return;
+
+    buf[0] = d[0];
+    buf[1] = d[1];
+    if (d[1] == MBRTU_FC_READ_HOLDING){
+        buf[2] = cnt * 2;
+        for (uint16_t i = 0; i != cnt; ++i){
+            buf[3 + i * 2] = (reg + i) >> 8;
+            buf[4 + i * 2] = (reg + i) & 0xff;
+        }
+    } else
+        memcpy(&buf[2], &d[2], 4);      // write echo
+    modbus::setcrc16(buf, len);
+
+    q->rxenqueue(new RX_msg(buf, len));
+}
+
+int main(int argc, char *argv[]){
+    int requests = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:h")) != -1){
+        switch (opt){
+            case 'r' : requests = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-r requests]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (requests < 1)
+        return 1;
+
+    alarm(CHECK_DEADLINE);
+
+    NullQ q;
+    MBMaster mb(&q);
+    q.attach_RX_hndlr([&mb](RX_msg *m){ mb.rx_sink(m); delete m; });
+    q.attach_TX_hndlr([&q](TX_msg *t){ slave(&q, t); });
+
+    // direct submits, reply is delivered before submit() returns
+    int ok = 0, bad = 0;
+    for (int i = 0; i != requests; ++i){
+        uint16_t reg = i % 100;
+        bool sent = mb.submit(mbrtu::read_holding(CHECK_ADDR, reg, 3), [&ok, &bad, reg](const mbrtu::reply &r){
+            if (r.status == mbrtu::status_t::ok && r.value(0) == reg && r.value(2) == reg + 2)
+                ++ok;
+            else
+                ++bad;
+        });
+        if (!sent)
+            ++bad;
+    }
+    mb.submit(mbrtu::write_register(CHECK_ADDR, 5, 42), [&ok, &bad](const mbrtu::reply &r){ r.status == mbrtu::status_t::ok ? ++ok : ++bad; });
+    printf("submit: requests %d, replies %d, bad %d\n", requests + 1, ok, bad);
+    check(ok == requests + 1 && !bad && !mb.pending(), "direct submit");
+
+    // planner merges adjacent reads into one transaction, flush() submits from the caller's context
+    MBReadPlanner plan(&mb, 0);
+    ok = bad = 0;
+    for (int i = 0; i != requests; ++i){
+        uint16_t reg = (i % 10) * 4;
+        plan.submit(mbrtu::read_holding(CHECK_ADDR, reg, 4), [&ok, &bad, reg](const mbrtu::reply &r){
+            if (r.status == mbrtu::status_t::ok && r.cnt == 4 && r.value(0) == reg && r.value(3) == reg + 3)
+                ++ok;
+            else
+                ++bad;
+        });
+        if (i % 10 == 9)
+            plan.flush();
+    }
+    plan.flush();
+    printf("planner: requests %u, transactions %u, replies %d, bad %d\n", plan.getRequests(), plan.getTransactions(), ok, bad);
+    check(ok == requests && !bad && !mb.pending() && plan.getTransactions() < plan.getRequests(), "planner flush");
+
+    // request that is never answered stays in flight until it expires
+    ok = bad = 0;
+    check(mb.submit(mbrtu::read_holding(CHECK_ADDR + 1, 0, 1), [&bad](const mbrtu::reply &r){ ++bad; }) && mb.pending() == 1, "no reply");
+    mb.setTimeout(0);
+    vTaskDelay(2);
+    check(mb.expire() == 1 && bad == 1 && !mb.pending(), "expired");
+
+    // queue refuses the message, request is removed from flight
+    q.detach_TX_hndlr();
+    check(!mb.submit(mbrtu::read_holding(CHECK_ADDR, 0, 1), [&bad](const mbrtu::reply &r){ ++bad; }) && !mb.pending() && bad == 1, "failed submit");
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
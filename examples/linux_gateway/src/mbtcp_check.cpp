@@ -0,0 +1,192 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+MBTCPGateway loopback check.
+Serves a pool of emulated PZEM004 meters on a NullQ port over a local TCP listener, server loop is driven by
+MBTCPGateway::poll() from the main thread. A client thread checks cached reads, forwarded writes and energy reset,
+unknown units and that a write forwarded to a mute meter does not delay a read pipelined after it.
+Exits with non-zero code on any failure.
+
+ mbtcp_check [-r requests]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mbtcp.hpp"
+#include "lwip/sockets.h"
+#include <getopt.h>
+#include <atomic>
+#include <thread>
+
+#define CHECK_PORT              15502   // first port to try
+#define CHECK_UNIT              1       // meter answering all requests
+#define CHECK_MUTE              2       // meter answering reads only
+#define CHECK_FAST_REPLY        200     // ms, max time for a cached read behind a pending write
+
+static std::atomic<bool> done{false};
+static std::atomic<int> failures{0};
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// PZEM004 emulator, metrics are answered by all meters, writes and reset only by CHECK_UNIT
+static void emulate(NullQ *q, TX_msg *t){
+    uint8_t addr = t->data[0];
+    RX_msg *r = nullptr;
+    if (t->data[1] == CMD_RIR){
+        uint8_t regs[20] = {};
+        regs[0] = 2300 >> 8; regs[1] = 2300 & 0xff;     // voltage
+        regs[3] = addr;                                 // current
+        regs[15] = 50;                                  // frequency
+        r = pzmbus::create_reply(CMD_RIR, regs, sizeof(regs), addr);
+    } else if (addr == 0x20 + CHECK_UNIT){
+        // WSR and energy reset replies are echo of the request
+        uint8_t *b = msgbuf_alloc(t->len);
+        if (b){
+            memcpy(b, t->data, t->len);
+            r = new RX_msg(b, t->len);
+        }
+    }
+    if (r)
+        q->rxenqueue(r);
+}
+
+static bool recv_all(int fd, uint8_t *buf, size_t len){
+    size_t pos = 0;
+    while (pos < len){
+        int n = recv(fd, buf + pos, len - pos, 0);
+        if (n <= 0)
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+static bool request(int fd, uint16_t tid, uint8_t unit, const uint8_t *pdu, size_t plen){
+    uint8_t adu[MBTCP_ADU_MAX];
+    *(uint16_t*)&adu[0] = __builtin_bswap16(tid);
+    adu[2] = adu[3] = 0;
+    *(uint16_t*)&adu[4] = __builtin_bswap16(plen + 1);
+    adu[6] = unit;
+    memcpy(&adu[7], pdu, plen);
+    return send(fd, adu, MBTCP_MBAP_LEN + plen, MSG_NOSIGNAL) == static_cast<int>(MBTCP_MBAP_LEN + plen);
+}
+
+// response ADU, returns PDU length, 0 on error
+static size_t response(int fd, uint8_t *adu, uint16_t &tid){
+    if (!recv_all(fd, adu, MBTCP_MBAP_LEN))
+        return 0;
+    size_t plen = __builtin_bswap16(*(uint16_t*)&adu[4]) - 1;
+    if (plen + MBTCP_MBAP_LEN > MBTCP_ADU_MAX || !recv_all(fd, &adu[MBTCP_MBAP_LEN], plen))
+        return 0;
+    tid = __builtin_bswap16(*(uint16_t*)&adu[0]);
+    return plen;
+}
+
+static void client(uint16_t port, int requests){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))){
+        check(false, "connect");
+        done = true;
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));     // pipelined requests go out without waiting for ack
+
+    uint8_t adu[MBTCP_ADU_MAX];
+    uint16_t tid;
+    const uint8_t read_rir[] = { CMD_RIR, 0, 0, 0, 10 };
+
+    // cached reads
+    int ok = 0;
+    for (int i = 0; i != requests; ++i){
+        size_t plen = request(fd, i, CHECK_UNIT, read_rir, sizeof(read_rir)) ? response(fd, adu, tid) : 0;
+        if (plen == 22 && tid == i && adu[7] == CMD_RIR && adu[8] == 20 && adu[9] == (2300 >> 8) && adu[10] == (2300 & 0xff))
+            ++ok;
+    }
+    printf("reads: requests %d, replies %d\n", requests, ok);
+    check(ok == requests, "cached read");
+
+    // forwarded write and energy reset
+    const uint8_t wsr[] = { CMD_WSR, 0, PZ004_RHR_ALARM_THR, 0x01, 0x2c };
+    size_t plen = request(fd, 1000, CHECK_UNIT, wsr, sizeof(wsr)) ? response(fd, adu, tid) : 0;
+    check(plen == 5 && tid == 1000 && !memcmp(&adu[7], wsr, sizeof(wsr)), "forwarded write");
+
+    const uint8_t rst[] = { CMD_RST_ENRG };
+    plen = request(fd, 1001, CHECK_UNIT, rst, sizeof(rst)) ? response(fd, adu, tid) : 0;
+    check(plen == 1 && tid == 1001 && adu[7] == CMD_RST_ENRG, "energy reset");
+
+    plen = request(fd, 1002, 9, read_rir, sizeof(read_rir)) ? response(fd, adu, tid) : 0;
+    check(plen == 2 && tid == 1002 && adu[7] == (CMD_RIR | 0x80) && adu[8] == MBEX_GW_TARGET, "unknown unit");
+
+    // write to a mute meter must not hold a read pipelined after it
+    int64_t t = esp_timer_get_time();
+    bool sent = request(fd, 2000, CHECK_MUTE, wsr, sizeof(wsr)) && request(fd, 2001, CHECK_MUTE, read_rir, sizeof(read_rir));
+    plen = sent ? response(fd, adu, tid) : 0;
+    int64_t read_ms = (esp_timer_get_time() - t) / 1000;
+    check(plen == 22 && tid == 2001 && read_ms < CHECK_FAST_REPLY, "read behind a pending write");
+
+    plen = response(fd, adu, tid);
+    int64_t write_ms = (esp_timer_get_time() - t) / 1000;
+    check(plen == 2 && tid == 2000 && adu[8] == MBEX_GW_TARGET && write_ms >= MBTCP_REPLY_TIMEOUT, "mute meter timeout");
+    printf("mute meter: read %lld ms, write timeout %lld ms\n", static_cast<long long>(read_ms), static_cast<long long>(write_ms));
+
+    close(fd);
+    done = true;
+}
+
+int main(int argc, char *argv[]){
+    int requests = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:h")) != -1){
+        switch (opt){
+            case 'r' : requests = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-r requests]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (requests < 1)
+        return 1;
+
+    PZPool pool;
+    auto *q = new NullQ();
+    q->attach_TX_hndlr([q](TX_msg *t){ emulate(q, t); });
+    pool.addPort(std::make_shared<PZPort>(1, q));
+    pool.addPZEM(1, CHECK_UNIT, 0x20 + CHECK_UNIT, pzmbus::pzmodel_t::pzem004v3);
+    pool.addPZEM(1, CHECK_MUTE, 0x20 + CHECK_MUTE, pzmbus::pzmodel_t::pzem004v3);
+    pool.updateMetrics();
+
+    std::unique_ptr<MBTCPGateway> gw;
+    for (uint16_t p = CHECK_PORT; p != CHECK_PORT + 50; ++p){
+        gw.reset(new MBTCPGateway(&pool, p));
+        if (gw->listen())
+            break;
+        gw.reset();
+    }
+    if (!gw){
+        perror("listen");
+        return 1;
+    }
+    gw->setMaxAge(0);
+
+    std::thread c(client, gw->port, requests);
+    while (!done)
+        gw->poll(MBTCP_FWD_POLL);
+    c.join();
+    gw->stop();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
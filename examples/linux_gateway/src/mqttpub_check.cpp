@@ -0,0 +1,380 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+MQTTBatcher check against an MQTT broker.
+Publishes batched meter samples with a minimal MQTT 3.1.1 QoS0 client and receives them back with a subscriber
+connection, checks payload count per topic group, that every sample arrives on it's group topic with the latest
+values, and that samples are kept and overwritten, not queued, while transport is busy.
+An embedded loopback broker is used unless external one is given with -b/-p, i.e. a local mosquitto.
+Exits with non-zero code on any failure.
+
+ mqttpub_check [-b broker] [-p port] [-m meters] [-r rounds]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mqttpub.hpp"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include <getopt.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#define CHECK_PORT              18830   // first port to try for embedded broker
+#define CHECK_TOPIC0            "pzem/check/g0"
+#define CHECK_TOPIC1            "pzem/check/g1"
+#define CHECK_FILTER            "pzem/check/#"
+#define CHECK_RECV_TIMEOUT      5000    // ms, wait for all payloads to arrive
+
+#define MQTT_CONNECT            0x10
+#define MQTT_CONNACK            0x20
+#define MQTT_PUBLISH            0x30
+#define MQTT_SUBSCRIBE          0x82
+#define MQTT_SUBACK             0x90
+#define MQTT_PINGREQ            0xc0
+#define MQTT_PINGRESP           0xd0
+#define MQTT_DISCONNECT         0xe0
+
+static int failures = 0;
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+static bool recv_all(int fd, uint8_t *buf, size_t len){
+    size_t pos = 0;
+    while (pos < len){
+        int n = recv(fd, buf + pos, len - pos, 0);
+        if (n <= 0)
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+// MQTT control packet: fixed header byte, remaining length and body
+static bool send_packet(int fd, uint8_t type, const std::string &body){
+    std::string p(1, static_cast<char>(type));
+    size_t len = body.size();
+    do {
+        uint8_t b = len & 0x7f;
+        len >>= 7;
+        p += static_cast<char>(len ? b | 0x80 : b);
+    } while (len);
+    p += body;
+    return send(fd, p.data(), p.size(), MSG_NOSIGNAL) == static_cast<int>(p.size());
+}
+
+static bool recv_packet(int fd, uint8_t &type, std::string &body){
+    uint8_t b;
+    if (!recv_all(fd, &type, 1))
+        return false;
+    size_t len = 0;
+    for (int shift = 0; shift != 28; shift += 7){
+        if (!recv_all(fd, &b, 1))
+            return false;
+        len |= static_cast<size_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    body.resize(len);
+    return !len || recv_all(fd, reinterpret_cast<uint8_t*>(&body[0]), len);
+}
+
+static std::string mqtt_str(const char *s){
+    size_t len = strlen(s);
+    std::string r;
+    r += static_cast<char>(len >> 8);
+    r += static_cast<char>(len & 0xff);
+    return r + s;
+}
+
+static int tcp_connect(const char *host, uint16_t port){
+    struct addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char p[8];
+    snprintf(p, sizeof(p), "%u", port);
+    if (getaddrinfo(host, p, &hints, &res) || !res)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen)){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// CONNECT with clean session, waits for CONNACK
+static int mqtt_connect(const char *host, uint16_t port, const char *client){
+    int fd = tcp_connect(host, port);
+    if (fd < 0)
+        return -1;
+
+    std::string body = mqtt_str("MQTT");
+    body += '\x04';                     // protocol level 3.1.1
+    body += '\x02';                     // clean session
+    body += std::string("\x00\x3c", 2); // keep alive, s
+    body += mqtt_str(client);
+    uint8_t type;
+    std::string ack;
+    if (!send_packet(fd, MQTT_CONNECT, body) || !recv_packet(fd, type, ack) || type != MQTT_CONNACK || ack.size() != 2 || ack[1]){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief embedded broker, forwards every PUBLISH to all subscribed connections
+ * topic filters are not matched, subscription to anything subscribes to everything
+ */
+class Broker {
+    int lfd = -1;
+    std::mutex mtx;
+    std::vector<int> fds;
+    std::vector<int> subs;
+    std::vector<std::thread> threads;
+
+    void session(int fd){
+        uint8_t type;
+        std::string body;
+        while (recv_packet(fd, type, body)){
+            switch (type & 0xf0){
+                case MQTT_CONNECT :
+                    send_packet(fd, MQTT_CONNACK, std::string(2, '\0'));
+                    break;
+                case MQTT_SUBSCRIBE & 0xf0 : {
+                    std::lock_guard<std::mutex> l(mtx);
+                    subs.push_back(fd);
+                    send_packet(fd, MQTT_SUBACK, body.substr(0, 2) + std::string(1, '\0'));
+                    break;
+                }
+                case MQTT_PUBLISH : {
+                    std::lock_guard<std::mutex> l(mtx);
+                    for (int s : subs)
+                        send_packet(s, MQTT_PUBLISH, body);
+                    break;
+                }
+                case MQTT_PINGREQ :
+                    send_packet(fd, MQTT_PINGRESP, std::string());
+                    break;
+                default :
+                    return;
+            }
+        }
+    }
+
+    void acceptor(){
+        for (;;){
+            int fd = accept(lfd, NULL, NULL);
+            if (fd < 0)
+                return;
+            std::lock_guard<std::mutex> l(mtx);
+            fds.push_back(fd);
+            threads.emplace_back(&Broker::session, this, fd);
+        }
+    }
+
+public:
+    uint16_t port = 0;
+
+    bool start(){
+        lfd = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (port = CHECK_PORT; port != CHECK_PORT + 50; ++port){
+            addr.sin_port = htons(port);
+            if (!bind(lfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) && !::listen(lfd, 4)){
+                threads.emplace_back(&Broker::acceptor, this);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ~Broker(){
+        shutdown(lfd, SHUT_RDWR);
+        {
+            std::lock_guard<std::mutex> l(mtx);
+            for (int fd : fds)
+                shutdown(fd, SHUT_RDWR);
+        }
+        // acceptor is the first one and could add sessions until it exits
+        threads.front().join();
+        for (size_t i = 1; i != threads.size(); ++i)
+            threads[i].join();
+        for (int fd : fds)
+            close(fd);
+        close(lfd);
+    }
+};
+
+// subscriber side: samples received per meter
+struct received_t {
+    std::atomic<uint32_t> payloads{0};
+    std::atomic<uint32_t> samples{0};
+    std::atomic<uint32_t> misplaced{0};         // sample on the topic of the other group
+    std::vector<uint32_t> count;
+    std::vector<uint32_t> voltage;              // last received voltage, dV
+};
+
+static void subscriber(int fd, received_t *rx, uint8_t meters){
+    uint8_t type;
+    std::string body;
+    while (recv_packet(fd, type, body)){
+        if ((type & 0xf0) != MQTT_PUBLISH || body.size() < 2)
+            continue;
+        size_t tlen = static_cast<uint8_t>(body[0]) << 8 | static_cast<uint8_t>(body[1]);
+        std::string topic = body.substr(2, tlen);
+        std::string payload = body.substr(2 + tlen);
+        uint8_t group = topic == CHECK_TOPIC1;
+        ++rx->payloads;
+
+        // {"meters":[{"id":1,"age":0,"voltage":230.1,...},...]}
+        size_t pos = 0;
+        while ((pos = payload.find("{\"id\":", pos)) != std::string::npos){
+            pos += 6;
+            unsigned id = strtoul(&payload[pos], NULL, 10);
+            size_t v = payload.find("\"voltage\":", pos);
+            if (!id || id > meters || v == std::string::npos)
+                continue;
+            rx->voltage[id - 1] = lround(strtod(&payload[v + 10], NULL) * 10);
+            ++rx->count[id - 1];
+            if (id % 2 != group)
+                ++rx->misplaced;
+            ++rx->samples;
+        }
+    }
+}
+
+int main(int argc, char *argv[]){
+    const char *host = "127.0.0.1";
+    uint16_t port = 0;
+    int meters = 25;
+    int rounds = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:m:r:h")) != -1){
+        switch (opt){
+            case 'b' : host = optarg; break;
+            case 'p' : port = atoi(optarg); break;
+            case 'm' : meters = atoi(optarg); break;
+            case 'r' : rounds = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-b broker] [-p port] [-m meters] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (meters < 1 || meters > 200 || rounds < 1)
+        return 1;
+
+    std::unique_ptr<Broker> broker;
+    if (!port){
+        broker.reset(new Broker());
+        if (!broker->start()){
+            perror("broker");
+            return 1;
+        }
+        port = broker->port;
+    }
+
+    int sfd = mqtt_connect(host, port, "pzem-check-sub");
+    int pfd = mqtt_connect(host, port, "pzem-check-pub");
+    if (sfd < 0 || pfd < 0){
+        fprintf(stderr, "can't connect to broker %s:%u\n", host, port);
+        return 1;
+    }
+    std::string sub = std::string("\x00\x01", 2) + mqtt_str(CHECK_FILTER) + std::string(1, '\0');
+    uint8_t type;
+    std::string ack;
+    if (!send_packet(sfd, MQTT_SUBSCRIBE, sub) || !recv_packet(sfd, type, ack) || type != MQTT_SUBACK){
+        fprintf(stderr, "subscribe failed\n");
+        return 1;
+    }
+
+    received_t rx;
+    rx.count.resize(meters);
+    rx.voltage.resize(meters);
+    std::thread st(subscriber, sfd, &rx, meters);
+
+    // odd meters are in group 1
+    MQTTBatcher pub;
+    pub.setTopic(0, CHECK_TOPIC0);
+    pub.setTopic(1, CHECK_TOPIC1);
+    for (int id = 1; id <= meters; ++id)
+        pub.setGroup(id, id % 2);
+
+    std::atomic<bool> busy{false};
+    uint32_t sent = 0;
+    pub.attach_publisher([pfd, &busy, &sent](const char *topic, const char *payload, size_t len){
+        if (busy)
+            return false;
+        ++sent;
+        return send_packet(pfd, MQTT_PUBLISH, mqtt_str(topic) + std::string(payload, len));
+    });
+
+    pz004::metrics m;
+    size_t odd = (meters + 1) / 2, even = meters / 2;
+    size_t per_round = (odd + MQTTPUB_BATCH_MAX - 1) / MQTTPUB_BATCH_MAX + (even + MQTTPUB_BATCH_MAX - 1) / MQTTPUB_BATCH_MAX;
+    int64_t t = esp_timer_get_time();
+    for (int r = 0; r != rounds; ++r){
+        for (int id = 1; id <= meters; ++id){
+            m.voltage = 2000 + id * 10 + r % 10;
+            pub.push(id, m);
+        }
+        check(pub.service() == per_round, "payloads per round");
+    }
+    int64_t elapsed = esp_timer_get_time() - t;
+    check(!pub.pending() && !pub.getDropped(), "nothing pending");
+
+    // transport busy, samples are kept with only the latest one per meter
+    busy = true;
+    for (int r = 0; r != 3; ++r){
+        for (int id = 1; id <= meters; ++id){
+            m.voltage = 2500 + id + r;
+            pub.push(id, m);
+        }
+        pub.service();
+    }
+    check(pub.pending() == static_cast<size_t>(meters) && pub.getDropped() == 2 * static_cast<uint32_t>(meters), "busy transport keeps latest samples");
+    busy = false;
+    check(pub.service() == per_round && !pub.pending(), "published after busy transport");
+
+    uint32_t expect_payloads = per_round * (rounds + 1);
+    uint32_t expect_samples = meters * (rounds + 1);
+    for (int i = 0; i != CHECK_RECV_TIMEOUT && rx.samples < expect_samples; ++i)
+        vTaskDelay(1);
+
+    send_packet(pfd, MQTT_DISCONNECT, std::string());
+    send_packet(sfd, MQTT_DISCONNECT, std::string());
+    shutdown(sfd, SHUT_RDWR);
+    st.join();
+    close(sfd);
+    close(pfd);
+    broker.reset();
+
+    bool latest = true;
+    for (int id = 1; id <= meters; ++id)
+        latest &= rx.count[id - 1] == static_cast<uint32_t>(rounds + 1) && rx.voltage[id - 1] == static_cast<uint32_t>(2500 + id + 2);
+
+    printf("published: payloads %u, received %u, samples %u, dropped %u, %.1f us per payload\n", pub.getPublished(),
+        rx.payloads.load(), rx.samples.load(), pub.getDropped(), static_cast<double>(elapsed) / (per_round * rounds));
+    check(sent == expect_payloads && pub.getPublished() == expect_payloads, "published payloads");
+    check(rx.payloads == expect_payloads && rx.samples == expect_samples, "received payloads");
+    check(!rx.misplaced, "group topics");
+    check(latest, "latest samples");
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
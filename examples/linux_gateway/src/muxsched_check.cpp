@@ -0,0 +1,198 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+MuxScheduler check.
+Runs fixed scenarios and a random push/next/clear load against UartMux channel scheduler and checks
+burst limits, round-robin fairness, clear() and switch accounting. Exits with non-zero code on any failure.
+
+ muxsched_check [-n rounds] [-s seed]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "muxsched.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+static int failures = 0;
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// busy channel is served no more than 'burst' in a row if others are waiting
+static void burst_limit(){
+    MuxScheduler s(3, 4);
+    for (int i = 0; i != 10; ++i)
+        s.push(0);
+    s.push(1); s.push(1);
+    s.push(2); s.push(2);
+
+    const int expect[] = {0, 0, 0, 0, 1, 1, 2, 2, 0, 0, 0, 0, 0, 0};
+    bool ok = true;
+    for (int ch : expect)
+        ok &= s.next() == ch;
+    check(ok, "burst: service order");
+    check(s.next() == -1, "burst: queue is empty");
+    check(s.switches() == 3, "burst: switch count");
+}
+
+// every channel with pending transactions gets a slice within one round
+static void fairness(){
+    const size_t chans = 4, burst = 5, per_ch = 100;
+    MuxScheduler s(chans, burst);
+    for (size_t ch = 0; ch != chans; ++ch){
+        for (size_t i = 0; i != per_ch; ++i)
+            s.push(ch);
+    }
+
+    size_t served[chans] = {};
+    bool ok = true;
+    for (size_t round = 0; round != per_ch / burst; ++round){
+        for (size_t i = 0; i != chans * burst; ++i){
+            int ch = s.next();
+            if (ch < 0){
+                ok = false;
+                break;
+            }
+            ++served[ch];
+        }
+        for (size_t ch = 0; ch != chans; ++ch)
+            ok &= served[ch] == (round + 1) * burst;
+    }
+    check(ok, "fairness: equal share per round");
+    check(s.next() == -1, "fairness: queue is empty");
+    check(s.switches() == chans * per_ch / burst - 1, "fairness: one switch per slice");
+}
+
+// with unlimited burst channel is drained before switching
+static void unlimited(){
+    MuxScheduler s(3, 0);
+    for (int i = 0; i != 50; ++i){
+        s.push(0);
+        s.push(1);
+        s.push(2);
+    }
+    int last = 0;
+    bool ok = true;
+    for (int i = 0; i != 150; ++i){
+        int ch = s.next();
+        ok &= ch == i / 50;
+        last = ch;
+    }
+    check(ok && last == 2, "unlimited: channels drained in order");
+    check(s.switches() == 2, "unlimited: switch count");
+}
+
+// cleared channel is skipped, out of range channels are ignored
+static void clear(){
+    MuxScheduler s(3, 2);
+    s.push(0); s.push(1); s.push(1); s.push(2);
+    s.push(3);
+    s.clear(7);
+    s.clear(1);
+    check(s.getPending(1) == 0, "clear: pending dropped");
+    check(s.next() == 0 && s.next() == 2 && s.next() == -1, "clear: channel skipped");
+
+    // clearing current channel in the middle of a slice moves to the next one
+    s.push(2); s.push(2); s.push(0);
+    check(s.next() == 2, "clear: current channel served");
+    s.clear(2);
+    check(s.next() == 0 && s.next() == -1, "clear: current channel left");
+
+    MuxScheduler none(0);
+    none.push(0);
+    check(none.next() == -1, "clear: no channels");
+}
+
+// random load, checks invariants against a model
+static void random_load(int rounds){
+    const size_t chans = 5, burst = 3;
+    MuxScheduler s(chans, burst);
+    size_t model[chans] = {};
+    int prev = 0;                       // scheduler starts on the first channel
+    size_t run = 0;
+    uint32_t switches = 0;
+    bool ok = true;
+
+    for (int r = 0; r != rounds && ok; ++r){
+        size_t ch = rand() % chans;
+        switch (rand() % 8){
+            case 0 :
+                s.clear(ch);
+                model[ch] = 0;
+                break;
+            case 1 :
+            case 2 :
+            case 3 :
+                s.push(ch);
+                ++model[ch];
+                break;
+            default : {
+                size_t total = 0, others = 0;
+                for (size_t i = 0; i != chans; ++i){
+                    total += model[i];
+                    if (static_cast<int>(i) != prev)
+                        others += model[i];
+                }
+                int n = s.next();
+                if (!total){
+                    ok &= n == -1;
+                    break;
+                }
+                if (n < 0 || !model[n]){
+                    ok = false;
+                    break;
+                }
+                --model[n];
+                if (n == prev)
+                    ++run;
+                else {
+                    ++switches;
+                    run = 1;
+                    prev = n;
+                }
+                // slice could be longer than a burst only if nobody else is waiting
+                ok &= run <= burst || !others;
+                if (run > burst)
+                    run = 1;
+            }
+        }
+        for (size_t i = 0; i != chans; ++i)
+            ok &= s.getPending(i) == model[i];
+    }
+    check(ok, "random: invariants");
+    check(s.switches() == switches, "random: switch count");
+}
+
+int main(int argc, char *argv[]){
+    int rounds = 100000;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1){
+        switch (opt){
+            case 'n' : rounds = atoi(optarg); break;
+            case 's' : seed = strtoul(optarg, NULL, 0); break;
+            default :
+                fprintf(stderr, "usage: %s [-n rounds] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    srand(seed);
+
+    burst_limit();
+    fairness();
+    unlimited();
+    clear();
+    random_load(rounds);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
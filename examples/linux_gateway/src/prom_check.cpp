@@ -0,0 +1,137 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Prometheus exposition check.
+Renders a scrape of a pool of emulated PZEM004/PZEM003 meters on a NullQ port with PromRenderer, checks
+families and samples, that read() into small buffers gives the same output as write(), and that an
+average scrape renders in less than 1 ms. Exits with non-zero code on any failure.
+
+ prom_check [-m meters] [-r repeats]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "prom.hpp"
+#include <getopt.h>
+#include <string>
+
+#define CHECK_SCRAPE_US         1000    // max average scrape time, us
+
+static int failures = 0;
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// answer RIR like a PZEM004 (even addresses) or PZEM003 (odd ones) would do
+static void emulate(NullQ *q, const TX_msg *tm){
+    if (tm->data[1] != CMD_RIR)
+        return;
+
+    uint8_t addr = tm->data[0];
+    uint8_t len = addr % 2 ? PZ003_RIR_RESP_LEN : PZ004_RIR_RESP_LEN;
+    uint16_t voltage = len == PZ003_RIR_RESP_LEN ? 23010 : 2301;     // 230.1 V, PZEM003 has 0.01 V resolution
+    uint8_t regs[PZ004_RIR_RESP_LEN] = {};
+    regs[0] = voltage >> 8; regs[1] = voltage & 0xff;
+    regs[3] = addr;                                     // current
+    if (len == PZ004_RIR_RESP_LEN)
+        regs[PZ004_RIR_FREQUENCY * 2 + 1] = 50;
+    RX_msg *r = pzmbus::create_reply(CMD_RIR, regs, len, addr);
+    if (r)
+        q->rxenqueue(r);
+}
+
+// drop data age samples, they change between renders
+static std::string aged(const std::string &s){
+    std::string r;
+    size_t pos = 0;
+    while (pos < s.size()){
+        size_t end = s.find('\n', pos);
+        end = end == std::string::npos ? s.size() : end + 1;
+        if (s.compare(pos, sizeof(PROM_PREFIX "data_age_seconds{") - 1, PROM_PREFIX "data_age_seconds{"))
+            r.append(s, pos, end - pos);
+        pos = end;
+    }
+    return r;
+}
+
+static size_t count(const std::string &s, const std::string &what){
+    size_t n = 0;
+    for (size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1))
+        ++n;
+    return n;
+}
+
+int main(int argc, char *argv[]){
+    int meters = 40, repeats = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:r:h")) != -1){
+        switch (opt){
+            case 'm' : meters = atoi(optarg); break;
+            case 'r' : repeats = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-m meters] [-r repeats]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (meters < 1 || meters > 247 || repeats < 1)
+        return 1;
+
+    PZPool pool;
+    auto *q = new NullQ();
+    q->attach_TX_hndlr([q](TX_msg *tm){ emulate(q, tm); });
+    pool.addPort(std::make_shared<PZPort>(1, q, "uart \"1\""));
+    for (int i = 1; i <= meters; ++i)
+        pool.addPZEM(1, i, i, i % 2 ? pzmbus::pzmodel_t::pzem003 : pzmbus::pzmodel_t::pzem004v3);
+    pool.updateMetrics();
+
+    PromRenderer pr(&pool);
+    std::string full;
+    pr.begin();
+    check(pr.write([&full](const char *data, size_t len){ full.append(data, len); return true; }), "write");
+
+    // every family has HELP and TYPE, every meter a voltage sample, port label is escaped
+    size_t families = count(full, "# TYPE ");
+    check(families && count(full, "# HELP ") == families, "family headers");
+    check(count(full, PROM_PREFIX "voltage_volts{") == static_cast<size_t>(meters), "voltage samples");
+    check(count(full, "} 230.1\n") + count(full, "} 230.10\n") == static_cast<size_t>(meters), "voltage value");
+    check(full.find("uart \\\"1\\\"") != std::string::npos, "label escaping");
+    check(full.back() == '\n', "trailing newline");
+
+    // resumable rendering into buffers of any size
+    bool same = true;
+    const size_t sizes[] = { 1, 7, 64, 4096 };
+    for (size_t sz : sizes){
+        std::string out;
+        char chunk[4096];
+        size_t n;
+        pr.begin();
+        while ((n = pr.read(chunk, sz)))
+            out.append(chunk, n);
+        same &= aged(out) == aged(full);
+    }
+    check(same, "read() into small buffers");
+
+    // aborted by sink
+    pr.begin();
+    check(!pr.write([](const char *, size_t){ return false; }), "sink abort");
+
+    size_t bytes = 0;
+    int64_t t = esp_timer_get_time();
+    for (int i = 0; i != repeats; ++i){
+        pr.begin();
+        pr.write([&bytes](const char *, size_t len){ bytes += len; return true; });
+    }
+    double us = static_cast<double>(esp_timer_get_time() - t) / repeats;
+    printf("scrape: meters %d, families %zu, %zu bytes, %.1f us\n", meters, families, bytes / repeats, us);
+    check(us < CHECK_SCRAPE_US, "scrape time");
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+QuantileHist check.
+Compares histogram quantiles of random samples with exact ones computed by sorting, checks bin edge cases
+(under/overflow ranks, the last bin clamped to hi when bin width does not divide the range), merge, export/import
+round trip, malformed import rejection and counters saturation on merge and import.
+Exits with non-zero code on any failure.
+
+ quantile_check [-n samples] [-s seed]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "quantile.hpp"
+#include <algorithm>
+#include <getopt.h>
+#include <random>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool cond, const char *what){
+    if (cond)
+        return;
+    printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// same LEB128 encoding as exportBins() uses
+static void put_varint(std::vector<uint8_t> &buf, uint32_t v){
+    do {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        buf.push_back(v ? b | 0x80 : b);
+    } while (v);
+}
+
+// bin width 1, quantiles must match sorted samples exactly
+static void exact(std::mt19937 &rng, uint32_t samples){
+    QuantileHist h(QHIST_PZ004_VOL_LO, QHIST_PZ004_VOL_HI, QHIST_PZ004_VOL_WIDTH);
+    check(h.valid(), "allocation");
+    std::normal_distribution<float> vol(2300, 50);
+    std::vector<uint32_t> v(samples);
+    for (auto &x : v){
+        x = std::max(0.0f, vol(rng));
+        h.push(x);
+    }
+    std::sort(v.begin(), v.end());
+
+    bool ok = h.count() == samples && !h.underflow() && !h.overflow();
+    const float qs[] = { 0.01, 0.1, 0.5, 0.9, 0.95, 0.99, 1.0 };
+    for (float q : qs){
+        uint32_t rank = std::max(1.0, std::ceil(static_cast<double>(q) * samples));
+        ok &= h.quantile(q) == v[rank - 1];
+    }
+    check(ok, "exact quantiles");
+}
+
+static void edges(){
+    QuantileHist empty(0, 10);
+    check(!empty.quantile(0.5), "empty histogram");
+
+    // bins [10-13] [14-17] [18-21], values past 20 are overflow
+    QuantileHist h(10, 20, 4);
+    check(h.nbins == 3, "bin count");
+    h.push(20);
+    check(h.quantile(0.5) == 19 && !h.overflow(), "last bin clamped to hi");
+    h.push(21);
+    check(h.overflow() == 1 && h.quantile(1.0) == 20, "value past hi is overflow");
+    h.push(5);
+    check(h.underflow() == 1 && h.quantile(0) == 10, "underflow rank returns lo");
+    h.clear();
+    h.push(15);
+    check(h.count() == 1 && h.quantile(0.5) == 16, "middle of a full bin");
+
+    QuantileHist a(0, 100, 10), b(0, 100, 10), c(0, 100, 5);
+    a.push(5); b.push(95); b.push(150);
+    check(a.merge(b) && a.count() == 3 && a.overflow() == 1 && a.quantile(0.5) == 95, "merge");
+    check(!a.merge(c), "merge geometry mismatch");
+}
+
+static void transfer(std::mt19937 &rng){
+    QuantileHist h(QHIST_PZ004_CUR_LO, QHIST_PZ004_CUR_HI, QHIST_PZ004_CUR_WIDTH), r(QHIST_PZ004_CUR_LO, QHIST_PZ004_CUR_HI, QHIST_PZ004_CUR_WIDTH);
+    std::exponential_distribution<float> cur(1.0 / 5000);
+    for (int i = 0; i != 10000; ++i)
+        h.push(cur(rng));
+
+    uint8_t buf[4096];
+    size_t len = h.exportBins(buf, sizeof(buf));
+    bool ok = len && r.importBins(buf, len) && r.count() == h.count() && r.overflow() == h.overflow();
+    const float qs[] = { 0.1, 0.5, 0.9, 0.99 };
+    for (float q : qs)
+        ok &= r.quantile(q) == h.quantile(q);
+    check(ok, "export/import round trip");
+    check(!h.exportBins(buf, len - 1), "export into short buffer");
+
+    // truncated payload and bin index past the end are rejected without touching counters
+    uint32_t cnt = r.count();
+    ok = !r.importBins(buf, len - 1);
+    std::vector<uint8_t> bad;
+    for (uint32_t v : { h.lo, h.width, h.nbins, 0u, 0u, h.nbins, 1u })
+        put_varint(bad, v);
+    ok &= !r.importBins(bad.data(), bad.size());
+    QuantileHist other(0, 1000);
+    ok &= !other.importBins(buf, len);
+    check(ok && r.count() == cnt, "malformed import");
+}
+
+// counters saturate instead of wrapping around
+static void saturation(){
+    QuantileHist h(0, 100, 10);
+    std::vector<uint8_t> buf;
+    for (uint32_t v : { h.lo, h.width, h.nbins, UINT32_MAX - 1, 5u, 9u, UINT32_MAX - 10 })
+        put_varint(buf, v);
+    check(h.importBins(buf.data(), buf.size()) && h.count() == UINT32_MAX && h.underflow() == UINT32_MAX - 1, "import total saturates");
+    check(h.importBins(buf.data(), buf.size()) && h.count() == UINT32_MAX && h.underflow() == UINT32_MAX && h.overflow() == 10,
+        "import counters saturate");
+
+    QuantileHist m(0, 100, 10);
+    m.push(95);
+    check(m.merge(h) && m.count() == UINT32_MAX && m.underflow() == UINT32_MAX && m.quantile(1.0) == m.lo, "merge saturates");
+}
+
+int main(int argc, char *argv[]){
+    uint32_t samples = 100000;
+    unsigned seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1){
+        switch (opt){
+            case 'n' : samples = atoi(optarg); break;
+            case 's' : seed = strtoul(optarg, NULL, 0); break;
+            default :
+                fprintf(stderr, "usage: %s [-n samples] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (!samples)
+        return 1;
+
+    std::mt19937 rng(seed);
+    exact(rng, samples);
+    edges();
+    transfer(rng);
+    saturation();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
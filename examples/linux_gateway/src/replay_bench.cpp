@@ -0,0 +1,144 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Capture replay throughput check.
+Replays a BusCapture stream through ReplayQ at speed 0 into a pool of PZEM004 meters and reports
+frame rate and data rate of the parsing pipeline. Without a capture file, traffic of a pool of emulated
+meters on a NullQ port is recorded through CaptureQ first, then replayed meters must end up with the same
+metrics as the recorded ones. Exits with non-zero code on any failure.
+
+ replay_bench [-f capture] [-m meters] [-r rounds] [-p passes]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "capture.hpp"
+#include "pzem_edl.hpp"
+#include <getopt.h>
+#include <vector>
+
+#define BENCH_FRAME_SIZE        48      // capture bytes per RIR exchange, TX + RX with record headers
+
+static uint32_t round_no = 0;
+
+// answer RIR like a PZEM004 with address 'addr', values change every round
+static void emulate(NullQ *q, const TX_msg *tm){
+    if (tm->data[1] != CMD_RIR)
+        return;
+
+    uint8_t addr = tm->data[0];
+    uint16_t voltage = 2200 + round_no % 200;
+    uint32_t power = addr * 1000 + round_no;
+    uint8_t regs[PZ004_RIR_RESP_LEN] = {};
+    regs[0] = voltage >> 8; regs[1] = voltage & 0xff;
+    regs[3] = addr;                                     // current
+    regs[PZ004_RIR_POWER_L * 2] = (power >> 8) & 0xff;
+    regs[PZ004_RIR_POWER_L * 2 + 1] = power & 0xff;
+    regs[PZ004_RIR_POWER_H * 2] = power >> 24;
+    regs[PZ004_RIR_POWER_H * 2 + 1] = (power >> 16) & 0xff;
+    regs[PZ004_RIR_FREQUENCY * 2 + 1] = 50;
+    RX_msg *r = pzmbus::create_reply(CMD_RIR, regs, sizeof(regs), addr);
+    if (r)
+        q->rxenqueue(r);
+}
+
+static std::vector<uint8_t> load(const char *fname){
+    std::vector<uint8_t> data;
+    FILE *f = fopen(fname, "rb");
+    if (!f)
+        return data;
+    uint8_t b[4096];
+    size_t n;
+    while ((n = fread(b, 1, sizeof(b), f)) > 0)
+        data.insert(data.end(), b, b + n);
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char *argv[]){
+    const char *fname = nullptr;
+    int meters = 16, rounds = 10000, passes = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:m:r:p:h")) != -1){
+        switch (opt){
+            case 'f' : fname = optarg; break;
+            case 'm' : meters = atoi(optarg); break;
+            case 'r' : rounds = atoi(optarg); break;
+            case 'p' : passes = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-f capture] [-m meters] [-r rounds] [-p passes]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (meters < 1 || meters > 247 || rounds < 1 || passes < 1)
+        return 1;
+
+    std::vector<uint8_t> file;
+    std::unique_ptr<BusCapture> cap;
+    PZPool src;
+    const uint8_t *stream;
+    size_t len;
+    uint32_t rx_frames = 0;
+
+    if (fname){
+        file = load(fname);
+        stream = file.data();
+        len = file.size();
+    } else {
+        cap.reset(new BusCapture(CAPTURE_HDR_LEN + static_cast<size_t>(meters) * rounds * BENCH_FRAME_SIZE));
+        auto *q = new NullQ();
+        q->attach_TX_hndlr([q](TX_msg *tm){ emulate(q, tm); });
+        src.addPort(std::make_shared<PZPort>(1, new CaptureQ(q, cap.get()), "capture"));
+        for (int i = 1; i <= meters; ++i)
+            src.addPZEM(1, i, i, pzmbus::pzmodel_t::pzem004v3);
+        for (round_no = 0; round_no != static_cast<uint32_t>(rounds); ++round_no)
+            src.updateMetrics();
+
+        stream = cap->data();
+        len = cap->length();
+        rx_frames = cap->getFrames() / 2;
+        printf("recorded: meters %d, rounds %d, frames %u, dropped %u, %zu bytes\n", meters, rounds, cap->getFrames(), cap->getDropped(), len);
+        if (cap->getDropped()){
+            printf("FAILED\n");
+            return 1;
+        }
+    }
+
+    auto *rq = new ReplayQ(stream, len, 0);
+    PZPool pool;
+    pool.addPort(std::make_shared<PZPort>(1, rq, "replay"));
+    for (int i = 1; i <= meters; ++i)
+        pool.addPZEM(1, i, i, pzmbus::pzmodel_t::pzem004v3);
+
+    // best of several passes
+    size_t frames = 0;
+    int64_t best = 0;
+    for (int p = 0; p != passes; ++p){
+        int64_t t = esp_timer_get_time();
+        frames = rq->play();
+        t = esp_timer_get_time() - t;
+        if (!best || t < best)
+            best = t;
+    }
+    if (!best)
+        best = 1;
+
+    printf("replayed: frames %zu, %zu bytes, %lld us, %.0f frames/s, %.1f MB/s, %.2f us per frame\n", frames, len,
+        static_cast<long long>(best), frames * 1e6 / best, len / static_cast<double>(best), static_cast<double>(best) / (frames ? frames : 1));
+
+    bool ok = frames > 0;
+    if (!fname){
+        ok &= frames == rx_frames;
+        for (int i = 1; i <= meters; ++i){
+            auto a = std::static_pointer_cast<const pz004::metrics>(src.getMetrics(i));
+            auto b = std::static_pointer_cast<const pz004::metrics>(pool.getMetrics(i));
+            ok &= a && b && a->voltage == b->voltage && a->power == b->power && a->power == static_cast<uint32_t>(i * 1000 + rounds - 1);
+        }
+    }
+
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+Heap-free operation check for PZEM_EDL_STATIC builds.
+Sets up a pool of emulated PZEM004 meters on a NullQ port and a TimeSeries with static storage,
+then counts every heap allocation made while polling them. Exits with non-zero code if there were any.
+
+ static_check [-m meters] [-r rounds]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "pzem_edl.hpp"
+#include "timeseries.hpp"
+#include "mempool.hpp"
+#include <getopt.h>
+#include <new>
+
+#ifndef PZEM_EDL_STATIC
+#error "static_check must be built with PZEM_EDL_STATIC"
+#endif
+
+#define CHECK_TS_SIZE           300
+
+// heap hooks, allocations are counted once init is done
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static bool armed = false;
+static size_t allocs = 0;
+
+static inline void account(){
+    if (armed)
+        ++allocs;
+}
+
+extern "C" void* malloc(size_t n){ account(); return __libc_malloc(n); }
+extern "C" void* calloc(size_t n, size_t s){ account(); return __libc_calloc(n, s); }
+extern "C" void* realloc(void *p, size_t n){ account(); return __libc_realloc(p, n); }
+
+void* operator new(size_t n){ account(); void *p = __libc_malloc(n ? n : 1); if (!p) throw std::bad_alloc(); return p; }
+void* operator new[](size_t n){ return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept { account(); return __libc_malloc(n ? n : 1); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept { account(); return __libc_malloc(n ? n : 1); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static pz004::metrics ts_storage[CHECK_TS_SIZE];
+
+// answer RIR/RHR requests like a PZEM004 with address 'addr' would do
+static void emulate(NullQ *q, const TX_msg *tm){
+    uint8_t addr = tm->data[0];
+    uint8_t regs[20] = {};
+    uint8_t len;
+
+    if (tm->data[1] == CMD_RIR){
+        regs[0] = 2300 >> 8; regs[1] = 2300 & 0xff;     // voltage
+        regs[3] = addr;                                 // current
+        regs[15] = 50;                                  // frequency
+        len = 20;
+    } else if (tm->data[1] == CMD_RHR){
+        regs[3] = addr;                                 // modbus address
+        len = 4;
+    } else
+        return;
+
+    RX_msg *r = pzmbus::create_reply(tm->data[1], regs, len, addr);
+    if (r)
+        q->rxenqueue(r);
+}
+
+int main(int argc, char *argv[]){
+    int meters = 16, rounds = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:r:h")) != -1){
+        switch (opt){
+            case 'm' : meters = atoi(optarg); break;
+            case 'r' : rounds = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-m meters] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (meters < 1 || meters > ADDR_MAX || rounds < 1)
+        return 1;
+
+    // init, allocations are allowed here
+    PZPool pool;
+    NullQ *q = new NullQ();
+    q->attach_TX_hndlr([q](TX_msg *tm){ emulate(q, tm); });
+    pool.addPort(std::make_shared<PZPort>(1, q, "nullq"));
+    for (int i = 1; i <= meters; ++i)
+        pool.addPZEM(1, i, i, pzmbus::pzmodel_t::pzem004v3);
+
+    TSContainer<pz004::metrics> tsc;
+    uint8_t ts = tsc.addTS(ts_storage, CHECK_TS_SIZE, 0);
+
+    // one round to settle any lazy init
+    pool.updateMetrics();
+
+    armed = true;
+    size_t fresh = 0;
+    for (int r = 1; r <= rounds; ++r){
+        pool.updateMetrics();
+        tsc.push(*std::static_pointer_cast<const pz004::metrics>(pool.getMetrics(1)), r);
+    }
+    pool.forEachPZEM([&fresh](const PZEM *pz){
+        if (pz->getState()->update_us && pz->getState()->err == pzmbus::pzem_err_t::err_ok)
+            ++fresh;
+        return true;
+    });
+    // exhausted pool gives no message, queue must drop it
+    uint32_t drops = q->getStats().tx_drop;
+    bool nullmsg = !q->txenqueue(nullptr) && q->getStats().tx_drop == drops + 1;
+    armed = false;
+
+    mempool_stats_t objs, bufs;
+    msgpool_stats(objs, bufs);
+
+    printf("meters %d, rounds %d, updated %zu, series size %d\n", meters, rounds, fresh, tsc.getTSsize(ts));
+    printf("message objects: %zu bytes x %zu, peak %zu, fails %u\n", objs.size, objs.capacity, objs.peak, objs.fails);
+    printf("message buffers: %zu bytes x %zu, peak %zu, fails %u\n", bufs.size, bufs.capacity, bufs.peak, bufs.fails);
+    printf("heap allocations after init: %zu\n", allocs);
+
+    if (!nullmsg)
+        printf("null message is not dropped\n");
+
+    bool ok = nullmsg && !allocs && fresh == static_cast<size_t>(meters) && !objs.fails && !bufs.fails && !objs.used && !bufs.used;
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
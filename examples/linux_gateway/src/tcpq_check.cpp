@@ -0,0 +1,171 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+TcpQ/TcpHub loopback check.
+Runs a serial server emulator on a local TCP listener that answers PZEM004 metrics requests,
+then polls it through TcpQ with 'rtu' and 'mbtcp' framing driving TcpHub::poll() from the main thread.
+Replies are sent in two chunks to check frame reassembly. Exits with non-zero code on any failure.
+
+ tcpq_check [-r requests]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "tcpq.hpp"
+#include "pzem_modbus.hpp"
+#include "lwip/sockets.h"
+#include <getopt.h>
+#include <atomic>
+#include <thread>
+
+#define CHECK_ADDR              0x21
+#define CHECK_REPLY_TIMEOUT     2000    // ms
+
+static std::atomic<bool> done{false};
+
+static bool recv_all(int fd, uint8_t *buf, size_t len){
+    size_t pos = 0;
+    while (pos < len){
+        int n = recv(fd, buf + pos, len - pos, 0);
+        if (n <= 0)
+            return false;
+        pos += n;
+    }
+    return true;
+}
+
+// RTU reply to a metrics request
+static RX_msg* make_reply(uint8_t addr){
+    uint8_t regs[20] = {};
+    regs[0] = 2300 >> 8; regs[1] = 2300 & 0xff;     // voltage
+    regs[3] = addr;                                 // current
+    regs[15] = 50;                                  // frequency
+    return pzmbus::create_reply(CMD_RIR, regs, sizeof(regs), addr);
+}
+
+// serial server emulator, serves one connection at a time
+static void server(int lfd, tcpq_proto_t proto){
+    while (!done){
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0)
+            return;
+
+        for (;;){
+            uint8_t req[12];
+            uint8_t frame[TCPQ_BUF_SIZE];
+            size_t len;
+            if (proto == tcpq_proto_t::rtu){
+                if (!recv_all(fd, req, 8) || !modbus::checkcrc16(req, 8))
+                    break;
+                RX_msg *r = make_reply(req[0]);
+                len = r->len;
+                memcpy(frame, r->rawdata, len);
+                delete r;
+            } else {
+                // MBAP header + unit + 'fc reg(2) cnt(2)'
+                if (!recv_all(fd, req, 12) || req[2] || req[3] || req[5] != 6)
+                    break;
+                RX_msg *r = make_reply(req[6]);
+                memcpy(frame, req, 4);                              // tid, proto
+                frame[4] = 0;
+                frame[5] = r->len - 2;
+                memcpy(&frame[6], r->rawdata, r->len - 2);          // unit + PDU, no CRC
+                len = r->len - 2 + 6;
+                delete r;
+            }
+
+            // split reply to check reassembly
+            size_t half = len / 2;
+            if (send(fd, frame, half, MSG_NOSIGNAL) != static_cast<int>(half))
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            if (send(fd, frame + half, len - half, MSG_NOSIGNAL) != static_cast<int>(len - half))
+                break;
+        }
+        close(fd);
+    }
+}
+
+static bool run(tcpq_proto_t proto, int requests){
+    const char *name = proto == tcpq_proto_t::rtu ? "rtu" : "mbtcp";
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (lfd < 0 || bind(lfd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) || listen(lfd, 1)
+        || getsockname(lfd, reinterpret_cast<struct sockaddr*>(&addr), &alen)){
+        perror("listener");
+        return false;
+    }
+
+    done = false;
+    std::thread srv(server, lfd, proto);
+
+    auto hub = std::make_shared<TcpHub>();
+    TcpQ *q = new TcpQ("localhost", ntohs(addr.sin_port), proto, hub);
+    q->startQueues();           // there is no hub task on host, it is polled below
+
+    int replies = 0, bad = 0;
+    q->attach_RX_hndlr([&replies, &bad](RX_msg *m){
+        pz004::metrics data;
+        if (m->valid && m->addr == CHECK_ADDR && m->cmd == CMD_RIR && data.parse_rx_msg(m) && data.voltage == 2300 && data.freq == 50)
+            ++replies;
+        else
+            ++bad;
+        delete m;
+    });
+
+    for (int i = 0; i != requests; ++i){
+        int expect = replies + 1;
+        q->txenqueue(pz004::cmd_get_metrics(CHECK_ADDR));
+        int64_t deadline = esp_timer_get_time() + CHECK_REPLY_TIMEOUT * 1000LL;
+        while (replies + bad < expect && esp_timer_get_time() < deadline)
+            hub->poll(TCPQ_POLL_PERIOD);
+        if (replies != expect)
+            break;
+    }
+
+    bool ok = replies == requests && !bad && q->connected();
+    printf("%s: requests %d, replies %d, bad %d\n", name, requests, replies, bad);
+
+    delete q;
+    done = true;
+    shutdown(lfd, SHUT_RDWR);
+    close(lfd);
+    srv.join();
+    return ok;
+}
+
+int main(int argc, char *argv[]){
+    int requests = 100;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:h")) != -1){
+        switch (opt){
+            case 'r' : requests = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-r requests]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (requests < 1)
+        return 1;
+
+    bool ok = run(tcpq_proto_t::rtu, requests);
+    ok &= run(tcpq_proto_t::mbtcp, requests);
+
+    // hub with no open sockets must wait for the timeout instead of spinning
+    TcpHub idle;
+    int64_t t = esp_timer_get_time();
+    idle.poll(50);
+    t = (esp_timer_get_time() - t) / 1000;
+    printf("idle poll: %lld ms\n", static_cast<long long>(t));
+    ok &= t >= 45;
+
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
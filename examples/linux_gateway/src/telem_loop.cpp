@@ -0,0 +1,188 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+UDP telemetry end-to-end check over loopback.
+Simulates a number of edge nodes with meters, encodes their updates with telem::Encoder, sends datagrams
+to a loopback UDP socket dropping some of them on purpose and decodes them with telem::Aggregator.
+Every decoded sample is checked against the values that were sent, after a final lossless key round
+aggregator must hold the latest values of all meters. Exits with non-zero code on any mismatch.
+
+ telem_loop [-n nodes] [-m meters per node] [-r rounds] [-l loss %]
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "telemetry.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct node_t {
+    std::unique_ptr<telem::Encoder> enc;
+    std::vector<pz004::metrics> meters;
+    std::vector<uint32_t> age;
+};
+
+static std::vector<node_t> nodes;
+static uint64_t tstamp = 1000000;
+static size_t mismatch = 0;
+
+static bool same(const telem::sample_t &s, const pz004::metrics &m){
+    for (uint8_t i = 0; i != 8; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        if (m.decimals(meter) < 0)
+            continue;
+        if (!(s.mask & (1 << i)) || s.raw[i] != m.asRaw(meter))
+            return false;
+    }
+    return s.model == pzmbus::pzmodel_t::pzem004v3;
+}
+
+// random walk around typical household load
+static void mutate(pz004::metrics &m){
+    m.voltage = 2300 + rand() % 100 - 50;
+    m.current = std::min<int32_t>(std::max<int32_t>(m.current + rand() % 2001 - 1000, 0), 100000);
+    m.power = m.voltage * m.current / 10000;
+    m.energy += rand() % 50;
+    m.freq = 499 + rand() % 3;
+    m.pf = rand() % 101;
+}
+
+static uint64_t now_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char *argv[]){
+    int n_nodes = 1000, n_meters = 16, rounds = 30, loss = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:r:l:h")) != -1){
+        switch (opt){
+            case 'n' : n_nodes = atoi(optarg); break;
+            case 'm' : n_meters = atoi(optarg); break;
+            case 'r' : rounds = atoi(optarg); break;
+            case 'l' : loss = atoi(optarg); break;
+            default :
+                fprintf(stderr, "usage: %s [-n nodes] [-m meters per node] [-r rounds] [-l loss %%]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (n_nodes < 1 || n_meters < 1 || n_meters > 247 || rounds < 1 || loss < 0 || loss > 100)
+        return 1;
+
+    // aggregator socket on an ephemeral loopback port
+    int rx = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    if (rx < 0 || tx < 0 || bind(rx, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) ||
+        getsockname(rx, reinterpret_cast<struct sockaddr*>(&addr), &alen)){
+        perror("socket");
+        return 1;
+    }
+
+    telem::Aggregator agg;
+    size_t samples = 0;
+    agg.attach_cb([&samples](const telem::sample_t &s){
+        const node_t &n = nodes[s.node];
+        if (s.id < 1 || s.id > n.meters.size() || !same(s, n.meters[s.id - 1]) || s.tstamp != tstamp - n.age[s.id - 1])
+            ++mismatch;
+        ++samples;
+    });
+
+    srand(1);
+    nodes.resize(n_nodes);
+    for (int i = 0; i != n_nodes; ++i){
+        nodes[i].enc.reset(new telem::Encoder(i, rand()));
+        nodes[i].meters.resize(n_meters);
+        nodes[i].age.resize(n_meters);
+    }
+
+    uint8_t dgram[TELEM_MTU];
+    uint8_t rxbuf[TELEM_MTU + 1];
+    size_t sent = 0, dropped = 0, bytes = 0;
+    uint64_t decode_us = 0;
+
+    auto drain = [&](){
+        ssize_t len;
+        while ((len = recv(rx, rxbuf, sizeof(rxbuf), 0)) > 0){
+            uint64_t t = now_us();
+            agg.feed(rxbuf, len);
+            decode_us += now_us() - t;
+        }
+    };
+
+    // one round is an update of every meter of every node, the last one is lossless with key records only
+    for (int r = 0; r <= rounds; ++r){
+        tstamp += 1000;
+        bool last = r == rounds;
+        for (auto &n : nodes){
+            if (last)
+                n.enc->forceKey();
+            n.enc->begin(dgram, sizeof(dgram), tstamp);
+
+            auto send = [&](){
+                size_t len = n.enc->finish();
+                if (!len)
+                    return;
+                bytes += len;
+                if (!last && rand() % 100 < loss){
+                    ++dropped;
+                    return;
+                }
+                if (sendto(tx, dgram, len, 0, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == static_cast<ssize_t>(len))
+                    ++sent;
+            };
+
+            for (int m = 0; m != n_meters; ++m){
+                mutate(n.meters[m]);
+                n.age[m] = rand() % 500;
+                if (n.enc->add(m + 1, pzmbus::pzmodel_t::pzem004v3, n.meters[m], n.age[m]))
+                    continue;
+                send();
+                n.enc->begin(dgram, sizeof(dgram), tstamp);
+                n.enc->add(m + 1, pzmbus::pzmodel_t::pzem004v3, n.meters[m], n.age[m]);
+            }
+            send();
+            drain();                        // keep socket buffer from overflowing
+        }
+    }
+    drain();
+
+    // after the lossless round aggregator must hold the latest values of every meter
+    size_t missing = 0;
+    for (size_t i = 0; i != nodes.size(); ++i){
+        for (size_t m = 0; m != nodes[i].meters.size(); ++m){
+            const telem::sample_t *s = agg.get(i, m + 1);
+            if (!s)
+                ++missing;
+            else if (!same(*s, nodes[i].meters[m]))
+                ++mismatch;
+        }
+    }
+
+    const telem::agg_stats_t &st = agg.getStats();
+    size_t updates = static_cast<size_t>(n_nodes) * n_meters * (rounds + 1);
+    printf("nodes %d, meters %d, rounds %d, loss %d%%\n", n_nodes, n_meters, rounds, loss);
+    printf("datagrams sent %zu, dropped %zu, %.1f bytes per update\n", sent, dropped, static_cast<double>(bytes) / updates);
+    printf("aggregator: frames %u, lost %u, late %u, bad %u, records %u, orphans %u\n",
+        st.frames, st.lost, st.late, st.bad, st.records, st.orphans);
+    printf("decode: %.0f datagrams/s, %.0f records/s\n", st.frames * 1e6 / decode_us, st.records * 1e6 / decode_us);
+    printf("samples %zu, mismatch %zu, missing %zu\n", samples, mismatch, missing);
+
+    close(rx);
+    close(tx);
+
+    bool ok = !mismatch && !missing && st.frames == sent && !st.bad && st.lost <= dropped;     // loss of node's first datagram is not a gap
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -77,6 +77,7 @@ void menu(){
     Serial.println("4 - Reset energy counter");
     Serial.println("5 - Get power alarm threshold");
     Serial.println("6 - Set power alarm threshold");
+    Serial.println("7 - Heap usage by library subsystems");
     Serial.println();
 
     WAIT4SERIAL; // this is just good-old blocking loop method :)
@@ -101,6 +102,9 @@ void menu(){
         case 6 :
             set_alrm_thr();
             break;
+        case 7 :
+            mem_stats();
+            break;
         default:
             break;
     }
@@ -172,6 +176,23 @@ void set_alrm_thr(){
     }
 }
 
+/**
+ * @brief print heap accounting counters
+ * library must be built with PZEM_EDL_MEMSTAT flag, i.e. 'pio run -e memstat'
+ */
+void mem_stats(){
+    Serial.println("subsys    live    peak   psram    allocs     frees   alloc/s");
+    for (uint8_t i = 0; i != static_cast<uint8_t>(memstat::tag_t::count); ++i){
+        auto tag = static_cast<memstat::tag_t>(i);
+        memstat::stats_t s;
+        if (!memstat::get(tag, s)){
+            Serial.println("heap accounting is disabled, build with PZEM_EDL_MEMSTAT flag");
+            return;
+        }
+        Serial.printf("%-6s %7u %7u %7u %9u %9u %9.1f\n", memstat::name(tag), s.live, s.peak, s.psram, s.allocs, s.frees, s.rate);
+    }
+    Serial.printf("free heap: %u, internal: %u, min free: %u\n", ESP.getFreeHeap(), heap_caps_get_free_size(MALLOC_CAP_INTERNAL), ESP.getMinFreeHeap());
+}
 
 /**
  * @brief this is our call-back routine
@@ -12,6 +12,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #include <Arduino.h>
 #include "pzem_modbus.hpp"
+#include "memstat.hpp"
 
 void menu();
 void get_addr_bcast();
@@ -21,3 +22,4 @@ void get_metrics();
 void reset_nrg();
 void get_alrm_thr();
 void set_alrm_thr();
+void mem_stats();
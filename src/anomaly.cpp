@@ -0,0 +1,83 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "anomaly.hpp"
+
+namespace anomaly {
+
+void ewma_t::push(float v, float alpha){
+    if (!cnt++){
+        mean = v;
+        var = 0;
+        return;
+    }
+
+    // incremental EWMA mean/variance (West, 1979)
+    float diff = v - mean;
+    float incr = alpha * diff;
+    mean += incr;
+    var = (1 - alpha) * (var + diff * incr);
+}
+
+float ewma_t::zscore(float v) const {
+    if (var <= 0)
+        return 0;
+
+    return (v - mean) / std::sqrt(var);
+}
+
+evt_t Detector::push(float v, uint32_t time){
+    if (std::isnan(v))
+        return state;
+
+    flatcnt = (v == last) ? flatcnt + 1 : 0;
+
+    ewma_t &s = season[(time / 3600) % ANOMALY_HOURS];
+    float z = base.cnt >= warmup ? base.zscore(v) : 0;
+    float sz = s.cnt >= warmup ? s.zscore(v) : 0;
+
+    evt_t evt = evt_t::none;
+    if (flat_cnt && v != 0 && flatcnt >= flat_cnt)
+        evt = evt_t::flat;
+    else if (std::fabs(z) >= zthreshold)
+        evt = z > 0 ? evt_t::high : evt_t::low;
+    else if (std::fabs(sz) >= zthreshold){
+        evt = sz > 0 ? evt_t::seasonal_high : evt_t::seasonal_low;
+        z = sz;
+    }
+
+    if (evt != state){
+        raise(evt == evt_t::none ? evt_t::cleared : evt, v, z);
+        state = evt;
+    }
+
+    base.push(v, alpha);
+    s.push(v, season_alpha);
+    last = v;
+    return state;
+}
+
+void Detector::reset(){
+    base = ewma_t();
+    for (auto &s : season)
+        s = ewma_t();
+    last = NAN;
+    flatcnt = 0;
+    state = evt_t::none;
+}
+
+void Detector::raise(evt_t evt, float value, float score){
+    if (cb)
+        cb(id, evt, value, score);
+}
+
+}   // namespace anomaly
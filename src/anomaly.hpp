@@ -0,0 +1,151 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <cmath>
+#include <functional>
+#include "pzem_modbus.hpp"
+
+#define ANOMALY_ALPHA           0.05    // EWMA smoothing factor for the short-term baseline
+#define ANOMALY_SEASON_ALPHA    0.02    // EWMA smoothing factor for hour-of-day baselines, slow enough to average the whole hour
+#define ANOMALY_Z_THRESHOLD     4.0     // z-score to raise an event
+#define ANOMALY_WARMUP          30      // number of samples to collect before any events are raised
+#define ANOMALY_FLAT_CNT        600     // number of equal consecutive samples considered as a 'stuck' value
+#define ANOMALY_HOURS           24      // number of seasonal slots (hour-of-day)
+
+namespace anomaly {
+
+// Types of detected anomalies
+enum class evt_t:uint8_t {
+    none = 0,
+    high,               // value is above short-term baseline
+    low,                // value is below short-term baseline
+    seasonal_high,      // value is above usual level for this hour-of-day
+    seasonal_low,       // value is below usual level for this hour-of-day
+    flat,               // value is stuck, i.e. it does not change for too long
+    cleared             // value returned back to normal after any of the above
+};
+
+/**
+ * @brief anomaly event call-back
+ * @param id - detector id (usually matches PZEM id)
+ * @param evt - event type
+ * @param value - sample value triggered an event
+ * @param score - z-score for the sample
+ */
+typedef std::function<void (uint8_t id, evt_t evt, float value, float score)> callback_t;
+
+/**
+ * @brief EWMA mean/variance accumulator
+ *
+ */
+struct ewma_t {
+    float mean = 0;
+    float var = 0;
+    uint32_t cnt = 0;
+
+    void push(float v, float alpha);
+
+    /**
+     * @brief return z-score for the value against current mean/variance
+     * returns 0 if variance is still unknown
+     */
+    float zscore(float v) const;
+};
+
+/**
+ * @brief Online anomaly detector for a single metric of one meter
+ * It tracks short-term EWMA mean/variance of the metric and a seasonal baseline per hour-of-day,
+ * each new sample is scored against both and an event is raised once z-score exceeds threshold.
+ * Events are raised on state change only, i.e. a long lasting deviation generates one event,
+ * followed by 'cleared' event when metric returns to normal.
+ * Memory footprint is fixed, ~350 bytes per detector, no allocations on push.
+ *
+ * Detector could be fed directly from PZEM/PZPool rx callbacks or attached to TimeSeries
+ * via TimeSeries::attach_push_callback() to process averaged samples.
+ */
+class Detector {
+    ewma_t base;                                // short-term baseline
+    ewma_t season[ANOMALY_HOURS];               // hour-of-day baselines
+    float last = NAN;                           // last sample value
+    uint32_t flatcnt = 0;                       // number of consecutive equal samples
+    evt_t state = evt_t::none;                  // current anomaly state
+    callback_t cb = nullptr;
+
+    void raise(evt_t evt, float value, float score);
+
+public:
+    const uint8_t id;                           // detector id
+    const pzmbus::meter_t metric;               // metric to check
+
+    // tunables
+    float alpha = ANOMALY_ALPHA;
+    float season_alpha = ANOMALY_SEASON_ALPHA;
+    float zthreshold = ANOMALY_Z_THRESHOLD;
+    uint32_t warmup = ANOMALY_WARMUP;
+    uint32_t flat_cnt = ANOMALY_FLAT_CNT;       // 0 to disable 'stuck' value detection
+
+    explicit Detector(uint8_t _id, pzmbus::meter_t m = pzmbus::meter_t::pwr) : id(_id), metric(m) {}
+
+    /**
+     * @brief feed new sample to detector
+     *
+     * @param v - sample value
+     * @param time - sample timestamp, epoch seconds (local time), used to pick hour-of-day baseline
+     * @return evt_t - current anomaly state
+     */
+    evt_t push(float v, uint32_t time);
+
+    /**
+     * @brief feed new sample to detector from a metrics struct
+     *
+     * @param m - metrics struct
+     * @param time - sample timestamp, epoch seconds (local time)
+     * @return evt_t - current anomaly state
+     */
+    evt_t push(const pzmbus::metrics &m, uint32_t time){ return push(m.asFloat(metric), time); }
+
+    /**
+     * @brief reset detector to initial state, all learned baselines are dropped
+     */
+    void reset();
+
+    /**
+     * @brief get current anomaly state
+     */
+    evt_t getState() const { return state; }
+
+    /**
+     * @brief get short-term baseline
+     */
+    const ewma_t& getBaseline() const { return base; }
+
+    /**
+     * @brief get seasonal baseline for specific hour
+     */
+    const ewma_t& getBaseline(uint8_t hour) const { return season[hour % ANOMALY_HOURS]; }
+
+    /**
+     * @brief attach event call-back
+     *
+     * @param f callback function prototype: std::function<void (uint8_t id, evt_t evt, float value, float score)>
+     */
+    void attach_callback(callback_t f){ if (f) cb = std::move(f); }
+
+    /**
+     * @brief detach event call-back
+     */
+    void detach_callback(){ cb = nullptr; }
+};
+
+}   // namespace anomaly
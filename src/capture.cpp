@@ -0,0 +1,329 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "capture.hpp"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+static size_t put_varint(uint8_t *dst, uint64_t v){
+    size_t n = 0;
+    while (v > 0x7f){
+        dst[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = v;
+    return n;
+}
+
+static bool get_varint(const uint8_t *src, size_t len, size_t &pos, uint64_t &v){
+    v = 0;
+    for (uint8_t shift = 0; pos < len && shift < 64; shift += 7){
+        uint8_t b = src[pos++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// ****  BusCapture Implementation  **** //
+
+static uint8_t* capture_alloc(size_t size){
+    auto p = static_cast<uint8_t*>(heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));     // try to alloc SPI ram first
+    if (!p)
+        p = static_cast<uint8_t*>(malloc(size));
+    return p;
+}
+
+BusCapture::BusCapture(size_t bufsize) : size(bufsize < CAPTURE_HDR_LEN * 2 ? CAPTURE_HDR_LEN * 2 : bufsize) {
+    buf.reset(capture_alloc(size));
+    lock = xSemaphoreCreateMutex();
+    flush_sem = xSemaphoreCreateBinary();
+    start();
+}
+
+BusCapture::~BusCapture(){
+    stop = true;
+    xSemaphoreGive(flush_sem);
+    while (t_flush)
+        vTaskDelay(1);
+    vSemaphoreDelete(flush_sem);
+    vSemaphoreDelete(lock);
+}
+
+void BusCapture::attach_sink(sink_t f){
+    if (!f)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sink = std::move(f);
+    if (!spare)
+        spare.reset(capture_alloc(size));
+    xSemaphoreGive(lock);
+
+    if (spare && !t_flush)
+        xTaskCreate(BusCapture::flushTask, CAPTURE_TASK_NAME, CAPTURE_TASK_STACK, reinterpret_cast<void *>(this), CAPTURE_TASK_PRIO, &t_flush);
+}
+
+void BusCapture::detach_sink(){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sink = nullptr;
+    xSemaphoreGive(lock);
+}
+
+void BusCapture::start(){
+    pos = 0;
+    if (!buf)
+        return;
+
+    last_us = esp_timer_get_time();
+    memcpy(buf.get(), CAPTURE_MAGIC, 3);
+    buf[3] = CAPTURE_VERSION;
+    for (uint8_t i = 0; i != 8; ++i)
+        buf[4 + i] = (uint64_t)last_us >> (8 * i);
+    pos = CAPTURE_HDR_LEN;
+}
+
+bool BusCapture::record(bool tx, const uint8_t *data, size_t len){
+    if (!active || !buf || !data)
+        return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (pos + CAPTURE_REC_MAX_HDR + len > size){
+        // continue into a new chunk if worker could take the full one
+        if (!t_flush || CAPTURE_REC_MAX_HDR + len > size || !swap_locked(true)){
+            ++dropped;
+            xSemaphoreGive(lock);
+            return false;
+        }
+    }
+
+    int64_t t = esp_timer_get_time();
+    uint8_t *ptr = &buf[pos];
+    ptr += put_varint(ptr, ((uint64_t)(t - last_us) << 1) | tx);
+    ptr += put_varint(ptr, len);
+    memcpy(ptr, data, len);
+    pos = ptr - buf.get() + len;
+    last_us = t;
+    ++frames;
+    xSemaphoreGive(lock);
+    return true;
+}
+
+bool BusCapture::swap_locked(bool notify){
+    if (!sink || !buf || !spare || !pos || spare_len)
+        return false;
+
+    buf.swap(spare);
+    spare_len = pos;
+    // next chunk continues the stream, no header
+    pos = 0;
+    if (notify)
+        xSemaphoreGive(flush_sem);
+    return true;
+}
+
+bool BusCapture::drain(){
+    // spare buffer is not touched by record() while spare_len is set, so sink is called without the lock
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sink_t f = sink;
+    size_t len = spare_len;
+    xSemaphoreGive(lock);
+
+    bool ok = f && f(spare.get(), len);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!ok)
+        active = false;
+    spare_len = 0;
+    xSemaphoreGive(lock);
+    return ok;
+}
+
+void BusCapture::flushq(){
+    while (!stop){
+        if (xSemaphoreTake(flush_sem, portMAX_DELAY) != pdTRUE || stop)
+            continue;
+
+        if (spare_len)
+            drain();
+    }
+}
+
+bool BusCapture::flush(){
+    for (;;){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (!sink || !spare){
+            xSemaphoreGive(lock);
+            return false;
+        }
+        if (!spare_len)
+            break;
+        // worker is still writing previous buffer
+        xSemaphoreGive(lock);
+        vTaskDelay(1);
+    }
+
+    if (!pos){
+        xSemaphoreGive(lock);
+        return true;
+    }
+
+    // buffer is drained here, not by the worker
+    swap_locked(false);
+    xSemaphoreGive(lock);
+    return drain();
+}
+
+void BusCapture::clear(){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    start();
+    frames = dropped = 0;
+    xSemaphoreGive(lock);
+}
+
+// ****  CaptureQ Implementation  **** //
+
+bool CaptureQ::txenqueue(TX_msg *msg){
+    if (msg)
+        cap->record(true, msg->data, msg->len);
+
+    return q->txenqueue(msg);
+}
+
+void CaptureQ::attach_RX_hndlr(rxdatahandler_t f){
+    if (!f)
+        return;
+
+    rx_callback = std::move(f);
+    q->attach_RX_hndlr([this](RX_msg *m){
+        cap->record(false, m->rawdata, m->len);
+        if (rx_callback)
+            rx_callback(m);
+        else
+            delete m;
+    });
+}
+
+void CaptureQ::detach_RX_hndlr(){
+    q->detach_RX_hndlr();
+    rx_callback = nullptr;
+}
+
+// ****  CaptureReader Implementation  **** //
+
+CaptureReader::CaptureReader(const uint8_t *data, size_t len) : buf(data), size(len), pos(CAPTURE_HDR_LEN) {}
+
+bool CaptureReader::valid() const {
+    return buf && size >= CAPTURE_HDR_LEN && !memcmp(buf, CAPTURE_MAGIC, 3) && buf[3] == CAPTURE_VERSION;
+}
+
+int64_t CaptureReader::getStartTime() const {
+    if (!valid())
+        return 0;
+
+    uint64_t v = 0;
+    for (uint8_t i = 0; i != 8; ++i)
+        v |= (uint64_t)buf[4 + i] << (8 * i);
+    return v;
+}
+
+bool CaptureReader::next(capture_frame_t &f){
+    if (!valid())
+        return false;
+
+    size_t p = pos;
+    uint64_t hdr, len;
+    if (!get_varint(buf, size, p, hdr) || !get_varint(buf, size, p, len) || len > size - p)
+        return false;
+
+    t += hdr >> 1;
+    f.time_us = t;
+    f.tx = hdr & 1;
+    f.len = len;
+    f.data = &buf[p];
+    pos = p + len;
+    return true;
+}
+
+void CaptureReader::rewind(){
+    pos = CAPTURE_HDR_LEN;
+    t = 0;
+}
+
+// ****  ReplayQ Implementation  **** //
+
+ReplayQ::~ReplayQ(){
+    stopQueues();
+    while (t_play)
+        vTaskDelay(1);
+}
+
+bool ReplayQ::txenqueue(TX_msg *msg){
+    if (msg && tx_callback)
+        tx_callback(msg);
+    ++stats.tx;
+
+    delete msg;
+    return true;
+}
+
+size_t ReplayQ::play(){
+    size_t cnt = 0;
+    capture_frame_t f;
+    int64_t t0 = esp_timer_get_time();
+
+    if (!t_play)
+        stop = false;       // direct call, not from the replay task
+    rd.rewind();
+    while (!stop && rd.next(f)){
+        if (f.tx || !f.len)
+            continue;
+
+        if (speed > 0){
+            int64_t due = t0 + f.time_us / speed;
+            int64_t now = esp_timer_get_time();
+            if (due - now >= 1000)
+                vTaskDelay(pdMS_TO_TICKS((due - now) / 1000));
+        }
+
+        if (!rx_callback)
+            continue;
+
+        uint8_t *b = msgbuf_alloc(f.len);
+        if (!b)
+            continue;
+        memcpy(b, f.data, f.len);
+        RX_msg *msg = new (std::nothrow) RX_msg(b, f.len);
+        if (!msg){
+            msgbuf_free(b);
+            continue;
+        }
+        rx_callback(msg);                       // receiver will destroy the message
+        ++stats.rx;
+        ++cnt;
+    }
+
+    return cnt;
+}
+
+bool ReplayQ::start(){
+    if (t_play || !rd.valid())
+        return false;
+
+    stop = false;
+    return xTaskCreate(ReplayQ::playTask, REPLAY_TASK_NAME, REPLAY_TASK_STACK, reinterpret_cast<void *>(this), REPLAY_TASK_PRIO, &t_play) == pdPASS;
+}
+
+void ReplayQ::stopQueues(){
+    stop = true;
+}
@@ -0,0 +1,340 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "msgq.hpp"
+#include "freertos/semphr.h"
+
+#define CAPTURE_BUF_SIZE        32768   // default capture buffer size, bytes
+#define CAPTURE_MAGIC           "PZC"   // capture stream signature
+#define CAPTURE_VERSION         1
+#define CAPTURE_HDR_LEN         12      // magic(3) + version(1) + start time(8)
+#define CAPTURE_REC_MAX_HDR     12      // max record header size: time delta varint(10) + len varint(2)
+
+#define CAPTURE_TASK_PRIO       1
+#define CAPTURE_TASK_STACK      3072
+#define CAPTURE_TASK_NAME       "CAPTURE"
+
+#define REPLAY_TASK_PRIO        2
+#define REPLAY_TASK_STACK       3072
+#define REPLAY_TASK_NAME        "REPLAYQ"
+
+/*
+Capture stream format
+
+ header:    'P' 'Z' 'C' <version:u8> <start time, us since boot: int64 little-endian>
+ records:   <varint: (time delta, us) << 1 | tx> <varint: frame length> <frame bytes>
+
+ time delta for each record is counted from the previous record (from start time for the first one),
+ varints are LEB128 encoded. A typical PZEM004 poll (TX 8 bytes + RX 25 bytes) takes ~40 bytes of capture.
+*/
+
+/**
+ * @brief single frame decoded from a capture stream
+ *
+ */
+struct capture_frame_t {
+    int64_t time_us;            // frame timestamp, us since capture start
+    bool tx;                    // true for TX frame, false for RX
+    size_t len;                 // frame length
+    const uint8_t *data;        // frame data, points into capture buffer
+};
+
+/**
+ * @brief bus capture recorder
+ * Appends timestamped frames to a fixed size buffer (PSRAM if available). With a sink attached capture is
+ * double buffered: once buffer is full it is swapped with a spare one and handed over to a worker task
+ * that feeds it to the sink, recording continues into the empty buffer. If there is no sink or the spare
+ * buffer is still being written out, new frames are counted as dropped.
+ * Record cost is a mutex and a memcpy of the frame, no allocations, the sink is never called from record().
+ */
+class BusCapture {
+
+public:
+    /**
+     * @brief capture data sink call-back
+     * it is called with a chunk of capture stream, first chunk always starts with a stream header
+     * @return true if data has been consumed, false on error (recording will stop)
+     */
+    typedef std::function<bool (const uint8_t *data, size_t len)> sink_t;
+
+private:
+    std::unique_ptr<uint8_t[], decltype(free)*> buf{nullptr, free};
+    std::unique_ptr<uint8_t[], decltype(free)*> spare{nullptr, free};     // allocated on sink attach
+    const size_t size;
+    size_t pos = 0;
+    size_t spare_len = 0;               // data length in spare buffer, it is owned by the writer while non zero
+    int64_t last_us = 0;                // timestamp of the last record
+    uint32_t frames = 0;                // number of frames recorded
+    uint32_t dropped = 0;               // number of frames dropped on buffer overflow
+    bool active = true;
+    sink_t sink = nullptr;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t flush_sem;        // wakes up worker task
+    TaskHandle_t t_flush = nullptr;
+    volatile bool stop = false;
+
+    // static wrapper for Task to call flushq() class member
+    static void flushTask(void* pvParams){
+        auto *self = reinterpret_cast<BusCapture*>(pvParams);
+        self->flushq();
+        self->t_flush = nullptr;
+        vTaskDelete(NULL);
+    }
+
+    void flushq();
+    void start();
+
+    /**
+     * @brief swap full buffer with the spare one
+     * @param notify - wake up worker task to drain the spare buffer
+     * @return false if there is no sink, nothing to swap or spare buffer is busy
+     */
+    bool swap_locked(bool notify);
+
+    /**
+     * @brief feed spare buffer to the sink in the caller's context and release it
+     */
+    bool drain();
+
+public:
+    explicit BusCapture(size_t bufsize = CAPTURE_BUF_SIZE);
+    ~BusCapture();
+
+    // Copy semantics : forbidden
+    BusCapture(const BusCapture&) = delete;
+    BusCapture& operator=(const BusCapture&) = delete;
+
+    /**
+     * @brief append frame to capture
+     *
+     * @param tx - true for TX frame, false for RX
+     * @param data - frame data
+     * @param len - frame length
+     * @return true if frame was recorded
+     */
+    bool record(bool tx, const uint8_t *data, size_t len);
+
+    /**
+     * @brief pass buffered data to the sink and empty the buffer
+     * sink is called in the caller's context, it waits for the worker task if it is still writing
+     * previous buffer. Without worker task (i.e. it could not be started) full buffers are not
+     * swapped on record() and flush() must be called periodically
+     *
+     * @return true on success
+     * @return false if no sink attached or sink failed
+     */
+    bool flush();
+
+    /**
+     * @brief drop all captured data and restart capture with a new header
+     */
+    void clear();
+
+    /**
+     * @brief pause/resume recording
+     */
+    void pause(){ active = false; }
+    void resume(){ active = true; }
+
+    /**
+     * @brief captured data stream (not flushed to sink yet)
+     * it could be fed to CaptureReader/ReplayQ directly if capture has never been flushed
+     */
+    const uint8_t* data() const { return buf.get(); }
+
+    /**
+     * @brief length of captured data stream in buffer
+     */
+    size_t length() const { return pos; }
+
+    /**
+     * @brief number of frames recorded
+     */
+    uint32_t getFrames() const { return frames; }
+
+    /**
+     * @brief number of frames dropped due to buffer overflow or sink errors
+     */
+    uint32_t getDropped() const { return dropped; }
+
+    /**
+     * @brief attach capture data sink, i.e. a file writer
+     * allocates spare buffer and starts worker task on first call
+     *
+     * @param f callback function prototype: std::function<bool (const uint8_t *data, size_t len)>
+     */
+    void attach_sink(sink_t f);
+
+    /**
+     * @brief detach capture data sink
+     */
+    void detach_sink();
+};
+
+/**
+ * @brief MsgQ tap decorator recording all bus traffic
+ * Wraps any MsgQ object and passes TX/RX messages through, copying each one into BusCapture.
+ * Could be used in place of any MsgQ, i.e. PZPort(id, new CaptureQ(new UartQ(...), &capture))
+ * NOTE: TX frames are timestamped on enqueue, not on actual transmission
+ */
+class CaptureQ : public MsgQ {
+    std::unique_ptr<MsgQ> q;
+    BusCapture *cap;
+
+public:
+    /**
+     * @brief Construct a new CaptureQ object
+     *
+     * @param mq - MsgQ object to tap, CaptureQ takes ownership of it
+     * @param capture - capture recorder, must outlive CaptureQ
+     */
+    CaptureQ(MsgQ *mq, BusCapture *capture) : q(mq), cap(capture) {}
+
+    // Copy semantics : forbidden
+    CaptureQ(const CaptureQ&) = delete;
+    CaptureQ& operator=(const CaptureQ&) = delete;
+
+    bool txenqueue(TX_msg *msg) override;
+
+    void attach_RX_hndlr(rxdatahandler_t f) override;
+
+    void detach_RX_hndlr() override;
+
+    bool startQueues() override { return q->startQueues(); }
+
+    void stopQueues() override { q->stopQueues(); }
+
+    const msgq_stats_t& getStats() const override { return q->getStats(); }
+};
+
+/**
+ * @brief sequential reader for a capture stream
+ *
+ */
+class CaptureReader {
+    const uint8_t *buf;
+    const size_t size;
+    size_t pos;
+    int64_t t = 0;
+
+public:
+    /**
+     * @brief Construct a new Capture Reader object
+     *
+     * @param data - capture stream starting with header, must outlive reader
+     * @param len - stream length
+     */
+    CaptureReader(const uint8_t *data, size_t len);
+
+    /**
+     * @brief check if stream header is valid
+     */
+    bool valid() const;
+
+    /**
+     * @brief capture start time, us since boot of the recording device
+     */
+    int64_t getStartTime() const;
+
+    /**
+     * @brief decode next frame
+     *
+     * @param f - frame struct to fill in
+     * @return true on success
+     * @return false on end of stream or malformed record
+     */
+    bool next(capture_frame_t &f);
+
+    /**
+     * @brief rewind to the first frame
+     */
+    void rewind();
+};
+
+/**
+ * @brief MsgQ replaying captured RX frames
+ * Feeds RX frames from a capture stream to the attached RX handler (PZEM/PZPool) with original timing
+ * scaled by speed factor. Speed 0 replays as fast as possible, which is handy to benchmark parsing and
+ * data processing pipeline over hours of real traffic. TX messages are consumed and passed to TX handler,
+ * if any.
+ */
+class ReplayQ : public NullQ {
+    CaptureReader rd;
+    float speed;
+    TaskHandle_t t_play = nullptr;
+    volatile bool stop = false;
+
+    // static wrapper for Task to call play() class member
+    static void playTask(void* pvParams){
+        auto *self = reinterpret_cast<ReplayQ*>(pvParams);
+        self->play();
+        self->t_play = nullptr;
+        vTaskDelete(NULL);
+    }
+
+public:
+    /**
+     * @brief Construct a new ReplayQ object
+     *
+     * @param data - capture stream, must outlive ReplayQ
+     * @param len - stream length
+     * @param _speed - replay speed factor, 1 - real time, 0 - max speed
+     */
+    ReplayQ(const uint8_t *data, size_t len, float _speed = 1.0) : rd(data, len), speed(_speed) {}
+    virtual ~ReplayQ();
+
+    // Copy semantics : forbidden
+    ReplayQ(const ReplayQ&) = delete;
+    ReplayQ& operator=(const ReplayQ&) = delete;
+
+    /**
+     * @brief set replay speed factor
+     *
+     * @param x - 1 - real time, 2 - twice as fast, etc, 0 - max speed
+     */
+    void setSpeed(float x){ speed = x < 0 ? 0 : x; }
+
+    /**
+     * @brief consume TX message, it is passed to TX handler if attached
+     *
+     * @return true always
+     */
+    bool txenqueue(TX_msg *msg) override;
+
+    /**
+     * @brief replay capture from the beginning in the caller's context
+     * blocks until capture ends or stopQueues() is called
+     *
+     * @return size_t - number of RX frames replayed
+     */
+    size_t play();
+
+    /**
+     * @brief replay capture in a separate task
+     *
+     * @return true if task started
+     * @return false if replay is already running or capture is invalid
+     */
+    bool start();
+
+    /**
+     * @brief check if replay task is running
+     */
+    bool running() const { return t_play; }
+
+    /**
+     * @brief stop replay task
+     */
+    void stopQueues() override;
+};
@@ -0,0 +1,449 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "cbor.hpp"
+
+#define CBOR_METERS             8       // number of meter_t fields
+
+namespace cbor {
+
+// ****  Writer  **** //
+
+void Writer::put(const void *data, size_t len){
+    if (!ok || pos + len > cap){
+        ok = false;
+        return;
+    }
+    memcpy(&buf[pos], data, len);
+    pos += len;
+}
+
+void Writer::head(uint8_t major, uint64_t v){
+    uint8_t h[9];
+    size_t n;
+    major <<= 5;
+    if (v < 24){
+        h[0] = major | v;
+        n = 1;
+    } else if (v <= 0xff){
+        h[0] = major | 24;
+        n = 2;
+    } else if (v <= 0xffff){
+        h[0] = major | 25;
+        n = 3;
+    } else if (v <= 0xffffffff){
+        h[0] = major | 26;
+        n = 5;
+    } else {
+        h[0] = major | 27;
+        n = 9;
+    }
+
+    // argument is big endian
+    for (size_t i = n - 1; i; --i, v >>= 8)
+        h[i] = v & 0xff;
+
+    put(h, n);
+}
+
+void Writer::text(const char *str){
+    size_t n = str ? strlen(str) : 0;
+    head(3, n);
+    put(str, n);
+}
+
+void Writer::typed(uint8_t width, size_t cnt){
+    tag(width == 1 ? CBOR_TAG_UINT8 : width == 2 ? CBOR_TAG_UINT16LE : CBOR_TAG_UINT32LE);
+    head(2, width * cnt);
+}
+
+void Writer::element(uint8_t width, uint32_t v){
+    uint8_t b[4];
+    for (uint8_t i = 0; i != width; ++i, v >>= 8)
+        b[i] = v & 0xff;
+    put(b, width);
+}
+
+// ****  Reader  **** //
+
+bool Reader::head(uint8_t major, uint64_t &v){
+    if (!ok || pos >= len || (buf[pos] >> 5) != major)
+        return ok = false;
+
+    uint8_t info = buf[pos++] & 0x1f;
+    if (info < 24){
+        v = info;
+        return true;
+    }
+
+    if (info > 27)
+        return ok = false;          // indefinite length and reserved values are not supported
+
+    size_t n = 1 << (info - 24);
+    if (pos + n > len)
+        return ok = false;
+
+    v = 0;
+    while (n--)
+        v = (v << 8) | buf[pos++];
+    return true;
+}
+
+bool Reader::integer(int64_t &v){
+    uint64_t u;
+    if (peek() == 1){
+        if (!head(1, u))
+            return false;
+        v = -1 - (int64_t)u;
+        return true;
+    }
+    if (!head(0, u))
+        return false;
+    v = u;
+    return true;
+}
+
+bool Reader::bytes(const uint8_t *&data, size_t &n){
+    uint64_t l;
+    if (!head(2, l) || l > len - pos)
+        return ok = false;
+    data = &buf[pos];
+    n = l;
+    pos += l;
+    return true;
+}
+
+bool Reader::array(size_t &n){
+    uint64_t v;
+    if (!head(4, v))
+        return false;
+    n = v;
+    return true;
+}
+
+bool Reader::map(size_t &n){
+    uint64_t v;
+    if (!head(5, v))
+        return false;
+    n = v;
+    return true;
+}
+
+bool Reader::boolean(bool &v){
+    if (!ok || pos >= len || (buf[pos] != 0xf4 && buf[pos] != 0xf5))
+        return ok = false;
+    v = buf[pos++] == 0xf5;
+    return true;
+}
+
+bool Reader::typed(uint32_t *dst, size_t max, size_t &n){
+    uint64_t t;
+    const uint8_t *data;
+    size_t blen;
+    if (!tag(t) || !bytes(data, blen))
+        return false;
+
+    uint8_t width = t == CBOR_TAG_UINT8 ? 1 : t == CBOR_TAG_UINT16LE ? 2 : t == CBOR_TAG_UINT32LE ? 4 : 0;
+    if (!width || blen % width)
+        return ok = false;
+
+    n = blen / width;
+    for (size_t i = 0; i != n && i != max; ++i){
+        uint32_t v = 0;
+        for (uint8_t b = width; b; --b)
+            v = (v << 8) | data[i * width + b - 1];
+        dst[i] = v;
+    }
+    return true;
+}
+
+bool Reader::skip(){
+    if (!ok || pos >= len)
+        return ok = false;
+
+    uint8_t major = buf[pos] >> 5;
+    if (major == 7){
+        // simple values and floats
+        uint8_t info = buf[pos] & 0x1f;
+        pos += info < 24 ? 1 : info == 24 ? 2 : info == 25 ? 3 : info == 26 ? 5 : 9;
+        return pos <= len || (ok = false);
+    }
+
+    uint64_t v;
+    if (!head(major, v))
+        return false;
+
+    switch (major){
+        case 2 :
+        case 3 :
+            if (v > len - pos)
+                return ok = false;
+            pos += v;
+            return true;
+        case 4 :
+            while (v--)
+                if (!skip()) return false;
+            return true;
+        case 5 :
+            while (v--)
+                if (!skip() || !skip()) return false;
+            return true;
+        case 6 :
+            return skip();
+        default :
+            return true;
+    }
+}
+
+// ****  Metrics and state  **** //
+
+static uint8_t fields_cnt(const pzmbus::metrics &m, uint8_t mask){
+    uint8_t n = 0;
+    for (uint8_t i = 0; i != CBOR_METERS; ++i)
+        if (textfmt::selected(mask, static_cast<pzmbus::meter_t>(i)) && m.decimals(static_cast<pzmbus::meter_t>(i)) >= 0)
+            ++n;
+    return n;
+}
+
+void encode(Writer &w, const pzmbus::metrics &m, uint8_t mask){
+    w.map(fields_cnt(m, mask));
+    for (uint8_t i = 0; i != CBOR_METERS; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        if (!textfmt::selected(mask, meter) || m.decimals(meter) < 0)
+            continue;
+        w.uinteger(i);
+        w.uinteger(m.asRaw(meter));
+    }
+}
+
+void encode(Writer &w, const pzmbus::state &s, const pzmbus::metrics &m, uint8_t mask){
+    w.map(5);
+    w.uinteger(static_cast<uint8_t>(key_t::model));
+    w.uinteger(static_cast<uint8_t>(s.model));
+    w.uinteger(static_cast<uint8_t>(key_t::addr));
+    w.uinteger(s.addr);
+    w.uinteger(static_cast<uint8_t>(key_t::err));
+    w.uinteger(static_cast<uint8_t>(s.err));
+    w.uinteger(static_cast<uint8_t>(key_t::age));
+    w.uinteger(s.update_us ? s.dataAge() : UINT32_MAX);
+    w.uinteger(static_cast<uint8_t>(key_t::metrics));
+    encode(w, m, mask);
+}
+
+bool decode(Reader &r, uint32_t *vals, uint8_t &mask){
+    size_t n;
+    mask = 0;
+    if (!r.map(n))
+        return false;
+
+    while (n--){
+        uint64_t k, v;
+        if (!r.uinteger(k) || !r.uinteger(v))
+            return false;
+        if (k < CBOR_METERS){
+            vals[k] = v;
+            mask |= 1 << k;
+        }
+    }
+    return true;
+}
+
+bool decode(Reader &r, pz004::metrics &m){
+    uint32_t v[CBOR_METERS] = {};
+    uint8_t mask;
+    if (!decode(r, v, mask))
+        return false;
+
+    m.voltage = v[static_cast<uint8_t>(pzmbus::meter_t::vol)];
+    m.current = v[static_cast<uint8_t>(pzmbus::meter_t::cur)];
+    m.power   = v[static_cast<uint8_t>(pzmbus::meter_t::pwr)];
+    m.energy  = v[static_cast<uint8_t>(pzmbus::meter_t::enrg)];
+    m.freq    = v[static_cast<uint8_t>(pzmbus::meter_t::frq)];
+    m.pf      = v[static_cast<uint8_t>(pzmbus::meter_t::pf)];
+    m.alarm   = v[static_cast<uint8_t>(pzmbus::meter_t::alrmh)];
+    return true;
+}
+
+bool decode(Reader &r, pz003::metrics &m){
+    uint32_t v[CBOR_METERS] = {};
+    uint8_t mask;
+    if (!decode(r, v, mask))
+        return false;
+
+    m.voltage = v[static_cast<uint8_t>(pzmbus::meter_t::vol)];
+    m.current = v[static_cast<uint8_t>(pzmbus::meter_t::cur)];
+    m.power   = v[static_cast<uint8_t>(pzmbus::meter_t::pwr)];
+    m.energy  = v[static_cast<uint8_t>(pzmbus::meter_t::enrg)];
+    m.alarmh  = v[static_cast<uint8_t>(pzmbus::meter_t::alrmh)];
+    m.alarml  = v[static_cast<uint8_t>(pzmbus::meter_t::alrml)];
+    return true;
+}
+
+bool decode(Reader &r, pzmbus::pzmodel_t &model, uint8_t &addr, pzmbus::pzem_err_t &err, uint32_t &age, uint32_t *vals, uint8_t &mask){
+    size_t n;
+    if (!r.map(n))
+        return false;
+
+    while (n--){
+        uint64_t k, v = 0;
+        if (!r.uinteger(k))
+            return false;
+
+        if (k == static_cast<uint8_t>(key_t::metrics)){
+            if (!decode(r, vals, mask))
+                return false;
+            continue;
+        }
+
+        if (!r.uinteger(v))
+            return false;
+
+        switch (static_cast<key_t>(k)){
+            case key_t::model : model = static_cast<pzmbus::pzmodel_t>(v); break;
+            case key_t::addr :  addr = v; break;
+            case key_t::err :   err = static_cast<pzmbus::pzem_err_t>(v); break;
+            case key_t::age :   age = v; break;
+            default: break;
+        }
+    }
+    return r.good();
+}
+
+// ****  Series  **** //
+
+void encode_series(Writer &w, series_at_t at, const void *series, int from, int cnt, uint32_t tstamp, uint32_t interval, uint8_t mask, bool delta){
+    // pick columns supported by stored metrics type
+    uint8_t cols = 0;
+    uint32_t vmax[CBOR_METERS] = {};
+    if (cnt > 0){
+        const pzmbus::metrics *m = at(series, from);
+        for (uint8_t i = 0; i != CBOR_METERS; ++i)
+            if (textfmt::selected(mask, static_cast<pzmbus::meter_t>(i)) && m->decimals(static_cast<pzmbus::meter_t>(i)) >= 0)
+                cols |= 1 << i;
+
+        // find widths for typed arrays
+        if (!delta){
+            for (int s = 0; s != cnt; ++s){
+                m = at(series, from + s);
+                for (uint8_t i = 0; i != CBOR_METERS; ++i){
+                    uint32_t v = m->asRaw(static_cast<pzmbus::meter_t>(i));
+                    if (v > vmax[i]) vmax[i] = v;
+                }
+            }
+        }
+    }
+
+    w.map(5);
+    w.uinteger(static_cast<uint8_t>(skey_t::tstamp));
+    w.uinteger(tstamp);
+    w.uinteger(static_cast<uint8_t>(skey_t::interval));
+    w.uinteger(interval);
+    w.uinteger(static_cast<uint8_t>(skey_t::cnt));
+    w.uinteger(cnt > 0 ? cnt : 0);
+    w.uinteger(static_cast<uint8_t>(skey_t::delta));
+    w.boolean(delta);
+    w.uinteger(static_cast<uint8_t>(skey_t::columns));
+    w.map(__builtin_popcount(cols));
+
+    for (uint8_t i = 0; i != CBOR_METERS; ++i){
+        if (!(cols & (1 << i)))
+            continue;
+
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        w.uinteger(i);
+        if (delta){
+            w.array(cnt);
+            int64_t prev = 0;
+            for (int s = 0; s != cnt; ++s){
+                int64_t v = at(series, from + s)->asRaw(meter);
+                w.integer(v - prev);
+                prev = v;
+            }
+        } else {
+            uint8_t width = vmax[i] <= 0xff ? 1 : vmax[i] <= 0xffff ? 2 : 4;
+            w.typed(width, cnt);
+            for (int s = 0; s != cnt; ++s)
+                w.element(width, at(series, from + s)->asRaw(meter));
+        }
+    }
+}
+
+bool decode(Reader &r, series_t &s){
+    size_t n;
+    s.mask = 0;
+    if (!r.map(n))
+        return false;
+
+    while (n--){
+        uint64_t k, v;
+        if (!r.uinteger(k))
+            return false;
+
+        switch (static_cast<skey_t>(k)){
+            case skey_t::tstamp :
+                if (!r.uinteger(v)) return false;
+                s.tstamp = v;
+                break;
+            case skey_t::interval :
+                if (!r.uinteger(v)) return false;
+                s.interval = v;
+                break;
+            case skey_t::cnt :
+                if (!r.uinteger(v)) return false;
+                s.cnt = v;
+                break;
+            case skey_t::delta :
+                if (!r.boolean(s.delta)) return false;
+                break;
+            case skey_t::columns : {
+                size_t ncols;
+                if (!r.map(ncols))
+                    return false;
+                while (ncols--){
+                    uint64_t c;
+                    if (!r.uinteger(c))
+                        return false;
+
+                    uint32_t *dst = c < CBOR_METERS ? s.col[c] : nullptr;
+                    if (!dst){
+                        if (!r.skip()) return false;
+                        continue;
+                    }
+                    s.mask |= 1 << c;
+
+                    if (r.peek() == 6){
+                        size_t cnt;
+                        if (!r.typed(dst, s.max, cnt)) return false;
+                        continue;
+                    }
+
+                    size_t cnt;
+                    if (!r.array(cnt))
+                        return false;
+                    int64_t acc = 0;
+                    for (size_t i = 0; i != cnt; ++i){
+                        int64_t d;
+                        if (!r.integer(d)) return false;
+                        acc += d;
+                        if (i < s.max) dst[i] = acc;
+                    }
+                }
+                break;
+            }
+            default :
+                if (!r.skip()) return false;
+        }
+    }
+    return r.good();
+}
+
+}   // namespace cbor
@@ -0,0 +1,235 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_modbus.hpp"
+#include "timeseries.hpp"
+#include "textfmt.hpp"
+
+// RFC 8746 typed array tags used for series columns
+#define CBOR_TAG_UINT8          64
+#define CBOR_TAG_UINT16LE       69
+#define CBOR_TAG_UINT32LE       70
+
+/**
+ * @brief compact binary serialization of metrics, state and TimeSeries ranges (CBOR, RFC 8949)
+ *
+ * Schema, all map keys are small integers:
+ *  metrics:    { <meter_t>: <raw value>, ... }                         only fields supported by device
+ *  state:      { 0: model, 1: addr, 2: err, 3: data age ms, 4: metrics }
+ *  series:     { 0: last sample timestamp, 1: interval, 2: sample count, 3: delta flag,
+ *                4: { <meter_t>: <column>, ... } }
+ * series column is a typed array (RFC 8746, uint8/uint16le/uint32le, narrowest to fit the values) or,
+ * with delta encoding, an array of integers where the first one is an absolute value and the rest are
+ * differences to the previous sample. Samples are ordered from the oldest to the newest.
+ * All values are raw device integers, use metrics::decimals() to scale them.
+ */
+namespace cbor {
+
+// metrics/state/series map keys
+enum class key_t:uint8_t { model = 0, addr, err, age, metrics };
+enum class skey_t:uint8_t { tstamp = 0, interval, cnt, delta, columns };
+
+/**
+ * @brief CBOR writer into a caller supplied buffer
+ * overflow is sticky, once buffer is exhausted all further writes are ignored and good() returns false
+ */
+class Writer {
+    uint8_t *buf;
+    const size_t cap;
+    size_t pos = 0;
+    bool ok = true;
+
+    void head(uint8_t major, uint64_t v);
+    void put(const void *data, size_t len);
+
+public:
+    Writer(uint8_t *dst, size_t len) : buf(dst), cap(len) {}
+
+    void uinteger(uint64_t v){ head(0, v); }
+    void integer(int64_t v){ v < 0 ? head(1, -1 - v) : head(0, v); }
+    void bytes(const uint8_t *data, size_t len){ head(2, len); put(data, len); }
+    void text(const char *str);
+    void array(size_t n){ head(4, n); }
+    void map(size_t n){ head(5, n); }
+    void tag(uint64_t t){ head(6, t); }
+    void boolean(bool v){ uint8_t b = v ? 0xf5 : 0xf4; put(&b, 1); }
+
+    /**
+     * @brief start typed array of unsigned integers (RFC 8746), little endian
+     * must be followed by exactly cnt calls to element()
+     *
+     * @param width - element size in bytes, 1, 2 or 4
+     * @param cnt - number of values
+     */
+    void typed(uint8_t width, size_t cnt);
+
+    /**
+     * @brief write typed array element
+     */
+    void element(uint8_t width, uint32_t v);
+
+    /**
+     * @brief rewind to the beginning of the buffer
+     */
+    void reset(){ pos = 0; ok = true; }
+
+    /**
+     * @brief number of bytes written
+     */
+    size_t size() const { return pos; }
+
+    /**
+     * @brief check that nothing was lost due to buffer overflow
+     */
+    bool good() const { return ok; }
+};
+
+/**
+ * @brief CBOR reader for the data produced by Writer
+ * supports definite length items only, errors are sticky
+ */
+class Reader {
+    const uint8_t *buf;
+    const size_t len;
+    size_t pos = 0;
+    bool ok = true;
+
+    bool head(uint8_t major, uint64_t &v);
+
+public:
+    Reader(const uint8_t *src, size_t size) : buf(src), len(size) {}
+
+    /**
+     * @brief major type of the next item, 0xff on end of data
+     */
+    uint8_t peek() const { return pos < len ? buf[pos] >> 5 : 0xff; }
+
+    bool uinteger(uint64_t &v){ return head(0, v); }
+    bool integer(int64_t &v);
+    bool bytes(const uint8_t *&data, size_t &n);
+    bool array(size_t &n);
+    bool map(size_t &n);
+    bool tag(uint64_t &t){ return head(6, t); }
+    bool boolean(bool &v);
+
+    /**
+     * @brief read typed array written with Writer::typed()
+     *
+     * @param dst - destination array
+     * @param max - destination array size
+     * @param n - number of values read
+     */
+    bool typed(uint32_t *dst, size_t max, size_t &n);
+
+    /**
+     * @brief skip next item including nested ones
+     */
+    bool skip();
+
+    bool good() const { return ok; }
+    size_t position() const { return pos; }
+};
+
+/**
+ * @brief encode metrics struct, only fields supported by device and selected in mask are written
+ */
+void encode(Writer &w, const pzmbus::metrics &m, uint8_t mask = TEXTFMT_METERS_ALL);
+
+/**
+ * @brief encode PZEM state with it's metrics
+ */
+void encode(Writer &w, const pzmbus::state &s, const pzmbus::metrics &m, uint8_t mask = TEXTFMT_METERS_ALL);
+
+/**
+ * @brief decode metrics map into raw values array
+ *
+ * @param vals - array of 8 values indexed by meter_t
+ * @param mask - returned mask of fields present
+ */
+bool decode(Reader &r, uint32_t *vals, uint8_t &mask);
+
+bool decode(Reader &r, pz004::metrics &m);
+bool decode(Reader &r, pz003::metrics &m);
+
+/**
+ * @brief decode state map
+ *
+ * @param model, addr, err, age - decoded state fields
+ * @param vals, mask - decoded metrics, see decode() for metrics
+ */
+bool decode(Reader &r, pzmbus::pzmodel_t &model, uint8_t &addr, pzmbus::pzem_err_t &err, uint32_t &age, uint32_t *vals, uint8_t &mask);
+
+// accessor for series samples, keeps encoder type agnostic
+typedef const pzmbus::metrics* (*series_at_t)(const void *series, int idx);
+
+/**
+ * @brief encode a range of samples, column-wise
+ * use template wrapper for TimeSeries objects
+ *
+ * @param at - sample accessor
+ * @param series - series object
+ * @param from - index of the first sample (0 - the oldest one)
+ * @param cnt - number of samples
+ * @param tstamp - timestamp of the last sample in range
+ * @param interval - sample interval
+ * @param mask - metrics fields to encode
+ * @param delta - delta-encode columns
+ */
+void encode_series(Writer &w, series_at_t at, const void *series, int from, int cnt, uint32_t tstamp, uint32_t interval, uint8_t mask, bool delta);
+
+template <typename T>
+const pzmbus::metrics* series_at(const void *series, int idx){ return static_cast<const TimeSeries<T>*>(series)->at(idx); }
+
+/**
+ * @brief encode TimeSeries range
+ *
+ * @param ts - series
+ * @param mask - metrics fields to encode
+ * @param delta - delta-encode columns
+ * @param from - index of the first sample (0 - the oldest one)
+ * @param cnt - number of samples, -1 - up to the newest one
+ */
+template <typename T>
+void encode(Writer &w, const TimeSeries<T> &ts, uint8_t mask = TEXTFMT_METERS_ALL, bool delta = false, int from = 0, int cnt = -1){
+    int size = ts.getSize();
+    if (from < 0 || from > size)
+        from = size;
+    if (cnt < 0 || from + cnt > size)
+        cnt = size - from;
+
+    // timestamp of the last sample in range
+    uint32_t t = ts.getTstamp() - (size - from - cnt) * ts.getInterval();
+    encode_series(w, &series_at<T>, &ts, from, cnt, t, ts.getInterval(), mask, delta);
+}
+
+/**
+ * @brief decoded series range, host side helper
+ * columns are decoded into caller supplied arrays
+ */
+struct series_t {
+    uint32_t tstamp = 0;
+    uint32_t interval = 0;
+    size_t cnt = 0;
+    bool delta = false;
+    uint8_t mask = 0;               // columns present
+    uint32_t *col[8] = {};          // destination arrays indexed by meter_t, nullptr to skip column
+    size_t max = 0;                 // destination arrays size
+};
+
+/**
+ * @brief decode series range
+ */
+bool decode(Reader &r, series_t &s);
+
+}   // namespace cbor
@@ -0,0 +1,70 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "forecast.hpp"
+
+namespace forecast {
+
+HoltWinters::HoltWinters(uint8_t _id, uint16_t _period) : id(_id), period(_period ? _period : 1) {
+    season.reset(new (std::nothrow) float[period]);
+}
+
+void HoltWinters::push(float y){
+    if (!season || std::isnan(y))
+        return;
+
+    uint16_t idx = n % period;
+
+    // first season - collect initial level and seasonal offsets
+    if (n < period){
+        season[idx] = y;
+        level += (y - level) / (n + 1);         // running mean over the first season
+        if (++n == period){
+            for (uint16_t i = 0; i != period; ++i)
+                season[i] -= level;
+        }
+        return;
+    }
+
+    float s = season[idx];
+    float e = y - (level + trend + s);          // one-step forecast error
+    mse = n == period ? e * e : (1 - err_alpha) * mse + err_alpha * e * e;
+
+    float prev = level;
+    level = alpha * (y - s) + (1 - alpha) * (level + trend);
+    trend = beta * (level - prev) + (1 - beta) * trend;
+    season[idx] = gamma * (y - level) + (1 - gamma) * s;
+    ++n;
+}
+
+float HoltWinters::predict(uint16_t h) const {
+    if (!ready())
+        return NAN;
+
+    if (!h) h = 1;
+    return level + h * trend + season[(n + h - 1) % period];
+}
+
+float HoltWinters::errorBand(uint16_t h, float z) const {
+    if (!ready())
+        return NAN;
+
+    if (!h) h = 1;
+    return z * std::sqrt(mse * h);
+}
+
+void HoltWinters::reset(){
+    level = trend = mse = 0;
+    n = 0;
+}
+
+}   // namespace forecast
@@ -0,0 +1,112 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <memory>
+#include "pzem_modbus.hpp"
+
+#define HW_ALPHA            0.2     // level smoothing factor
+#define HW_BETA             0.01    // trend smoothing factor
+#define HW_GAMMA            0.1     // seasonal smoothing factor
+#define HW_ERR_ALPHA        0.05    // smoothing factor for squared forecast error
+#define HW_BAND_Z           1.96    // default error band width, ~95% for normally distributed errors
+
+namespace forecast {
+
+/**
+ * @brief Incremental additive Holt-Winters forecaster
+ * Meant to be updated once per TimeSeries bucket (i.e. via TimeSeries::attach_push_callback())
+ * with a daily season, i.e. season length of 96 for 15 min buckets.
+ * Season coefficients are allocated once on construction (4 bytes per bucket),
+ * each update is O(1), there is no re-fit over history. First season is used to
+ * collect initial levels, forecasts are available after that.
+ */
+class HoltWinters {
+    std::unique_ptr<float[]> season;    // seasonal coefficients
+    float level = 0;
+    float trend = 0;
+    float mse = 0;                      // EWMA of squared one-step forecast error
+    uint32_t n = 0;                     // number of samples processed
+
+public:
+    const uint8_t id;                   // forecaster id (usually matches PZEM or TimeSeries id)
+    const uint16_t period;              // season length, in samples
+
+    // tunables
+    float alpha = HW_ALPHA;
+    float beta = HW_BETA;
+    float gamma = HW_GAMMA;
+    float err_alpha = HW_ERR_ALPHA;
+
+    /**
+     * @brief Construct a new Holt-Winters forecaster
+     *
+     * @param _id - forecaster id
+     * @param _period - season length, number of samples (buckets) per day
+     */
+    HoltWinters(uint8_t _id, uint16_t _period);
+
+    // Copy semantics : forbidden
+    HoltWinters(const HoltWinters&) = delete;
+    HoltWinters& operator=(const HoltWinters&) = delete;
+
+    /**
+     * @brief feed next sample
+     *
+     * @param y - sample value
+     */
+    void push(float y);
+
+    /**
+     * @brief feed next sample from metrics struct
+     *
+     * @param m - metrics struct
+     * @param t - metric to forecast, power by default
+     */
+    void push(const pzmbus::metrics &m, pzmbus::meter_t t = pzmbus::meter_t::pwr){ push(m.asFloat(t)); }
+
+    /**
+     * @brief check if model has collected initial season and could make forecasts
+     */
+    bool ready() const { return season && n >= period; }
+
+    /**
+     * @brief predicted value h samples ahead
+     *
+     * @param h - forecast horizon in samples, 1 is the next bucket
+     * @return float predicted value, NAN if model is not ready yet
+     */
+    float predict(uint16_t h = 1) const;
+
+    /**
+     * @brief half-width of the error band for forecast h samples ahead
+     * estimated from smoothed one-step errors, widening as sqrt(h)
+     *
+     * @param h - forecast horizon in samples
+     * @param z - band width in standard deviations
+     * @return float band half-width, NAN if model is not ready yet
+     */
+    float errorBand(uint16_t h = 1, float z = HW_BAND_Z) const;
+
+    /**
+     * @brief number of samples processed so far
+     */
+    uint32_t getCnt() const { return n; }
+
+    /**
+     * @brief reset model to initial state
+     */
+    void reset();
+};
+
+}   // namespace forecast
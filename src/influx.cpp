@@ -0,0 +1,118 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "influx.hpp"
+
+// escape tag value, spaces, commas and equal signs must be backslashed
+static size_t tag_escape(char *dst, const char *src){
+    size_t n = 0;
+    for (size_t i = 0; src && src[i] && i != INFLUX_TAG_MAX; ++i){
+        if (src[i] == ' ' || src[i] == ',' || src[i] == '=')
+            dst[n++] = '\\';
+        dst[n++] = src[i];
+    }
+    return n;
+}
+
+void InfluxEncoder::begin(const PZPool *_pool, uint32_t t){
+    spool.reset();
+    ts = nullptr;
+    pool = _pool;
+    time = t;
+    cursor = 0;
+}
+
+size_t InfluxEncoder::read(char *dst, size_t len){
+    size_t n = 0;
+    while (n != len){
+        if (!spool.pending() && !render())
+            break;
+        n += spool.drain(&dst[n], len - n);
+    }
+    return n;
+}
+
+bool InfluxEncoder::render(){
+    if (pool){
+        size_t l = 0;
+        // skip meters with no data, so that empty lines are never emitted
+        while (!l){
+            size_t visited = pool->forEachPZEM([this, &l](const PZEM *pz){
+                    ++cursor;
+                    const auto *s = pz->getState();
+                    if (s->update_us)
+                        l = line(spool.buf(), pz->id, pz->getDescr(), *pz->getMetrics(), time);
+                    return false;
+                }, cursor);
+
+            if (!visited){
+                pool = nullptr;
+                return false;
+            }
+        }
+        spool.commit(l);
+        return true;
+    }
+
+    if (ts){
+        if (cursor >= (size_t)ts_size){
+            ts = nullptr;
+            return false;
+        }
+
+        const pzmbus::metrics *m = ts_at(ts, cursor);
+        uint32_t t = ts_last - (ts_size - 1 - cursor) * ts_interval;
+        ++cursor;
+        spool.commit(line(spool.buf(), ts_id, ts_name, *m, t));
+        return true;
+    }
+
+    return false;
+}
+
+size_t InfluxEncoder::line(char *dst, uint8_t id, const char *name, const pzmbus::metrics &m, uint32_t t) const {
+    char *p = dst;
+    p += textfmt::fmt_str(p, measurement, INFLUX_TAG_MAX);
+    p += textfmt::fmt_str(p, ",id=");
+    p += textfmt::fmt_uint(p, id);
+    if (name && *name){
+        p += textfmt::fmt_str(p, ",name=");
+        p += tag_escape(p, name);
+    }
+
+    char sep = ' ';
+    for (uint8_t i = static_cast<uint8_t>(pzmbus::meter_t::vol); i <= static_cast<uint8_t>(pzmbus::meter_t::alrml); ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        int8_t dec = m.decimals(meter);
+        if (dec < 0 || !textfmt::selected(fields, meter))
+            continue;
+
+        *p++ = sep;
+        sep = ',';
+        p += textfmt::fmt_str(p, textfmt::meter_name(meter));
+        *p++ = '=';
+        p += textfmt::fmt_fixed(p, m.asRaw(meter), dec);
+        if (!dec)
+            *p++ = 'i';             // integer field, keeps field type consistent across points
+    }
+
+    // no fields selected, line would be invalid
+    if (sep == ' ')
+        return 0;
+
+    if (t){
+        *p++ = ' ';
+        p += textfmt::fmt_uint(p, t);
+    }
+    *p++ = '\n';
+    return p - dst;
+}
@@ -0,0 +1,116 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include "timeseries.hpp"
+#include "textfmt.hpp"
+
+#define INFLUX_MEASUREMENT      "pzem"  // default measurement name
+#define INFLUX_TAG_MAX          32      // max length of a tag value, chars
+
+/**
+ * @brief InfluxDB line protocol encoder
+ * Renders metrics for all meters of a PZPool or for all samples of a TimeSeries into caller supplied
+ * buffers, one line per meter/sample:
+ *
+ *  pzem,id=1,name=PZEM-1 voltage=230.1,current=1.234,power=210.5,energy=1234i,frequency=50.0,pf=0.95 1700000000
+ *
+ * Encoding is resumable, read() could be called with buffers of any size (i.e. chunks of an HTTP body)
+ * until it returns 0. No heap allocations are made, values are printed from integers.
+ * Timestamps are in seconds, so data should be posted with 'precision=s'.
+ */
+class InfluxEncoder {
+    // accessor for TimeSeries samples, keeps encoder type agnostic
+    typedef const pzmbus::metrics* (*ts_at_t)(const void *ts, int idx);
+
+    textfmt::LineSpool spool;
+    const char *measurement;
+    uint8_t fields = TEXTFMT_METERS_ALL;
+
+    // current source
+    const PZPool *pool = nullptr;
+    const void *ts = nullptr;
+    ts_at_t ts_at = nullptr;
+    int ts_size = 0;
+    uint32_t ts_last = 0;               // timestamp of the last sample
+    uint32_t ts_interval = 0;
+    uint8_t ts_id = 0;
+    const char *ts_name = nullptr;
+
+    size_t cursor = 0;                  // next meter/sample to render
+    uint32_t time = 0;                  // pool timestamp
+
+    template <typename T>
+    static const pzmbus::metrics* series_at(const void *series, int idx){ return static_cast<const TimeSeries<T>*>(series)->at(idx); }
+
+    // render next line into spool, return false when there is nothing left
+    bool render();
+
+    size_t line(char *dst, uint8_t id, const char *name, const pzmbus::metrics &m, uint32_t t) const;
+
+public:
+    explicit InfluxEncoder(const char *_measurement = INFLUX_MEASUREMENT) : measurement(_measurement) {}
+
+    /**
+     * @brief select fields to render
+     *
+     * @param mask - bitmask of pzmbus::meter_t fields, i.e. 1 << meter_t::pwr | 1 << meter_t::enrg
+     */
+    void setFields(uint8_t mask){ fields = mask; }
+
+    /**
+     * @brief start encoding metrics for all meters in a pool
+     * meters that have not received any data yet are skipped
+     *
+     * @param _pool - pool object, must not change until encoding is done
+     * @param t - timestamp for all lines, epoch seconds, 0 - omit timestamp (server time is used)
+     */
+    void begin(const PZPool *_pool, uint32_t t = 0);
+
+    /**
+     * @brief start encoding all samples of a TimeSeries
+     * sample timestamps are derived from series timestamp and interval
+     *
+     * @param series - TimeSeries object, must not change until encoding is done
+     * @param id - 'id' tag value, i.e. PZEM id
+     * @param name - 'name' tag value, series description is used if null
+     */
+    template <typename T>
+    void begin(const TimeSeries<T> &series, uint8_t id, const char *name = nullptr){
+        spool.reset();
+        pool = nullptr;
+        ts = &series;
+        ts_at = &InfluxEncoder::series_at<T>;
+        ts_size = series.getSize();
+        ts_last = series.getTstamp();
+        ts_interval = series.getInterval();
+        ts_id = id;
+        ts_name = name ? name : series.getDescr();
+        cursor = 0;
+    }
+
+    /**
+     * @brief render next portion of line protocol data
+     *
+     * @param dst - destination buffer
+     * @param len - buffer size
+     * @return size_t - number of bytes written, 0 when encoding is done
+     */
+    size_t read(char *dst, size_t len);
+
+    /**
+     * @brief check if encoding is done
+     */
+    bool done() const { return !spool.pending() && !pool && !ts; }
+};
@@ -0,0 +1,192 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "jsonw.hpp"
+
+#define JSONW_METERS            8       // number of meter_t fields
+
+// ****  JsonWriter  **** //
+
+void JsonWriter::put(const char *data, size_t len){
+    while (ok && len){
+        size_t n = JSONW_CHUNK_SIZE - pos;
+        if (n > len)
+            n = len;
+        memcpy(&chunk[pos], data, n);
+        pos += n;
+        data += n;
+        len -= n;
+        if (pos == JSONW_CHUNK_SIZE)
+            flush();
+    }
+}
+
+bool JsonWriter::flush(){
+    if (ok && pos)
+        ok = sink(chunk, pos);
+    pos = 0;
+    return ok;
+}
+
+void JsonWriter::separate(){
+    if (after_key){
+        after_key = false;
+        return;
+    }
+
+    // top level values are separate documents
+    if (depth && (nonempty & (1 << depth)))
+        put(',');
+    nonempty |= 1 << depth;
+}
+
+void JsonWriter::open(char c){
+    separate();
+    put(c);
+    if (depth < JSONW_MAX_DEPTH - 1)
+        ++depth;
+    nonempty &= ~(1 << depth);
+}
+
+void JsonWriter::close(char c){
+    put(c);
+    if (depth)
+        --depth;
+}
+
+JsonWriter& JsonWriter::key(const char *k){
+    value(k);
+    put(':');
+    after_key = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(uint64_t v){
+    char buf[20];
+    separate();
+    put(buf, textfmt::fmt_uint(buf, v));
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(int64_t v){
+    char buf[21];
+    separate();
+    put(buf, textfmt::fmt_int(buf, v));
+    return *this;
+}
+
+JsonWriter& JsonWriter::fixed(int64_t raw, uint8_t dec){
+    char buf[22];
+    separate();
+    put(buf, textfmt::fmt_fixed(buf, raw, dec));
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(bool v){
+    separate();
+    v ? put("true", 4) : put("false", 5);
+    return *this;
+}
+
+JsonWriter& JsonWriter::null(){
+    separate();
+    put("null", 4);
+    return *this;
+}
+
+JsonWriter& JsonWriter::value(const char *str){
+    separate();
+    put('"');
+    for (; str && *str; ++str){
+        char c = *str;
+        if (c == '"' || c == '\\'){
+            put('\\');
+            put(c);
+        } else if (static_cast<uint8_t>(c) < 0x20){
+            // control chars
+            char esc[6] = {'\\', 'u', '0', '0', "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 0xf]};
+            put(esc, 6);
+        } else
+            put(c);
+    }
+    put('"');
+    return *this;
+}
+
+namespace jsonw {
+
+void write(JsonWriter &w, const pzmbus::metrics &m, uint8_t mask){
+    w.beginObject();
+    for (uint8_t i = 0; i != JSONW_METERS; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        int8_t dec = m.decimals(meter);
+        if (dec < 0 || !textfmt::selected(mask, meter))
+            continue;
+        w.key(textfmt::meter_name(meter)).fixed(m.asRaw(meter), dec);
+    }
+    w.endObject();
+}
+
+void write(JsonWriter &w, const PZEM &pz, uint8_t mask){
+    const auto *s = pz.getState();
+    w.beginObject();
+    w.key("id").value(static_cast<uint32_t>(pz.id));
+    w.key("name").value(pz.getDescr());
+    w.key("model").value(static_cast<uint32_t>(s->model));
+    w.key("addr").value(static_cast<uint32_t>(s->addr));
+    w.key("err").value(static_cast<uint32_t>(s->err));
+    if (s->update_us){
+        w.key("age").value(s->dataAge());
+        w.key("metrics");
+        write(w, *pz.getMetrics(), mask);
+    }
+    w.endObject();
+}
+
+void write(JsonWriter &w, const PZPool &pool, uint8_t mask){
+    w.beginObject();
+    w.key("meters").beginArray();
+    pool.forEachPZEM([&w, mask](const PZEM *pz){
+        write(w, *pz, mask);
+        return w.good();
+    });
+    w.endArray();
+    w.endObject();
+}
+
+void write_series(JsonWriter &w, series_at_t at, const void *series, int cnt, uint8_t id, const char *name, uint32_t tstamp, uint32_t interval, uint8_t mask){
+    w.beginObject();
+    w.key("id").value(static_cast<uint32_t>(id));
+    w.key("name").value(name);
+    w.key("tstamp").value(tstamp);
+    w.key("interval").value(interval);
+    w.key("cnt").value(static_cast<int32_t>(cnt));
+    w.key("data").beginObject();
+    if (cnt > 0){
+        const pzmbus::metrics *m = at(series, 0);
+        for (uint8_t i = 0; i != JSONW_METERS && w.good(); ++i){
+            auto meter = static_cast<pzmbus::meter_t>(i);
+            int8_t dec = m->decimals(meter);
+            if (dec < 0 || !textfmt::selected(mask, meter))
+                continue;
+
+            w.key(textfmt::meter_name(meter)).beginArray();
+            for (int s = 0; s != cnt; ++s)
+                w.fixed(at(series, s)->asRaw(meter), dec);
+            w.endArray();
+        }
+    }
+    w.endObject();
+    w.endObject();
+}
+
+}   // namespace jsonw
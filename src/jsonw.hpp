@@ -0,0 +1,139 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include "timeseries.hpp"
+#include "textfmt.hpp"
+
+#define JSONW_CHUNK_SIZE        256     // output chunk buffer size
+#define JSONW_MAX_DEPTH         16      // max nesting level of objects/arrays
+
+/**
+ * @brief streaming JSON writer
+ * Writes JSON tokens into a small fixed chunk buffer which is passed to a sink call-back once full,
+ * so memory usage does not depend on the amount of data. Commas between elements are placed automatically.
+ * Sink errors are sticky, once sink returns false all further output is discarded.
+ */
+class JsonWriter {
+
+public:
+    /**
+     * @brief output sink call-back
+     * @return true if data has been consumed, false to abort writing
+     */
+    typedef std::function<bool (const char *data, size_t len)> sink_t;
+
+private:
+    sink_t sink;
+    char chunk[JSONW_CHUNK_SIZE];
+    size_t pos = 0;
+    uint8_t depth = 0;
+    uint16_t nonempty = 0;              // per nesting level flag, level already has elements
+    bool after_key = false;
+    bool ok = true;
+
+    void put(const char *data, size_t len);
+    void put(char c){ put(&c, 1); }
+    void separate();
+    void open(char c);
+    void close(char c);
+
+public:
+    explicit JsonWriter(sink_t f) : sink(std::move(f)) {}
+
+    // Copy semantics : forbidden
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    JsonWriter& beginObject(){ open('{'); return *this; }
+    JsonWriter& endObject(){ close('}'); return *this; }
+    JsonWriter& beginArray(){ open('['); return *this; }
+    JsonWriter& endArray(){ close(']'); return *this; }
+
+    /**
+     * @brief write object key, must be followed by a value, object or array
+     */
+    JsonWriter& key(const char *k);
+
+    JsonWriter& value(uint64_t v);
+    JsonWriter& value(int64_t v);
+    JsonWriter& value(uint32_t v){ return value(static_cast<uint64_t>(v)); }
+    JsonWriter& value(int32_t v){ return value(static_cast<int64_t>(v)); }
+    JsonWriter& value(bool v);
+    JsonWriter& value(const char *str);
+    JsonWriter& null();
+
+    /**
+     * @brief write fixed point value as a decimal number, i.e. (2301, 1) -> 230.1
+     */
+    JsonWriter& fixed(int64_t raw, uint8_t dec);
+
+    /**
+     * @brief pass buffered data to sink
+     *
+     * @return true if everything written so far was consumed by sink
+     */
+    bool flush();
+
+    /**
+     * @brief check that nothing was lost
+     */
+    bool good() const { return ok; }
+};
+
+namespace jsonw {
+
+/**
+ * @brief write metrics object with selected fields
+ * {"voltage":230.1,"current":1.234,...}
+ *
+ * @param mask - bitmask of pzmbus::meter_t fields
+ */
+void write(JsonWriter &w, const pzmbus::metrics &m, uint8_t mask = TEXTFMT_METERS_ALL);
+
+/**
+ * @brief write PZEM object
+ * {"id":1,"name":"PZEM-1","model":1,"addr":1,"err":0,"age":123,"metrics":{...}}
+ * 'age' and 'metrics' are only present if PZEM has received any data
+ */
+void write(JsonWriter &w, const PZEM &pz, uint8_t mask = TEXTFMT_METERS_ALL);
+
+/**
+ * @brief write all pool meters
+ * {"meters":[{...},...]}
+ */
+void write(JsonWriter &w, const PZPool &pool, uint8_t mask = TEXTFMT_METERS_ALL);
+
+// accessor for series samples, keeps writer type agnostic
+typedef const pzmbus::metrics* (*series_at_t)(const void *series, int idx);
+
+/**
+ * @brief write series samples column-wise
+ * use template wrapper for TimeSeries objects
+ */
+void write_series(JsonWriter &w, series_at_t at, const void *series, int cnt, uint8_t id, const char *name, uint32_t tstamp, uint32_t interval, uint8_t mask);
+
+template <typename T>
+const pzmbus::metrics* series_at(const void *series, int idx){ return static_cast<const TimeSeries<T>*>(series)->at(idx); }
+
+/**
+ * @brief write TimeSeries object, samples are ordered from the oldest to the newest
+ * {"id":1,"name":"ts","tstamp":1700000000,"interval":10,"cnt":300,"data":{"voltage":[...],"power":[...]}}
+ */
+template <typename T>
+void write(JsonWriter &w, const TimeSeries<T> &ts, uint8_t mask = TEXTFMT_METERS_ALL){
+    write_series(w, &series_at<T>, &ts, ts.getSize(), ts.id, ts.getDescr(), ts.getTstamp(), ts.getInterval(), mask);
+}
+
+}   // namespace jsonw
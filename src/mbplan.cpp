@@ -0,0 +1,180 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mbplan.hpp"
+#include <algorithm>
+#include <memory>
+
+static bool is_read(uint8_t fc){
+    return fc >= MBRTU_FC_READ_COILS && fc <= MBRTU_FC_READ_INPUT;
+}
+
+static bool is_bits(uint8_t fc){
+    return fc == MBRTU_FC_READ_COILS || fc == MBRTU_FC_READ_DISCRETE;
+}
+
+MBReadPlanner::MBReadPlanner(MBMaster *master, uint32_t window_ms) : mb(master), window(window_ms) {
+    lock = xSemaphoreCreateMutex();
+    if (window)
+        t_flush = xTimerCreate("MBplan", pdMS_TO_TICKS(window), pdFALSE, static_cast<void*>(this), MBReadPlanner::timerRunner);
+}
+
+MBReadPlanner::~MBReadPlanner(){
+    if (t_flush){
+        xTimerStop(t_flush, portMAX_DELAY);
+        xTimerDelete(t_flush, portMAX_DELAY);
+    }
+    vSemaphoreDelete(lock);
+}
+
+bool MBReadPlanner::submit(const mbrtu::request &rq, MBMaster::reply_cb_t cb){
+    if (!mb || !rq.valid())
+        return false;
+
+    // writes and broadcasts are never delayed
+    if (!is_read(rq.fc) || !rq.addr)
+        return mb->submit(rq, std::move(cb));
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (queued.size() >= MBPLAN_QUEUE_MAX){
+        xSemaphoreGive(lock);
+        return false;
+    }
+    queued.push_back({rq, std::move(cb)});
+    ++requests;
+    bool first = queued.size() == 1;
+    xSemaphoreGive(lock);
+
+    // window starts with the first request, later ones do not extend it
+    if (first && t_flush)
+        xTimerStart(t_flush, portMAX_DELAY);
+
+    return true;
+}
+
+size_t MBReadPlanner::flush(){
+    std::vector<entry_t> batch;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    batch.swap(queued);
+    xSemaphoreGive(lock);
+
+    if (batch.empty())
+        return 0;
+
+    std::stable_sort(batch.begin(), batch.end(), [](const entry_t &a, const entry_t &b){
+        if (a.rq.addr != b.rq.addr) return a.rq.addr < b.rq.addr;
+        if (a.rq.fc != b.rq.fc) return a.rq.fc < b.rq.fc;
+        return a.rq.reg < b.rq.reg;
+    });
+
+    size_t sent = 0;
+    std::vector<entry_t> group;
+    uint32_t from = 0, to = 0;          // merged range [from, to)
+
+    for (auto &e : batch){
+        uint32_t limit = is_bits(e.rq.fc) ? MBRTU_MAX_READ_BITS : MBRTU_MAX_READ_REGS;
+        uint32_t end = e.rq.reg + e.rq.cnt;
+
+        if (!group.empty() && group.front().rq.addr == e.rq.addr && group.front().rq.fc == e.rq.fc &&
+            e.rq.reg <= to + gap && std::max(to, end) - from <= limit){
+            to = std::max(to, end);
+            group.emplace_back(std::move(e));
+            continue;
+        }
+
+        if (!group.empty())
+            sent += dispatch(std::move(group), from, to - from);
+
+        group.clear();
+        from = e.rq.reg;
+        to = end;
+        group.emplace_back(std::move(e));
+    }
+
+    if (!group.empty())
+        sent += dispatch(std::move(group), from, to - from);
+
+    return sent;
+}
+
+bool MBReadPlanner::dispatch(std::vector<entry_t> &&group, uint16_t reg, uint16_t cnt){
+    mbrtu::request rq = group.front().rq;
+    bool ok;
+
+    if (group.size() == 1){
+        ok = mb->submit(rq, group.front().cb);
+    } else {
+        rq.reg = reg;
+        rq.cnt = cnt;
+        auto members = std::make_shared< std::vector<entry_t> >(std::move(group));
+
+        ok = mb->submit(rq, [members, reg](const mbrtu::reply &r){
+            bool bits = is_bits(r.fc);
+            std::vector<uint8_t> buff;
+
+            for (const auto &m : *members){
+                if (!m.cb)
+                    continue;
+
+                mbrtu::reply part = r;
+                part.reg = m.rq.reg;
+                part.cnt = m.rq.cnt;
+                part.data = nullptr;
+                part.len = 0;
+
+                if (r.status == mbrtu::status_t::ok){
+                    uint16_t offset = m.rq.reg - reg;
+                    if (bits){
+                        if ((offset + m.rq.cnt + 7u) / 8 > r.len){
+                            part.status = mbrtu::status_t::frame;
+                        } else {
+                            // repack bits so that requested range starts from bit 0
+                            buff.assign((m.rq.cnt + 7) / 8, 0);
+                            for (uint16_t i = 0; i != m.rq.cnt; ++i)
+                                if (r.bit(offset + i))
+                                    buff[i / 8] |= 1 << (i % 8);
+                            part.data = buff.data();
+                            part.len = buff.size();
+                        }
+                    } else {
+                        if ((offset + m.rq.cnt) * 2u > r.len){
+                            part.status = mbrtu::status_t::frame;
+                        } else {
+                            part.data = r.data + offset * 2;
+                            part.len = m.rq.cnt * 2;
+                        }
+                    }
+                }
+                m.cb(part);
+            }
+        });
+
+        if (!ok)
+            group = std::move(*members);
+    }
+
+    if (ok){
+        ++transactions;
+        return true;
+    }
+
+    // master's queue is full, requesters are notified right away
+    for (const auto &m : group){
+        if (!m.cb)
+            continue;
+        mbrtu::reply r;
+        mbrtu::decode(m.rq, nullptr, 0, r);
+        r.status = mbrtu::status_t::busy;
+        m.cb(r);
+    }
+    return false;
+}
@@ -0,0 +1,102 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "mbrtu.hpp"
+#include "freertos/timers.h"
+
+#define MBPLAN_WINDOW           20      // ms, requests collected within this window are coalesced
+#define MBPLAN_MAX_GAP          0       // max number of unrequested registers/coils allowed between merged ranges
+#define MBPLAN_QUEUE_MAX        32      // max read requests waiting for the window to expire
+
+/**
+ * @brief read coalescing planner for MBMaster
+ * Collects read requests (FC 01/02/03/04) for a short window, then merges overlapping or adjacent ranges
+ * of the same slave and function code into a single transaction (within protocol limits).
+ * Merged reply is split back and each requester gets a reply for exactly the range it has asked for.
+ * Write requests are passed to the master immediately.
+ */
+class MBReadPlanner {
+    struct entry_t {
+        mbrtu::request rq;
+        MBMaster::reply_cb_t cb;
+    };
+
+    MBMaster *mb;
+    std::vector<entry_t> queued;
+    uint32_t window;
+    uint16_t gap = MBPLAN_MAX_GAP;
+    uint32_t requests = 0;              // read requests accepted
+    uint32_t transactions = 0;          // read transactions submitted to master
+    TimerHandle_t t_flush = nullptr;
+    SemaphoreHandle_t lock;
+
+    // submit a group of requests as one transaction
+    bool dispatch(std::vector<entry_t> &&group, uint16_t reg, uint16_t cnt);
+
+    static void timerRunner(TimerHandle_t xTimer){
+        if (!xTimer) return;
+        MBReadPlanner* p = reinterpret_cast<MBReadPlanner*>(pvTimerGetTimerID(xTimer));
+        if (p) p->flush();
+    }
+
+public:
+    /**
+     * @brief Construct a new read planner
+     *
+     * @param master - Modbus master to submit transactions to
+     * @param window_ms - coalescing window, 0 - no timer, flush() must be called manually
+     */
+    MBReadPlanner(MBMaster *master, uint32_t window_ms = MBPLAN_WINDOW);
+    ~MBReadPlanner();
+
+    // Copy semantics : forbidden
+    MBReadPlanner(const MBReadPlanner&) = delete;
+    MBReadPlanner& operator=(const MBReadPlanner&) = delete;
+
+    /**
+     * @brief queue request
+     * read requests are queued until window expires, other requests are submitted immediately
+     *
+     * @param rq - request
+     * @param cb - reply call-back
+     * @return true if request has been accepted
+     * @return false if request is invalid or too many requests are queued
+     */
+    bool submit(const mbrtu::request &rq, MBMaster::reply_cb_t cb);
+
+    /**
+     * @brief merge queued requests and submit transactions to master
+     *
+     * @return size_t - number of transactions submitted
+     */
+    size_t flush();
+
+    /**
+     * @brief set max gap between ranges to be merged
+     * reading a few unrequested registers is usually cheaper than a separate transaction
+     *
+     * @param regs - number of registers/coils
+     */
+    void setMaxGap(uint16_t regs){ gap = regs; }
+
+    /**
+     * @brief number of read requests accepted
+     */
+    uint32_t getRequests() const { return requests; }
+
+    /**
+     * @brief number of read transactions submitted to master
+     */
+    uint32_t getTransactions() const { return transactions; }
+};
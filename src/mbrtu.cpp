@@ -0,0 +1,347 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mbrtu.hpp"
+
+#define MBRTU_ADDR_MAX          247     // max slave address, 0 is broadcast
+#define MBRTU_EXCEPTION_LEN     5       // addr + fc + code + CRC16
+
+namespace mbrtu {
+
+static request make(uint8_t addr, uint8_t fc, uint16_t reg, uint16_t cnt){
+    request rq;
+    rq.addr = addr;
+    rq.fc = fc;
+    rq.reg = reg;
+    rq.cnt = cnt;
+    return rq;
+}
+
+request read_coils(uint8_t addr, uint16_t reg, uint16_t cnt){ return make(addr, MBRTU_FC_READ_COILS, reg, cnt); }
+request read_discrete(uint8_t addr, uint16_t reg, uint16_t cnt){ return make(addr, MBRTU_FC_READ_DISCRETE, reg, cnt); }
+request read_holding(uint8_t addr, uint16_t reg, uint16_t cnt){ return make(addr, MBRTU_FC_READ_HOLDING, reg, cnt); }
+request read_input(uint8_t addr, uint16_t reg, uint16_t cnt){ return make(addr, MBRTU_FC_READ_INPUT, reg, cnt); }
+
+request write_coil(uint8_t addr, uint16_t reg, bool value){
+    request rq = make(addr, MBRTU_FC_WRITE_COIL, reg, 1);
+    rq.payload = { static_cast<uint8_t>(value ? 0xff : 0), 0 };
+    return rq;
+}
+
+request write_register(uint8_t addr, uint16_t reg, uint16_t value){
+    request rq = make(addr, MBRTU_FC_WRITE_REG, reg, 1);
+    rq.payload = { static_cast<uint8_t>(value >> 8), static_cast<uint8_t>(value & 0xff) };
+    return rq;
+}
+
+request write_coils(uint8_t addr, uint16_t reg, uint16_t cnt, const uint8_t *bits){
+    request rq = make(addr, MBRTU_FC_WRITE_COILS, reg, cnt);
+    if (bits)
+        rq.payload.assign(bits, bits + (cnt + 7) / 8);
+    return rq;
+}
+
+request write_registers(uint8_t addr, uint16_t reg, uint16_t cnt, const uint16_t *values){
+    request rq = make(addr, MBRTU_FC_WRITE_REGS, reg, cnt);
+    if (values){
+        rq.payload.resize(cnt * 2);
+        for (uint16_t i = 0; i != cnt; ++i)
+            *(uint16_t*)&rq.payload[i * 2] = __builtin_bswap16(values[i]);
+    }
+    return rq;
+}
+
+bool request::valid() const {
+    if (addr > MBRTU_ADDR_MAX)
+        return false;
+
+    switch (fc){
+        case MBRTU_FC_READ_COILS :
+        case MBRTU_FC_READ_DISCRETE :
+            return addr && cnt && cnt <= MBRTU_MAX_READ_BITS && payload.empty();
+        case MBRTU_FC_READ_HOLDING :
+        case MBRTU_FC_READ_INPUT :
+            return addr && cnt && cnt <= MBRTU_MAX_READ_REGS && payload.empty();
+        case MBRTU_FC_WRITE_COIL :
+        case MBRTU_FC_WRITE_REG :
+            return payload.size() == 2;
+        case MBRTU_FC_WRITE_COILS :
+            return cnt && cnt <= MBRTU_MAX_WRITE_BITS && payload.size() == (cnt + 7u) / 8;
+        case MBRTU_FC_WRITE_REGS :
+            return cnt && cnt <= MBRTU_MAX_WRITE_REGS && payload.size() == cnt * 2u;
+        default:
+            return false;
+    }
+}
+
+size_t request::replyLen() const {
+    switch (fc){
+        case MBRTU_FC_READ_COILS :
+        case MBRTU_FC_READ_DISCRETE :
+            return 5 + (cnt + 7) / 8;
+        case MBRTU_FC_READ_HOLDING :
+        case MBRTU_FC_READ_INPUT :
+            return 5 + cnt * 2;
+        default:
+            return 8;           // writes echo address and value/count
+    }
+}
+
+TX_msg* request::frame() const {
+    if (!valid())
+        return nullptr;
+
+    bool multi = fc == MBRTU_FC_WRITE_COILS || fc == MBRTU_FC_WRITE_REGS;
+    size_t len = multi ? 9 + payload.size() : 8;
+    TX_msg *msg = new TX_msg(len, addr != 0);       // there is no reply for broadcasts
+    if (!msg || !msg->data){
+        delete msg;
+        return nullptr;
+    }
+
+    msg->data[0] = addr;
+    msg->data[1] = fc;
+    *(uint16_t*)&msg->data[2] = __builtin_bswap16(reg);
+    if (fc == MBRTU_FC_WRITE_COIL || fc == MBRTU_FC_WRITE_REG)
+        memcpy(&msg->data[4], payload.data(), 2);
+    else
+        *(uint16_t*)&msg->data[4] = __builtin_bswap16(cnt);
+
+    if (multi){
+        msg->data[6] = payload.size();
+        memcpy(&msg->data[7], payload.data(), payload.size());
+    }
+
+    modbus::setcrc16(msg->data, len);
+    return msg;
+}
+
+void decode(const request &rq, const uint8_t *frame, size_t len, reply &r){
+    r.addr = rq.addr;
+    r.fc = rq.fc;
+    r.reg = rq.reg;
+    r.cnt = rq.cnt;
+    r.data = nullptr;
+    r.len = 0;
+    r.exception = 0;
+
+    if (len < MBRTU_EXCEPTION_LEN || frame[0] != rq.addr){
+        r.status = status_t::frame;
+        return;
+    }
+
+    if (!modbus::checkcrc16(frame, len)){
+        r.status = status_t::crc;
+        return;
+    }
+
+    if (frame[1] == (rq.fc | MBRTU_FC_EXCEPTION) && len == MBRTU_EXCEPTION_LEN){
+        r.status = status_t::exception;
+        r.exception = frame[2];
+        return;
+    }
+
+    if (frame[1] != rq.fc || len != rq.replyLen()){
+        r.status = status_t::frame;
+        return;
+    }
+
+    switch (rq.fc){
+        case MBRTU_FC_READ_COILS :
+        case MBRTU_FC_READ_DISCRETE :
+        case MBRTU_FC_READ_HOLDING :
+        case MBRTU_FC_READ_INPUT :
+            if (frame[2] != len - 5){
+                r.status = status_t::frame;
+                return;
+            }
+            r.data = &frame[3];
+            r.len = frame[2];
+            break;
+        case MBRTU_FC_WRITE_COIL :
+        case MBRTU_FC_WRITE_REG :
+            // echo of the request
+            if (__builtin_bswap16(*(uint16_t*)&frame[2]) != rq.reg || memcmp(&frame[4], rq.payload.data(), 2)){
+                r.status = status_t::frame;
+                return;
+            }
+            break;
+        default:
+            if (__builtin_bswap16(*(uint16_t*)&frame[2]) != rq.reg || __builtin_bswap16(*(uint16_t*)&frame[4]) != rq.cnt){
+                r.status = status_t::frame;
+                return;
+            }
+    }
+
+    r.status = status_t::ok;
+}
+
+}   // namespace mbrtu
+
+
+// ****  MBMaster  **** //
+
+MBMaster::MBMaster(MsgQ *mq) : q(mq) {
+    lock = xSemaphoreCreateMutex();
+}
+
+MBMaster::~MBMaster(){
+    vSemaphoreDelete(lock);
+}
+
+bool MBMaster::submit(const mbrtu::request &rq, reply_cb_t cb){
+    TX_msg *msg = rq.frame();
+    if (!msg || !q){
+        delete msg;
+        return false;
+    }
+
+    expire();
+
+    if (!rq.addr){
+        // broadcast, there would be no reply
+        if (!q->txenqueue(msg))
+            return false;
+        if (cb){
+            mbrtu::reply r;
+            decode(rq, nullptr, 0, r);
+            r.status = mbrtu::status_t::ok;
+            cb(r);
+        }
+        return true;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (inflight.size() >= MBRTU_MAX_INFLIGHT){
+        xSemaphoreGive(lock);
+        delete msg;
+        return false;
+    }
+
+    // request must be registered before it is sent, reply could arrive any time after that
+    uint32_t id = ++seq;
+    inflight.push_back({rq, esp_timer_get_time(), std::move(cb), id});
+    xSemaphoreGive(lock);
+
+    // queue could be synchronous and feed the reply back to rx_sink() from within txenqueue()
+    if (q->txenqueue(msg))
+        return true;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto i = inflight.begin(); i != inflight.end(); ++i){
+        if (i->id == id){
+            inflight.erase(i);
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return false;
+}
+
+// complete request with timeout status
+static void notify_timeout(const mbrtu::request &rq, const MBMaster::reply_cb_t &cb){
+    if (!cb)
+        return;
+    mbrtu::reply r;
+    decode(rq, nullptr, 0, r);
+    r.status = mbrtu::status_t::timeout;
+    cb(r);
+}
+
+bool MBMaster::rx_sink(const RX_msg *m){
+    if (!m || !m->len)
+        return false;
+
+    expire();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (inflight.empty()){
+        flen = 0;
+        xSemaphoreGive(lock);
+        return false;
+    }
+
+    size_t n = m->len;
+    if (flen + n > sizeof(frame))
+        n = sizeof(frame) - flen;
+    memcpy(&frame[flen], m->rawdata, n);
+    flen += n;
+
+    // reply belongs to the oldest request with the same slave address, function code and reply length
+    bool known = false, more = false;
+    size_t idx = inflight.size();
+    if (flen >= 2){
+        bool exc = frame[1] & MBRTU_FC_EXCEPTION;
+        uint8_t fc = frame[1] & ~MBRTU_FC_EXCEPTION;
+        for (size_t i = 0; i != inflight.size(); ++i){
+            const auto &rq = inflight[i].rq;
+            if (rq.addr != frame[0] || rq.fc != fc)
+                continue;
+            known = true;
+            size_t expect = exc ? MBRTU_EXCEPTION_LEN : rq.replyLen();
+            if (flen == expect){
+                idx = i;
+                break;
+            }
+            more |= flen < expect;
+        }
+    } else
+        known = more = true;        // not enough data to tell
+
+    if (idx == inflight.size()){
+        if (!known || !more)
+            flen = 0;               // stray data or a frame of unexpected length, drop it
+        xSemaphoreGive(lock);
+        return known;               // either consumed as a part of the reply or dropped
+    }
+
+    // bus is serialized, so requests sent before this one won't get their replies anymore
+    std::vector<pending_t> missed;
+    for (size_t i = 0; i != idx; ++i)
+        missed.emplace_back(std::move(inflight[i]));
+    pending_t p = std::move(inflight[idx]);
+    inflight.erase(inflight.begin(), inflight.begin() + idx + 1);
+
+    // frame buffer could be reused by the next reply once the lock is released
+    uint8_t reply[MBRTU_ADU_MAX];
+    size_t len = flen;
+    memcpy(reply, frame, len);
+    flen = 0;
+    xSemaphoreGive(lock);
+
+    for (const auto &e : missed)
+        notify_timeout(e.rq, e.cb);
+
+    if (p.cb){
+        mbrtu::reply r;
+        decode(p.rq, reply, len, r);
+        p.cb(r);
+    }
+    return true;
+}
+
+size_t MBMaster::expire(){
+    std::vector<pending_t> expired;
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    while (!inflight.empty() && now - inflight.front().submit_us > timeout * 1000LL){
+        expired.emplace_back(std::move(inflight.front()));
+        inflight.pop_front();
+        flen = 0;
+    }
+    xSemaphoreGive(lock);
+
+    for (const auto &p : expired)
+        notify_timeout(p.rq, p.cb);
+    return expired.size();
+}
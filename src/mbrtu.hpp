@@ -0,0 +1,217 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "msgq.hpp"
+#include "freertos/semphr.h"
+#include <deque>
+#include <vector>
+
+#define MBRTU_FC_READ_COILS     0x01
+#define MBRTU_FC_READ_DISCRETE  0x02
+#define MBRTU_FC_READ_HOLDING   0x03
+#define MBRTU_FC_READ_INPUT     0x04
+#define MBRTU_FC_WRITE_COIL     0x05
+#define MBRTU_FC_WRITE_REG      0x06
+#define MBRTU_FC_WRITE_COILS    0x0F
+#define MBRTU_FC_WRITE_REGS     0x10
+#define MBRTU_FC_EXCEPTION      0x80    // exception flag in reply function code
+
+#define MBRTU_MAX_READ_REGS     125
+#define MBRTU_MAX_READ_BITS     2000
+#define MBRTU_MAX_WRITE_REGS    123
+#define MBRTU_MAX_WRITE_BITS    1968
+#define MBRTU_ADU_MAX           256     // max RTU frame size
+#define MBRTU_MAX_INFLIGHT      tx_msg_q_DEPTH  // max requests in flight per master
+#define MBRTU_TIMEOUT           1000    // ms, request expires if not answered in this time since it was submitted
+
+/**
+ * @brief generic Modbus-RTU requests and replies
+ */
+namespace mbrtu {
+
+enum class status_t : uint8_t {
+    ok = 0,
+    exception,          // slave replied with exception, see 'exception' code
+    timeout,            // no reply
+    crc,                // reply has bad CRC
+    frame,              // reply has unexpected length or content
+    invalid,            // request is malformed
+    busy                // request could not be enqueued
+};
+
+/**
+ * @brief request object
+ * use factory functions below to create requests
+ */
+struct request {
+    uint8_t addr = 0;
+    uint8_t fc = 0;
+    uint16_t reg = 0;                   // first register/coil address
+    uint16_t cnt = 0;                   // number of registers/coils
+    std::vector<uint8_t> payload;       // values for write requests, in MODBUS byte order / packed bits
+
+    /**
+     * @brief check request limits for it's function code
+     */
+    bool valid() const;
+
+    /**
+     * @brief build RTU frame
+     *
+     * @return TX_msg*, nullptr if request is not valid
+     */
+    TX_msg* frame() const;
+
+    /**
+     * @brief expected length of a normal reply frame, bytes
+     */
+    size_t replyLen() const;
+};
+
+request read_coils(uint8_t addr, uint16_t reg, uint16_t cnt);
+request read_discrete(uint8_t addr, uint16_t reg, uint16_t cnt);
+request read_holding(uint8_t addr, uint16_t reg, uint16_t cnt);
+request read_input(uint8_t addr, uint16_t reg, uint16_t cnt);
+request write_coil(uint8_t addr, uint16_t reg, bool value);
+request write_register(uint8_t addr, uint16_t reg, uint16_t value);
+// bits are packed LSB first, as in MODBUS frame
+request write_coils(uint8_t addr, uint16_t reg, uint16_t cnt, const uint8_t *bits);
+request write_registers(uint8_t addr, uint16_t reg, uint16_t cnt, const uint16_t *values);
+
+/**
+ * @brief decoded reply
+ */
+struct reply {
+    status_t status = status_t::timeout;
+    uint8_t exception = 0;              // exception code if status is 'exception'
+    uint8_t addr = 0;
+    uint8_t fc = 0;                     // request function code
+    uint16_t reg = 0;                   // request first register/coil
+    uint16_t cnt = 0;                   // request count
+    const uint8_t *data = nullptr;      // read reply payload, valid only within call-back
+    size_t len = 0;                     // payload length, bytes
+
+    /**
+     * @brief register value by it's index in reply to FC 03/04
+     */
+    uint16_t value(uint16_t idx) const { return idx * 2u + 2 <= len ? __builtin_bswap16(*(uint16_t*)&data[idx * 2]) : 0; }
+
+    /**
+     * @brief coil/input state by it's index in reply to FC 01/02
+     */
+    bool bit(uint16_t idx) const { return idx / 8u < len && (data[idx / 8] >> (idx % 8) & 1); }
+};
+
+/**
+ * @brief decode reply frame for a request
+ *
+ * @param rq - request
+ * @param frame - reply frame
+ * @param len - frame length
+ * @param r - reply object to fill in
+ */
+void decode(const request &rq, const uint8_t *frame, size_t len, reply &r);
+
+}   // namespace mbrtu
+
+
+/**
+ * @brief Modbus-RTU master
+ * Sends requests to the port's message queue, so they are serialized with all other traffic on the bus,
+ * i.e. PZEM polls of the pool sharing the same port are transmitted back-to-back with master requests.
+ * Any number of requests could be submitted without waiting for replies, reply is matched to the oldest request
+ * with the same slave address, function code and reply length. Requests sent before the matched one are completed
+ * with timeout status, their reply window on the bus has closed. Replies of unexpected length are dropped.
+ * Long replies that arrive in pieces are reassembled using expected reply length.
+ *
+ * RX messages must be fed to rx_sink(), for a pool port use PZPool::attach_stray_callback()
+ *
+ *  MBMaster mb(pool.getPortQueue(1));
+ *  pool.attach_stray_callback([&mb](uint8_t port, const RX_msg *m){ if (port == 1) mb.rx_sink(m); });
+ *  mb.submit(mbrtu::read_holding(10, 0, 4), [](const mbrtu::reply &r){ ... });
+ */
+class MBMaster {
+
+public:
+    typedef std::function<void (const mbrtu::reply &r)> reply_cb_t;
+
+private:
+    struct pending_t {
+        mbrtu::request rq;
+        int64_t submit_us;
+        reply_cb_t cb;
+        uint32_t id;                    // submission id
+    };
+
+    MsgQ *q;
+    std::deque<pending_t> inflight;
+    uint8_t frame[MBRTU_ADU_MAX];       // reassembly buffer
+    size_t flen = 0;                    // bytes in reassembly buffer
+    uint32_t timeout = MBRTU_TIMEOUT;
+    uint32_t seq = 0;                   // last submission id
+    SemaphoreHandle_t lock;
+
+public:
+    /**
+     * @brief Construct a new Modbus master
+     *
+     * @param mq - message queue to send requests to, i.e. port's queue
+     */
+    explicit MBMaster(MsgQ *mq);
+    ~MBMaster();
+
+    // Copy semantics : forbidden
+    MBMaster(const MBMaster&) = delete;
+    MBMaster& operator=(const MBMaster&) = delete;
+
+    /**
+     * @brief submit request
+     * call-back is called once reply is received or request has expired,
+     * broadcast requests (addr 0) are completed immediately after enqueueing
+     *
+     * @param rq - request
+     * @param cb - reply call-back, could be empty
+     * @return true if request has been enqueued
+     * @return false if request is invalid, too many requests in flight or port queue is full
+     */
+    bool submit(const mbrtu::request &rq, reply_cb_t cb);
+
+    /**
+     * @brief feed RX message
+     *
+     * @param m - RX message
+     * @return true if message has been consumed as a reply (or it's part)
+     */
+    bool rx_sink(const RX_msg *m);
+
+    /**
+     * @brief expire requests that were not answered in time
+     * it is called on each submit/rx, should be called periodically if bus is idle
+     *
+     * @return size_t - number of expired requests
+     */
+    size_t expire();
+
+    /**
+     * @brief set request timeout
+     *
+     * @param ms - time since submission
+     */
+    void setTimeout(uint32_t ms){ timeout = ms; }
+
+    /**
+     * @brief number of requests in flight
+     */
+    size_t pending() const { return inflight.size(); }
+};
@@ -0,0 +1,403 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mbtcp.hpp"
+#include "lwip/sockets.h"
+#ifdef ARDUINO
+#include "esp32-hal-log.h"
+#else
+#include "esp_log.h"
+#endif
+
+static const char *TAG_GW __attribute__((unused)) = "MBTCP";
+
+MBTCPGateway::MBTCPGateway(PZPool *_pool, uint16_t _port) : pool(_pool), port(_port) {
+    lock = xSemaphoreCreateMutex();
+    if (pool)
+        pool->attach_reply_hook([this](uint8_t id, const RX_msg *m){ on_reply(id, m); });
+}
+
+MBTCPGateway::~MBTCPGateway(){
+    stop();
+    if (pool)
+        pool->detach_reply_hook();
+    vSemaphoreDelete(lock);
+}
+
+bool MBTCPGateway::start(){
+    if (t_srv || !listen())
+        return false;
+
+    quit = false;
+    if (xTaskCreate(MBTCPGateway::srvTask, MBTCP_TASK_NAME, MBTCP_TASK_STACK, reinterpret_cast<void *>(this), MBTCP_TASK_PRIO, &t_srv) != pdPASS){
+        close(lsock);
+        lsock = -1;
+        t_srv = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool MBTCPGateway::listen(){
+    if (!pool)
+        return false;
+    if (lsock >= 0)
+        return true;
+
+    lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (lsock < 0)
+        return false;
+
+    int opt = 1;
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(lsock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(lsock, MBTCP_MAX_CLIENTS) != 0){
+        ESP_LOGE(TAG_GW, "can't listen on port %u", port);
+        close(lsock);
+        lsock = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void MBTCPGateway::stop(){
+    // task could hold the lock or be in the middle of a send, it exits once current poll() is done
+    if (t_srv){
+        quit = true;
+        while (t_srv)
+            vTaskDelay(1);
+    }
+
+    for (auto &c : clients)
+        client_close(c);
+
+    if (lsock >= 0){
+        close(lsock);
+        lsock = -1;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    fwd.clear();
+    xSemaphoreGive(lock);
+}
+
+void MBTCPGateway::setMaxAge(uint8_t unit, uint32_t ms){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto &i : unit_maxage){
+        if (i.first == unit){
+            i.second = ms;
+            xSemaphoreGive(lock);
+            return;
+        }
+    }
+    unit_maxage.emplace_back(unit, ms);
+    xSemaphoreGive(lock);
+}
+
+uint32_t MBTCPGateway::getMaxAge(uint8_t unit) const {
+    uint32_t age = maxage;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (const auto &i : unit_maxage){
+        if (i.first == unit){
+            age = i.second;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return age;
+}
+
+void MBTCPGateway::on_reply(uint8_t id, const RX_msg *m){
+    // RX path only stores the reply, response is sent by the server loop
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto &f : fwd){
+        if (!f.len && f.unit == id && (m->cmd & 0x7f) == f.fc && m->len <= sizeof(f.reply)){
+            memcpy(f.reply, m->rawdata, m->len);
+            f.len = m->len;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+size_t MBTCPGateway::forward(uint8_t unit, uint8_t fc, TX_msg *msg, uint8_t *resp, done_cb_t done){
+    if (!msg || !done){
+        delete msg;
+        return exception(resp, fc, MBEX_GW_PATH);
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (fwd.size() >= MBTCP_MAX_FWD){
+        xSemaphoreGive(lock);
+        delete msg;
+        return exception(resp, fc, MBEX_GW_PATH);
+    }
+
+    // request must be registered before it is sent, reply could arrive any time after that
+    fwd.emplace_back();
+    fwd_t &f = fwd.back();
+    f.unit = unit;
+    f.fc = fc;
+    memcpy(f.mbap, resp, MBTCP_MBAP_LEN);
+    f.deadline_us = esp_timer_get_time() + MBTCP_REPLY_TIMEOUT * 1000LL;
+    f.done = std::move(done);
+    xSemaphoreGive(lock);
+
+    // port queue could be synchronous and feed the reply to on_reply() from within txenqueue()
+    if (pool->txenqueue(unit, msg))
+        return 0;
+
+    // request is the newest one for the unit, so it is the last matching entry
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto i = fwd.rbegin(); i != fwd.rend(); ++i){
+        if (i->unit == unit && i->fc == fc && !i->len){
+            fwd.erase(std::next(i).base());
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return exception(resp, fc, MBEX_GW_PATH);
+}
+
+size_t MBTCPGateway::fwd_response(const fwd_t &f, uint8_t *resp) const {
+    memcpy(resp, f.mbap, MBTCP_MBAP_LEN);
+
+    if (!f.len)
+        return exception(resp, f.fc, MBEX_GW_TARGET);
+
+    if (f.reply[1] & 0x80)
+        return exception(resp, f.fc, f.reply[2]);       // device exception is passed as-is
+
+    // device reply PDU without address and CRC
+    size_t plen = f.len - 3;
+    memcpy(&resp[MBTCP_MBAP_LEN], &f.reply[1], plen);
+    *(uint16_t*)&resp[4] = __builtin_bswap16(plen + 1);
+    return MBTCP_MBAP_LEN + plen;
+}
+
+void MBTCPGateway::complete(){
+    std::vector<fwd_t> ready;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    for (auto i = fwd.begin(); i != fwd.end();){
+        if (i->len || now > i->deadline_us){
+            ready.emplace_back(std::move(*i));
+            i = fwd.erase(i);
+        } else
+            ++i;
+    }
+    xSemaphoreGive(lock);
+
+    uint8_t resp[MBTCP_ADU_MAX];
+    for (const auto &f : ready){
+        size_t rlen = fwd_response(f, resp);
+        f.done(resp, rlen);
+    }
+}
+
+void MBTCPGateway::poll(uint32_t timeout_ms){
+    if (lsock < 0){
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+        return;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!fwd.empty() && timeout_ms > MBTCP_FWD_POLL)
+        timeout_ms = MBTCP_FWD_POLL;        // replies are picked up on the RX path, poll for them
+    xSemaphoreGive(lock);
+
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(lsock, &rfds);
+    int maxfd = lsock;
+
+    for (const auto &c : clients){
+        if (c.fd < 0)
+            continue;
+        FD_SET(c.fd, &rfds);
+        if (c.fd > maxfd)
+            maxfd = c.fd;
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    if (select(maxfd + 1, &rfds, NULL, NULL, &tv) <= 0){
+        complete();
+        return;
+    }
+
+    if (FD_ISSET(lsock, &rfds)){
+        int fd = accept(lsock, NULL, NULL);
+        if (fd >= 0){
+            client_t *slot = nullptr;
+            for (auto &c : clients){
+                if (c.fd < 0){
+                    slot = &c;
+                    break;
+                }
+            }
+
+            if (slot){
+                int opt = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                slot->fd = fd;
+                slot->len = 0;
+                ++slot->gen;
+            } else {
+                ESP_LOGW(TAG_GW, "too many clients, connection rejected");
+                close(fd);
+            }
+        }
+    }
+
+    for (auto &c : clients){
+        if (c.fd >= 0 && FD_ISSET(c.fd, &rfds))
+            client_read(c);
+    }
+
+    complete();
+}
+
+void MBTCPGateway::client_close(client_t &c){
+    if (c.fd >= 0)
+        close(c.fd);
+    c.fd = -1;
+    c.len = 0;
+}
+
+void MBTCPGateway::client_read(client_t &c){
+    int n = recv(c.fd, c.buf + c.len, sizeof(c.buf) - c.len, 0);
+    if (n <= 0){
+        client_close(c);
+        return;
+    }
+    c.len += n;
+
+    uint8_t resp[MBTCP_ADU_MAX];
+
+    // process all complete ADUs in buffer, clients may pipeline requests
+    while (c.len >= MBTCP_MBAP_LEN){
+        size_t adu = 6 + __builtin_bswap16(*(uint16_t*)&c.buf[4]);
+        if (adu > sizeof(c.buf) || adu < MBTCP_MBAP_LEN + 1){
+            client_close(c);        // garbage on the line, drop the client
+            return;
+        }
+        if (c.len < adu)
+            return;                 // wait for the rest of the ADU
+
+        // forwarded request is answered once device replies, unless connection has been closed or reused meanwhile
+        client_t *cp = &c;
+        uint32_t gen = c.gen;
+        size_t rlen = process(c.buf, adu, resp, sizeof(resp), [cp, gen](const uint8_t *r, size_t len){
+            if (cp->fd >= 0 && cp->gen == gen)
+                send(cp->fd, r, len, 0);
+        });
+        if (rlen && send(c.fd, resp, rlen, 0) != static_cast<int>(rlen)){
+            client_close(c);
+            return;
+        }
+
+        c.len -= adu;
+        memmove(c.buf, c.buf + adu, c.len);
+    }
+}
+
+size_t MBTCPGateway::exception(uint8_t *resp, uint8_t fc, uint8_t code) const {
+    resp[4] = 0;
+    resp[5] = 3;        // unit + fc + code
+    resp[7] = fc | 0x80;
+    resp[8] = code;
+    return MBTCP_MBAP_LEN + 2;
+}
+
+size_t MBTCPGateway::process(const uint8_t *req, size_t len, uint8_t *resp, size_t rlen, done_cb_t done){
+    if (len < MBTCP_MBAP_LEN + 1 || rlen < MBTCP_MBAP_LEN + 2)
+        return 0;
+
+    // protocol id must be 0 for Modbus, declared length must match
+    if (req[2] || req[3] || static_cast<size_t>(6 + __builtin_bswap16(*(uint16_t*)&req[4])) != len)
+        return 0;
+
+    memcpy(resp, req, MBTCP_MBAP_LEN);      // transaction id, protocol id, unit id
+    const uint8_t unit = req[6];
+    const uint8_t *pdu = &req[MBTCP_MBAP_LEN];
+    const size_t pdulen = len - MBTCP_MBAP_LEN;
+    const uint8_t fc = pdu[0];
+
+    // reads are served from raw images only, writes need device address from state
+    if (fc == CMD_RHR || fc == CMD_RIR){
+        if (pdulen != 5)
+            return exception(resp, fc, MBEX_ILLEGAL_DATA);
+        return read_regs(pdu, resp, rlen, unit);
+    }
+
+    auto st = pool->getState(unit);
+    if (!st)
+        return exception(resp, fc, MBEX_GW_TARGET);
+
+    switch (fc){
+        case CMD_WSR : {
+            if (pdulen != 5)
+                return exception(resp, fc, MBEX_ILLEGAL_DATA);
+
+            uint16_t reg = __builtin_bswap16(*(uint16_t*)&pdu[1]);
+            uint16_t val = __builtin_bswap16(*(uint16_t*)&pdu[3]);
+            return forward(unit, fc, pzmbus::create_msg(CMD_WSR, reg, val, st->addr), resp, std::move(done));
+        }
+        case CMD_RST_ENRG :
+            return forward(unit, fc, pzmbus::cmd_energy_reset(st->addr), resp, std::move(done));
+        default:
+            return exception(resp, fc, MBEX_ILLEGAL_FUNC);
+    }
+}
+
+size_t MBTCPGateway::read_regs(const uint8_t *pdu, uint8_t *resp, size_t rlen, uint8_t unit) const {
+    const uint8_t fc = pdu[0];
+    const uint16_t start = __builtin_bswap16(*(uint16_t*)&pdu[1]);
+    const uint16_t cnt = __builtin_bswap16(*(uint16_t*)&pdu[3]);
+
+    if (!cnt || cnt > MBTCP_MAX_REGS || rlen < MBTCP_MBAP_LEN + 2 + cnt * 2u)
+        return exception(resp, fc, MBEX_ILLEGAL_DATA);
+
+    auto p = pool->getRegImage(unit, fc);
+    if (!p)
+        return exception(resp, fc, MBEX_GW_TARGET);
+
+    const pzmbus::regimage_t img = p->snapshot();     // image is updated by RX task
+
+    // freshness policy, reads are never forwarded to the bus
+    uint32_t age = getMaxAge(unit);
+    if (age && (!img.update_us || (esp_timer_get_time() - img.update_us)/1000 > age))
+        return exception(resp, fc, MBEX_GW_TARGET);
+
+    if (start < img.begin || start + cnt > img.begin + img.cnt())
+        return exception(resp, fc, MBEX_ILLEGAL_ADDR);
+
+    // image is kept in wire byte order, so it is copied as-is without decoding metrics
+    uint8_t *data = &resp[MBTCP_MBAP_LEN];
+    data[0] = fc;
+    data[1] = cnt * 2;
+    memcpy(&data[2], &img.data[(start - img.begin) * 2], cnt * 2);
+
+    uint16_t plen = 1 + 2 + cnt * 2;       // unit + fc + byte count + data
+    *(uint16_t*)&resp[4] = __builtin_bswap16(plen);
+    return 6 + plen;
+}
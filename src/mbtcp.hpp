@@ -0,0 +1,204 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include <deque>
+#include <vector>
+
+#define MBTCP_PORT              502     // default Modbus-TCP port
+#define MBTCP_MAX_CLIENTS       4       // max number of simultaneous client connections
+#define MBTCP_ADU_MAX           260     // max Modbus-TCP ADU size
+#define MBTCP_MBAP_LEN          7       // MBAP header size
+#define MBTCP_MAX_REGS          125     // max number of registers per read request
+#define MBTCP_SELECT_TIMEOUT    1000    // ms, server loop select() timeout
+#define MBTCP_FWD_POLL          10      // ms, server loop select() timeout while forwarded requests are pending
+#define MBTCP_REPLY_TIMEOUT     ((tx_msg_q_DEPTH + 1) * PZEM_UART_TIMEOUT)  // ms, wait for device reply to a forwarded request
+#define MBTCP_MAX_FWD           tx_msg_q_DEPTH  // max forwarded requests awaiting device reply
+#define MBTCP_FWD_REPLY_MAX     8       // longest device reply to a forwarded request, RTU frame
+
+#define MBTCP_TASK_PRIO         3
+#define MBTCP_TASK_STACK        4096
+#define MBTCP_TASK_NAME         "MBTCP_GW"
+
+// Modbus exception codes used by gateway
+#define MBEX_ILLEGAL_FUNC       0x01
+#define MBEX_ILLEGAL_ADDR       0x02
+#define MBEX_ILLEGAL_DATA       0x03
+#define MBEX_GW_PATH            0x0A    // Gateway path unavailable
+#define MBEX_GW_TARGET          0x0B    // Gateway target device failed to respond
+
+/**
+ * @brief Modbus-TCP server serving PZPool devices from cached data
+ * MBAP Unit ID addresses PZEM by it's id in a pool (NOT a modbus address).
+ * Read requests (FC03/FC04) are answered from the raw register images of the last replies
+ * received by pool polling, they never generate bus transactions, so any number of clients adds no bus load.
+ * Write requests (FC06) and energy reset (0x42) are forwarded to the bus and completed asynchronously,
+ * device's reply is picked up on the RX path with pool's reply hook (see PZPool::attach_reply_hook()) and is sent
+ * to the client by the server loop, so a slow or mute device does not stall other clients.
+ * If device does not reply within MBTCP_REPLY_TIMEOUT client gets 'gateway target failed to respond' exception.
+ *
+ * Freshness policy: each unit has a max data age, if cached data is older than that a read
+ * is answered with 'gateway target failed to respond' exception. Max age of 0 serves any data.
+ */
+class MBTCPGateway {
+
+public:
+    /**
+     * @brief completion of a forwarded request
+     * called from poll() with the response ADU
+     */
+    typedef std::function<void (const uint8_t *resp, size_t len)> done_cb_t;
+
+private:
+    struct client_t {
+        int fd = -1;
+        uint32_t gen = 0;               // connection generation, replies to a closed connection are dropped
+        size_t len = 0;                 // bytes in buffer
+        uint8_t buf[MBTCP_ADU_MAX];
+    };
+
+    // forwarded request awaiting device reply
+    struct fwd_t {
+        uint8_t unit;                   // awaited unit id
+        uint8_t fc;                     // awaited function code
+        uint8_t mbap[MBTCP_MBAP_LEN];   // request header
+        int64_t deadline_us;
+        size_t len = 0;                 // reply length, 0 - not received yet
+        uint8_t reply[MBTCP_FWD_REPLY_MAX];     // device reply, RTU frame
+        done_cb_t done;
+    };
+
+    PZPool *pool;
+    int lsock = -1;                     // listening socket
+    client_t clients[MBTCP_MAX_CLIENTS];
+    TaskHandle_t t_srv = nullptr;       // server task
+    volatile bool quit = false;         // server task must exit
+    uint32_t maxage = 2 * PZEM_REFRESH_PERIOD;                  // default max data age, ms
+    std::vector< std::pair<uint8_t, uint32_t> > unit_maxage;    // per-unit max data age, ms
+    std::deque<fwd_t> fwd;              // forwarded requests in order of submission
+
+    SemaphoreHandle_t lock;             // guards unit_maxage and forwarded requests
+
+    // static wrapper for Task to call server loop class member
+    static void srvTask(void* pvParams){
+        auto *self = reinterpret_cast<MBTCPGateway*>(pvParams);
+        while (!self->quit)
+            self->poll(MBTCP_SELECT_TIMEOUT);
+        self->t_srv = nullptr;
+        vTaskDelete(NULL);
+    }
+
+    // send responses to completed and expired forwarded requests
+    void complete();
+
+    void client_close(client_t &c);
+
+    void client_read(client_t &c);
+
+    size_t exception(uint8_t *resp, uint8_t fc, uint8_t code) const;
+
+    size_t read_regs(const uint8_t *pdu, uint8_t *resp, size_t rlen, uint8_t unit) const;
+
+    /**
+     * @brief send request to the unit, response is passed to 'done' once device replies or request expires
+     *
+     * @param msg - request, it is consumed
+     * @param resp - buffer for response ADU with MBAP header already filled in
+     * @return size_t - 0 if request has been forwarded, otherwise gateway exception response length
+     */
+    size_t forward(uint8_t unit, uint8_t fc, TX_msg *msg, uint8_t *resp, done_cb_t done);
+
+    // build response ADU from device reply
+    size_t fwd_response(const fwd_t &f, uint8_t *resp) const;
+
+    // pool reply hook
+    void on_reply(uint8_t id, const RX_msg *m);
+
+public:
+    const uint16_t port;                // TCP port to listen on
+
+    MBTCPGateway(PZPool *_pool, uint16_t _port = MBTCP_PORT);
+    ~MBTCPGateway();
+
+    // Copy semantics : forbidden
+    MBTCPGateway(const MBTCPGateway&) = delete;
+    MBTCPGateway& operator=(const MBTCPGateway&) = delete;
+
+    /**
+     * @brief open listening socket and start server task
+     *
+     * @return true on success
+     * @return false on any error or if server is already running
+     */
+    bool start();
+
+    /**
+     * @brief open listening socket only
+     * server loop must be run with poll(), i.e. on a host without server task
+     *
+     * @return true on success or if socket is already open
+     */
+    bool listen();
+
+    /**
+     * @brief stop server task and close all connections
+     * task exits on it's own once current poll() iteration is complete, this call waits for that.
+     * Forwarded requests in flight are dropped
+     */
+    void stop();
+
+    /**
+     * @brief run one iteration of the server loop
+     * accept connections, serve client requests and send responses to forwarded requests
+     *
+     * @param timeout_ms - max time to wait for socket events, it is capped to MBTCP_FWD_POLL while forwarded requests are pending
+     */
+    void poll(uint32_t timeout_ms);
+
+    /**
+     * @brief set default max data age for read requests
+     *
+     * @param ms - max age in ms, 0 - serve any cached data
+     */
+    void setMaxAge(uint32_t ms){ maxage = ms; }
+
+    /**
+     * @brief set max data age for read requests to a specific unit
+     *
+     * @param unit - unit id (PZEM id in a pool)
+     * @param ms - max age in ms, 0 - serve any cached data
+     */
+    void setMaxAge(uint8_t unit, uint32_t ms);
+
+    /**
+     * @brief get max data age for a specific unit
+     */
+    uint32_t getMaxAge(uint8_t unit) const;
+
+    /**
+     * @brief process one Modbus-TCP request ADU and craft a reply
+     * it is used by the server loop, but could be called directly to serve requests from any other transport.
+     * Forwarded requests are completed asynchronously, response is passed to 'done' call-back from poll()
+     * once device replies or MBTCP_REPLY_TIMEOUT expires. Without a call-back they are answered with
+     * 'gateway path unavailable' exception
+     *
+     * @param req - request ADU, starting with MBAP header
+     * @param len - request length
+     * @param resp - buffer for response ADU
+     * @param rlen - response buffer size, MBTCP_ADU_MAX is always enough
+     * @param done - completion call-back for forwarded requests
+     * @return size_t - response length, 0 if request is malformed or forwarded and no reply should be sent now
+     */
+    size_t process(const uint8_t *req, size_t len, uint8_t *resp, size_t rlen, done_cb_t done = nullptr);
+};
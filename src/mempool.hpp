@@ -0,0 +1,111 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief pool counters
+ */
+struct mempool_stats_t {
+    size_t size = 0;            // block size, bytes
+    size_t capacity = 0;        // number of blocks
+    size_t used = 0;            // blocks in use
+    size_t peak = 0;            // max blocks in use
+    uint32_t fails = 0;         // failed allocations, pool exhausted or request is larger than a block
+};
+
+/**
+ * @brief fixed-block memory pool with in-place storage
+ * Blocks are handed out from a free list, alloc and free are O(1) and never touch the heap,
+ * so pool object could be placed in static memory and used after init in heap-free builds.
+ * Thread-safe, must not be used from ISR.
+ *
+ * @tparam BLOCK - block size, bytes
+ * @tparam COUNT - number of blocks
+ */
+template <size_t BLOCK, size_t COUNT>
+class FixedPool {
+    union block_t {
+        block_t *next;
+        alignas(8) uint8_t data[BLOCK];
+    };
+
+    block_t blocks[COUNT];
+    block_t *head = nullptr;
+    mempool_stats_t stats;
+    StaticSemaphore_t lock_buf;
+    SemaphoreHandle_t lock;
+
+public:
+    FixedPool(){
+        lock = xSemaphoreCreateMutexStatic(&lock_buf);
+        for (size_t i = COUNT; i; --i){
+            blocks[i - 1].next = head;
+            head = &blocks[i - 1];
+        }
+        stats.size = BLOCK;
+        stats.capacity = COUNT;
+    }
+
+    ~FixedPool(){ vSemaphoreDelete(lock); }
+
+    // Copy semantics : forbidden
+    FixedPool(const FixedPool&) = delete;
+    FixedPool& operator=(const FixedPool&) = delete;
+
+    /**
+     * @brief take a block
+     *
+     * @param len - requested size, must not exceed block size
+     * @return void* - block or nullptr if pool is exhausted
+     */
+    void* alloc(size_t len){
+        xSemaphoreTake(lock, portMAX_DELAY);
+        block_t *b = len <= BLOCK ? head : nullptr;
+        if (b){
+            head = b->next;
+            if (++stats.used > stats.peak)
+                stats.peak = stats.used;
+        } else
+            ++stats.fails;
+        xSemaphoreGive(lock);
+        return b;
+    }
+
+    /**
+     * @brief return a block to the pool
+     * nullptr is ignored
+     */
+    void free(void *p){
+        if (!p)
+            return;
+
+        block_t *b = static_cast<block_t*>(p);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        b->next = head;
+        head = b;
+        --stats.used;
+        xSemaphoreGive(lock);
+    }
+
+    /**
+     * @brief check if pointer belongs to the pool
+     */
+    bool owns(const void *p) const { return p >= &blocks[0] && p < &blocks[COUNT]; }
+
+    const mempool_stats_t& getStats() const { return stats; }
+};
@@ -0,0 +1,99 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "memstat.hpp"
+
+#ifdef PZEM_EDL_MEMSTAT
+#include "esp_timer.h"
+#include <atomic>
+#endif
+
+namespace memstat {
+
+static const char* const names[] = { "uartq", "msg", "pool", "series" };
+
+const char* name(tag_t tag){
+    return tag < tag_t::count ? names[static_cast<uint8_t>(tag)] : "";
+}
+
+#ifdef PZEM_EDL_MEMSTAT
+
+struct counter_t {
+    std::atomic<size_t> live{0};
+    std::atomic<size_t> peak{0};
+    std::atomic<size_t> psram{0};
+    std::atomic<uint32_t> allocs{0};
+    std::atomic<uint32_t> frees{0};
+    // rate sampling, touched by get() only
+    uint32_t last_allocs = 0;
+    int64_t last_us = 0;
+    float rate = 0;
+};
+
+static counter_t counters[static_cast<uint8_t>(tag_t::count)];
+
+void alloc(tag_t tag, size_t size, bool psram){
+    if (tag >= tag_t::count)
+        return;
+
+    counter_t &c = counters[static_cast<uint8_t>(tag)];
+    size_t live = c.live.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t peak = c.peak.load(std::memory_order_relaxed);
+    while (live > peak && !c.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+    if (psram)
+        c.psram.fetch_add(size, std::memory_order_relaxed);
+    c.allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void release(tag_t tag, size_t size, bool psram){
+    if (tag >= tag_t::count)
+        return;
+
+    counter_t &c = counters[static_cast<uint8_t>(tag)];
+    c.live.fetch_sub(size, std::memory_order_relaxed);
+    if (psram)
+        c.psram.fetch_sub(size, std::memory_order_relaxed);
+    c.frees.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool get(tag_t tag, stats_t &s){
+    if (tag >= tag_t::count)
+        return false;
+
+    counter_t &c = counters[static_cast<uint8_t>(tag)];
+    s.live = c.live.load(std::memory_order_relaxed);
+    s.peak = c.peak.load(std::memory_order_relaxed);
+    s.psram = c.psram.load(std::memory_order_relaxed);
+    s.allocs = c.allocs.load(std::memory_order_relaxed);
+    s.frees = c.frees.load(std::memory_order_relaxed);
+
+    int64_t now = esp_timer_get_time();
+    if (!c.last_us){
+        c.last_us = now;
+        c.last_allocs = s.allocs;
+    } else if (now - c.last_us >= MEMSTAT_RATE_PERIOD){
+        c.rate = (s.allocs - c.last_allocs) * 1e6f / (now - c.last_us);
+        c.last_us = now;
+        c.last_allocs = s.allocs;
+    }
+    s.rate = c.rate;
+    return true;
+}
+
+void resetPeak(){
+    for (auto &c : counters)
+        c.peak.store(c.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+#endif  // PZEM_EDL_MEMSTAT
+
+}   // namespace memstat
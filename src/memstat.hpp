@@ -0,0 +1,140 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <new>
+
+#define MEMSTAT_RATE_PERIOD     1000000 // us, min interval to average allocation rate over
+
+/*
+ PZEM_EDL_MEMSTAT build flag - heap accounting per library subsystem.
+ Allocations made by UartQ, message objects and buffers, PZPool nodes and RingBuff/TSContainer storage
+ are tagged and counted, see memstat::get(). Without the flag all hooks are no-ops and tagged allocators
+ are plain std::allocator.
+*/
+namespace memstat {
+
+/**
+ * @brief subsystems accounted
+ */
+enum class tag_t : uint8_t {
+    uartq = 0,      // UartQ objects, UART driver buffers, queues and task stacks
+    msg,            // TX/RX message objects and data buffers
+    pool,           // PZPool topology, nodes, ports and PZEM objects
+    series,         // RingBuff storage, TimeSeries objects and TSContainer chain
+    count
+};
+
+/**
+ * @brief subsystem counters
+ */
+struct stats_t {
+    size_t live = 0;            // bytes allocated now
+    size_t peak = 0;            // max bytes allocated
+    size_t psram = 0;           // bytes of 'live' placed in PSRAM
+    uint32_t allocs = 0;        // allocations made, wraps around on overflow
+    uint32_t frees = 0;         // releases made, wraps around on overflow
+    float rate = 0;             // allocations per second, averaged between get() calls
+};
+
+/**
+ * @brief subsystem mnemonic name
+ */
+const char* name(tag_t tag);
+
+#ifdef PZEM_EDL_MEMSTAT
+/**
+ * @brief account an allocation
+ * lock-free, could be called from any task
+ *
+ * @param tag - subsystem
+ * @param size - bytes allocated
+ * @param psram - memory is in PSRAM
+ */
+void alloc(tag_t tag, size_t size, bool psram = false);
+
+/**
+ * @brief account a release, size and psram must match the ones passed to alloc()
+ */
+void release(tag_t tag, size_t size, bool psram = false);
+
+/**
+ * @brief read subsystem counters
+ * allocation rate is averaged over the time passed since the previous call, but not less than MEMSTAT_RATE_PERIOD,
+ * so it should be polled from one task only
+ *
+ * @return true - counters read
+ * @return false - wrong tag or accounting is disabled
+ */
+bool get(tag_t tag, stats_t &s);
+
+/**
+ * @brief reset peak values to current live bytes
+ */
+void resetPeak();
+
+/**
+ * @brief std allocator that accounts memory under a tag
+ * could be used with containers and std::allocate_shared()
+ */
+template <class T, tag_t TAG>
+struct allocator {
+    typedef T value_type;
+
+    template <class U>
+    struct rebind { typedef allocator<U, TAG> other; };
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U, TAG>&) noexcept {}
+
+    T* allocate(size_t n){
+        T *p = std::allocator<T>().allocate(n);
+        memstat::alloc(TAG, n * sizeof(T));
+        return p;
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+        std::allocator<T>().deallocate(p, n);
+        memstat::release(TAG, n * sizeof(T));
+    }
+
+    template <class U>
+    bool operator==(const allocator<U, TAG>&) const noexcept { return true; }
+    template <class U>
+    bool operator!=(const allocator<U, TAG>&) const noexcept { return false; }
+};
+
+// class operators new/delete that account objects under a tag
+#define MEMSTAT_CLASS(tag) \
+    static void* operator new(size_t size){ memstat::alloc(tag, size); return ::operator new(size); } \
+    static void* operator new(size_t size, const std::nothrow_t&) noexcept { void *p = ::operator new(size, std::nothrow); if (p) memstat::alloc(tag, size); return p; } \
+    static void operator delete(void *p, size_t size) noexcept { memstat::release(tag, size); ::operator delete(p); }
+
+#else
+inline void alloc(tag_t, size_t, bool = false){}
+inline void release(tag_t, size_t, bool = false){}
+inline bool get(tag_t, stats_t&){ return false; }
+inline void resetPeak(){}
+
+template <class T, tag_t TAG>
+using allocator = std::allocator<T>;
+
+#define MEMSTAT_CLASS(tag)
+#endif
+
+}   // namespace memstat
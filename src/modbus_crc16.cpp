@@ -66,4 +66,39 @@ bool checkcrc16(const uint8_t *data, uint16_t len){
     return *(uint16_t*)&data[len-2] == crc16(data, len - 2);
 }
 
+size_t reply_len(const uint8_t *req, size_t len){
+    if (!req || len < 4)
+        return 0;
+
+    uint16_t cnt = len < 8 ? 0 : req[4] << 8 | req[5];
+    switch (req[1]){
+        case 0x01 :     // read coils
+        case 0x02 :     // read discrete inputs
+            return len < 8 ? 0 : 5 + (cnt + 7) / 8;
+        case 0x03 :     // read holding registers
+        case 0x04 :     // read input registers
+            return len < 8 ? 0 : 5 + cnt * 2;
+        case 0x05 :     // write single coil
+        case 0x06 :     // write single register
+        case 0x0F :     // write multiple coils
+        case 0x10 :     // write multiple registers
+            return len < 8 ? 0 : 8;     // echo of address and value/count
+        case 0x42 :     // PZEM energy reset
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+bool reply_complete(const uint8_t *frame, size_t len, size_t expect){
+    if (!expect)
+        return len;
+
+    // exception reply: addr + (fc | 0x80) + code + CRC16
+    if (len >= 5 && (frame[1] & 0x80))
+        return true;
+
+    return len >= expect;
+}
+
 }   // namespace modbus
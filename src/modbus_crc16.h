@@ -36,4 +36,24 @@ bool checkcrc16(const uint8_t *buf, uint16_t len);
  */
 void setcrc16(uint8_t *data, uint16_t len);
 
+/**
+ * @brief expected length of a normal reply to RTU request frame
+ * standard function codes 01..06, 0F, 10 and PZEM energy reset (0x42) are known
+ *
+ * @param req - request frame
+ * @param len - request frame length
+ * @return size_t - reply length, 0 if it is unknown
+ */
+size_t reply_len(const uint8_t *req, size_t len);
+
+/**
+ * @brief check if RTU reply is complete
+ * reply is complete once it has expected length or it is an exception frame (5 bytes)
+ *
+ * @param frame - reply data received so far
+ * @param len - data length
+ * @param expect - expected reply length, see reply_len(), 0 - unknown, any data is complete
+ */
+bool reply_complete(const uint8_t *frame, size_t len, size_t expect);
+
 }   // namespace modbus
\ No newline at end of file
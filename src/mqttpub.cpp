@@ -0,0 +1,252 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "mqttpub.hpp"
+
+#define MQTTPUB_METERS          8       // number of meter_t fields
+
+MQTTBatcher::MQTTBatcher() : payload(new char[MQTTPUB_PAYLOAD_MAX]) {
+    lock = xSemaphoreCreateMutex();
+    publock = xSemaphoreCreateMutex();
+}
+
+MQTTBatcher::~MQTTBatcher(){
+    stop();
+    vSemaphoreDelete(publock);
+    vSemaphoreDelete(lock);
+}
+
+void MQTTBatcher::attach_publisher(publish_t f){
+    if (!f)
+        return;
+
+    xSemaphoreTake(publock, portMAX_DELAY);
+    publisher = std::move(f);
+    xSemaphoreGive(publock);
+}
+
+void MQTTBatcher::detach_publisher(){
+    xSemaphoreTake(publock, portMAX_DELAY);
+    publisher = nullptr;
+    xSemaphoreGive(publock);
+}
+
+MQTTBatcher::slot_t* MQTTBatcher::slot(uint8_t id){
+    for (auto &s : slots)
+        if (s.id == id)
+            return &s;
+
+    slot_t s;
+    s.id = id;
+    slots.push_back(s);
+    return &slots.back();
+}
+
+void MQTTBatcher::setTopic(uint8_t group, const char *topic){
+    if (!topic)
+        return;
+
+    xSemaphoreTake(publock, portMAX_DELAY);
+    auto t = std::unique_ptr<char[]>(strcpy(new char[strlen(topic) + 1], topic));
+    for (auto &g : groups){
+        if (g.id == group){
+            g.topic = std::move(t);
+            xSemaphoreGive(publock);
+            return;
+        }
+    }
+    groups.push_back({group, std::move(t)});
+    xSemaphoreGive(publock);
+}
+
+const char* MQTTBatcher::topic(uint8_t group) const {
+    for (const auto &g : groups)
+        if (g.id == group)
+            return g.topic.get();
+
+    return group ? nullptr : MQTTPUB_TOPIC;
+}
+
+void MQTTBatcher::setGroup(uint8_t id, uint8_t group){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    slot(id)->group = group;
+    xSemaphoreGive(lock);
+}
+
+void MQTTBatcher::push(uint8_t id, const pzmbus::metrics &m){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    slot_t *s = slot(id);
+    if (s->dirty)
+        ++dropped;
+
+    s->mask = 0;
+    for (uint8_t i = 0; i != MQTTPUB_METERS; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        s->dec[i] = m.decimals(meter);
+        if (s->dec[i] < 0)
+            continue;
+        s->raw[i] = m.asRaw(meter);
+        s->mask |= 1 << i;
+    }
+    s->update_us = esp_timer_get_time();
+    s->dirty = true;
+    xSemaphoreGive(lock);
+}
+
+size_t MQTTBatcher::pending() const {
+    size_t n = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (const auto &s : slots)
+        if (s.dirty)
+            ++n;
+    xSemaphoreGive(lock);
+    return n;
+}
+
+bool MQTTBatcher::publish_group(uint8_t group, int64_t cutoff){
+    const char *t = topic(group);
+    char *buf = payload.get();
+    size_t len = 0;
+    bool overflow = false;
+    JsonWriter w([buf, &len, &overflow](const char *data, size_t n){
+        if (len + n > MQTTPUB_PAYLOAD_MAX){
+            overflow = true;
+            return false;
+        }
+        memcpy(&buf[len], data, n);
+        len += n;
+        return true;
+    });
+
+    // slots are picked by id and sample time, a slot updated while publishing stays dirty
+    uint8_t ids[MQTTPUB_BATCH_MAX];
+    int64_t stamps[MQTTPUB_BATCH_MAX];
+    size_t cnt = 0;
+    int64_t now = esp_timer_get_time();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    w.beginObject();
+    w.key("meters").beginArray();
+    for (auto &s : slots){
+        if (!s.dirty || s.group != group || s.update_us > cutoff)
+            continue;
+
+        w.beginObject();
+        w.key("id").value(static_cast<uint32_t>(s.id));
+        w.key("age").value((now - s.update_us) / 1000);
+        for (uint8_t i = 0; i != MQTTPUB_METERS; ++i){
+            auto meter = static_cast<pzmbus::meter_t>(i);
+            if (!(s.mask & (1 << i)) || !textfmt::selected(fields, meter))
+                continue;
+            w.key(textfmt::meter_name(meter)).fixed(s.raw[i], s.dec[i]);
+        }
+        w.endObject();
+
+        ids[cnt] = s.id;
+        stamps[cnt++] = s.update_us;
+        if (cnt == MQTTPUB_BATCH_MAX)
+            break;
+    }
+    w.endArray();
+    w.endObject();
+    xSemaphoreGive(lock);
+    w.flush();
+
+    bool discard = !t || overflow;
+    if (discard)
+        // topic is not set for the group or payload does not fit, samples are discarded
+        ESP_LOGW(TAG, "can't publish group %u", group);
+    else if (!publisher(t, buf, len))
+        return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto &s : slots){
+        for (size_t i = 0; i != cnt; ++i){
+            if (s.id == ids[i] && s.update_us == stamps[i]){
+                s.dirty = false;
+                break;
+            }
+        }
+    }
+    if (discard)
+        dropped += cnt;
+    else
+        ++published;
+    xSemaphoreGive(lock);
+    return true;
+}
+
+size_t MQTTBatcher::service(){
+    xSemaphoreTake(publock, portMAX_DELAY);
+    if (!publisher){
+        xSemaphoreGive(publock);
+        return 0;
+    }
+
+    uint32_t before = published;
+    // samples pushed while publishing are left for the next run
+    int64_t cutoff = esp_timer_get_time();
+    // groups are published in order of meters, each round takes up to MQTTPUB_BATCH_MAX meters of a group
+    for (;;){
+        bool found = false;
+        uint8_t group = 0;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        for (const auto &s : slots){
+            if (s.dirty && s.update_us <= cutoff){
+                group = s.group;
+                found = true;
+                break;
+            }
+        }
+        xSemaphoreGive(lock);
+
+        // transport is busy, pending samples will be published on next run
+        if (!found || !publish_group(group, cutoff))
+            break;
+    }
+    xSemaphoreGive(publock);
+
+    return published - before;
+}
+
+void MQTTBatcher::run(){
+    int64_t due = esp_timer_get_time() + interval * 1000LL;
+    while (!quit){
+        int64_t now = esp_timer_get_time();
+        if (now < due){
+            // sleep in short slices to notice stop() request
+            uint32_t ms = (due - now) / 1000;
+            vTaskDelay(pdMS_TO_TICKS(ms < MQTTPUB_STOP_POLL ? ms + 1 : MQTTPUB_STOP_POLL));
+            continue;
+        }
+        service();
+        due = esp_timer_get_time() + interval * 1000LL;
+    }
+}
+
+bool MQTTBatcher::start(uint32_t ms){
+    interval = ms;
+    if (t_pub)
+        return true;
+
+    quit = false;
+    return xTaskCreate(MQTTBatcher::pubTask, MQTTPUB_TASK_NAME, MQTTPUB_TASK_STACK, reinterpret_cast<void *>(this), MQTTPUB_TASK_PRIO, &t_pub) == pdPASS;
+}
+
+void MQTTBatcher::stop(){
+    if (!t_pub)
+        return;
+
+    quit = true;
+    while (t_pub)
+        vTaskDelay(1);
+}
@@ -0,0 +1,192 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "jsonw.hpp"
+#include "freertos/semphr.h"
+#include <vector>
+
+#define MQTTPUB_TOPIC           "pzem/batch"    // default topic for group 0
+#define MQTTPUB_PAYLOAD_MAX     2048            // max payload size, bytes
+#define MQTTPUB_BATCH_MAX       10              // max meters per payload, ~200 bytes of JSON per meter
+#define MQTTPUB_INTERVAL        5000            // default publish interval, ms
+#define MQTTPUB_STOP_POLL       100             // ms, max publisher task sleep between quit flag checks
+
+#define MQTTPUB_TASK_PRIO       1
+#define MQTTPUB_TASK_STACK      4096
+#define MQTTPUB_TASK_NAME       "MQTTpub"
+
+/**
+ * @brief batched MQTT publisher stage
+ * Collects meter updates (i.e. from PZPool rx call-back) and publishes them once per interval as one JSON
+ * payload per topic group instead of a message per meter:
+ *
+ *  {"meters":[{"id":1,"age":120,"voltage":230.1,"power":210.5,...},...]}
+ *
+ * Each meter has a single slot holding it's latest sample, so outbound backlog is bounded by the number
+ * of meters. If broker (publish call-back) is slow, pending samples are overwritten by newer ones from
+ * the same meter, i.e. older samples are dropped, never the newer.
+ * Publisher is transport agnostic, publish call-back could wrap esp-mqtt, PubSubClient, or any other client.
+ * Payloads are published from a dedicated task, so publish call-back is allowed to block on the network.
+ */
+class MQTTBatcher {
+
+public:
+    /**
+     * @brief publish call-back
+     * @param topic - topic string
+     * @param payload - JSON payload
+     * @param len - payload length
+     * @return true if message was accepted by transport, false if it is busy/disconnected (retry later)
+     */
+    typedef std::function<bool (const char *topic, const char *payload, size_t len)> publish_t;
+
+private:
+    struct slot_t {
+        uint8_t id;                         // PZEM id
+        uint8_t group = 0;                  // topic group
+        uint8_t mask = 0;                   // fields present
+        bool dirty = false;                 // not published yet
+        int64_t update_us = 0;              // sample time
+        uint32_t raw[8];                    // raw metric values
+        int8_t dec[8];                      // decimals for metric values
+    };
+
+    struct group_t {
+        uint8_t id;
+        std::unique_ptr<char[]> topic;
+    };
+
+    std::vector<slot_t> slots;
+    std::vector<group_t> groups;
+    publish_t publisher = nullptr;
+    uint8_t fields = TEXTFMT_METERS_ALL;
+    uint32_t interval = MQTTPUB_INTERVAL;
+    uint32_t published = 0;                 // number of payloads published
+    uint32_t dropped = 0;                   // number of samples overwritten before publishing
+    std::unique_ptr<char[]> payload;        // payload buffer, MQTTPUB_PAYLOAD_MAX
+    TaskHandle_t t_pub = nullptr;
+    volatile bool quit = false;             // publisher task must exit
+    SemaphoreHandle_t lock;                 // guards slots and counters
+    SemaphoreHandle_t publock;              // guards publisher, topics and payload buffer
+
+    slot_t* slot(uint8_t id);
+
+    const char* topic(uint8_t group) const;
+
+    // render and publish up to MQTTPUB_BATCH_MAX dirty slots of a group sampled not later than cutoff,
+    // return false if transport is busy. Slots are rendered under the lock, publisher is called without it
+    bool publish_group(uint8_t group, int64_t cutoff);
+
+    // publish once per interval until quit flag is set
+    void run();
+
+    // static wrapper for Task to call publisher loop
+    static void pubTask(void* pvParams){
+        auto *self = reinterpret_cast<MQTTBatcher*>(pvParams);
+        self->run();
+        self->t_pub = nullptr;
+        vTaskDelete(NULL);
+    }
+
+public:
+    MQTTBatcher();
+    ~MQTTBatcher();
+
+    // Copy semantics : forbidden
+    MQTTBatcher(const MQTTBatcher&) = delete;
+    MQTTBatcher& operator=(const MQTTBatcher&) = delete;
+
+    /**
+     * @brief attach publish call-back
+     *
+     * @param f callback function prototype: std::function<bool (const char *topic, const char *payload, size_t len)>
+     */
+    void attach_publisher(publish_t f);
+
+    /**
+     * @brief detach publish call-back
+     */
+    void detach_publisher();
+
+    /**
+     * @brief set topic for a group of meters
+     *
+     * @param group - group id
+     * @param topic - topic string, copied
+     */
+    void setTopic(uint8_t group, const char *topic);
+
+    /**
+     * @brief assign meter to a topic group, meters are in group 0 by default
+     */
+    void setGroup(uint8_t id, uint8_t group);
+
+    /**
+     * @brief select fields to publish
+     *
+     * @param mask - bitmask of pzmbus::meter_t fields
+     */
+    void setFields(uint8_t mask){ fields = mask; }
+
+    /**
+     * @brief store new sample for a meter, replaces unpublished one if any
+     *
+     * @param id - PZEM id
+     * @param m - metrics
+     */
+    void push(uint8_t id, const pzmbus::metrics &m);
+
+    /**
+     * @brief store new sample from PZEM object
+     */
+    void push(const PZEM *pz){ if (pz) push(pz->id, *pz->getMetrics()); }
+
+    /**
+     * @brief publish all pending samples, one payload per group (or more for large groups)
+     * called by publisher task once started, could be called manually
+     *
+     * @return size_t - number of payloads published
+     */
+    size_t service();
+
+    /**
+     * @brief start periodic publishing task
+     * if task is already running, new interval takes effect after the current one
+     *
+     * @param ms - publish interval
+     * @return true on success
+     */
+    bool start(uint32_t ms = MQTTPUB_INTERVAL);
+
+    /**
+     * @brief stop periodic publishing
+     * task exits on it's own once publishing in progress is complete, this call waits for that
+     */
+    void stop();
+
+    /**
+     * @brief number of payloads published
+     */
+    uint32_t getPublished() const { return published; }
+
+    /**
+     * @brief number of samples dropped, i.e. overwritten by newer ones before being published
+     */
+    uint32_t getDropped() const { return dropped; }
+
+    /**
+     * @brief number of meters with unpublished samples
+     */
+    size_t pending() const;
+};
@@ -12,6 +12,70 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #include "msgq.hpp"
 
+#ifdef PZEM_EDL_STATIC
+#include "mempool.hpp"
+#include <algorithm>
+
+// object pool block fits any message struct
+static FixedPool<std::max(sizeof(TX_msg), sizeof(RX_msg)), PZEM_STATIC_MSG_CNT> msg_objs;
+static FixedPool<PZEM_STATIC_BUF_SIZE, PZEM_STATIC_MSG_CNT> msg_bufs;
+
+// pool blocks are accounted with their full size
+void* msgobj_alloc(size_t size) noexcept {
+    void *p = msg_objs.alloc(size);
+    if (p)
+        memstat::alloc(memstat::tag_t::msg, msg_objs.getStats().size);
+    return p;
+}
+
+void msgobj_free(void *p) noexcept {
+    if (p)
+        memstat::release(memstat::tag_t::msg, msg_objs.getStats().size);
+    msg_objs.free(p);
+}
+
+uint8_t* msgbuf_alloc(size_t len){
+    void *p = msg_bufs.alloc(len);
+    if (p)
+        memstat::alloc(memstat::tag_t::msg, PZEM_STATIC_BUF_SIZE);
+    return static_cast<uint8_t*>(p);
+}
+
+void msgbuf_free(uint8_t *buf){
+    if (buf)
+        memstat::release(memstat::tag_t::msg, PZEM_STATIC_BUF_SIZE);
+    msg_bufs.free(buf);
+}
+
+void msgpool_stats(mempool_stats_t &objs, mempool_stats_t &bufs){
+    objs = msg_objs.getStats();
+    bufs = msg_bufs.getStats();
+}
+#elif defined(PZEM_EDL_MEMSTAT)
+#include <cstddef>
+
+// buffer size is kept in front of the data to be accounted on release
+#define MSGBUF_HDR  alignof(std::max_align_t)
+
+uint8_t* msgbuf_alloc(size_t len){
+    uint8_t *p = new uint8_t[len + MSGBUF_HDR];
+    *reinterpret_cast<size_t*>(p) = len;
+    memstat::alloc(memstat::tag_t::msg, len);
+    return p + MSGBUF_HDR;
+}
+
+void msgbuf_free(uint8_t *buf){
+    if (!buf)
+        return;
+    buf -= MSGBUF_HDR;
+    memstat::release(memstat::tag_t::msg, *reinterpret_cast<size_t*>(buf));
+    delete[] buf;
+}
+#else
+uint8_t* msgbuf_alloc(size_t len){ return new uint8_t[len]; }
+void msgbuf_free(uint8_t *buf){ delete[] buf; }
+#endif
+
 
 void MsgQ::attach_RX_hndlr(rxdatahandler_t f){
     if (!f)
@@ -67,7 +131,8 @@ void MsgQ::tx_msg_debug(const TX_msg *m){}
 UartQ::~UartQ(){
     rx_callback = nullptr;
     stopQueues();
-    uart_driver_delete(port);
+    if (uart_driver_delete(port) == ESP_OK)
+        memstat::release(memstat::tag_t::uartq, RX_BUF_SIZE + rx_msg_q_DEPTH * sizeof(uart_event_t));
     vSemaphoreDelete(rts_sem);
 }
 
@@ -75,8 +140,13 @@ void UartQ::init(const uart_config_t &uartcfg, int gpio_rx, int gpio_tx){
     // TODO: catch port init errors
     uart_param_config(port, &uartcfg);
     uart_set_pin(port, gpio_tx, gpio_rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-    uart_driver_install(port, RX_BUF_SIZE, TX_BUF_SIZE, rx_msg_q_DEPTH, &rx_msg_q, 0);
+    if (uart_driver_install(port, RX_BUF_SIZE, TX_BUF_SIZE, rx_msg_q_DEPTH, &rx_msg_q, 0) == ESP_OK)
+        memstat::alloc(memstat::tag_t::uartq, RX_BUF_SIZE + rx_msg_q_DEPTH * sizeof(uart_event_t));   // driver's RX ring and event queue
+#ifdef PZEM_EDL_STATIC
+    rts_sem = xSemaphoreCreateBinaryStatic(&rts_buf);   // Ready-To-Send-next semaphore
+#else
     rts_sem = xSemaphoreCreateBinary();     // Ready-To-Send-next semaphore
+#endif
 }
 
 
@@ -89,6 +159,9 @@ void UartQ::stop_tx_msg_q(){
     if (t_txq){
         vTaskDelete(t_txq);
         t_txq = nullptr;
+#ifndef PZEM_EDL_STATIC
+        memstat::release(memstat::tag_t::uartq, TXQ_TASK_STACK);
+#endif
     }
 
     if (!tx_msg_q)
@@ -104,12 +177,18 @@ void UartQ::stop_tx_msg_q(){
     }
 
     vQueueDelete(_t);
+#ifndef PZEM_EDL_STATIC
+    memstat::release(memstat::tag_t::uartq, tx_msg_q_DEPTH * sizeof(TX_msg*));
+#endif
 }
 
 void UartQ::stop_rx_msg_q(){
     if (t_rxq){
         vTaskDelete(t_rxq);
         t_rxq = nullptr;
+#ifndef PZEM_EDL_STATIC
+        memstat::release(memstat::tag_t::uartq, EVT_TASK_STACK);
+#endif
     }
 }
 
@@ -120,6 +199,7 @@ bool UartQ::txenqueue(TX_msg *msg){
     // check if q is present
     if (!tx_msg_q){
         delete msg;     // пакет надо удалять сразу, иначе, не попав в очередь, он останется потерян в памяти
+        ++stats.tx_drop;
         return false;
     }
 
@@ -127,10 +207,12 @@ bool UartQ::txenqueue(TX_msg *msg){
         ESP_LOGD(TAG, "TX packet enque, t: %ld", esp_timer_get_time()/1000);
     #endif
 
-    if (xQueueSendToBack(tx_msg_q, (void *) &msg, (TickType_t)0) == pdTRUE)
+    if (xQueueSendToBack(tx_msg_q, (void *) &msg, (TickType_t)0) == pdTRUE){
+        ++stats.tx;
         return true;
-    else {
+    } else {
         delete msg;     // пакет надо удалять сразу, иначе, не попав в очередь, он останется потерян в памяти
+        ++stats.tx_drop;
         return false;
     }
 }
@@ -185,17 +267,29 @@ void NullQ::detach_TX_hndlr(){
 }
 
 bool NullQ::txenqueue(TX_msg *msg){
+    // message builders return nullptr when message pool is exhausted
+    if (!msg){
+        ++stats.tx_drop;
+        return false;
+    }
+
     bool status = false;
     if (tx_callback){
         tx_callback(msg);
         status = true;
-    }
+        ++stats.tx;
+    } else
+        ++stats.tx_drop;
 
     delete msg;
     return status;
 }
 
 bool NullQ::rxenqueue(RX_msg *msg){
+    ++stats.rx;
+    if (!msg->valid)
+        ++stats.rx_err;
+
     if (rx_callback){
         rx_callback(msg);
         return true;
@@ -212,7 +306,16 @@ NullCable::NullCable(){
 }
 
 void NullCable::tx_rx(TX_msg *tm, bool atob){
-    auto *rmsg = new RX_msg(tm->data, tm->len);
+    // TX message is destroyed by sender, so data is copied
+    uint8_t *buf = msgbuf_alloc(tm->len);
+    if (!buf)
+        return;
+    memcpy(buf, tm->data, tm->len);
+    auto *rmsg = new RX_msg(buf, tm->len);
+    if (!rmsg){
+        msgbuf_free(buf);
+        return;
+    }
     atob ? portB.rxenqueue(rmsg) : portA.rxenqueue(rmsg);
     // receiver call will destroy dynamically allocated object
 }
@@ -15,6 +15,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 #include <functional>
 #include <memory>
 #include "modbus_crc16.h"
+#include "memstat.hpp"
 #include <string.h>
 
 #ifdef ARDUINO
@@ -29,6 +30,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 #define PZEM_UART_RX_READ_TICKS 10              // ticks to wait for RX byte read from buffer
 
 #define RX_BUF_SIZE (UART_FIFO_LEN * 2)         // 2xUART_FIFO_LEN is enough to fit 10 PZEM msg's
+#define UARTQ_FRAME_SIZE        256             // max RTU frame, replies are reassembled up to this size
 #define TX_BUF_SIZE (0)                         // should be eq 0 or greater than UART_FIFO_LEN, I set it 0 'cause I have my own TX queue
 
 // RX
@@ -43,6 +45,21 @@ GitHub: https://github.com/vortigont/pzem-edl
 #define TXQ_TASK_STACK          2048
 #define TXQ_TASK_NAME           "UART_TXQ"
 
+/*
+ PZEM_EDL_STATIC build flag - heap-free operation after init.
+ Messages and their data buffers are taken from fixed static pools, UartQ tasks, queues and semaphores
+ are created with xxxCreateStatic() API using storage embedded in the UartQ object.
+ If pool is exhausted, message is dropped the same way as on TX queue overflow.
+*/
+#ifdef PZEM_EDL_STATIC
+#ifndef PZEM_STATIC_MSG_CNT
+#define PZEM_STATIC_MSG_CNT     32              // TX and RX messages in flight, for all ports
+#endif
+#ifndef PZEM_STATIC_BUF_SIZE
+#define PZEM_STATIC_BUF_SIZE    64              // max message size, bytes, PZEM frames are 25 bytes max
+#endif
+#endif
+
 // ESP32 log tag
 static const char *TAG __attribute__((unused)) = "UartQ";
 
@@ -63,9 +80,37 @@ UART1 	GPIO 9 	    GPIO 10 	GPIO 11 	GPIO 6
 UART2 	GPIO 16 	GPIO 17 	GPIO 7 	    GPIO 8 
 */
 
+/**
+ * @brief allocate message data buffer
+ * buffers are taken from heap or from static pool with PZEM_EDL_STATIC build flag,
+ * data passed to RX_msg must be allocated with this function
+ *
+ * @param len - buffer size
+ * @return uint8_t* - buffer or nullptr if static pool is exhausted
+ */
+uint8_t* msgbuf_alloc(size_t len);
+
+/**
+ * @brief release message data buffer allocated with msgbuf_alloc()
+ */
+void msgbuf_free(uint8_t *buf);
+
+#ifdef PZEM_EDL_STATIC
+// message objects storage, new-expression returns nullptr once pool is exhausted
+void* msgobj_alloc(size_t size) noexcept;
+void msgobj_free(void *p) noexcept;
+#define MSG_ALLOCATOR \
+    static void* operator new(size_t size) noexcept { return msgobj_alloc(size); } \
+    static void* operator new(size_t size, const std::nothrow_t&) noexcept { return msgobj_alloc(size); } \
+    static void operator delete(void *p) noexcept { msgobj_free(p); }
+#else
+#define MSG_ALLOCATOR MEMSTAT_CLASS(memstat::tag_t::msg)
+#endif
+
 /**
  * @brief Structure with Modbus-RTU message data
  * ment to be sent over UART
+ * NOTE: with PZEM_EDL_STATIC both 'new TX_msg' and data buffer could be nullptr if static pool is exhausted
  */
 struct TX_msg {
     const size_t len;       // msg size
@@ -73,16 +118,18 @@ struct TX_msg {
     bool w4rx;              // 'wait for reply' - a reply for message expected, should block TX queue handler
 
     explicit TX_msg(size_t size, bool rxreq = true) : len(size), w4rx(rxreq) {
-        data = new uint8_t[len];
+        data = msgbuf_alloc(len);
         //memcpy(data, srcdata, len);
     }
-    ~TX_msg(){ delete[] data; data = nullptr; }
+    ~TX_msg(){ msgbuf_free(data); data = nullptr; }
+
+    MSG_ALLOCATOR
 };
 
 
 /**
  * @brief struct with Modbus-RTU RX data message
- * 
+ * takes ownership on data buffer, it must be allocated with msgbuf_alloc()
  */
 struct RX_msg {
     uint8_t *rawdata;                               // raw serial data pointer
@@ -92,7 +139,34 @@ struct RX_msg {
     const uint8_t cmd =  rawdata[1];                // modbus command code
 
     RX_msg(uint8_t *data, const size_t size) : rawdata(data), len(size), valid(modbus::checkcrc16(data, size)) {}
-    ~RX_msg(){ delete[] rawdata; rawdata = nullptr; }
+    ~RX_msg(){ msgbuf_free(rawdata); rawdata = nullptr; }
+
+    MSG_ALLOCATOR
+};
+
+#ifdef PZEM_EDL_STATIC
+struct mempool_stats_t;
+
+/**
+ * @brief static message pools counters
+ * could be used to size pools for particular setup
+ *
+ * @param objs - message objects pool
+ * @param bufs - message data buffers pool
+ */
+void msgpool_stats(mempool_stats_t &objs, mempool_stats_t &bufs);
+#endif
+
+
+/**
+ * @brief message queue counters
+ * could be used to monitor bus health, values are wrapping around on overflow
+ */
+struct msgq_stats_t {
+    uint32_t tx = 0;            // messages accepted for transmission
+    uint32_t rx = 0;            // messages received
+    uint32_t tx_drop = 0;       // TX messages dropped, i.e. queue is full or not running
+    uint32_t rx_err = 0;        // RX errors, i.e. bad CRC, UART overflow or framing errors
 };
 
 
@@ -162,9 +236,17 @@ public:
      */
     virtual void stopQueues(){};
 
+    /**
+     * @brief get queue counters
+     *
+     * @return const msgq_stats_t&
+     */
+    virtual const msgq_stats_t& getStats() const { return stats; }
+
 protected:
 
     rxdatahandler_t   rx_callback = nullptr;    // RX data callback
+    msgq_stats_t      stats;                    // queue counters
 
 };
 
@@ -234,6 +316,8 @@ public:
     UartQ(const UartQ&) = delete;
     UartQ& operator=(const UartQ&) = delete;
 
+    MEMSTAT_CLASS(memstat::tag_t::uartq)
+
     // Device UART port number
     const uart_port_t port;
 
@@ -266,14 +350,40 @@ public:
 
     void detach_RX_hndlr() override;
 
+    /**
+     * @brief prepare RX framing for a message that is written to UART bypassing TX queue, i.e. by UartMux
+     * any partial frame left from previous transaction is dropped
+     *
+     * @param msg - message about to be sent
+     */
+    void rx_prepare(const TX_msg *msg){
+        rx_stale = true;
+        rx_expect = msg->w4rx ? modbus::reply_len(msg->data, msg->len) : 0;
+    }
+
 private:
     TaskHandle_t    t_rxq = nullptr;          // RX Q servicing task
     TaskHandle_t    t_txq = nullptr;          // TX Q servicing task
-    SemaphoreHandle_t rts_sem;              // 'ready to send next' Semaphore
+    SemaphoreHandle_t rts_sem;              // 'ready to send next' Semaphore, given once reply is complete or timed out
+    volatile size_t rx_expect = 0;          // reply length expected for the request in flight, 0 - unknown
+    volatile bool   rx_stale = false;       // reply has timed out on TX side, partial frame must be dropped
+    uint8_t         rxbuf[UARTQ_FRAME_SIZE];  // reply frame reassembly buffer
+    size_t          rxlen = 0;
 
     QueueHandle_t   rx_msg_q = nullptr;       // RX msg queue
     QueueHandle_t   tx_msg_q = nullptr;       // TX msg queue
 
+#ifdef PZEM_EDL_STATIC
+    // storage for tasks, queue and semaphore, UartQ object itself must be created during init
+    StaticTask_t    rx_tcb;
+    StaticTask_t    tx_tcb;
+    StackType_t     rx_stack[EVT_TASK_STACK];
+    StackType_t     tx_stack[TXQ_TASK_STACK];
+    StaticQueue_t   txq_buf;
+    uint8_t         txq_storage[tx_msg_q_DEPTH * sizeof(TX_msg*)];
+    StaticSemaphore_t rts_buf;
+#endif
+
     /**
      * @brief start task handling UART RX queue events
      * 
@@ -283,10 +393,17 @@ private:
             return false;
 
         //Create a task to handle UART event from ISR
-        if (!t_rxq)
-            return xTaskCreate(UartQ::rxTask, EVT_TASK_NAME, EVT_TASK_STACK, reinterpret_cast<void *>(this), EVT_TASK_PRIO, &t_rxq) == pdPASS;
-        else
+        if (t_rxq)
             return true;
+#ifdef PZEM_EDL_STATIC
+        t_rxq = xTaskCreateStatic(UartQ::rxTask, EVT_TASK_NAME, EVT_TASK_STACK, reinterpret_cast<void *>(this), EVT_TASK_PRIO, rx_stack, &rx_tcb);
+        return t_rxq;
+#else
+        if (xTaskCreate(UartQ::rxTask, EVT_TASK_NAME, EVT_TASK_STACK, reinterpret_cast<void *>(this), EVT_TASK_PRIO, &t_rxq) != pdPASS)
+            return false;
+        memstat::alloc(memstat::tag_t::uartq, EVT_TASK_STACK);
+        return true;
+#endif
     }
 
     /**
@@ -303,16 +420,29 @@ private:
         if (tx_msg_q)           // queue already exist
             return true;
 
+#ifdef PZEM_EDL_STATIC
+        tx_msg_q = xQueueCreateStatic( tx_msg_q_DEPTH, sizeof(TX_msg*), txq_storage, &txq_buf );
+#else
         tx_msg_q = xQueueCreate( tx_msg_q_DEPTH, sizeof(TX_msg*) ); // make q for MSG struct pointers
+        if (tx_msg_q)
+            memstat::alloc(memstat::tag_t::uartq, tx_msg_q_DEPTH * sizeof(TX_msg*));
+#endif
 
         if (!tx_msg_q)
             return false;
 
         //Create a task to handle UART event from ISR
-        if (!t_txq)
-            return xTaskCreate(UartQ::txTask, TXQ_TASK_NAME, TXQ_TASK_STACK, reinterpret_cast<void *>(this), TXQ_TASK_PRIO, &t_txq) == pdPASS;
-        else
+        if (t_txq)
             return true;
+#ifdef PZEM_EDL_STATIC
+        t_txq = xTaskCreateStatic(UartQ::txTask, TXQ_TASK_NAME, TXQ_TASK_STACK, reinterpret_cast<void *>(this), TXQ_TASK_PRIO, tx_stack, &tx_tcb);
+        return t_txq;
+#else
+        if (xTaskCreate(UartQ::txTask, TXQ_TASK_NAME, TXQ_TASK_STACK, reinterpret_cast<void *>(this), TXQ_TASK_PRIO, &t_txq) != pdPASS)
+            return false;
+        memstat::alloc(memstat::tag_t::uartq, TXQ_TASK_STACK);
+        return true;
+#endif
     }
 
     /**
@@ -336,84 +466,147 @@ private:
      * NOTE: On RX event, handler creates new RX_msg object with received data
      * once this object is passed to the call-back function - it is up to the calee
      * to maintaint life-time of the object. Once utilised it MUST be 'delete'ed to prevent mem leaks
+     * Reply data is collected in rxbuf until it has the length expected for the request in flight,
+     * or it is an exception frame. Only then RX_msg is delivered and TX line is released,
+     * partial frame is dropped on PZEM_UART_TIMEOUT
      */
     void rxqueuehndlr(){
         uart_event_t event;
 
+        xSemaphoreGive(rts_sem);                    // сигналим что можно отправлять первый пакет
+
         // Task runs inside Infinite loop
         for (;;){
-            xSemaphoreGive(rts_sem);                // сигналим что можно отправлять следующий пакет и мы готовы ловить ответ
-
-            // 'xQueueReceive' will "sleep" untill an event messages arrives from the RX event queue
-            if(xQueueReceive(rx_msg_q, reinterpret_cast<void*>(&event), portMAX_DELAY)) {
-
-                //Handle received event
-                switch(event.type) {
-                    case UART_DATA: {
-                        if (!rx_callback){              // if there is no RX handler, than discard all RX
-                            uart_flush_input(port);
-                            xQueueReset(rx_msg_q);
-                            break;
-                        }
-
-                        size_t datalen = 0;
-                        ESP_ERROR_CHECK(uart_get_buffered_data_len(port, &datalen));
-                        if (0 == datalen){
-                            ESP_LOGD(TAG, "can't retreive RX data from buffer, t: %lld", esp_timer_get_time()/1000);
-                            uart_flush_input(port);
-                            xQueueReset(rx_msg_q);
-                            break;
-                        }
-
-                        ESP_LOGD(TAG, "RX buff has %u bytes data msg, t: %lld", datalen, esp_timer_get_time()/1000);
-
-                        uint8_t* buff = (uint8_t*) malloc(datalen);
-                        if (buff){
-                            datalen = uart_read_bytes(port, buff, datalen, PZEM_UART_RX_READ_TICKS);
-                            if (!datalen){
-                                ESP_LOGD(TAG, "unable to read data from RX buff");
-                                delete[] buff;
-                                uart_flush_input(port);
-                                xQueueReset(rx_msg_q);
-                                break;
-                            }
-
-                            RX_msg *msg = new RX_msg(buff, datalen);
-
-                            #ifdef PZEM_EDL_DEBUG
-                                ESP_LOGD(TAG, "got RX data packet from buff, len: %d, t: %ld", datalen, esp_timer_get_time()/1000);
-                                rx_msg_debug(msg);
-                            #endif
-
-                            rx_callback(msg);                   // call external function to process PZEM message
-                        } else
-                            uart_flush_input(port);             // если маллок не выдал память - очищаем весь инпут
+            // 'xQueueReceive' will "sleep" untill an event messages arrives from the RX event queue,
+            // or reply window closes if there is a partial frame in rxbuf
+            if(!xQueueReceive(rx_msg_q, reinterpret_cast<void*>(&event), rxlen ? pdMS_TO_TICKS(PZEM_UART_TIMEOUT) : portMAX_DELAY)) {
+                ESP_LOGD(TAG, "RX timeout, dropping %u bytes of partial frame", static_cast<unsigned>(rxlen));
+                ++stats.rx_err;
+                rx_release();
+                continue;
+            }
 
-                        break;
-                    }
-                    case UART_FIFO_OVF:
-                        ESP_LOGW(TAG, "UART RX fifo overflow!");
+            // TX has given up on waiting, whatever is left in a buffer belongs to the timed-out reply
+            if (rx_stale){
+                rx_stale = false;
+                if (rxlen){
+                    ++stats.rx_err;
+                    rxlen = 0;
+                }
+            }
+
+            //Handle received event
+            switch(event.type) {
+                case UART_DATA: {
+                    if (!rx_callback){              // if there is no RX handler, than discard all RX
+                        uart_flush_input(port);
                         xQueueReset(rx_msg_q);
+                        rx_release();
                         break;
-                    case UART_BUFFER_FULL:
-                        ESP_LOGW(TAG, "UART RX ringbuff full");
+                    }
+
+                    size_t datalen = 0;
+                    ESP_ERROR_CHECK(uart_get_buffered_data_len(port, &datalen));
+                    if (0 == datalen){
+                        ESP_LOGD(TAG, "can't retreive RX data from buffer, t: %lld", static_cast<long long>(esp_timer_get_time()/1000));
                         uart_flush_input(port);
                         xQueueReset(rx_msg_q);
+                        rx_release();
                         break;
-                    case UART_BREAK:
-                    case UART_FRAME_ERR:
-                        ESP_LOGW(TAG, "UART RX err");
+                    }
+
+                    ESP_LOGD(TAG, "RX buff has %u bytes data msg, t: %lld", static_cast<unsigned>(datalen), static_cast<long long>(esp_timer_get_time()/1000));
+
+                    if (rxlen + datalen > sizeof(rxbuf)){
+                        ESP_LOGW(TAG, "RX frame is too long");
+                        uart_flush_input(port);
+                        ++stats.rx_err;
+                        rx_release();
                         break;
-                    default:
+                    }
+
+                    datalen = uart_read_bytes(port, rxbuf + rxlen, datalen, PZEM_UART_RX_READ_TICKS);
+                    if (!datalen){
+                        ESP_LOGD(TAG, "unable to read data from RX buff");
+                        uart_flush_input(port);
+                        xQueueReset(rx_msg_q);
+                        rx_release();
                         break;
+                    }
+                    rxlen += datalen;
+
+                    if (modbus::reply_complete(rxbuf, rxlen, rx_expect))
+                        rx_deliver();
+
+                    break;
                 }
+                case UART_FIFO_OVF:
+                    ESP_LOGW(TAG, "UART RX fifo overflow!");
+                    ++stats.rx_err;
+                    xQueueReset(rx_msg_q);
+                    rx_release();
+                    break;
+                case UART_BUFFER_FULL:
+                    ESP_LOGW(TAG, "UART RX ringbuff full");
+                    ++stats.rx_err;
+                    uart_flush_input(port);
+                    xQueueReset(rx_msg_q);
+                    rx_release();
+                    break;
+                case UART_BREAK:
+                case UART_FRAME_ERR:
+                    ESP_LOGW(TAG, "UART RX err");
+                    ++stats.rx_err;
+                    break;
+                default:
+                    break;
             }
-
         }
         // Task needs to self-terminate before returning (but we should not ever reach this point anyway)
         vTaskDelete(NULL);
     }
 
+    /**
+     * @brief drop any partial frame and release TX line
+     *
+     */
+    void rx_release(){
+        rxlen = 0;
+        xSemaphoreGive(rts_sem);                    // сигналим что можно отправлять следующий пакет и мы готовы ловить ответ
+    }
+
+    /**
+     * @brief pass complete frame from rxbuf to RX callback and release TX line
+     *
+     */
+    void rx_deliver(){
+        uint8_t* buff = msgbuf_alloc(rxlen);
+        if (!buff){
+            ++stats.rx_err;
+            rx_release();
+            return;
+        }
+        memcpy(buff, rxbuf, rxlen);
+
+        RX_msg *msg = new RX_msg(buff, rxlen);
+        rx_release();
+        if (!msg){
+            msgbuf_free(buff);
+            ++stats.rx_err;
+            return;
+        }
+        ++stats.rx;
+        if (!msg->valid)
+            ++stats.rx_err;
+
+        #ifdef PZEM_EDL_DEBUG
+            ESP_LOGD(TAG, "got RX data packet from buff, len: %d, t: %ld", msg->len, esp_timer_get_time()/1000);
+            rx_msg_debug(msg);
+        #endif
+
+        rx_callback(msg);                           // call external function to process PZEM message
+    }
+
 
     /**
      * @brief TX message Queue handler function
@@ -430,12 +623,13 @@ private:
 
                 // if smg would expect a reply than I need to grab a semaphore from the RX queue task
                 if (msg->w4rx){
-                    ESP_LOGD(TAG, "Wait for tx semaphore, t: %lld", esp_timer_get_time()/1000);
-                    xSemaphoreTake(rts_sem, pdMS_TO_TICKS(PZEM_UART_TIMEOUT));
-                    // an old reply migh be still in the rx queue while I'm handling this one
-                    //uart_flush_input(port);     // input should be cleared from any leftovers if I expect a reply (in case of a timeout only)
-                    //xQueueReset(rx_msg_q);
-                }
+                    ESP_LOGD(TAG, "Wait for tx semaphore, t: %lld", static_cast<long long>(esp_timer_get_time()/1000));
+                    // previous reply has not completed in time, RX must drop it's partial frame
+                    if (!xSemaphoreTake(rts_sem, pdMS_TO_TICKS(PZEM_UART_TIMEOUT)))
+                        rx_stale = true;
+                    rx_expect = modbus::reply_len(msg->data, msg->len);
+                } else
+                    rx_expect = 0;
 
                 // Send message data to the UART TX FIFO
                 uart_write_bytes(port, (const char*)msg->data, msg->len);
@@ -465,6 +659,7 @@ private:
 class PZPort {
     bool qrun;
     std::unique_ptr<char[]> descr;
+    std::unique_ptr<UART_cfg> ucfg;         // UART configuration, only for ports created from UART_cfg
 
     void setdescr(const char *_name);
 
@@ -473,6 +668,13 @@ public:
     const char *getDescr() const;
     bool active() const {return qrun;}
     bool active(bool newstate);
+
+    /**
+     * @brief get UART configuration the port was created with
+     *
+     * @return const UART_cfg*, nullptr if port was constructed from generic MsgQ object
+     */
+    const UART_cfg* getUARTcfg() const { return ucfg.get(); }
     std::unique_ptr<MsgQ> q = nullptr;
 
     // Construct from generic MgsQ object
@@ -487,6 +689,7 @@ public:
     PZPort (uint8_t _id, UART_cfg &cfg, const char *_name = nullptr) : id(_id) {
         UartQ *_q = new UartQ(cfg.p, cfg.uartcfg, cfg.gpio_rx, cfg.gpio_tx);
         q.reset(_q);
+        ucfg.reset(new UART_cfg(cfg));
         setdescr(_name);
         qrun = q->startQueues();
     }
@@ -513,7 +716,7 @@ public:
      * 
      * @param msg PZEM command message object
      * @return true - if mesage has been processed successfully
-     * @return false - if tx_callback is not defined
+     * @return false - if tx_callback is not defined or msg is null
      */
     bool txenqueue(TX_msg *msg) override;
 
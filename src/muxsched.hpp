@@ -0,0 +1,108 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define MUXSCHED_BURST          8       // default max transactions per channel slice
+
+/**
+ * @brief transaction scheduler for a multiplexed bus
+ * Decides which channel (sub-bus) to serve next. Current channel is served while it has pending
+ * transactions, but no more than 'burst' in a row, than scheduler moves round-robin to the next channel
+ * with pending transactions. So a poll cycle that enqueues a request for every meter costs one pin switch
+ * per sub-bus, while a busy channel can't starve the others.
+ *
+ * Scheduler has no dependencies on RTOS or hardware and is not thread-safe, caller must serialize access.
+ */
+class MuxScheduler {
+    std::vector<size_t> pending;        // pending transactions per channel
+    size_t burst;
+    size_t cur = 0;                     // current channel
+    size_t served = 0;                  // transactions served in current slice
+    uint32_t nswitch = 0;               // channel switches count
+
+public:
+    /**
+     * @brief Construct a new Mux Scheduler object
+     *
+     * @param channels - number of channels
+     * @param max_burst - max transactions per channel slice, 0 - unlimited
+     */
+    MuxScheduler(size_t channels, size_t max_burst = MUXSCHED_BURST) : pending(channels, 0), burst(max_burst) {}
+
+    /**
+     * @brief register new pending transaction for a channel
+     */
+    void push(size_t ch){ if (ch < pending.size()) ++pending[ch]; }
+
+    /**
+     * @brief drop all pending transactions for a channel
+     */
+    void clear(size_t ch){ if (ch < pending.size()) pending[ch] = 0; }
+
+    /**
+     * @brief pick a channel for the next transaction and account it as served
+     *
+     * @return int - channel index, -1 if there are no pending transactions
+     */
+    int next(){
+        size_t n = pending.size();
+        if (!n)
+            return -1;
+
+        if (!pending[cur] || (burst && served >= burst)){
+            // round-robin search starting from the channel next to the current one
+            size_t i = 1;
+            for (; i <= n; ++i){
+                if (pending[(cur + i) % n])
+                    break;
+            }
+            if (i > n)
+                return -1;
+
+            size_t ch = (cur + i) % n;
+            if (ch != cur){
+                cur = ch;
+                ++nswitch;
+            }
+            served = 0;
+        }
+
+        --pending[cur];
+        ++served;
+        return static_cast<int>(cur);
+    }
+
+    /**
+     * @brief current channel
+     */
+    size_t current() const { return cur; }
+
+    /**
+     * @brief number of pending transactions for a channel
+     */
+    size_t getPending(size_t ch) const { return ch < pending.size() ? pending[ch] : 0; }
+
+    /**
+     * @brief number of channel switches made so far
+     */
+    uint32_t switches() const { return nswitch; }
+
+    /**
+     * @brief number of channels
+     */
+    size_t channels() const { return pending.size(); }
+};
@@ -0,0 +1,186 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "nilm.hpp"
+
+#define NILM_MEAN_WINDOW        32      // cap for running mean counters, so that levels could slowly drift
+
+namespace nilm {
+
+bool EdgeDetector::push(float power, float pf, uint32_t time){
+    if (std::isnan(power))
+        return false;
+
+    // reactive power from P and PF, PZEM does not report it directly
+    float q = (pf > 0 && pf < 1) ? power * std::sqrt(1 - pf * pf) / pf : 0;
+
+    if (!sn){
+        sp = power; sq = q; sn = 1;
+        return false;
+    }
+
+    // still on the same steady level
+    if (std::fabs(power - sp) < threshold){
+        pn = 0;
+        if (sn < NILM_MEAN_WINDOW) ++sn;
+        sp += (power - sp) / sn;
+        sq += (q - sq) / sn;
+        return false;
+    }
+
+    // pending level is not consistent, restart it
+    if (pn && std::fabs(power - pp) >= threshold)
+        pn = 0;
+
+    if (!pn){
+        pp = power; pq = q; pn = 1;
+    } else {
+        ++pn;
+        pp += (power - pp) / pn;
+        pq += (q - pq) / pn;
+    }
+
+    if (pn < settle)
+        return false;
+
+    // new steady level accepted
+    event_t e{time, pp - sp, pq - sq, -1};
+    e.sig = e.dP > 0 ? on_step(e) : off_step(e);
+
+    sp = pp; sq = pq; sn = pn;
+    pn = 0;
+
+    if (cb)
+        cb(id, e);
+
+    return true;
+}
+
+bool EdgeDetector::push(const pzmbus::metrics &m, uint32_t time){
+    return push(m.asFloat(pzmbus::meter_t::pwr), m.asFloat(pzmbus::meter_t::pf), time);
+}
+
+bool EdgeDetector::match(float a, float b) const {
+    float tol = tolerance * std::fabs(b);
+    return std::fabs(a - b) <= (tol > tolerance_abs ? tol : tolerance_abs);
+}
+
+int8_t EdgeDetector::on_step(const event_t &e){
+    int8_t best = -1;
+    float dist = 0;
+
+    for (int8_t i = 0; i != NILM_MAX_SIGNATURES; ++i){
+        const auto &s = sigs[i];
+        if (!s.cnt || !match(e.dP, s.dP) || !match(e.dQ, s.dQ))
+            continue;
+
+        float d = std::fabs(e.dP - s.dP);
+        if (best < 0 || d < dist){
+            best = i;
+            dist = d;
+        }
+    }
+
+    if (best < 0){
+        // pick an empty slot or evict the least used inactive signature
+        for (int8_t i = 0; i != NILM_MAX_SIGNATURES; ++i){
+            const auto &s = sigs[i];
+            if (!s.cnt){
+                best = i;
+                break;
+            }
+            if (s.on)
+                continue;
+            if (best < 0 || s.cnt < sigs[best].cnt || (s.cnt == sigs[best].cnt && s.last < sigs[best].last))
+                best = i;
+        }
+
+        if (best < 0)
+            return -1;      // all slots are busy with active appliances
+
+        sigs[best] = signature_t();
+    }
+
+    auto &s = sigs[best];
+    uint32_t n = s.cnt < NILM_MEAN_WINDOW ? s.cnt + 1 : NILM_MEAN_WINDOW;
+    s.dP += (e.dP - s.dP) / n;
+    s.dQ += (e.dQ - s.dQ) / n;
+    ++s.cnt;
+    s.last = e.time;
+
+    if (!s.on){
+        s.on = true;
+        s.on_since = e.time;
+    }
+
+    return best;
+}
+
+int8_t EdgeDetector::off_step(const event_t &e){
+    int8_t best = -1;
+    float dist = 0;
+
+    for (int8_t i = 0; i != NILM_MAX_SIGNATURES; ++i){
+        const auto &s = sigs[i];
+        if (!s.cnt || !s.on || !match(-e.dP, s.dP))
+            continue;
+
+        float d = std::fabs(e.dP + s.dP);
+        if (best < 0 || d < dist){
+            best = i;
+            dist = d;
+        }
+    }
+
+    if (best < 0)
+        return -1;
+
+    auto &s = sigs[best];
+    uint32_t dt = e.time - s.on_since;
+    s.on = false;
+    s.on_time += dt;
+    s.energy += s.dP * dt;
+    s.last = e.time;
+    return best;
+}
+
+void EdgeDetector::reset(){
+    sp = sq = pp = pq = 0;
+    sn = pn = 0;
+    for (auto &s : sigs)
+        s = signature_t();
+}
+
+const signature_t* EdgeDetector::getSignature(uint8_t idx) const {
+    if (idx >= NILM_MAX_SIGNATURES || !sigs[idx].cnt)
+        return nullptr;
+
+    return &sigs[idx];
+}
+
+uint32_t EdgeDetector::getOnTime(uint8_t idx, uint32_t time) const {
+    const auto s = getSignature(idx);
+    if (!s)
+        return 0;
+
+    return s->on ? s->on_time + (time - s->on_since) : s->on_time;
+}
+
+float EdgeDetector::getEnergy(uint8_t idx, uint32_t time) const {
+    const auto s = getSignature(idx);
+    if (!s)
+        return 0;
+
+    return s->on ? s->energy + s->dP * (time - s->on_since) : s->energy;
+}
+
+}   // namespace nilm
@@ -0,0 +1,156 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <functional>
+#include "pzem_modbus.hpp"
+
+#define NILM_MAX_SIGNATURES     16      // max number of appliance signatures tracked per meter
+#define NILM_STEP_THRESHOLD     15.0    // W, minimal power step considered as an appliance event
+#define NILM_SETTLE_SAMPLES     2       // number of consistent samples required to accept new steady level
+#define NILM_MATCH_TOLERANCE    0.1     // relative tolerance to match a step to a signature
+#define NILM_MATCH_ABS          10.0    // W/var, absolute tolerance to match a step to a signature
+
+/**
+ * @brief edge-based non-intrusive load monitoring
+ * detects power steps on a meter and clusters them into appliance signatures
+ */
+namespace nilm {
+
+/**
+ * @brief load step event
+ *
+ */
+struct event_t {
+    uint32_t time;          // event timestamp
+    float dP;               // active power step, W
+    float dQ;               // reactive power step, var
+    int8_t sig;             // matched signature index, -1 if none
+};
+
+/**
+ * @brief appliance signature
+ * a cluster of recurring 'on' steps with accounted on-time and energy
+ *
+ */
+struct signature_t {
+    float dP = 0;           // centroid of active power step, W
+    float dQ = 0;           // centroid of reactive power step, var
+    uint32_t cnt = 0;       // number of 'on' events matched, 0 for an empty slot
+    uint32_t last = 0;      // timestamp of last match
+    uint32_t on_since = 0;  // timestamp of last 'on' event
+    uint32_t on_time = 0;   // total accounted on-time, in units of timestamp
+    float energy = 0;       // total accounted energy, W*units of timestamp (i.e. W*s for epoch time)
+    bool on = false;        // signature is currently 'on'
+};
+
+/**
+ * @brief step event call-back
+ * @param id - detector id (usually matches PZEM id)
+ * @param e - event data
+ */
+typedef std::function<void (uint8_t id, const event_t &e)> callback_t;
+
+/**
+ * @brief Incremental edge detector for power series
+ * Runs on each new sample, tracks current steady power level and emits an event once
+ * power settles on a new level differing more than step threshold.
+ * 'On' steps are clustered online into a fixed number of signatures, 'off' steps are
+ * paired to the closest active signature to account it's on-time and energy.
+ * Memory footprint is fixed, each push is O(NILM_MAX_SIGNATURES) with no allocations.
+ */
+class EdgeDetector {
+    float sp = 0, sq = 0;           // steady level mean
+    uint32_t sn = 0;                // number of samples in steady level mean
+    float pp = 0, pq = 0;           // pending level mean
+    uint32_t pn = 0;                // number of samples in pending level
+    signature_t sigs[NILM_MAX_SIGNATURES];
+    callback_t cb = nullptr;
+
+    bool match(float a, float b) const;
+    int8_t on_step(const event_t &e);
+    int8_t off_step(const event_t &e);
+
+public:
+    const uint8_t id;               // detector id
+
+    // tunables
+    float threshold = NILM_STEP_THRESHOLD;
+    uint32_t settle = NILM_SETTLE_SAMPLES;
+    float tolerance = NILM_MATCH_TOLERANCE;
+    float tolerance_abs = NILM_MATCH_ABS;
+
+    explicit EdgeDetector(uint8_t _id) : id(_id) {}
+
+    /**
+     * @brief feed new sample to detector
+     *
+     * @param power - active power, W
+     * @param pf - power factor, 0-1
+     * @param time - sample timestamp (any monotonic units, i.e. epoch seconds)
+     * @return true if a step event was detected on this sample
+     */
+    bool push(float power, float pf, uint32_t time);
+
+    /**
+     * @brief feed new sample to detector from a metrics struct
+     *
+     * @param m - metrics struct
+     * @param time - sample timestamp
+     */
+    bool push(const pzmbus::metrics &m, uint32_t time);
+
+    /**
+     * @brief reset detector, all learned signatures are dropped
+     */
+    void reset();
+
+    /**
+     * @brief get signature data
+     *
+     * @param idx - signature index
+     * @return const signature_t* or nullptr for an empty slot
+     */
+    const signature_t* getSignature(uint8_t idx) const;
+
+    /**
+     * @brief get accounted on-time for signature up to specified time
+     * includes current 'on' interval if signature is active
+     */
+    uint32_t getOnTime(uint8_t idx, uint32_t time) const;
+
+    /**
+     * @brief get accounted energy for signature up to specified time
+     * includes current 'on' interval if signature is active
+     */
+    float getEnergy(uint8_t idx, uint32_t time) const;
+
+    /**
+     * @brief current steady power level, W
+     */
+    float getSteadyPower() const { return sp; }
+
+    /**
+     * @brief attach event call-back
+     *
+     * @param f callback function prototype: std::function<void (uint8_t id, const event_t &e)>
+     */
+    void attach_callback(callback_t f){ if (f) cb = std::move(f); }
+
+    /**
+     * @brief detach event call-back
+     */
+    void detach_callback(){ cb = nullptr; }
+};
+
+}   // namespace nilm
@@ -0,0 +1,236 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "persist.hpp"
+#include <sys/time.h>
+
+#define PERSIST_HDR_LEN         12      // version, model, addr, err, int64 wall time
+
+// wall clock time in us, 0 if clock is not set
+static int64_t wall_us(){
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    if (tv.tv_sec < PERSIST_EPOCH_MIN)
+        return 0;
+    return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+// ****  NVSStateStorage  **** //
+
+NVSStateStorage::NVSStateStorage(const char *ns){
+    opened = nvs_open(ns, NVS_READWRITE, &h) == ESP_OK;
+}
+
+NVSStateStorage::~NVSStateStorage(){
+    if (opened)
+        nvs_close(h);
+}
+
+size_t NVSStateStorage::load(uint8_t id, uint8_t *dst, size_t len){
+    char key[6];
+    sprintf(key, "st%u", id);
+    if (!opened || nvs_get_blob(h, key, dst, &len) != ESP_OK)
+        return 0;
+    return len;
+}
+
+bool NVSStateStorage::store(uint8_t id, const uint8_t *data, size_t len){
+    char key[6];
+    sprintf(key, "st%u", id);
+    return opened && nvs_set_blob(h, key, data, len) == ESP_OK;
+}
+
+bool NVSStateStorage::commit(){
+    return opened && nvs_commit(h) == ESP_OK;
+}
+
+// ****  RAMStateStorage  **** //
+
+bool RAMStateStorage::valid(const uint8_t *s) const {
+    return s[1] && s[1] <= PERSIST_REC_MAX && modbus::checkcrc16(s, s[1] + 4);
+}
+
+size_t RAMStateStorage::load(uint8_t id, uint8_t *dst, size_t len){
+    for (size_t i = 0; i != slots; ++i){
+        const uint8_t *s = slot(i);
+        if (s[0] != id || !valid(s))
+            continue;
+        if (s[1] > len)
+            return 0;
+        memcpy(dst, &s[2], s[1]);
+        return s[1];
+    }
+    return 0;
+}
+
+bool RAMStateStorage::store(uint8_t id, const uint8_t *data, size_t len){
+    if (!len || len > PERSIST_REC_MAX)
+        return false;
+
+    uint8_t *dst = nullptr;
+    for (size_t i = 0; i != slots; ++i){
+        uint8_t *s = slot(i);
+        if (!valid(s)){
+            if (!dst)
+                dst = s;        // first free slot
+        } else if (s[0] == id){
+            dst = s;
+            break;
+        }
+    }
+
+    if (!dst)
+        return false;
+
+    dst[0] = id;
+    dst[1] = len;
+    memcpy(&dst[2], data, len);
+    modbus::setcrc16(dst, len + 4);
+    return true;
+}
+
+// ****  PZCheckpoint  **** //
+
+PZCheckpoint::PZCheckpoint(PZPool &p, StateStorage &s) : pool(&p), storage(&s) {
+    lock = xSemaphoreCreateMutex();
+    restored = restore();
+}
+
+PZCheckpoint::~PZCheckpoint(){
+    stop();
+    vSemaphoreDelete(lock);
+}
+
+int64_t& PZCheckpoint::saved_us(uint8_t id){
+    for (auto &i : saved)
+        if (i.first == id)
+            return i.second;
+
+    saved.emplace_back(id, 0);
+    return saved.back().second;
+}
+
+size_t PZCheckpoint::restore(){
+    uint8_t rec[PERSIST_REC_MAX];
+    std::vector<uint8_t> ids;
+    ids.reserve(pool->countPZEM());
+    pool->forEachPZEM([&ids](const PZEM *pz){ ids.push_back(pz->id); return true; });
+
+    int64_t now = esp_timer_get_time();
+    int64_t wall = wall_us();
+    size_t cnt = 0;
+
+    for (auto id : ids){
+        size_t len = storage->load(id, rec, sizeof(rec));
+        auto s = pool->getState(id);
+        if (!s || len < PERSIST_HDR_LEN + 2 || rec[0] != PERSIST_VERSION
+            || rec[1] != static_cast<uint8_t>(s->model) || rec[2] != s->addr)
+            continue;
+
+        int64_t rec_wall;
+        memcpy(&rec_wall, &rec[4], sizeof(rec_wall));
+        const uint8_t *rir = &rec[PERSIST_HDR_LEN];
+        if (PERSIST_HDR_LEN + rir[0] + 2u > len)
+            continue;
+        const uint8_t *rhr = rir + rir[0] + 1;
+        if (rhr + rhr[0] + 1 > rec + len)
+            continue;
+
+        // map sample time to time since boot, if it can't be done sample is treated as taken right before boot
+        int64_t update_us = (rec_wall && wall && wall > rec_wall) ? now - (wall - rec_wall) : -1;
+        if (!update_us)
+            update_us = -1;
+
+        if (rhr[0])
+            pool->restoreRegImage(id, CMD_RHR, &rhr[1], rhr[0]);
+        if (rir[0] && pool->restoreRegImage(id, CMD_RIR, &rir[1], rir[0], update_us)){
+            auto img = pool->getRegImage(id, CMD_RIR);
+            if (img)
+                saved_us(id) = img->snapshot().update_us;
+            ++cnt;
+        }
+    }
+
+    return cnt;
+}
+
+size_t PZCheckpoint::checkpoint(){
+    size_t cnt = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+
+    int64_t now = esp_timer_get_time();
+    int64_t wall = wall_us();
+    pool->forEachPZEM([this, &cnt, now, wall](const PZEM *pz){
+        const auto *rir_p = pz->getRegImage(CMD_RIR);
+        const auto *rhr_p = pz->getRegImage(CMD_RHR);
+        if (!rir_p || !rhr_p)
+            return true;
+
+        // images are updated by RX task, work with consistent copies
+        const pzmbus::regimage_t rir_img = rir_p->snapshot(), rhr_img = rhr_p->snapshot();
+        const auto *rir = &rir_img, *rhr = &rhr_img;
+        if (!rir->len)
+            return true;
+
+        int64_t &last = saved_us(pz->id);
+        if (rir->update_us == last)
+            return true;        // nothing new since last checkpoint
+
+        uint8_t rec[PERSIST_REC_MAX];
+        const auto *s = pz->getState();
+        rec[0] = PERSIST_VERSION;
+        rec[1] = static_cast<uint8_t>(s->model);
+        rec[2] = s->addr;
+        rec[3] = static_cast<uint8_t>(s->err);
+        int64_t rec_wall = wall ? wall - (now - rir->update_us) : 0;
+        memcpy(&rec[4], &rec_wall, sizeof(rec_wall));
+
+        size_t len = PERSIST_HDR_LEN;
+        rec[len++] = rir->len;
+        memcpy(&rec[len], rir->data, rir->len);
+        len += rir->len;
+        rec[len++] = rhr->len;
+        memcpy(&rec[len], rhr->data, rhr->len);
+        len += rhr->len;
+
+        if (storage->store(pz->id, rec, len)){
+            last = rir->update_us;
+            ++cnt;
+        }
+        return true;
+    });
+
+    if (cnt)
+        storage->commit();
+
+    xSemaphoreGive(lock);
+    return cnt;
+}
+
+bool PZCheckpoint::start(uint32_t ms){
+    if (t_chkpt)
+        return false;
+
+    interval = ms < PERSIST_MIN_INTERVAL ? PERSIST_MIN_INTERVAL : ms;
+    return xTaskCreate(PZCheckpoint::chkptTask, PERSIST_TASK_NAME, PERSIST_TASK_STACK, reinterpret_cast<void *>(this), PERSIST_TASK_PRIO, &t_chkpt) == pdPASS;
+}
+
+void PZCheckpoint::stop(){
+    if (!t_chkpt)
+        return;
+
+    // do not interrupt a checkpoint in progress
+    xSemaphoreTake(lock, portMAX_DELAY);
+    vTaskDelete(t_chkpt);
+    t_chkpt = nullptr;
+    xSemaphoreGive(lock);
+}
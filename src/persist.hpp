@@ -0,0 +1,186 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include <vector>
+
+#define PERSIST_VERSION         1
+#define PERSIST_REC_MAX         64              // max size of a meter state record, bytes
+#define PERSIST_NVS_NAMESPACE   "pzem"
+#define PERSIST_INTERVAL        60000           // default checkpoint interval, ms
+#define PERSIST_MIN_INTERVAL    10000           // minimal checkpoint interval, ms
+#define PERSIST_EPOCH_MIN       1600000000      // wall clock is considered set if it's past this time, s
+
+#define PERSIST_TASK_NAME       "PZchkpt"
+#define PERSIST_TASK_STACK      4096
+#define PERSIST_TASK_PRIO       1
+
+/**
+ * @brief storage backend for meter state records
+ * records are identified by PZEM id, backend must keep at least PERSIST_REC_MAX bytes per record
+ */
+class StateStorage {
+
+public:
+    virtual ~StateStorage(){};
+
+    /**
+     * @brief load record
+     *
+     * @param id - PZEM id
+     * @param dst - destination buffer
+     * @param len - buffer size
+     * @return size_t - record size, 0 if there is no valid record
+     */
+    virtual size_t load(uint8_t id, uint8_t *dst, size_t len) = 0;
+
+    /**
+     * @brief store record, it might not be persistent until commit() is called
+     *
+     * @return true on success
+     */
+    virtual bool store(uint8_t id, const uint8_t *data, size_t len) = 0;
+
+    /**
+     * @brief make stored records persistent, called once per checkpoint batch
+     */
+    virtual bool commit(){ return true; }
+};
+
+/**
+ * @brief NVS storage backend
+ * each record is kept as a blob in NVS namespace, nvs_flash_init() must be called beforehand
+ */
+class NVSStateStorage : public StateStorage {
+    nvs_handle_t h;
+    bool opened;
+
+public:
+    explicit NVSStateStorage(const char *ns = PERSIST_NVS_NAMESPACE);
+    ~NVSStateStorage();
+
+    // Copy semantics : forbidden
+    NVSStateStorage(const NVSStateStorage&) = delete;
+    NVSStateStorage& operator=(const NVSStateStorage&) = delete;
+
+    size_t load(uint8_t id, uint8_t *dst, size_t len) override;
+    bool store(uint8_t id, const uint8_t *data, size_t len) override;
+    bool commit() override;
+};
+
+/**
+ * @brief RAM storage backend
+ * keeps records in an external buffer split into CRC protected slots. Buffer placed into RTC memory
+ * survives deep-sleep and soft resets without flash wear, i.e.
+ *
+ *  RTC_NOINIT_ATTR static uint8_t rtcbuf[RAMStateStorage::slot_size * 8];
+ *
+ * Slots with bad CRC (i.e. garbage after power-on) are treated as free.
+ */
+class RAMStateStorage : public StateStorage {
+    uint8_t *buf;
+    size_t slots;
+
+    uint8_t* slot(size_t idx) const { return &buf[idx * slot_size]; }
+    bool valid(const uint8_t *s) const;
+
+public:
+    // slot layout: id, len, data, crc16
+    static constexpr size_t slot_size = PERSIST_REC_MAX + 4;
+
+    RAMStateStorage(uint8_t *buffer, size_t size) : buf(buffer), slots(size / slot_size) {}
+
+    size_t load(uint8_t id, uint8_t *dst, size_t len) override;
+    bool store(uint8_t id, const uint8_t *data, size_t len) override;
+};
+
+/**
+ * @brief persistent last-known state of pool meters
+ * On construction restores saved state of every pool meter, so that metrics are available right after boot.
+ * Restored state is flagged with 'restored' and is always stale until the meter is polled,
+ * it's update time is mapped from the wall clock time of the saved sample, so dataAge() shows real age
+ * if wall clock is set on both save and restore.
+ *
+ * Checkpoints are written in batches - once per interval only meters with new data are saved and
+ * storage commit is called once per batch, that limits flash writes
+ */
+class PZCheckpoint {
+    PZPool *pool;
+    StateStorage *storage;
+    std::vector< std::pair<uint8_t, int64_t> > saved;     // PZEM id, RIR image time of the last saved record
+    uint32_t interval = PERSIST_INTERVAL;
+    size_t restored = 0;
+    TaskHandle_t t_chkpt = nullptr;
+    SemaphoreHandle_t lock;
+
+    int64_t& saved_us(uint8_t id);
+
+    static void chkptTask(void* pvParams){
+        auto *c = reinterpret_cast<PZCheckpoint*>(pvParams);
+        for (;;){
+            vTaskDelay(pdMS_TO_TICKS(c->interval));
+            c->checkpoint();
+        }
+    }
+
+public:
+    /**
+     * @brief construct and restore saved state of pool meters
+     * pool must be populated beforehand
+     *
+     * @param p - PZPool object
+     * @param s - storage backend, must outlive this object
+     */
+    PZCheckpoint(PZPool &p, StateStorage &s);
+    ~PZCheckpoint();
+
+    // Copy semantics : forbidden
+    PZCheckpoint(const PZCheckpoint&) = delete;
+    PZCheckpoint& operator=(const PZCheckpoint&) = delete;
+
+    /**
+     * @brief restore saved state of pool meters
+     * records with model or address mismatch are ignored
+     *
+     * @return size_t - number of meters restored
+     */
+    size_t restore();
+
+    /**
+     * @brief save state of meters that have new data since last checkpoint
+     *
+     * @return size_t - number of records written
+     */
+    size_t checkpoint();
+
+    /**
+     * @brief start periodic checkpoints
+     *
+     * @param ms - checkpoint interval, not less than PERSIST_MIN_INTERVAL
+     * @return true on success
+     */
+    bool start(uint32_t ms = PERSIST_INTERVAL);
+
+    /**
+     * @brief stop periodic checkpoints
+     */
+    void stop();
+
+    /**
+     * @brief number of meters restored on construction
+     */
+    size_t getRestored() const { return restored; }
+};
@@ -0,0 +1,319 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "pollq.hpp"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define POLLQ_RTU_MIN           5       // shortest valid RTU reply, exception frame
+
+static const char *TAG_POLLQ __attribute__((unused)) = "PollQ";
+
+static speed_t baud2speed(uint32_t baud){
+    switch (baud){
+        case 1200 : return B1200;
+        case 2400 : return B2400;
+        case 4800 : return B4800;
+        case 19200 : return B19200;
+        case 38400 : return B38400;
+        case 57600 : return B57600;
+        case 115200 : return B115200;
+        default : return B9600;
+    }
+}
+
+// ****  PollQ  **** //
+
+PollQ::PollQ(const char *dev, uint32_t baud, size_t qdepth) : own(true), depth(qdepth) {
+    fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0){
+        ESP_LOGE(TAG_POLLQ, "can't open %s", dev);
+        return;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0){
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, baud2speed(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+        tcsetattr(fd, TCSANOW, &tio);
+        tcflush(fd, TCIOFLUSH);
+    }
+}
+
+PollQ::PollQ(int _fd, size_t qdepth, bool take) : fd(_fd), own(take), depth(qdepth) {
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+PollQ::~PollQ(){
+    rx_callback = nullptr;
+    if (loop)
+        loop->remove(this);
+
+    for (auto m : txq)
+        delete m;
+
+    if (own && fd >= 0)
+        close(fd);
+}
+
+bool PollQ::txenqueue(TX_msg *msg){
+    if (!msg)
+        return false;
+
+    if (fd < 0 || txq.size() >= depth){
+        delete msg;
+        ++stats.tx_drop;
+        return false;
+    }
+
+    txq.push_back(msg);
+    ++stats.tx;
+    transmit();
+    return true;
+}
+
+void PollQ::transmit(){
+    while (!busy && !txq.empty() && fd >= 0){
+        TX_msg *msg = txq.front();
+        txq.pop_front();
+
+        len = 0;                        // anything received so far is not a reply to this request
+        if (write(fd, msg->data, msg->len) == static_cast<ssize_t>(msg->len) && msg->w4rx){
+            busy = true;
+            deadline_us = esp_timer_get_time() + POLLQ_REPLY_TIMEOUT * 1000LL;
+        }
+        delete msg;
+    }
+}
+
+void PollQ::receive(){
+    ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    if (n <= 0){
+        // device is gone, stop polling it so that loop does not spin on hangup events
+        ESP_LOGE(TAG_POLLQ, "port fd %d is gone", fd);
+        if (loop)
+            loop->remove(this);
+        if (own)
+            close(fd);
+        fd = -1;
+        busy = false;
+        len = 0;
+        return;
+    }
+
+    if (!busy){
+        len = 0;                        // line noise or a late reply
+        return;
+    }
+
+    len += n;
+    rx_us = esp_timer_get_time();
+
+    // frame is complete once CRC matches, otherwise it is delivered by service() after a silent gap
+    if ((len >= POLLQ_RTU_MIN && modbus::checkcrc16(buf, len)) || len == sizeof(buf))
+        deliver();
+}
+
+void PollQ::deliver(){
+    busy = false;
+
+    uint8_t *raw = len >= 2 ? msgbuf_alloc(len) : nullptr;
+    RX_msg *msg = nullptr;
+    if (raw){
+        memcpy(raw, buf, len);
+        msg = new RX_msg(raw, len);
+        if (!msg)
+            msgbuf_free(raw);
+    }
+
+    if (msg){
+        ++stats.rx;
+        if (!msg->valid)
+            ++stats.rx_err;
+
+        if (rx_callback)
+            rx_callback(msg);           // handler takes ownership on the message
+        else
+            delete msg;
+    }
+    len = 0;
+
+    transmit();
+}
+
+int64_t PollQ::service(int64_t now){
+    if (!busy)
+        return 0;
+
+    if (len && now - rx_us >= POLLQ_FRAME_GAP * 1000LL){
+        deliver();                      // incomplete or corrupted frame, it will be flagged invalid
+    } else if (now >= deadline_us){
+        busy = false;
+        len = 0;
+        transmit();
+    }
+
+    if (!busy)
+        return 0;
+
+    return len ? std::min<int64_t>(deadline_us, rx_us + POLLQ_FRAME_GAP * 1000LL) : deadline_us;
+}
+
+
+// ****  PollLoop  **** //
+
+PollLoop::PollLoop(){
+    efd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+PollLoop::~PollLoop(){
+    for (auto q : ports)
+        q->loop = nullptr;
+    if (efd >= 0)
+        close(efd);
+}
+
+bool PollLoop::watch(watch_t *w){
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, w->fd, &ev) != 0){
+        delete w;
+        return false;
+    }
+    watches.emplace_back(w);
+    return true;
+}
+
+bool PollLoop::add(PollQ *q){
+    if (!q || !q->good() || q->loop)
+        return false;
+
+    if (!watch(new watch_t{q->fd, q, nullptr}))
+        return false;
+
+    ports.push_back(q);
+    q->loop = this;
+    return true;
+}
+
+void PollLoop::remove(PollQ *q){
+    for (auto &w : watches){
+        if (w->q != q || w->fd < 0)
+            continue;
+        epoll_ctl(efd, EPOLL_CTL_DEL, w->fd, NULL);
+        w->fd = -1;                     // freed after dispatch, there could be pending events for it
+        w->q = nullptr;
+        dirty = true;
+    }
+
+    ports.erase(std::remove(ports.begin(), ports.end(), q), ports.end());
+    q->loop = nullptr;
+}
+
+bool PollLoop::watch(int fd, fdhandler_t h){
+    if (fd < 0 || !h)
+        return false;
+
+    return watch(new watch_t{fd, nullptr, std::move(h)});
+}
+
+void PollLoop::unwatch(int fd){
+    for (auto &w : watches){
+        if (w->fd != fd || w->q)
+            continue;
+        epoll_ctl(efd, EPOLL_CTL_DEL, w->fd, NULL);
+        w->fd = -1;
+        dirty = true;
+    }
+}
+
+void PollLoop::every(uint32_t ms, job_t job){
+    if (!ms || !job)
+        return;
+
+    jobs.push_back({ms, esp_timer_get_time() + ms * 1000LL, std::move(job)});
+}
+
+void PollLoop::reap(){
+    watches.erase(std::remove_if(watches.begin(), watches.end(), [](const std::unique_ptr<watch_t> &w){ return w->fd < 0; }), watches.end());
+    dirty = false;
+}
+
+size_t PollLoop::runOnce(uint32_t timeout_ms){
+    int64_t now = esp_timer_get_time();
+    int64_t wake = now + timeout_ms * 1000LL;
+
+    for (size_t i = 0; i != ports.size(); ++i){
+        int64_t t = ports[i]->service(now);
+        if (t && t < wake)
+            wake = t;
+    }
+    for (const auto &j : jobs)
+        wake = std::min(wake, j.next_us);
+
+    int timeout = wake > now ? static_cast<int>((wake - now + 999) / 1000) : 0;
+
+    struct epoll_event evs[POLLQ_MAX_EVENTS];
+    int n = epoll_wait(efd, evs, POLLQ_MAX_EVENTS, timeout);
+
+    for (int i = 0; i < n; ++i){
+        watch_t *w = static_cast<watch_t*>(evs[i].data.ptr);
+        if (w->fd < 0)
+            continue;                   // removed by one of previous handlers
+        if (w->q)
+            w->q->receive();
+        else
+            w->handler(evs[i].events);
+    }
+
+    now = esp_timer_get_time();
+    for (size_t i = 0; i != ports.size(); ++i)
+        ports[i]->service(now);
+
+    // jobs could add new jobs, so iterate by index and call a copy
+    for (size_t i = 0; i != jobs.size(); ++i){
+        if (now < jobs[i].next_us)
+            continue;
+        jobs[i].next_us += jobs[i].period * 1000LL;
+        if (jobs[i].next_us <= now)
+            jobs[i].next_us = now + jobs[i].period * 1000LL;     // skip missed runs
+        job_t job = jobs[i].job;
+        job();
+    }
+
+    if (dirty)
+        reap();
+
+    return n > 0 ? n : 0;
+}
+
+void PollLoop::run(){
+    running = true;
+    while (running)
+        runOnce(1000);
+}
+
+#endif  // __linux__
@@ -0,0 +1,204 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+// Linux host only, serial ports are serviced by epoll loop instead of FreeRTOS tasks
+#ifdef __linux__
+
+#include "msgq.hpp"
+#include <deque>
+#include <vector>
+
+#define POLLQ_REPLY_TIMEOUT     PZEM_UART_TIMEOUT   // ms
+#define POLLQ_FRAME_GAP         10      // ms, incomplete frame is delivered if line is silent for this time
+#define POLLQ_BUF_SIZE          256     // RX buffer, fits max RTU frame
+#define POLLQ_Q_DEPTH           64      // TX queue depth, a whole bus worth of meters could be polled at once
+#define POLLQ_MAX_EVENTS        64      // max epoll events per loop iteration
+
+class PollLoop;
+
+/**
+ * @brief message queue for a serial port (tty, USB-RS485 adapter or pty) on Linux
+ * It has no tasks or threads, all I/O is done by PollLoop the queue is added to.
+ * Requests are sent one at a time, next one is sent once reply has been received or timed out.
+ *
+ * Not thread-safe, must only be used from the loop thread.
+ */
+class PollQ : public MsgQ {
+    friend class PollLoop;
+
+    int fd;
+    bool own;                           // close fd on destruction
+    size_t depth;
+    PollLoop *loop = nullptr;
+    std::deque<TX_msg*> txq;
+    bool busy = false;                  // waiting for reply
+    int64_t deadline_us = 0;            // reply timeout
+    int64_t rx_us = 0;                  // last RX chunk time
+    size_t len = 0;                     // bytes in buffer
+    uint8_t buf[POLLQ_BUF_SIZE];
+
+    // send next message if line is idle
+    void transmit();
+
+    void receive();
+
+    void deliver();
+
+    // handle timeouts, returns time of the next deadline or 0 if there is none
+    int64_t service(int64_t now);
+
+public:
+    /**
+     * @brief open and configure a serial device, 8N1, raw mode
+     *
+     * @param dev - device path, i.e. /dev/ttyUSB0
+     * @param baud - baud rate
+     * @param qdepth - TX queue depth
+     */
+    explicit PollQ(const char *dev, uint32_t baud = PZEM_BAUD_RATE, size_t qdepth = POLLQ_Q_DEPTH);
+
+    /**
+     * @brief use already opened descriptor, i.e. pty master
+     *
+     * @param _fd - file descriptor
+     * @param qdepth - TX queue depth
+     * @param take - close descriptor on destruction
+     */
+    explicit PollQ(int _fd, size_t qdepth = POLLQ_Q_DEPTH, bool take = false);
+    virtual ~PollQ();
+
+    // Copy semantics : forbidden
+    PollQ(const PollQ&) = delete;
+    PollQ& operator=(const PollQ&) = delete;
+
+    /**
+     * @brief enqueue message to be sent once line is idle
+     * this method will take ownership on TX_msg object and 'delete' it
+     *
+     * @return true - if mesage has been enqueue's successfully
+     * @return false - if queue is full or port is not open
+     */
+    bool txenqueue(TX_msg *msg) override;
+
+    /**
+     * @brief check if port has been opened
+     */
+    bool good() const { return fd >= 0; }
+
+    /**
+     * @brief number of messages waiting for transmission
+     */
+    size_t pending() const { return txq.size(); }
+};
+
+
+/**
+ * @brief single-threaded epoll event loop
+ * Services any number of PollQ ports, periodic jobs (i.e. pool polling) and arbitrary descriptors
+ * (i.e. API sockets) from one thread, there is no thread per port.
+ *
+ *  PollLoop loop;
+ *  auto q = new PollQ("/dev/ttyUSB0");
+ *  loop.add(q);
+ *  pool.addPort(std::make_shared<PZPort>(1, q));
+ *  loop.every(1000, [&pool](){ pool.updateMetrics(); });
+ *  loop.run();
+ */
+class PollLoop {
+
+public:
+    typedef std::function<void (void)> job_t;
+    typedef std::function<void (uint32_t events)> fdhandler_t;
+
+private:
+    struct watch_t {
+        int fd;
+        PollQ *q;                       // port, or nullptr for a generic descriptor
+        fdhandler_t handler;
+    };
+
+    struct periodic_t {
+        uint32_t period;                // ms
+        int64_t next_us;
+        job_t job;
+    };
+
+    int efd;
+    std::vector< std::unique_ptr<watch_t> > watches;
+    std::vector<PollQ*> ports;
+    std::vector<periodic_t> jobs;
+    bool running = false;
+    bool dirty = false;                 // some watches were removed during dispatch
+
+    bool watch(watch_t *w);
+
+    void reap();
+
+public:
+    PollLoop();
+    ~PollLoop();
+
+    // Copy semantics : forbidden
+    PollLoop(const PollLoop&) = delete;
+    PollLoop& operator=(const PollLoop&) = delete;
+
+    /**
+     * @brief service a port
+     * port is detached automatically on destruction
+     */
+    bool add(PollQ *q);
+
+    void remove(PollQ *q);
+
+    /**
+     * @brief watch a descriptor for input
+     *
+     * @param fd - descriptor
+     * @param h - handler, called with epoll events
+     */
+    bool watch(int fd, fdhandler_t h);
+
+    /**
+     * @brief stop watching a descriptor, it is safe to call from handler
+     */
+    void unwatch(int fd);
+
+    /**
+     * @brief run a job periodically
+     *
+     * @param ms - period
+     * @param job - job to run, first run is after one period
+     */
+    void every(uint32_t ms, job_t job);
+
+    /**
+     * @brief run one loop iteration
+     *
+     * @param timeout_ms - max time to wait for events
+     * @return size_t - number of descriptor events handled
+     */
+    size_t runOnce(uint32_t timeout_ms);
+
+    /**
+     * @brief run loop until stop() is called
+     */
+    void run();
+
+    /**
+     * @brief make run() return, it is safe to call from handlers and jobs
+     */
+    void stop(){ running = false; }
+};
+
+#endif  // __linux__
@@ -0,0 +1,217 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "prom.hpp"
+
+// metric families, meter_t fields go first
+#define PROM_FAM_METERS         8
+#define PROM_FAM_AGE            8
+#define PROM_FAM_ERR            9
+#define PROM_FAM_PORT_TX        10
+#define PROM_FAM_PORT_RX        11
+#define PROM_FAM_PORT_TXDROP    12
+#define PROM_FAM_PORT_RXERR     13
+#define PROM_FAM_CNT            14
+
+static const char* const fam_help[PROM_FAM_CNT] = {
+    "Voltage", "Current", "Active power", "Active energy", "Frequency", "Power factor",
+    "Alarm (high) state", "Alarm (low) state",
+    "Time since last successful update", "Last error code, 0 - no error",
+    "Messages sent to port", "Messages received from port", "Messages dropped on TX", "RX errors"
+};
+
+static const char* const fam_name[PROM_FAM_CNT - PROM_FAM_METERS] = {
+    "data_age_seconds", "error_code",
+    "port_tx_messages_total", "port_rx_messages_total", "port_tx_dropped_total", "port_rx_errors_total"
+};
+
+// render label value, backslash, quote and new line must be escaped
+static size_t label_escape(char *dst, const char *src, size_t max){
+    size_t n = 0;
+    for (size_t i = 0; src && src[i] && n < max - 2; ++i){
+        char c = src[i];
+        if (c == '\\' || c == '"' || c == '\n'){
+            dst[n++] = '\\';
+            c = c == '\n' ? 'n' : c;
+        }
+        dst[n++] = c;
+    }
+    return n;
+}
+
+// render label set {id="1",name="descr"}
+static uint8_t labels_render(char *dst, uint8_t id, const char *descr){
+    char *p = dst;
+    p += textfmt::fmt_str(p, "{id=\"");
+    p += textfmt::fmt_uint(p, id);
+    p += textfmt::fmt_str(p, "\",name=\"");
+    p += label_escape(p, descr, PROM_LABEL_MAX - (p - dst) - 2);
+    p += textfmt::fmt_str(p, "\"}");
+    return p - dst;
+}
+
+void PromRenderer::begin(){
+    spool.reset();
+    fam = 0;
+    item = 0;
+    hdr = false;
+    present = 0;
+
+    labels.clear();
+    pool->forEachPZEM([this](const PZEM *pz){
+        label_t l;
+        l.pz = pz;
+        l.len = labels_render(l.str, pz->id, pz->getDescr());
+        labels.push_back(l);
+
+        const auto *m = pz->getMetrics();
+        for (uint8_t i = 0; i != PROM_FAM_METERS; ++i)
+            if (m->decimals(static_cast<pzmbus::meter_t>(i)) >= 0)
+                present |= 1 << i;
+        return true;
+    });
+
+    port_labels.clear();
+    pool->forEachPort([this](const PZPort *port){
+        port_label_t l;
+        l.port = port;
+        l.len = labels_render(l.str, port->id, port->getDescr());
+        port_labels.push_back(l);
+        return true;
+    });
+}
+
+size_t PromRenderer::read(char *dst, size_t len){
+    size_t n = 0;
+    while (n != len){
+        if (!spool.pending() && !render())
+            break;
+        n += spool.drain(&dst[n], len - n);
+    }
+    return n;
+}
+
+bool PromRenderer::write(sink_t sink){
+    char chunk[PROM_CHUNK_SIZE];
+    size_t n;
+    while ((n = read(chunk, PROM_CHUNK_SIZE)))
+        if (!sink(chunk, n))
+            return false;
+    return true;
+}
+
+size_t PromRenderer::family_size(uint8_t family) const {
+    if (family < PROM_FAM_METERS)
+        return present & (1 << family) ? labels.size() : 0;
+    if (family < PROM_FAM_PORT_TX)
+        return labels.size();
+    return port_labels.size();
+}
+
+bool PromRenderer::render(){
+    while (fam != PROM_FAM_CNT){
+        size_t cnt = family_size(fam);
+        if (item >= cnt){
+            ++fam;
+            item = 0;
+            hdr = false;
+            continue;
+        }
+
+        if (!hdr){
+            hdr = true;
+            spool.commit(header(spool.buf(), fam));
+            return true;
+        }
+
+        size_t l = sample(spool.buf(), fam, item++);
+        if (l){
+            spool.commit(l);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t PromRenderer::name(char *dst, uint8_t family) const {
+    char *p = dst;
+    p += textfmt::fmt_str(p, PROM_PREFIX);
+    if (family < PROM_FAM_METERS){
+        auto m = static_cast<pzmbus::meter_t>(family);
+        p += textfmt::fmt_str(p, textfmt::meter_name(m));
+        const char *unit = textfmt::meter_unit(m);
+        if (*unit){
+            *p++ = '_';
+            p += textfmt::fmt_str(p, unit);
+        }
+    } else
+        p += textfmt::fmt_str(p, fam_name[family - PROM_FAM_METERS]);
+    return p - dst;
+}
+
+size_t PromRenderer::header(char *dst, uint8_t family) const {
+    char *p = dst;
+    p += textfmt::fmt_str(p, "# HELP ");
+    p += name(p, family);
+    *p++ = ' ';
+    p += textfmt::fmt_str(p, fam_help[family]);
+    p += textfmt::fmt_str(p, "\n# TYPE ");
+    p += name(p, family);
+    p += textfmt::fmt_str(p, family >= PROM_FAM_PORT_TX ? " counter\n" : " gauge\n");
+    return p - dst;
+}
+
+size_t PromRenderer::sample(char *dst, uint8_t family, size_t idx) const {
+    char *p = dst;
+    if (family >= PROM_FAM_PORT_TX){
+        const auto &l = port_labels[idx];
+        const auto &st = l.port->q->getStats();
+        uint32_t v = family == PROM_FAM_PORT_TX ? st.tx : family == PROM_FAM_PORT_RX ? st.rx :
+                     family == PROM_FAM_PORT_TXDROP ? st.tx_drop : st.rx_err;
+        p += name(p, family);
+        memcpy(p, l.str, l.len);
+        p += l.len;
+        *p++ = ' ';
+        p += textfmt::fmt_uint(p, v);
+        *p++ = '\n';
+        return p - dst;
+    }
+
+    const auto &l = labels[idx];
+    const auto *s = l.pz->getState();
+    // no data yet, only error state is reported
+    if (!s->update_us && family != PROM_FAM_ERR)
+        return 0;
+
+    p += name(p, family);
+    memcpy(p, l.str, l.len);
+    p += l.len;
+    *p++ = ' ';
+
+    switch (family){
+        case PROM_FAM_AGE :
+            p += textfmt::fmt_fixed(p, s->dataAge(), 3);          // ms to seconds
+            break;
+        case PROM_FAM_ERR :
+            p += textfmt::fmt_uint(p, static_cast<uint8_t>(s->err));
+            break;
+        default : {
+            size_t n = textfmt::fmt_meter(p, *l.pz->getMetrics(), static_cast<pzmbus::meter_t>(family));
+            if (!n)
+                return 0;           // metric is not supported by this meter
+            p += n;
+        }
+    }
+
+    *p++ = '\n';
+    return p - dst;
+}
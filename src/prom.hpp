@@ -0,0 +1,107 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include "textfmt.hpp"
+#include <vector>
+
+#define PROM_PREFIX             "pzem_" // metric name prefix
+#define PROM_LABEL_MAX          64      // max length of precomputed label set, chars
+#define PROM_CHUNK_SIZE         512     // chunk buffer size for write()
+
+/**
+ * @brief Prometheus text exposition renderer for PZPool
+ * Renders metric families for all pool meters: every supported meter_t field, data age and error state,
+ * plus TX/RX/error counters for every pool port, i.e.
+ *
+ *  # HELP pzem_voltage_volts Voltage
+ *  # TYPE pzem_voltage_volts gauge
+ *  pzem_voltage_volts{id="1",name="PZEM-1"} 230.1
+ *
+ * Label sets are rendered once per meter on begin() and reused for all families. Values are printed
+ * from integers, no floating point formatting is involved. Rendering is resumable into buffers of any size,
+ * memory is only allocated for label cache when pool grows.
+ */
+class PromRenderer {
+
+public:
+    /**
+     * @brief output sink call-back
+     * @return true if data has been consumed, false to abort rendering
+     */
+    typedef std::function<bool (const char *data, size_t len)> sink_t;
+
+private:
+    struct label_t {
+        const PZEM *pz;
+        uint8_t len;
+        char str[PROM_LABEL_MAX];
+    };
+
+    struct port_label_t {
+        const PZPort *port;
+        uint8_t len;
+        char str[PROM_LABEL_MAX];
+    };
+
+    const PZPool *pool;
+    textfmt::LineSpool spool;
+    std::vector<label_t> labels;            // per-meter label cache
+    std::vector<port_label_t> port_labels;  // per-port label cache
+    uint8_t present = 0;                    // mask of meter_t fields supported by any of the meters
+    uint8_t fam = 0;                        // current metric family
+    size_t item = 0;                        // current item in a family
+    bool hdr = false;                       // family header has been rendered
+
+    // render next record into spool, return false when there is nothing left
+    bool render();
+
+    size_t header(char *dst, uint8_t family) const;
+
+    size_t sample(char *dst, uint8_t family, size_t idx) const;
+
+    size_t family_size(uint8_t family) const;
+
+    size_t name(char *dst, uint8_t family) const;
+
+public:
+    explicit PromRenderer(const PZPool *_pool) : pool(_pool) {}
+
+    // Copy semantics : forbidden
+    PromRenderer(const PromRenderer&) = delete;
+    PromRenderer& operator=(const PromRenderer&) = delete;
+
+    /**
+     * @brief start a new scrape
+     * refreshes label cache, pool must not change until rendering is done
+     */
+    void begin();
+
+    /**
+     * @brief render next portion of exposition data
+     *
+     * @param dst - destination buffer
+     * @param len - buffer size
+     * @return size_t - number of bytes written, 0 when rendering is done
+     */
+    size_t read(char *dst, size_t len);
+
+    /**
+     * @brief render full scrape to a sink in PROM_CHUNK_SIZE chunks
+     *
+     * @param sink - output call-back
+     * @return true if all data was consumed by sink
+     */
+    bool write(sink_t sink);
+};
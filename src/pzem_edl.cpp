@@ -102,8 +102,11 @@ bool PZEM::autopoll(bool newstate){
     }
 
     // disable timer otherwise
-    if (t_poller)
-        return xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+    if (t_poller){
+        bool ok = xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+        t_poller = nullptr;
+        return ok;
+    }
 
     return false;   // last resort state
 }
@@ -185,22 +188,224 @@ void PZ003::resetEnergyCounter(){
 
 
 
+// ****  PZAggregate Implementation  **** //
+PZAggregate::PZAggregate(uint8_t _id, const char *_descr) : id(_id) {
+    if (!_descr || !*_descr){
+        descr.reset(new char[9]);   // i.e. AGGR-123
+        sprintf(descr.get(), "AGGR-%d", id);
+    }  else
+        descr.reset(strcpy(new char[strlen(_descr) + 1], _descr));
+    lock = xSemaphoreCreateMutex();
+}
+
+PZAggregate::~PZAggregate(){
+    vSemaphoreDelete(lock);
+}
+
+bool PZAggregate::addMember(uint8_t pzem_id, float weight){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (const auto& m : members){
+        if (m.id == pzem_id){
+            xSemaphoreGive(lock);
+            return false;
+        }
+    }
+
+    members.emplace_back(pzem_id, weight);
+    xSemaphoreGive(lock);
+    return true;
+}
+
+bool PZAggregate::removeMember(uint8_t pzem_id){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto m = members.begin(); m != members.end(); ++m){
+        if (m->id != pzem_id)
+            continue;
+
+        if (m->seen){
+            psum -= m->p; isum -= m->i; esum -= m->e; ssum -= m->s;
+            if (m->v) { vsum -= m->v; --vcnt; }
+            if (m->f) { fsum -= m->f; --fcnt; }
+        }
+        members.erase(m);
+        xSemaphoreGive(lock);
+        return true;
+    }
+    xSemaphoreGive(lock);
+    return false;
+}
+
+bool PZAggregate::update(const PZEM *pz){
+    if (!pz)
+        return false;
+
+    // every reply of the pool is offered to every aggregate, metrics are decoded for members only
+    bool member = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (const auto& m : members){
+        if (m.id == pz->id){
+            member = true;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    if (!member)
+        return false;
+
+    const pzmbus::state *st = pz->getState();
+    if (!st->update_us)
+        return true;            // no data from the member yet
+
+    // convert member's metrics into PZEM004 raw units: dV, mA, dW, Wh, dHz
+    // it is done without the lock, metrics are decoded under the state's own lock
+    uint32_t v = 0, i = 0, p = 0, e = 0, f = 0;
+    switch (st->model){
+        case pzmbus::pzmodel_t::pzem004v3 : {
+            const auto *d = static_cast<const pz004::metrics*>(pz->getMetrics());
+            v = d->voltage; i = d->current; p = d->power; e = d->energy; f = d->freq;
+            break;
+        }
+        case pzmbus::pzmodel_t::pzem003 : {
+            const auto *d = static_cast<const pz003::metrics*>(pz->getMetrics());
+            v = d->voltage / 10; i = d->current * 10; p = d->power; e = d->energy;
+            break;
+        }
+        default:
+            return true;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto& m : members){
+        if (m.id != pz->id)
+            continue;
+
+        // subtract old contribution
+        if (m.seen){
+            psum -= m.p; isum -= m.i; esum -= m.e; ssum -= m.s;
+            if (m.v) { vsum -= m.v; --vcnt; }
+            if (m.f) { fsum -= m.f; --fcnt; }
+        }
+
+        // add the new one
+        m.p = llroundf(p * m.weight);
+        m.i = llroundf(i * m.weight);
+        m.e = llroundf(e * m.weight);
+        m.s = llroundf(static_cast<float>(v) * i / 1000 * m.weight);   // dV*mA/1000 = 0.1 VA, same scale as power
+        m.v = v; m.f = f;
+        psum += m.p; isum += m.i; esum += m.e; ssum += m.s;
+        if (m.v) { vsum += m.v; ++vcnt; }
+        if (m.f) { fsum += m.f; ++fcnt; }
+
+        m.seen = true;
+        m.update_us = st->update_us;
+        update_us = esp_timer_get_time();
+        xSemaphoreGive(lock);
+        return true;
+    }
+
+    xSemaphoreGive(lock);
+    return false;
+}
+
+pz004::metrics PZAggregate::getMetrics() const {
+    pz004::metrics m;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    m.power   = psum > 0 ? psum : 0;
+    m.current = isum > 0 ? isum : 0;
+    m.energy  = esum > 0 ? esum : 0;
+    m.voltage = vcnt ? vsum / vcnt : 0;
+    m.freq    = fcnt ? fsum / fcnt : 0;
+    m.pf      = ssum > 0 ? psum * 100 / ssum : 0;
+    xSemaphoreGive(lock);
+    if (m.pf > 100) m.pf = 100;
+    return m;
+}
+
+bool PZAggregate::dataStale() const {
+    int64_t t = esp_timer_get_time();
+    bool stale = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (const auto& m : members){
+        if (!m.seen || t - m.update_us > 2 * PZEM_REFRESH_PERIOD * 1000){
+            stale = true;
+            break;
+        }
+    }
+    xSemaphoreGive(lock);
+    return stale;
+}
+
+int64_t PZAggregate::dataAge() const {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t oldest = update_us;
+    for (const auto& m : members){
+        if (m.update_us < oldest)
+            oldest = m.update_us;
+    }
+    xSemaphoreGive(lock);
+    return (esp_timer_get_time() - oldest)/1000;
+}
+
+int64_t PZAggregate::getUpdateTime() const {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t t = update_us;
+    xSemaphoreGive(lock);
+    return t;
+}
+
+
 /*   === PZPool immplementation ===   */
 
+PZPool::PZPool() : topo(std::allocate_shared<topology_t>(pool_alloc<topology_t>())) {
+    wlock = xSemaphoreCreateMutex();
+}
+
+PZPool::~PZPool(){
+    if (t_poller)
+        xTimerDelete(t_poller, TIMER_CMD_TIMEOUT);
+    vSemaphoreDelete(wlock);
+}
+
+bool PZPool::update(std::function<bool (topology_t &t)> f){
+    xSemaphoreTake(wlock, portMAX_DELAY);
+    auto t = std::allocate_shared<topology_t>(pool_alloc<topology_t>(), *snapshot());
+    bool ok = f(*t);
+    if (ok)
+        std::atomic_store(&topo, topology_ptr(std::move(t)));   // old snapshot is released by it's last reader
+    xSemaphoreGive(wlock);
+    return ok;
+}
+
 bool PZPool::addPort(uint8_t _id, UART_cfg &portcfg, const char *descr){
     if (port_by_id(_id))
         return false;       // port with such id already exist
 
-    auto p = std::make_shared<PZPort>(_id, portcfg, descr);
+    auto p = std::allocate_shared<PZPort>(pool_alloc<PZPort>(), _id, portcfg, descr);
     return addPort(p);
 }
 
+bool PZPool::add_port(topology_t &t, const std::shared_ptr<PZPort> &port){
+    if (!port)
+        return false;
+
+    for (const auto &i : t.ports)
+        if (i->id == port->id)
+            return false;       // port with such id already exist
+
+    t.ports.emplace_back(port);
+    return true;
+}
+
 bool PZPool::addPort(std::shared_ptr<PZPort> port){
-    if (port_by_id(port->id))
-        return false;       // port with such id already exist
+    if (!update([&port](topology_t &t){ return add_port(t, port); }))
+        return false;
+
+    attach_port(port.get());
+    return true;
+}
 
+void PZPool::attach_port(PZPort *port){
     uint8_t portid = port->id;
-    ports.emplace_back(port);
 
     // RX handler lambda catches port-id here and suppies this id to the handler function
     port->q->attach_RX_hndlr([this, portid](RX_msg *msg){
@@ -210,8 +415,6 @@ bool PZPool::addPort(std::shared_ptr<PZPort> port){
             rx_dispatcher(msg, portid);
             delete msg;     // must delete the message once processed, otherwise it will leak mem
       });
-
-    return true;
 }
 
 // TODO: возвращать код ошибки
@@ -248,16 +451,34 @@ bool PZPool::addPZEM(const uint8_t port_id, const uint8_t pzem_id, uint8_t modbu
 
 // TODO: возвращать код ошибки
 bool PZPool::addPZEM(const uint8_t port_id, PZEM *pz){
+    if (!pz)
+        return false;
+
+    // caller keeps the object if it was not added
+    std::unique_ptr<PZEM> p(pz);
+    bool ok = update([port_id, &p](topology_t &t){ return add_pzem(t, port_id, p); });
+    p.release();
+    return ok;
+}
 
+bool PZPool::add_pzem(topology_t &t, uint8_t port_id, std::unique_ptr<PZEM> &pz){
     // reject objects with catch-all or invalid address
-    if (pz->getaddr() < ADDR_MIN || pz->getaddr() > ADDR_MAX)
+    if (!pz || pz->getaddr() < ADDR_MIN || pz->getaddr() > ADDR_MAX)
         return false;
 
-    auto p = port_by_id(port_id);
+    std::shared_ptr<PZPort> p;
+    for (const auto &i : t.ports)
+        if (i->id == port_id)
+            p = i;
+
     if (!p)             // reject non-existing ports
         return false;
 
-    auto node = std::make_shared<PZNode>();
+    for (const auto &i : t.meters)
+        if (i->pzem->id == pz->id)
+            return false;       // pzem with this id already exist
+
+    auto node = std::allocate_shared<PZNode>(pool_alloc<PZNode>());
     node->port = p;
 
     // detach existing rx call-back (if any)
@@ -269,20 +490,84 @@ bool PZPool::addPZEM(const uint8_t port_id, PZEM *pz){
     // and attach our port  (TX-only!)
     pz->attachMsgQ(node->port.get()->q.get(), true);
 
-    node->pzem.reset(std::move(pz));
+    node->pzem = std::move(pz);
+
+    t.meters.emplace_back(std::move(node));
+    return true;
+}
+
+bool PZPool::addBatch(const std::vector< std::shared_ptr<PZPort> > &ports, std::vector< std::pair<uint8_t, std::unique_ptr<PZEM>> > meters){
+    // objects moved to the nodes of a rejected copy are destroyed with it, the rest - with 'meters'
+    bool ok = update([&ports, &meters](topology_t &t){
+        for (const auto &p : ports)
+            if (!add_port(t, p))
+                return false;
+
+        for (auto &m : meters)
+            if (!add_pzem(t, m.first, m.second))
+                return false;
+
+        return true;
+    });
+    if (!ok)
+        return false;
+
+    for (const auto &p : ports)
+        attach_port(p.get());
 
-    meters.emplace_back(std::move(node));
     return true;
 }
 
 bool PZPool::removePZEM(const uint8_t pzem_id){
-    for (auto i = meters.begin(); i != meters.end(); ++i ){
-        if ((*i)->pzem->id == pzem_id){
-            meters.erase(i);
-            return true;
-        }        
+    // PZEM object is destroyed once the last snapshot referencing it is released
+    return update([pzem_id](topology_t &t){
+        for (auto i = t.meters.begin(); i != t.meters.end(); ++i ){
+            if ((*i)->pzem->id == pzem_id){
+                t.meters.erase(i);
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+bool PZPool::addAggregate(std::shared_ptr<PZAggregate> a){
+    if (!a)
+        return false;
+
+    return update([&a](topology_t &t){
+        for (const auto& i : t.aggregates)
+            if (i->id == a->id)
+                return false;       // aggregate with such id already exist
+
+        // account current state of the members
+        for (const auto& i : t.meters)
+            a->update(i->pzem.get());
+
+        t.aggregates.emplace_back(std::move(a));
+        return true;
+    });
+}
+
+bool PZPool::removeAggregate(uint8_t id){
+    return update([id](topology_t &t){
+        for (auto i = t.aggregates.begin(); i != t.aggregates.end(); ++i ){
+            if ((*i)->id == id){
+                t.aggregates.erase(i);
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+std::shared_ptr<const PZAggregate> PZPool::getAggregate(uint8_t id) const {
+    auto t = snapshot();
+    for (const auto& i : t->aggregates){
+        if (i->id == id)
+            return i;
     }
-    return false;
+    return nullptr;
 }
 
 void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
@@ -291,17 +576,28 @@ void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
         #ifdef PZEM_EDL_DEBUG
         ESP_LOGW(TAG, "RX packet CRC err");
         #endif
+        if (stray_callback)
+            stray_callback(port_id, msg);       // could be a part of a long reply for other device
         return;
     }
-    
+
+    // snapshot keeps nodes alive even if they are removed from the pool during dispatch
+    auto t = snapshot();
+
     //  ищем объект совпадающий по паре порт/modbus_addr
-    for (const auto& i : meters){
+    for (const auto& i : t->meters){
         if (i->pzem->getaddr() == msg->addr && i->port->id == port_id){
             #ifdef PZEM_EDL_DEBUG
             ESP_LOGD(TAG, "Got match PZEM Node for port:%d , addr:%d\n", port_id, msg->addr);
             #endif
             i->pzem->rx_sink(msg);
 
+            for (const auto& a : t->aggregates)
+                a->update(i->pzem.get());
+
+            if (reply_hook)
+                reply_hook(i->pzem->id, msg);
+
             if (rx_callback)
                 rx_callback(i->pzem->id, msg);       // run external call-back function (if set)
             return;
@@ -310,15 +606,19 @@ void PZPool::rx_dispatcher(const RX_msg *msg, const uint8_t port_id){
 #ifdef PZEM_EDL_DEBUG
     ESP_LOGD(TAG, "Stray packet, no matching PZEM found");
 #endif
+    if (stray_callback)
+        stray_callback(port_id, msg);
 }
 
 void PZPool::updateMetrics(){
-    for (const auto& i : meters)
+    auto t = snapshot();
+    for (const auto& i : t->meters)
        i->pzem->updateMetrics();
 }
 
-std::shared_ptr<PZPort> PZPool::port_by_id(uint8_t id){
-    for (auto i : ports){
+std::shared_ptr<PZPort> PZPool::port_by_id(uint8_t id) const {
+    auto t = snapshot();
+    for (const auto &i : t->ports){
         if (i->id == id)
             return i;
     }
@@ -326,18 +626,13 @@ std::shared_ptr<PZPort> PZPool::port_by_id(uint8_t id){
     return nullptr;
 }
 
-const PZEM* PZPool::pzem_by_id(uint8_t id) const {
-    for (auto i = meters.cbegin(); i != meters.cend(); ++i){
-        if (i->get()->pzem->id == id)
-            return i->get()->pzem.get();
-    }
-
-/*
-    for (const auto &i : std::as_const(meters)){        // std::as_const req c++17
+std::shared_ptr<const PZEM> PZPool::pzem_by_id(uint8_t id) const {
+    auto t = snapshot();
+    for (const auto &i : t->meters){
         if (i->pzem->id == id)
-            return i->pzem.get();
+            return std::shared_ptr<const PZEM>(i, i->pzem.get());     // aliased to the node owning PZEM
     }
-*/
+
     return nullptr;
 }
 
@@ -366,8 +661,11 @@ bool PZPool::autopoll(bool newstate){
     }
 
     // disable timer otherwise
-    if (t_poller)
-        return xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+    if (t_poller){
+        bool ok = xTimerDelete(t_poller, TIMER_CMD_TIMEOUT) == pdPASS;
+        t_poller = nullptr;
+        return ok;
+    }
 
     return false;   // last resort state
 }
@@ -376,13 +674,17 @@ size_t PZPool::getPollrate() const {
     if (t_poller)
         return pdTICKS_TO_MS( xTimerGetPeriod( t_poller ));
 
-    return 0;
+    return poll_period;
 }
 
 bool PZPool::setPollrate(size_t t){
     if (t < POLLER_MIN_PERIOD)
         return false;
 
+    poll_period = t;
+    if (!t_poller)
+        return true;        // new rate will be applied once poller is started
+
     return ( xTimerChangePeriod( t_poller, t / portTICK_PERIOD_MS, TIMER_CMD_TIMEOUT ) == pdPASS );
 }
 
@@ -392,35 +694,98 @@ void PZPool::attach_rx_callback(rx_callback_t f){
     rx_callback = std::move(f);
 }
 
-const char* PZPool::getDescr(uint8_t id) const {
-    const PZEM* p = pzem_by_id(id);
+std::shared_ptr<const char> PZPool::getDescr(uint8_t id) const {
+    auto p = pzem_by_id(id);
     if (p){
-        return p->getDescr();
+        return std::shared_ptr<const char>(p, p->getDescr());
     }
     
     return nullptr;
 };
 
-const pzmbus::state* PZPool::getState(uint8_t id) const {
-    const auto *pz = pzem_by_id(id);
+std::shared_ptr<const pzmbus::state> PZPool::getState(uint8_t id) const {
+    auto pz = pzem_by_id(id);
 
     if (pz)
-        return pz->getState();
+        return std::shared_ptr<const pzmbus::state>(pz, pz->getState());
 
     return nullptr;
 };
 
-const pzmbus::metrics* PZPool::getMetrics(uint8_t id) const {
-    const auto *pz = pzem_by_id(id);
+std::shared_ptr<const pzmbus::metrics> PZPool::getMetrics(uint8_t id) const {
+    auto pz = pzem_by_id(id);
 
     if (pz)
-        return pz->getMetrics();
+        return std::shared_ptr<const pzmbus::metrics>(pz, pz->getMetrics());
+
+    return nullptr;
+}
+
+std::shared_ptr<const pzmbus::regimage_t> PZPool::getRegImage(uint8_t id, uint8_t fc) const {
+    auto pz = pzem_by_id(id);
+
+    if (pz && pz->getRegImage(fc))
+        return std::shared_ptr<const pzmbus::regimage_t>(pz, pz->getRegImage(fc));
+
+    return nullptr;
+}
+
+size_t PZPool::forEachPZEM(std::function<bool (const PZEM *pz)> f, size_t skip) const {
+    auto t = snapshot();
+    size_t cnt = 0;
+    for (const auto &i : t->meters){
+        if (skip){
+            --skip;
+            continue;
+        }
+        ++cnt;
+        if (!f(i->pzem.get()))
+            break;
+    }
+    return cnt;
+}
+
+size_t PZPool::forEachPort(std::function<bool (const PZPort *port)> f, size_t skip) const {
+    auto t = snapshot();
+    size_t cnt = 0;
+    for (const auto &i : t->ports){
+        if (skip){
+            --skip;
+            continue;
+        }
+        ++cnt;
+        if (!f(i.get()))
+            break;
+    }
+    return cnt;
+}
+
+MsgQ* PZPool::getPortQueue(uint8_t port_id){
+    auto p = port_by_id(port_id);
+    return p ? p->q.get() : nullptr;
+}
+
+bool PZPool::restoreRegImage(uint8_t id, uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us){
+    auto t = snapshot();
+    for (const auto &i : t->meters){
+        if (i->pzem->id == id)
+            return i->pzem->restoreRegImage(fc, data, len, update_us);
+    }
+    return false;
+}
 
+std::shared_ptr<const PZPort> PZPool::getPZEMPort(uint8_t id) const {
+    auto t = snapshot();
+    for (const auto &i : t->meters){
+        if (i->pzem->id == id)
+            return i->port;
+    }
     return nullptr;
 }
 
 void PZPool::resetEnergyCounter(uint8_t pzem_id){
-    for (auto &i : meters){
+    auto t = snapshot();
+    for (const auto &i : t->meters){
         if (i->pzem->id == pzem_id){
             i->pzem->resetEnergyCounter();
             return;
@@ -428,6 +793,16 @@ void PZPool::resetEnergyCounter(uint8_t pzem_id){
     }
 }
 
+bool PZPool::txenqueue(uint8_t pzem_id, TX_msg *msg){
+    auto t = snapshot();
+    for (const auto& i : t->meters){
+        if (i->pzem->id == pzem_id)
+            return i->port->q->txenqueue(msg);
+    }
+
+    delete msg;         // message must be destroyed anyway
+    return false;
+}
 
 #ifdef ARDUINO
 void FakeMeterPZ004::reset(){
@@ -14,8 +14,11 @@ GitHub: https://github.com/vortigont/pzem-edl
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "pzem_modbus.hpp"
 #include <list>
+#include <memory>
+#include <vector>
 
 #define POLLER_PERIOD       PZEM_REFRESH_PERIOD         // auto update period in ms
 #define POLLER_MIN_PERIOD   2*PZEM_UART_TIMEOUT         // minimal poller period
@@ -55,6 +58,8 @@ public:
     PZEM(const PZEM&) = delete;
     PZEM& operator=(const PZEM&) = delete;
 
+    MEMSTAT_CLASS(memstat::tag_t::pool)
+
     bool active = true;     // Active/disabled state
 
     /**
@@ -165,6 +170,28 @@ public:
      */
     virtual const pzmbus::metrics* getMetrics() const = 0; // const { return &pz.data; }
 
+    /**
+     * @brief Get raw register image of the last read reply
+     * it is kept as received from device and does not trigger metrics decoding
+     *
+     * @param fc - CMD_RIR or CMD_RHR
+     * @return const pzmbus::regimage_t*, nullptr if not supported
+     */
+    virtual const pzmbus::regimage_t* getRegImage(uint8_t fc) const { return nullptr; }
+
+    /**
+     * @brief restore state from a saved register image
+     * image is parsed as a regular read reply, but restored data is never considered fresh,
+     * see pzmbus::restore() for details. RX call-back is not triggered
+     *
+     * @param fc - CMD_RIR or CMD_RHR
+     * @param data - registers payload in MODBUS byte order
+     * @param len - payload length, bytes
+     * @param update_us - image capture time, us since boot, 0 - unknown
+     * @return true if image has been accepted
+     */
+    virtual bool restoreRegImage(uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us = 0){ return false; }
+
     /**
      * @brief send a command to PZEM device to reset it's internal energy counter
      * 
@@ -225,16 +252,20 @@ public:
      * 
      * @return const pzmbus::state& 
      */
-    const pzmbus::state* getState() const override { return &pz; }
-    const pz004::state*  getStatePZ004() const { return &pz; }
+    const pzmbus::state* getState() const override { pz.sync(); return &pz; }
+    const pz004::state*  getStatePZ004() const { pz.sync(); return &pz; }
 
     /**
      * @brief Get the PZEM Metrics object
      * it contains all electric metrics for PZEM device
      * @return const pzmbus::metrics&
      */
-    const pzmbus::metrics* getMetrics() const override { return &pz.data; }
-    const pz004::metrics*  getMetricsPZ004() const { return &pz.data; }
+    const pzmbus::metrics* getMetrics() const override { pz.sync(); return &pz.data; }
+    const pz004::metrics*  getMetricsPZ004() const { pz.sync(); return &pz.data; }
+
+    const pzmbus::regimage_t* getRegImage(uint8_t fc) const override { return fc == CMD_RIR ? &pz.rir : &pz.rhr; }
+
+    bool restoreRegImage(uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us = 0) override { return pzmbus::restore(pz, fc, data, len, update_us); }
 
     /**
      * @brief A sink for RX messages
@@ -297,16 +328,20 @@ public:
      * 
      * @return const pzmbus::state*
      */
-    const pzmbus::state* getState() const override { return &pz; }
-    const pz003::state*  getStatePZ003() const { return &pz; }
+    const pzmbus::state* getState() const override { pz.sync(); return &pz; }
+    const pz003::state*  getStatePZ003() const { pz.sync(); return &pz; }
 
     /**
      * @brief Get the PZEM Metrics object
      * it contains all electric metrics for PZEM device
      * @return const pzmbus::metrics*
      */
-    const pzmbus::metrics* getMetrics() const override { return &pz.data; }
-    const pz003::metrics*  getMetricsPZ003() const { return &pz.data; }
+    const pzmbus::metrics* getMetrics() const override { pz.sync(); return &pz.data; }
+    const pz003::metrics*  getMetricsPZ003() const { pz.sync(); return &pz.data; }
+
+    const pzmbus::regimage_t* getRegImage(uint8_t fc) const override { return fc == CMD_RIR ? &pz.rir : &pz.rhr; }
+
+    bool restoreRegImage(uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us = 0) override { return pzmbus::restore(pz, fc, data, len, update_us); }
 
     /**
      * @brief A sink for RX messages
@@ -323,10 +358,117 @@ public:
     void resetEnergyCounter() override;
 };
 
+/**
+ * @brief Virtual aggregate meter - a weighted sum of PZEM devices
+ * i.e. a site total or a distribution board sum.
+ * Aggregate is updated incrementally on each member update - member's previous contribution
+ * is subtracted and the new one is added, so there is no need to iterate all pool meters
+ * on every request. Power, current and energy are summed, voltage and frequency are averaged,
+ * power factor is derived from summed active and apparent power.
+ * Values are kept in PZEM004 raw units, so aggregate could be pushed into TimeSeries<pz004::metrics>
+ * like a real meter.
+ */
+class PZAggregate {
+
+    // member's last contribution to the sums
+    struct member_t {
+        uint8_t id;                     // PZEM id
+        float weight;                   // member weight
+        int64_t update_us = 0;          // member's last update time
+        int64_t p = 0, i = 0, e = 0, s = 0;     // weighted power, current, energy, apparent power
+        uint32_t v = 0, f = 0;          // voltage, frequency
+        bool seen = false;              // member has been updated at least once
+        member_t(uint8_t _id, float w) : id(_id), weight(w) {}
+    };
+
+    std::unique_ptr<char[]> descr;      // Mnemonic name for the instance
+    std::vector<member_t> members;
+    int64_t psum = 0, isum = 0, esum = 0, ssum = 0;
+    uint32_t vsum = 0, fsum = 0, vcnt = 0, fcnt = 0;
+    int64_t update_us = 0;              // last update time
+    SemaphoreHandle_t lock;             // sums are updated from RX task and read from any other
+
+public:
+    const uint8_t id;                   // aggregate unique ID
+
+    explicit PZAggregate(uint8_t _id, const char *_descr = nullptr);
+    ~PZAggregate();
+
+    // Copy semantics : forbidden
+    PZAggregate(const PZAggregate&) = delete;
+    PZAggregate& operator=(const PZAggregate&) = delete;
+
+    /**
+     * @brief add a pool member to the aggregate
+     *
+     * @param pzem_id - PZEM id in a pool
+     * @param weight - member weight, i.e. -1 to subtract a sub-meter from the total
+     * @return true on success
+     * @return false if member with this id already exist
+     */
+    bool addMember(uint8_t pzem_id, float weight = 1.0);
+
+    /**
+     * @brief remove member from the aggregate, it's contribution is subtracted from the sums
+     *
+     * @param pzem_id - PZEM id in a pool
+     * @return true if member was found and removed
+     */
+    bool removeMember(uint8_t pzem_id);
+
+    /**
+     * @brief update aggregate with member's new state
+     *
+     * @param pz - PZEM object
+     * @return true if PZEM is a member of the aggregate
+     * @return false otherwise
+     */
+    bool update(const PZEM *pz);
+
+    /**
+     * @brief get aggregated metrics in PZEM004 raw units
+     *
+     * @return pz004::metrics
+     */
+    pz004::metrics getMetrics() const;
+
+    /**
+     * @brief aggregate is stale if any of it's members has never been updated or it's data is stale
+     * i.e. sum mixes samples of too different ages
+     *
+     * @return true if stale
+     */
+    bool dataStale() const;
+
+    /**
+     * @brief return age of the oldest member's data in ms
+     *
+     * @return int64_t age time in ms
+     */
+    int64_t dataAge() const;
+
+    /**
+     * @brief return last update time, us since boot
+     */
+    int64_t getUpdateTime() const;
+
+    /**
+     * @brief return description string as 'const char*'
+     */
+    const char *getDescr() const { return descr.get(); };
+};
+
+
 /**
  * @brief a pool object that incorporates PZEM devices, UART ports and it's mapping
  * 
  * only PZEM004's are supported as pool members (so far)
+ *
+ * Pool topology (ports, meters and aggregates) is an immutable reference-counted snapshot. RX dispatch,
+ * polling and iterators take a reference to the current snapshot and work with it without locks.
+ * Add/remove methods copy the snapshot, modify the copy and publish it atomically, so the pool could be
+ * reconfigured while polling is running. Objects removed from the pool are destroyed once the last snapshot
+ * referencing them is released, i.e. after the dispatch that is in progress has finished.
  */
 class PZPool {
 
@@ -340,14 +482,55 @@ class PZPool {
     };
 
 protected:
-    std::list< std::shared_ptr<PZPort> > ports;                           // list of registered ports
-    std::list< std::shared_ptr<PZNode> > meters;                          // list of registered PZEM nodes
-    std::shared_ptr<PZPort> port_by_id(uint8_t id);
-    const PZEM* pzem_by_id(uint8_t id) const;
+    // pool's own allocations are accounted under memstat::tag_t::pool
+    template <class T>
+    using pool_alloc = memstat::allocator<T, memstat::tag_t::pool>;
+
+    template <class T>
+    using pool_vector = std::vector<T, pool_alloc<T>>;
+
+    struct topology_t {
+        pool_vector< std::shared_ptr<PZPort> > ports;                     // registered ports
+        pool_vector< std::shared_ptr<PZNode> > meters;                    // registered PZEM nodes
+        pool_vector< std::shared_ptr<PZAggregate> > aggregates;           // registered aggregate meters
+    };
+    typedef std::shared_ptr<const topology_t> topology_ptr;
+
+    /**
+     * @brief take a reference to the current topology snapshot
+     * snapshot is never modified, it stays valid as long as reference is held
+     */
+    topology_ptr snapshot() const { return std::atomic_load(&topo); }
+
+    /**
+     * @brief copy-on-write update of topology
+     * writers are serialized, mutator works on a private copy that is published if mutator returns true
+     *
+     * @param f - mutator function
+     * @return bool - mutator's result
+     */
+    bool update(std::function<bool (topology_t &t)> f);
 
+    std::shared_ptr<PZPort> port_by_id(uint8_t id) const;
+    // returned pointer keeps PZEM's node alive even if it is removed from the pool
+    std::shared_ptr<const PZEM> pzem_by_id(uint8_t id) const;
+
+    // add port to a topology copy under update()
+    static bool add_port(topology_t &t, const std::shared_ptr<PZPort> &port);
+
+    // add PZEM to a topology copy under update(), takes ownership of pz on success
+    static bool add_pzem(topology_t &t, uint8_t port_id, std::unique_ptr<PZEM> &pz);
+
+    // redirect port's RX messages to dispatcher
+    void attach_port(PZPort *port);
+
+private:
+    topology_ptr topo;                              // current snapshot, accessed with atomic_load/atomic_store only
+    SemaphoreHandle_t wlock;                        // serializes topology writers
 
 public:
-    PZPool() = default;
+    PZPool();
+    ~PZPool();
     // Copy semantics : not implemented
     PZPool(const PZPool&) = delete;
     PZPool& operator=(const PZPool&) = delete;
@@ -388,6 +571,18 @@ public:
     bool addPZEM(const uint8_t port_id, const uint8_t pzem_id, uint8_t modbus_addr, pzmbus::pzmodel_t model, const char *descr = nullptr);
     bool addPZEM(const uint8_t port_id, PZEM *pz);
 
+    /**
+     * @brief register a set of ports and PZEM objects with a single topology update
+     * readers see either none or all of the new objects. PZEMs could be attached to new ports
+     * or to the ports already registered in the pool
+     *
+     * @param ports - ports to add
+     * @param meters - pairs of port id and PZEM object, pool takes ownership, objects are destroyed on failure
+     * @return true - on success
+     * @return false - on any error, pool is not changed
+     */
+    bool addBatch(const std::vector< std::shared_ptr<PZPort> > &ports, std::vector< std::pair<uint8_t, std::unique_ptr<PZEM>> > meters);
+
     /**
      * @brief check if the port with spefied id exist in a pool
      * 
@@ -413,6 +608,32 @@ public:
      */
     bool removePZEM(const uint8_t pzem_id);
 
+    /**
+     * @brief register aggregate meter in the pool
+     * aggregate will be updated each time any of it's members receives new data
+     *
+     * @param a - shared pointer to aggregate object
+     * @return true - on success
+     * @return false - if aggregate with same id already exist
+     */
+    bool addAggregate(std::shared_ptr<PZAggregate> a);
+
+    /**
+     * @brief remove aggregate meter from the pool
+     *
+     * @param id - aggregate id
+     * @return true if removed
+     */
+    bool removeAggregate(uint8_t id);
+
+    /**
+     * @brief Get aggregate meter with specific id
+     *
+     * @param id - aggregate id
+     * @return shared pointer to aggregate or nullptr if aggregate with specified id does not exist
+     */
+    std::shared_ptr<const PZAggregate> getAggregate(uint8_t id) const;
+
     /**
      * @brief external callback function
      * it is fed with a ref to every incoming message along with instance ID
@@ -426,6 +647,44 @@ public:
      */
     inline void detach_rx_callback(){rx_callback = nullptr;}
 
+    /**
+     * @brief external callback for stray messages
+     * it is fed with messages that do not belong to any PZEM in a pool, including ones with bad CRC,
+     * along with port ID. Could be used to serve other devices sharing the bus, i.e. with MBMaster
+     *
+     * @param f callback function prototype: std::function<void (uint8_t port_id, const RX_msg*)>
+     */
+    void attach_stray_callback(rx_callback_t f){ if (f) stray_callback = std::move(f); }
+
+    /**
+     * @brief detach stray messages callback
+     */
+    inline void detach_stray_callback(){stray_callback = nullptr;}
+
+    /**
+     * @brief reply hook
+     * it is fed with every valid message matched to a pool PZEM along with it's ID, before rx_callback.
+     * Meant for gateways that forward client requests to meters and need device's reply, i.e. MBTCPGateway.
+     * There is a single hook per pool
+     *
+     * @param f callback function prototype: std::function<void (uint8_t id, const RX_msg*)>
+     */
+    void attach_reply_hook(rx_callback_t f){ if (f) reply_hook = std::move(f); }
+
+    /**
+     * @brief detach reply hook
+     */
+    inline void detach_reply_hook(){reply_hook = nullptr;}
+
+    /**
+     * @brief get message queue of a port
+     * could be used to send messages to other devices sharing the bus
+     *
+     * @param port_id - port id
+     * @return MsgQ*, nullptr if port with specified id does not exist
+     */
+    MsgQ* getPortQueue(uint8_t port_id);
+
     /**
      * @brief get auto-poll timer state - active/disabled
      * 
@@ -476,39 +735,104 @@ public:
      */
     void resetEnergyCounter(uint8_t pzem_id);
 
+    /**
+     * @brief enqueue a raw message to the port of PZEM device with specific id
+     * this method will take ownership on TX_msg object and 'delete' it
+     * after sending to FIFO. It is an error to access/delete/change this object once passed here.
+     * Reply, if any, is dispatched to the PZEM object as usual
+     * NOTE: pzem_id is NOT a MODBUS address, it's PZEM id in a pool
+     *
+     * @param pzem_id - PZEM id in a pool
+     * @param msg - message object
+     * @return true - if message has been enqueued successfully
+     * @return false - if there is no such PZEM or port queue is full
+     */
+    bool txenqueue(uint8_t pzem_id, TX_msg *msg);
+
 
     /**
-     * @brief Get the PZEM State object reference for PZEM with specific id
-     * it contains all parameters and metrics for PZEM device
-     * NOTE: It is an undefined behavior to call this method on a non-existing id!!!
-     * use existPZEM() method to check if unsure
+     * @brief Get the PZEM State object for PZEM with specific id
+     * it contains all parameters and metrics for PZEM device.
+     * Returned pointer shares ownership of the PZEM object, so it stays valid even if PZEM
+     * is removed from the pool meanwhile
      * 
-     * @return const pzmbus::state&, nullptr if PZEM with specified id does not exist
+     * @return std::shared_ptr<const pzmbus::state>, nullptr if PZEM with specified id does not exist
      */
-    const pzmbus::state* getState(uint8_t id) const;
+    std::shared_ptr<const pzmbus::state> getState(uint8_t id) const;
 
     /**
-     * @brief Get the PZEM Metrics object reference for PZEM with specific id
-     * it contains all electric metrics for PZEM device
-     * WARN: It is an undefined behavior to call this method on a non-existing id!!!    (to be fixed)
-     * use existPZEM() method to check if unsure
+     * @brief Get the PZEM Metrics object for PZEM with specific id
+     * it contains all electric metrics for PZEM device, see getState() on pointer lifetime
      * 
-     * @return const pzmbus::metrics&, nullptr if PZEM with specified id does not exist
+     * @return std::shared_ptr<const pzmbus::metrics>, nullptr if PZEM with specified id does not exist
      */
-    const pzmbus::metrics* getMetrics(uint8_t id) const;
+    std::shared_ptr<const pzmbus::metrics> getMetrics(uint8_t id) const;
 
     /**
-     * @brief return description string as 'const char*'
+     * @brief Get raw register image of the last read reply for PZEM with specific id
+     * see getState() on pointer lifetime, image is updated by RX task, use regimage_t::snapshot() to read it
+     *
+     * @param id - PZEM id
+     * @param fc - CMD_RIR or CMD_RHR
+     * @return std::shared_ptr<const pzmbus::regimage_t>, nullptr if PZEM with specified id does not exist
+     */
+    std::shared_ptr<const pzmbus::regimage_t> getRegImage(uint8_t id, uint8_t fc) const;
+
+    /**
+     * @brief restore state of PZEM with specific id from a saved register image
+     * see PZEM::restoreRegImage()
+     *
+     * @return true if image has been accepted
+     * @return false if there is no such PZEM or image is invalid
+     */
+    bool restoreRegImage(uint8_t id, uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us = 0);
+
+    /**
+     * @brief iterate over registered PZEM objects
+     *
+     * @param f - visitor function, iteration stops once it returns false
+     * @param skip - number of PZEM objects to skip from the beginning of the pool
+     * @return size_t - number of PZEM objects visited
+     */
+    size_t forEachPZEM(std::function<bool (const PZEM *pz)> f, size_t skip = 0) const;
+
+    /**
+     * @brief return number of registered PZEM objects
+     */
+    size_t countPZEM() const { return snapshot()->meters.size(); }
+
+    /**
+     * @brief iterate over registered ports
+     *
+     * @param f - visitor function, iteration stops once it returns false
+     * @param skip - number of ports to skip from the beginning of the pool
+     * @return size_t - number of ports visited
+     */
+    size_t forEachPort(std::function<bool (const PZPort *port)> f, size_t skip = 0) const;
+
+    /**
+     * @brief Get the port PZEM with specific id is attached to
+     *
+     * @param id - PZEM id
+     * @return shared pointer to port, nullptr if PZEM with specified id does not exist
+     */
+    std::shared_ptr<const PZPort> getPZEMPort(uint8_t id) const;
+
+    /**
+     * @brief return description string of PZEM with specific id
+     * see getState() on pointer lifetime
      * 
-     * @return const char* 
+     * @return std::shared_ptr<const char>, nullptr if PZEM with specified id does not exist
      */
-    const char* getDescr(uint8_t id) const;
+    std::shared_ptr<const char> getDescr(uint8_t id) const;
 
 
 private:
     TimerHandle_t t_poller = nullptr;
     size_t poll_period = POLLER_PERIOD;           // auto poll period in ms
     rx_callback_t rx_callback = nullptr;          // external callback to trigger on RX dat
+    rx_callback_t stray_callback = nullptr;       // external callback for messages not matching any PZEM
+    rx_callback_t reply_hook = nullptr;           // gateway hook for messages matching a PZEM
 
     static void timerRunner(TimerHandle_t xTimer){
         if (!xTimer) return;
@@ -11,6 +11,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 */
 
 #include <pzem_modbus.hpp>
+#include "freertos/task.h"
 #ifdef ARDUINO
 #include "esp32-hal-log.h"
 #else
@@ -22,8 +23,10 @@ namespace pzmbus {
 TX_msg* create_msg(uint8_t cmd, uint16_t reg_addr, uint16_t value, uint8_t slave_addr, bool w4r){
 
     TX_msg *msg = new TX_msg(GENERIC_MSG_SIZE);
-    if (!msg)
+    if (!msg || !msg->data){
+        delete msg;
         return nullptr;
+    }
 
     msg->data[0] = slave_addr;
     msg->data[1] = cmd;
@@ -47,6 +50,10 @@ TX_msg* cmd_set_modbus_addr(uint8_t new_addr, const uint8_t current_addr){
 TX_msg* cmd_energy_reset(const uint8_t addr){
 
     TX_msg *msg = new TX_msg(ENERGY_RST_MSG_SIZE);
+    if (!msg || !msg->data){
+        delete msg;
+        return nullptr;
+    }
 
     msg->data[0] = addr;
     msg->data[1] = CMD_RST_ENRG;
@@ -56,6 +63,108 @@ TX_msg* cmd_energy_reset(const uint8_t addr){
     return msg;
 }
 
+RX_msg* create_reply(uint8_t fc, const uint8_t *data, uint8_t len, uint8_t slave_addr){
+    size_t size = len + 5;          // addr + cmd + bytecount + CRC16
+    uint8_t *buff = msgbuf_alloc(size);
+    if (!buff)
+        return nullptr;
+
+    buff[0] = slave_addr;
+    buff[1] = fc;
+    buff[2] = len;
+    memcpy(&buff[3], data, len);
+    modbus::setcrc16(buff, size);
+
+    RX_msg *msg = new RX_msg(buff, size);
+    if (!msg)
+        msgbuf_free(buff);
+    return msg;
+}
+
+bool restore(state &s, uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us){
+    if (fc != CMD_RHR && fc != CMD_RIR)
+        return false;
+
+    std::unique_ptr<RX_msg> m(create_reply(fc, data, len, s.addr));
+    regimage_t &img = fc == CMD_RIR ? s.rir : s.rhr;
+    int64_t state_us = s.update_us;
+    int64_t img_us = img.update_us;
+    bool restored = s.restored;
+    pzem_err_t err = s.err;
+
+    bool ok = s.parse_rx_mgs(m.get());
+    s.update_us = state_us;
+    s.restored = restored;
+    s.err = err;
+    if (!ok)
+        return false;
+
+    img.update_us = update_us ? update_us : img_us;
+    if (update_us && fc == CMD_RIR){
+        s.update_us = update_us;
+        s.restored = true;
+    }
+    return true;
+}
+
+
+// seqlock, image has a single writer - RX task
+static inline void seq_begin(uint32_t &seq){
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_end(uint32_t &seq){
+    __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+bool regimage_t::set(const RX_msg *m){
+    uint8_t bytes = m->rawdata[2];
+    if (bytes > sizeof(data) || m->len < bytes + 5u)    // addr + cmd + bytecount + CRC16
+        return false;
+
+    seq_begin(seq);
+    memcpy(data, &m->rawdata[3], bytes);
+    len = bytes;
+    update_us = esp_timer_get_time();
+    seq_end(seq);
+    return true;
+}
+
+void regimage_t::setreg(uint8_t idx, uint16_t v){
+    if (idx*2 + 2 > len)
+        return;
+
+    seq_begin(seq);
+    *(uint16_t*)&data[idx*2] = __builtin_bswap16(v);
+    seq_end(seq);
+}
+
+static uint8_t decoding = 0;        // lazy decode lock, decoding takes a few us, so it is a spinlock
+
+void state::decode_lock(){
+    while (__atomic_test_and_set(&decoding, __ATOMIC_ACQUIRE))
+        vTaskDelay(1);
+}
+
+void state::decode_unlock(){
+    __atomic_clear(&decoding, __ATOMIC_RELEASE);
+}
+
+regimage_t regimage_t::snapshot() const {
+    regimage_t img;
+    for (unsigned retry = 0; ; ++retry){
+        uint32_t s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        if (!(s & 1)){
+            memcpy(&img, this, sizeof(img));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == s)
+                return img;
+        }
+        if (retry > 2)
+            vTaskDelay(1);          // writer could be preempted by us
+    }
+}
 
 } // end of 'namespace pzmbus'
 
@@ -87,6 +196,7 @@ void rx_msg_prettyp(const RX_msg *m){
     state pz;
 
     pz.parse_rx_mgs(m, false);
+    pz.sync();
 
     printf("=== PZEM DATA ===\n");
 
@@ -156,12 +266,56 @@ float metrics::asFloat(pzmbus::meter_t m) const {
     }
 }
 
+uint32_t metrics::asRaw(pzmbus::meter_t m) const {
+    switch (m){
+    case pzmbus::meter_t::vol :
+        return voltage;
+    case pzmbus::meter_t::cur :
+        return current;
+    case pzmbus::meter_t::pwr :
+        return power;
+    case pzmbus::meter_t::enrg :
+        return energy;
+    case pzmbus::meter_t::frq :
+        return freq;
+    case pzmbus::meter_t::pf :
+        return pf;
+    case pzmbus::meter_t::alrmh :
+        return alarm ? 1 : 0;
+    default:
+        return 0;
+    }
+}
+
+int8_t metrics::decimals(pzmbus::meter_t m) const {
+    switch (m){
+    case pzmbus::meter_t::vol :
+    case pzmbus::meter_t::pwr :
+    case pzmbus::meter_t::frq :
+        return 1;
+    case pzmbus::meter_t::cur :
+        return 3;
+    case pzmbus::meter_t::pf :
+        return 2;
+    case pzmbus::meter_t::enrg :
+    case pzmbus::meter_t::alrmh :
+        return 0;
+    default:
+        return -1;
+    }
+}
+
 bool metrics::parse_rx_msg(const RX_msg *m) {
-    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR || m->rawdata[2] != PZ004_RIR_RESP_LEN)
+    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR)
         return false;
-    ESP_LOGD(TAG, "PZ004 RXparser\n");
 
-    uint8_t const *value = &m->rawdata[3];
+    return parse_regs(&m->rawdata[3], m->rawdata[2]);
+}
+
+bool metrics::parse_regs(const uint8_t *value, size_t len) {
+    if (len != PZ004_RIR_RESP_LEN)
+        return false;
+    ESP_LOGD(TAG, "PZ004 RXparser\n");
 
     voltage = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_VOLTAGE*2]);
     current = __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_CURRENT_L*2]) | __builtin_bswap16(*(uint16_t*)&value[PZ004_RIR_CURRENT_H*2])  << 16;
@@ -182,17 +336,19 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
 
     switch (static_cast<pzmbus::pzemcmd_t>(m->cmd)){
         case pzmbus::pzemcmd_t::RIR : {
-            if(data.parse_rx_msg(m))  // try to parse it as a full metrics packet
+            // keep raw payload only, metrics are decoded on first access
+            if (m->rawdata[2] == PZ004_RIR_RESP_LEN && rir.set(m)){
+                restored = false;
                 break;
-            else {
+            } else {
                 err = pzmbus::pzem_err_t::err_parse;
                 return false;
             }
         }
         case pzmbus::pzemcmd_t::RHR : {
-            if (m->rawdata[2] == PZ004_RHR_LEN * 2){ // we got full len RHR data
-                alrm_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[3]);
-                addr = m->rawdata[6];
+            if (m->rawdata[2] == PZ004_RHR_LEN * 2 && rhr.set(m)){ // we got full len RHR data
+                alrm_thrsh = rhr.reg(PZ004_RHR_ALARM_THR - PZ004_RHR_BEGIN);
+                addr = rhr.reg(PZ004_RHR_MODBUS_ADDR - PZ004_RHR_BEGIN);
             }
             // unknown regs
             break;
@@ -201,14 +357,18 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
             // 4th byte is reg ADDR_L
             if (m->rawdata[3] == PZ004_RHR_MODBUS_ADDR){
                 addr = m->rawdata[5];            // addr is only one byte
+                rhr.setreg(PZ004_RHR_MODBUS_ADDR - PZ004_RHR_BEGIN, addr);
                 break;
             } else if(m->rawdata[3] == PZ004_RHR_ALARM_THR){
                 alrm_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[4]);
+                rhr.setreg(PZ004_RHR_ALARM_THR - PZ004_RHR_BEGIN, alrm_thrsh);
             }
             break;
         }
         case pzmbus::pzemcmd_t::reset_energy :
-            data.energy=0;                      // nothing to do, except reset conter
+            // nothing to do, except reset conter in image, metrics are decoded from it
+            rir.setreg(PZ004_RIR_ENERGY_L, 0);
+            rir.setreg(PZ004_RIR_ENERGY_H, 0);
             break;
         case pzmbus::pzemcmd_t::read_err :
         case pzmbus::pzemcmd_t::write_err :
@@ -226,6 +386,21 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
     return true;
 }
 
+void state::sync() const {
+    if (__atomic_load_n(&rir.seq, __ATOMIC_ACQUIRE) == __atomic_load_n(&data_seq, __ATOMIC_ACQUIRE))
+        return;
+
+    // several reader tasks could get here at once, image is decoded by one of them
+    decode_lock();
+    pzmbus::regimage_t img;
+    img = rir.snapshot();           // not an initialization, GCC 12 gives a false -Wdangling-pointer on it
+    if (img.seq != data_seq){
+        data.parse_regs(img.data, img.len);
+        __atomic_store_n(&data_seq, img.seq, __ATOMIC_RELEASE);
+    }
+    decode_unlock();
+}
+
 }  // namespace pz004
 
 
@@ -267,6 +442,7 @@ void rx_msg_prettyp(const RX_msg *m){
     state pz;
 
     pz.parse_rx_mgs(m, false);
+    pz.sync();
 
     printf("=== PZEM DATA ===\n");
 
@@ -343,11 +519,51 @@ float metrics::asFloat(pzmbus::meter_t m) const {
     }
 }
 
+uint32_t metrics::asRaw(pzmbus::meter_t m) const {
+    switch (m){
+    case pzmbus::meter_t::vol :
+        return voltage;
+    case pzmbus::meter_t::cur :
+        return current;
+    case pzmbus::meter_t::pwr :
+        return power;
+    case pzmbus::meter_t::enrg :
+        return energy;
+    case pzmbus::meter_t::alrmh :
+        return alarmh ? 1 : 0;
+    case pzmbus::meter_t::alrml :
+        return alarml ? 1 : 0;
+    default:
+        return 0;
+    }
+}
+
+int8_t metrics::decimals(pzmbus::meter_t m) const {
+    switch (m){
+    case pzmbus::meter_t::vol :
+    case pzmbus::meter_t::cur :
+        return 2;
+    case pzmbus::meter_t::pwr :
+        return 1;
+    case pzmbus::meter_t::enrg :
+    case pzmbus::meter_t::alrmh :
+    case pzmbus::meter_t::alrml :
+        return 0;
+    default:
+        return -1;
+    }
+}
+
 bool metrics::parse_rx_msg(const RX_msg *m) {
-    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR || m->rawdata[2] != PZ003_RIR_RESP_LEN)
+    if (static_cast<pzmbus::pzemcmd_t>(m->cmd) != pzmbus::pzemcmd_t::RIR)
         return false;
 
-    uint8_t const *value = &m->rawdata[3];
+    return parse_regs(&m->rawdata[3], m->rawdata[2]);
+}
+
+bool metrics::parse_regs(const uint8_t *value, size_t len) {
+    if (len != PZ003_RIR_RESP_LEN)
+        return false;
 
     voltage = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_VOLTAGE*2]);
     current = __builtin_bswap16(*(uint16_t*)&value[PZ003_RIR_CURRENT*2]);
@@ -367,20 +583,22 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
 
     switch (static_cast<pzmbus::pzemcmd_t>(m->cmd)){
         case pzmbus::pzemcmd_t::RIR : {
-            if(data.parse_rx_msg(m))  // try to parse it as a full metrics packet
+            // keep raw payload only, metrics are decoded on first access
+            if (m->rawdata[2] == PZ003_RIR_RESP_LEN && rir.set(m)){
+                restored = false;
                 break;
-            else {
+            } else {
                 err = pzmbus::pzem_err_t::err_parse;
                 return false;
             }
             break;
         }
         case pzmbus::pzemcmd_t::RHR : {
-            if (m->rawdata[2] == PZ003_RHR_CNT * 2){ // we got full len RHR data
-                alrmh_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[3]);
-                alrml_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[5]);
-                addr = m->rawdata[6];
-                irange = m->rawdata[8];
+            if (m->rawdata[2] == PZ003_RHR_CNT * 2 && rhr.set(m)){ // we got full len RHR data
+                alrmh_thrsh = rhr.reg(PZ003_RHR_ALARM_H);
+                alrml_thrsh = rhr.reg(PZ003_RHR_ALARM_L);
+                addr = rhr.reg(PZ003_RHR_ADDR);
+                irange = rhr.reg(PZ003_RHR_CURRENT_RANGE);
             }
             // unknown regs
             break;
@@ -390,15 +608,19 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
             switch (m->rawdata[3]){
                 case PZ003_RHR_ALARM_H :
                     alrmh_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[4]);
+                    rhr.setreg(PZ003_RHR_ALARM_H, alrmh_thrsh);
                     break;
                 case PZ003_RHR_ALARM_L :
                     alrml_thrsh = __builtin_bswap16(*(uint16_t*)&m->rawdata[4]);
+                    rhr.setreg(PZ003_RHR_ALARM_L, alrml_thrsh);
                     break;
                 case PZ003_RHR_ADDR :
                     addr = m->rawdata[5];            // addr is only one byte
+                    rhr.setreg(PZ003_RHR_ADDR, addr);
                     break;
                 case PZ003_RHR_CURRENT_RANGE :
                     irange = m->rawdata[5];          // shunt is only one byte
+                    rhr.setreg(PZ003_RHR_CURRENT_RANGE, irange);
                     break;
                 default:
                     break;
@@ -406,7 +628,9 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
             break;
         }
         case pzmbus::pzemcmd_t::reset_energy :
-            data.energy = 0;                      // nothing to do, except reset conter
+            // nothing to do, except reset conter in image, metrics are decoded from it
+            rir.setreg(PZ003_RIR_ENERGY_L, 0);
+            rir.setreg(PZ003_RIR_ENERGY_H, 0);
             break;
         case pzmbus::pzemcmd_t::read_err :
         case pzmbus::pzemcmd_t::write_err :
@@ -425,5 +649,20 @@ bool state::parse_rx_mgs(const RX_msg *m, bool skiponbad) {
     return true;
 }
 
+void state::sync() const {
+    if (__atomic_load_n(&rir.seq, __ATOMIC_ACQUIRE) == __atomic_load_n(&data_seq, __ATOMIC_ACQUIRE))
+        return;
+
+    // several reader tasks could get here at once, image is decoded by one of them
+    decode_lock();
+    pzmbus::regimage_t img;
+    img = rir.snapshot();           // not an initialization, GCC 12 gives a false -Wdangling-pointer on it
+    if (img.seq != data_seq){
+        data.parse_regs(img.data, img.len);
+        __atomic_store_n(&data_seq, img.seq, __ATOMIC_RELEASE);
+    }
+    decode_unlock();
+}
+
 }  // namespace pz003
 
@@ -141,17 +141,68 @@ enum class pzem_err_t:uint8_t {
 struct metrics {
     virtual ~metrics(){};
     virtual float asFloat(meter_t m) const { return NAN; }
+    // return metric value as a raw integer in device units (i.e. dV, mA, dW), no scaling applied
+    virtual uint32_t asRaw(meter_t m) const { return 0; }
+    // return number of decimal digits in raw value for metric (i.e. 1 for dV), -1 if metric is not supported by device
+    virtual int8_t decimals(meter_t m) const { return -1; }
     virtual bool parse_rx_msg(const RX_msg *m){ return false; }
 };
 
 
+/**
+ * @brief raw register image
+ * a payload of the last read reply as it came from the device, registers are kept in MODBUS (big endian) byte order
+ * sized to fit the largest reply, i.e. PZEM004 RIR
+ */
+struct regimage_t {
+    int64_t update_us = 0;      // last image update time, us since boot
+    uint16_t begin = 0;         // address of the first register in image
+    uint8_t len = 0;            // payload length, bytes
+    uint8_t data[PZ004_RIR_RESP_LEN];
+    uint32_t seq = 0;           // update sequence, odd while image is being written
+
+    /**
+     * @brief update image from a read reply message
+     *
+     * @param m - RHR/RIR reply message
+     * @return true on success
+     * @return false if message payload does not fit the image
+     */
+    bool set(const RX_msg *m);
+
+    /**
+     * @brief get register value by it's index in image
+     */
+    uint16_t reg(uint8_t idx) const { return __builtin_bswap16(*(uint16_t*)&data[idx*2]); }
+
+    /**
+     * @brief patch register value in image (if it is present there)
+     */
+    void setreg(uint8_t idx, uint16_t v);
+
+    /**
+     * @brief take a consistent copy of the image
+     * image is written by the RX task, readers on other tasks must work with a copy,
+     * otherwise they could see a half-written image with L/H register pairs from different replies
+     */
+    regimage_t snapshot() const;
+
+    /**
+     * @brief return number of registers in image
+     */
+    uint8_t cnt() const { return len / 2; }
+};
+
 struct state {
     const pzmodel_t model;      // state struct relates to specific pzem mddel
     uint8_t addr = ADDR_ANY;
-    pzmbus::pzem_err_t err;
+    pzmbus::pzem_err_t err = pzmbus::pzem_err_t::err_ok;
     int64_t poll_us = 0;     // last poll request sent time, microseconds since boot
     int64_t update_us = 0;   // last succes update time, us since boot
+    bool restored = false;   // metrics are restored from persistent storage and not polled since boot
     metrics data;          // default metrics struct, does nothing actually
+    regimage_t rir;         // raw image of the last RIR reply
+    regimage_t rhr;         // raw image of the last RHR reply
 
     // C-tor
     state (pzmodel_t m = pzmodel_t::none) : model(m){}
@@ -173,11 +224,12 @@ struct state {
 
     /**
      * @brief data considered stale if last update time is more than 2*PZEM_REFRESH_PERIOD ms
+     * restored data is always stale until first successful poll
      * 
      * @return true if stale
      * @return false if data is fresh and valid
      */
-    bool dataStale() const {return (esp_timer_get_time() - update_us > 2 * PZEM_REFRESH_PERIOD * 1000 );}
+    bool dataStale() const {return restored || (esp_timer_get_time() - update_us > 2 * PZEM_REFRESH_PERIOD * 1000 );}
 
     /**
      * @brief try to parse PZEM reply packet and update state structure
@@ -188,6 +240,22 @@ struct state {
      * @return false on error
      */
     virtual bool parse_rx_mgs(const RX_msg *m, bool skiponbad = true){return false;};
+
+    /**
+     * @brief decode metrics from the raw RIR image if it has been updated since last decode
+     * RX task only stores the image, metrics are decoded lazily on first access, so that replies nobody reads
+     * are never parsed. Object getters call it implicitly, it must be called before accessing 'data' member directly
+     */
+    virtual void sync() const {};
+
+protected:
+    mutable uint32_t data_seq = 0;      // RIR image sequence that metrics were decoded from
+
+    /**
+     * @brief serialize lazy decoding by reader tasks
+     */
+    static void decode_lock();
+    static void decode_unlock();
 };
 
 
@@ -221,6 +289,33 @@ TX_msg* cmd_set_modbus_addr(uint8_t addr, const uint8_t current_addr = ADDR_ANY)
  */
 TX_msg* cmd_energy_reset(const uint8_t addr = ADDR_ANY);
 
+/**
+ * @brief create a read reply message as if it came from the device
+ * could be used to restore state from a saved register image
+ *
+ * @param fc - read command, CMD_RHR or CMD_RIR
+ * @param data - registers payload in MODBUS byte order
+ * @param len - payload length, bytes
+ * @param slave_addr - slave device modbus address
+ * @return RX_msg* with valid CRC
+ */
+RX_msg* create_reply(uint8_t fc, const uint8_t *data, uint8_t len, uint8_t slave_addr);
+
+/**
+ * @brief restore state from a saved register image
+ * image is parsed as a read reply from the device with state's address, error code is kept intact.
+ * If image capture time is given, restored RIR image marks state as 'restored' and sets it's update time,
+ * otherwise state's update time is kept intact
+ *
+ * @param s - state object
+ * @param fc - read command, CMD_RHR or CMD_RIR
+ * @param data - registers payload in MODBUS byte order
+ * @param len - payload length, bytes
+ * @param update_us - image capture time, us since boot (negative for images captured before boot), 0 - unknown
+ * @return true if image has been parsed
+ */
+bool restore(state &s, uint8_t fc, const uint8_t *data, uint8_t len, int64_t update_us = 0);
+
 }   // namespace pzmbus
 
 /**
@@ -247,8 +342,21 @@ struct metrics : pzmbus::metrics {
     virtual ~metrics(){};
 
     float asFloat(pzmbus::meter_t m) const override;
-    
+
+    uint32_t asRaw(pzmbus::meter_t m) const override;
+
+    int8_t decimals(pzmbus::meter_t m) const override;
+
     bool parse_rx_msg(const RX_msg *m) override;
+
+    /**
+     * @brief parse metrics from RIR reply payload
+     *
+     * @param value - payload data
+     * @param len - payload length
+     * @return true on success
+     */
+    bool parse_regs(const uint8_t *value, size_t len);
 };
 
 /**
@@ -256,12 +364,12 @@ struct metrics : pzmbus::metrics {
  * 
  */
 struct state : pzmbus::state {
-    metrics data;
+    mutable metrics data;           // decoded lazily from RIR image, call sync() before accessing it directly
     uint16_t alrm_thrsh = 0;
     bool alarm = false;
 
     // C-tor - specify pzem model to base struct
-    state () : pzmbus::state(pzmbus::pzmodel_t::pzem004v3) {}
+    state () : pzmbus::state(pzmbus::pzmodel_t::pzem004v3) { rhr.begin = PZ004_RHR_BEGIN; }
     virtual ~state(){};
 
     /**
@@ -274,6 +382,8 @@ struct state : pzmbus::state {
      */
     bool parse_rx_mgs(const RX_msg *m, bool skiponbad = true) override;
 
+    void sync() const override;
+
 };
 
 /**
@@ -376,7 +486,20 @@ struct metrics : pzmbus::metrics {
 
     float asFloat(pzmbus::meter_t m) const override;
 
+    uint32_t asRaw(pzmbus::meter_t m) const override;
+
+    int8_t decimals(pzmbus::meter_t m) const override;
+
     bool parse_rx_msg(const RX_msg *m) override;
+
+    /**
+     * @brief parse metrics from RIR reply payload
+     *
+     * @param value - payload data
+     * @param len - payload length
+     * @return true on success
+     */
+    bool parse_regs(const uint8_t *value, size_t len);
 };
 
 /**
@@ -384,7 +507,7 @@ struct metrics : pzmbus::metrics {
  * 
  */
 struct state : pzmbus::state {
-    metrics data;
+    mutable metrics data;           // decoded lazily from RIR image, call sync() before accessing it directly
     uint16_t alrmh_thrsh = 0;
     uint16_t alrml_thrsh = 0;
     bool alarmh = false;
@@ -392,7 +515,7 @@ struct state : pzmbus::state {
     uint8_t irange = 0;     // 100A shunt
 
     // C-tor - specify pzem model to base struct
-    state () : pzmbus::state(pzmbus::pzmodel_t::pzem003) {}
+    state () : pzmbus::state(pzmbus::pzmodel_t::pzem003) { rhr.begin = PZ003_RHR_BEGIN; }
 
     /**
      * @brief try to parse PZEM reply packet and update structure state
@@ -404,6 +527,8 @@ struct state : pzmbus::state {
      */
     bool parse_rx_mgs(const RX_msg *m, bool skiponbad = true) override;
 
+    void sync() const override;
+
 };
 
 /**
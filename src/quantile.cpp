@@ -0,0 +1,197 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "quantile.hpp"
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// write unsigned LEB128 varint, returns number of bytes written or 0 if there is no room
+static size_t put_varint(uint8_t *buf, size_t len, uint32_t v){
+    size_t i = 0;
+    do {
+        if (i == len)
+            return 0;
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        buf[i++] = v ? b | 0x80 : b;
+    } while (v);
+    return i;
+}
+
+// read unsigned LEB128 varint, returns number of bytes consumed or 0 on malformed data
+static size_t get_varint(const uint8_t *buf, size_t len, uint32_t &v){
+    v = 0;
+    for (size_t i = 0; i != len && i < 5; ++i){
+        v |= static_cast<uint32_t>(buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+// add counters, saturating at UINT32_MAX
+static uint32_t sat_add(uint32_t a, uint32_t b){
+    return a > UINT32_MAX - b ? UINT32_MAX : a + b;
+}
+
+QuantileHist::QuantileHist(uint32_t _lo, uint32_t _hi, uint32_t _width) :
+    lo(_lo), width(_width ? _width : 1), nbins(_hi > _lo ? (_hi - _lo) / (_width ? _width : 1) + 1 : 1), hi(_hi > _lo ? _hi : _lo) {
+        auto p = static_cast<uint32_t*>(heap_caps_malloc(nbins*sizeof(uint32_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));     // try to alloc SPI ram first
+
+        if (!p)
+            p = static_cast<uint32_t*>(malloc(nbins*sizeof(uint32_t)));      // try any available RAM otherwise
+
+        if (p){
+            bins.reset(p);
+            clear();
+        }
+}
+
+void QuantileHist::push(uint32_t v){
+    if (!bins)
+        return;
+
+    ++total;
+    if (v < lo){
+        ++under;
+        return;
+    }
+
+    if (v > hi){                                    // last bin could span past hi
+        ++over;
+        return;
+    }
+
+    ++bins[(v - lo) / width];
+}
+
+void QuantileHist::clear(){
+    under = over = total = 0;
+    if (bins)
+        memset(bins.get(), 0, nbins*sizeof(uint32_t));
+}
+
+uint32_t QuantileHist::quantile(float q) const {
+    if (!bins || !total)
+        return 0;
+
+    if (q < 0) q = 0;
+    if (q > 1) q = 1;
+
+    // 1-based rank of the sample we are looking for
+    uint32_t rank = std::min<double>(std::ceil(static_cast<double>(q) * total), total);     // float product could exceed total
+    if (!rank) rank = 1;
+
+    uint64_t cnt = under;
+    if (rank <= cnt)
+        return lo;
+
+    for (uint32_t i = 0; i != nbins; ++i){
+        cnt += bins[i];
+        if (rank <= cnt){
+            uint32_t b = lo + i * width;
+            return b + (std::min(width - 1, hi - b) + 1) / 2;   // last bin is clamped to hi
+        }
+    }
+
+    return hi;                                      // rank falls into overflow
+}
+
+bool QuantileHist::merge(const QuantileHist &rhs){
+    if (!bins || !rhs.bins || lo != rhs.lo || width != rhs.width || nbins != rhs.nbins)
+        return false;
+
+    for (uint32_t i = 0; i != nbins; ++i)
+        bins[i] = sat_add(bins[i], rhs.bins[i]);
+
+    under = sat_add(under, rhs.under);
+    over = sat_add(over, rhs.over);
+    total = sat_add(total, rhs.total);
+    return true;
+}
+
+size_t QuantileHist::exportBins(uint8_t *buf, size_t len) const {
+    if (!bins || !buf)
+        return 0;
+
+    size_t pos = 0;
+    const uint32_t hdr[] = {lo, width, nbins, under, over};
+    for (auto v : hdr){
+        size_t n = put_varint(buf + pos, len - pos, v);
+        if (!n) return 0;
+        pos += n;
+    }
+
+    uint32_t last = 0;
+    for (uint32_t i = 0; i != nbins; ++i){
+        if (!bins[i])
+            continue;
+
+        size_t n = put_varint(buf + pos, len - pos, i - last);
+        if (!n) return 0;
+        pos += n;
+        n = put_varint(buf + pos, len - pos, bins[i]);
+        if (!n) return 0;
+        pos += n;
+        last = i;
+    }
+
+    return pos;
+}
+
+bool QuantileHist::importBins(const uint8_t *buf, size_t len){
+    if (!bins || !buf)
+        return false;
+
+    size_t pos = 0;
+    uint32_t hdr[5];
+    for (auto &v : hdr){
+        size_t n = get_varint(buf + pos, len - pos, v);
+        if (!n) return false;
+        pos += n;
+    }
+
+    if (hdr[0] != lo || hdr[1] != width || hdr[2] != nbins)
+        return false;
+
+    // validate the whole payload before touching counters
+    uint32_t idx = 0, sum = sat_add(hdr[3], hdr[4]);
+    for (size_t p = pos; p != len; ){
+        uint32_t gap, cnt;
+        size_t n = get_varint(buf + p, len - p, gap);
+        if (!n) return false;
+        p += n;
+        n = get_varint(buf + p, len - p, cnt);
+        if (!n) return false;
+        p += n;
+        idx += gap;
+        if (idx >= nbins) return false;
+        sum = sat_add(sum, cnt);
+    }
+
+    idx = 0;
+    while (pos != len){
+        uint32_t gap, cnt;
+        pos += get_varint(buf + pos, len - pos, gap);
+        pos += get_varint(buf + pos, len - pos, cnt);
+        idx += gap;
+        bins[idx] = sat_add(bins[idx], cnt);
+    }
+
+    // counters saturate, a histogram fed from many nodes stays usable for quantiles
+    under = sat_add(under, hdr[3]);
+    over = sat_add(over, hdr[4]);
+    total = sat_add(total, sum);
+    return true;
+}
@@ -0,0 +1,139 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include <cstdlib>
+#include <memory>
+#include "pzem_modbus.hpp"
+
+// default histogram geometry for PZEM004 voltage, 80-260 V in 0.1 V steps (1801 bins, ~7 KiB)
+#define QHIST_PZ004_VOL_LO      800
+#define QHIST_PZ004_VOL_HI      2600
+#define QHIST_PZ004_VOL_WIDTH   1
+
+// default histogram geometry for PZEM004 current, 0-100 A in 0.05 A steps (2001 bins, ~8 KiB)
+#define QHIST_PZ004_CUR_LO      0
+#define QHIST_PZ004_CUR_HI      100000
+#define QHIST_PZ004_CUR_WIDTH   50
+
+/**
+ * @brief Fixed-bucket histogram for streaming quantile estimation
+ * Bins are sized in raw PZEM integer units (i.e. dV for PZ004 voltage), so with bin width of 1
+ * quantiles are exact up to device resolution. Memory for bins is allocated once on construction,
+ * it tries PSRAM first, than falls back to malloc() (same as RingBuff). No allocations on push.
+ * Samples outside [lo, hi] range are accounted in under/overflow counters.
+ *
+ * Histograms of the same geometry could be merged, i.e. hourly buckets into a weekly one,
+ * or a set of meters into a group distribution.
+ */
+class QuantileHist {
+    std::unique_ptr<uint32_t[], decltype(free)*> bins{nullptr, free};
+    uint32_t under = 0;                 // samples below lo
+    uint32_t over = 0;                  // samples above hi
+    uint32_t total = 0;                 // total number of samples
+
+public:
+    const uint32_t lo;                  // lowest value of the first bin
+    const uint32_t width;               // bin width, in raw units
+    const uint32_t nbins;               // number of bins
+    const uint32_t hi;                  // highest value to account
+
+    /**
+     * @brief Construct a new histogram
+     *
+     * @param _lo - lowest value to account, raw units
+     * @param _hi - highest value to account, raw units
+     * @param _width - bin width, raw units
+     */
+    QuantileHist(uint32_t _lo, uint32_t _hi, uint32_t _width = 1);
+
+    // Copy semantics : forbidden
+    QuantileHist(const QuantileHist&) = delete;
+    QuantileHist& operator=(const QuantileHist&) = delete;
+
+    /**
+     * @brief check if memory for bins has been allocated
+     */
+    bool valid() const { return bins != nullptr; }
+
+    /**
+     * @brief account a new sample
+     *
+     * @param v - value in raw units
+     */
+    void push(uint32_t v);
+
+    /**
+     * @brief account specific metric from a metrics struct
+     *
+     * @param m - metrics struct
+     * @param t - metric type to account
+     */
+    void push(const pzmbus::metrics &m, pzmbus::meter_t t){ push(m.asRaw(t)); }
+
+    /**
+     * @brief reset all counters
+     */
+    void clear();
+
+    /**
+     * @brief total number of samples accounted (including out of range ones)
+     */
+    uint32_t count() const { return total; }
+
+    uint32_t underflow() const { return under; }
+    uint32_t overflow() const { return over; }
+
+    /**
+     * @brief estimate a quantile value
+     * returns the middle of the bin where requested rank falls into (the last bin ends at hi),
+     * for out of range ranks lo or hi values are returned
+     *
+     * @param q - quantile in range 0.0 - 1.0, i.e. 0.95 for 95th percentile
+     * @return uint32_t value in raw units, 0 if histogram is empty
+     */
+    uint32_t quantile(float q) const;
+
+    /**
+     * @brief merge another histogram into this one
+     * both histograms must have same geometry, counters saturate at UINT32_MAX
+     *
+     * @param rhs - histogram to merge from
+     * @return true on success
+     * @return false if geometry does not match
+     */
+    bool merge(const QuantileHist &rhs);
+
+    /**
+     * @brief export histogram into a compact binary form
+     * only non-empty bins are exported as a varint pairs of (bin index gap, count)
+     * preceded by a varint header with histogram geometry and out of range counters
+     *
+     * @param buf - destination buffer
+     * @param len - buffer size
+     * @return size_t - number of bytes written, 0 if buffer is too small
+     */
+    size_t exportBins(uint8_t *buf, size_t len) const;
+
+    /**
+     * @brief import histogram data exported with exportBins()
+     * imported counters are added to the existing ones, so it could be used to merge
+     * histograms received from different nodes, counters saturate at UINT32_MAX
+     *
+     * @param buf - source buffer
+     * @param len - data length
+     * @return true on success
+     * @return false if data is malformed or geometry does not match
+     */
+    bool importBins(const uint8_t *buf, size_t len);
+};
@@ -0,0 +1,518 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "tcpq.hpp"
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include <algorithm>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define TCPQ_MBAP_LEN           7       // MBAP header incl. unit id
+#define TCPQ_RTU_MIN            5       // shortest valid RTU reply, exception frame
+
+static const char *TAG_TCPQ __attribute__((unused)) = "TcpQ";
+
+// ****  TcpHub  **** //
+
+TcpHub::TcpHub(){
+    lock = xSemaphoreCreateMutex();
+    dlock = xSemaphoreCreateMutex();
+}
+
+TcpHub::~TcpHub(){
+    stop();
+    for (auto &c : conns)
+        disconnect(*c);
+    for (auto &r : ready)
+        delete r.msg;
+    vSemaphoreDelete(dlock);
+    vSemaphoreDelete(lock);
+}
+
+std::shared_ptr<TcpHub> TcpHub::shared(){
+    static std::weak_ptr<TcpHub> instance;
+    auto h = instance.lock();
+    if (!h){
+        h = std::make_shared<TcpHub>();
+        instance = h;
+    }
+    return h;
+}
+
+bool TcpHub::start(){
+    if (t_hub)
+        return true;
+
+    quit = false;
+    return xTaskCreate(TcpHub::hubTask, TCPQ_TASK_NAME, TCPQ_TASK_STACK, reinterpret_cast<void *>(this), TCPQ_TASK_PRIO, &t_hub) == pdPASS;
+}
+
+void TcpHub::stop(){
+    if (!t_hub)
+        return;
+
+    // task could be blocked in name lookup or RX handlers, it exits once current poll() is done
+    quit = true;
+    while (t_hub)
+        vTaskDelay(1);
+}
+
+TcpHub::conn_t* TcpHub::attach(TcpQ *q, const char *host, uint16_t port, tcpq_proto_t proto){
+    if (!host || !*host)
+        return nullptr;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    conn_t *conn = nullptr;
+    for (auto &c : conns){
+        if (c->port == port && c->proto == proto && !strcmp(c->host.get(), host)){
+            conn = c.get();
+            break;
+        }
+    }
+
+    if (!conn){
+        conn = new conn_t();
+        conn->host.reset(strcpy(new char[strlen(host) + 1], host));
+        conn->port = port;
+        conn->proto = proto;
+        conns.emplace_back(conn);
+    }
+    conn->users.push_back(q);
+    xSemaphoreGive(lock);
+    return conn;
+}
+
+void TcpHub::detach(TcpQ *q){
+    xSemaphoreTake(dlock, portMAX_DELAY);           // wait for RX handlers to return
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (auto i = conns.begin(); i != conns.end(); ++i){
+        conn_t &c = **i;
+        auto u = std::find(c.users.begin(), c.users.end(), q);
+        if (u == c.users.end())
+            continue;
+
+        c.users.erase(u);
+        if (c.owner == q){
+            c.owner = nullptr;          // reply would be discarded
+            c.len = 0;
+        }
+        if (c.users.empty()){
+            disconnect(c);
+            conns.erase(i);
+        }
+        break;
+    }
+
+    // drop replies collected for this queue, but not dispatched yet
+    for (auto i = ready.begin(); i != ready.end();){
+        if (i->q == q){
+            delete i->msg;
+            i = ready.erase(i);
+        } else
+            ++i;
+    }
+    xSemaphoreGive(lock);
+    xSemaphoreGive(dlock);
+}
+
+void TcpHub::resolve(){
+    struct pending_t {
+        const conn_t *c;
+        std::unique_ptr<char[]> host;
+        uint32_t ip;
+    };
+    std::vector<pending_t> pending;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+    for (auto &i : conns){
+        conn_t &c = *i;
+        if (c.state == cstate_t::closed && !c.ip && now >= c.retry_us)
+            pending.push_back({&c, std::unique_ptr<char[]>(strcpy(new char[strlen(c.host.get()) + 1], c.host.get())), 0});
+    }
+    xSemaphoreGive(lock);
+
+    if (pending.empty())
+        return;
+
+    // connections could be detached meanwhile, host names are copied
+    for (auto &p : pending){
+        struct addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *res = nullptr;
+        if (getaddrinfo(p.host.get(), NULL, &hints, &res) == 0 && res){
+            p.ip = reinterpret_cast<struct sockaddr_in*>(res->ai_addr)->sin_addr.s_addr;
+            freeaddrinfo(res);
+        } else
+            ESP_LOGW(TAG_TCPQ, "can't resolve %s", p.host.get());
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    now = esp_timer_get_time();
+    for (auto &i : conns){
+        conn_t &c = *i;
+        for (const auto &p : pending){
+            if (p.c != &c || c.state != cstate_t::closed || strcmp(p.host.get(), c.host.get()))
+                continue;
+            c.ip = p.ip;
+            if (!c.ip)
+                c.retry_us = now + TCPQ_RECONNECT * 1000LL;
+        }
+    }
+    xSemaphoreGive(lock);
+}
+
+void TcpHub::connect(conn_t &c){
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c.port);
+    addr.sin_addr.s_addr = c.ip;
+
+    int64_t now = esp_timer_get_time();
+    c.retry_us = now + TCPQ_RECONNECT * 1000LL;
+    c.ip = 0;                           // host is resolved again on next reconnect
+
+    c.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c.fd < 0)
+        return;
+
+    int opt = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+
+    int err = ::connect(c.fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+
+    if (!err){
+        c.state = cstate_t::ready;
+    } else if (errno == EINPROGRESS){
+        c.state = cstate_t::connecting;
+        c.deadline_us = now + TCPQ_CONNECT_TIMEOUT * 1000LL;
+    } else
+        disconnect(c);
+}
+
+void TcpHub::disconnect(conn_t &c){
+    if (c.fd >= 0){
+        close(c.fd);
+        ESP_LOGD(TAG_TCPQ, "%s:%u disconnected", c.host.get(), c.port);
+    }
+    c.fd = -1;
+    c.state = cstate_t::closed;
+    c.owner = nullptr;                  // request in flight is lost
+    c.len = 0;
+}
+
+void TcpHub::transmit(conn_t &c){
+    if (c.state != cstate_t::ready || c.owner || c.users.empty())
+        return;
+
+    TX_msg *msg = nullptr;
+    TcpQ *q = nullptr;
+    for (size_t i = 0; i != c.users.size() && !msg; ++i){
+        q = c.users[c.next++ % c.users.size()];
+        msg = q->dequeue();
+    }
+    if (!msg)
+        return;
+
+    uint8_t frame[TCPQ_BUF_SIZE];
+    const uint8_t *data = msg->data;
+    size_t len = msg->len;
+
+    if (c.proto == tcpq_proto_t::mbtcp){
+        // RTU 'addr + PDU + CRC' to MBAP 'tid + proto + len + unit + PDU'
+        if (len < 4 || len - 2 + 6 > sizeof(frame)){
+            delete msg;
+            return;
+        }
+        *(uint16_t*)&frame[0] = __builtin_bswap16(++c.tid);
+        frame[2] = frame[3] = 0;
+        *(uint16_t*)&frame[4] = __builtin_bswap16(len - 2);
+        memcpy(&frame[6], data, len - 2);
+        data = frame;
+        len = len - 2 + 6;
+    }
+
+    c.len = 0;                          // anything received so far is not a reply to this request
+    bool w4rx = msg->w4rx;
+    int n = send(c.fd, data, len, MSG_NOSIGNAL);
+    delete msg;
+
+    if (n != static_cast<int>(len)){
+        disconnect(c);
+        c.retry_us = esp_timer_get_time() + TCPQ_RECONNECT * 1000LL;
+        return;
+    }
+
+    if (w4rx){
+        c.owner = q;
+        c.deadline_us = esp_timer_get_time() + TCPQ_REPLY_TIMEOUT * 1000LL;
+    }
+}
+
+void TcpHub::receive(conn_t &c){
+    int n = recv(c.fd, c.buf + c.len, sizeof(c.buf) - c.len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)){
+        disconnect(c);
+        c.retry_us = esp_timer_get_time() + TCPQ_RECONNECT * 1000LL;
+        return;
+    }
+    if (n < 0)
+        return;
+
+    if (!c.owner){
+        c.len = 0;                      // late or unsolicited data
+        return;
+    }
+
+    c.len += n;
+    c.rx_us = esp_timer_get_time();
+
+    if (c.proto == tcpq_proto_t::rtu){
+        // RTU has no length field, frame is complete once CRC matches or the buffer is full,
+        // otherwise it is delivered by poll() after an inter-chunk gap
+        if ((c.len >= TCPQ_RTU_MIN && modbus::checkcrc16(c.buf, c.len)) || c.len == sizeof(c.buf))
+            deliver(c, c.buf, c.len);
+        return;
+    }
+
+    while (c.len >= TCPQ_MBAP_LEN){
+        size_t adu = 6 + __builtin_bswap16(*(uint16_t*)&c.buf[4]);
+        if (adu < TCPQ_MBAP_LEN + 1 || adu > sizeof(c.buf) - 2 || c.buf[2] || c.buf[3]){
+            disconnect(c);              // out of sync
+            c.retry_us = esp_timer_get_time() + TCPQ_RECONNECT * 1000LL;
+            return;
+        }
+        if (c.len < adu)
+            return;
+
+        size_t rest = c.len - adu;
+        if (c.owner && __builtin_bswap16(*(uint16_t*)&c.buf[0]) == c.tid){
+            // MBAP to RTU in place, 'unit + PDU' is moved to the start of the buffer and CRC is appended
+            size_t len = adu - 6 + 2;
+            memmove(c.buf, &c.buf[6], adu - 6);
+            modbus::setcrc16(c.buf, len);
+            deliver(c, c.buf, len);
+            // there should be nothing after a reply, request in flight is complete anyway
+            c.len = 0;
+            return;
+        }
+        // reply to a request that has timed out
+        memmove(c.buf, &c.buf[adu], rest);
+        c.len = rest;
+    }
+}
+
+void TcpHub::deliver(conn_t &c, uint8_t *frame, size_t len){
+    TcpQ *q = c.owner;
+    c.owner = nullptr;
+    c.len = 0;
+
+    if (!q || len < 2)
+        return;
+
+    uint8_t *raw = msgbuf_alloc(len);
+    if (!raw)
+        return;
+    memcpy(raw, frame, len);
+    RX_msg *msg = new RX_msg(raw, len);
+    if (!msg){
+        msgbuf_free(raw);
+        return;
+    }
+
+    ready.push_back({q, msg});
+}
+
+void TcpHub::dispatch(std::vector<rx_t> &rx){
+    // queues detached meanwhile have their replies removed from 'ready' list and are not called
+    for (auto &r : rx){
+        TcpQ *q = r.q;
+        ++q->stats.rx;
+        if (!r.msg->valid)
+            ++q->stats.rx_err;
+
+        if (q->rx_callback)
+            q->rx_callback(r.msg);      // handler takes ownership on the message
+        else
+            delete r.msg;
+    }
+    rx.clear();
+}
+
+size_t TcpHub::poll(uint32_t timeout_ms){
+    size_t delivered = 0;
+
+    resolve();
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t now = esp_timer_get_time();
+
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    int maxfd = -1;
+
+    for (auto &i : conns){
+        conn_t &c = *i;
+        if (c.state == cstate_t::closed && c.ip && now >= c.retry_us)
+            connect(c);
+
+        transmit(c);
+
+        if (c.fd < 0)
+            continue;
+        FD_SET(c.fd, c.state == cstate_t::connecting ? &wfds : &rfds);
+        if (c.fd > maxfd)
+            maxfd = c.fd;
+    }
+
+    if (maxfd >= 0){
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        if (select(maxfd + 1, &rfds, &wfds, NULL, &tv) < 0){
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+        }
+    }
+
+    now = esp_timer_get_time();
+    for (auto &i : conns){
+        conn_t &c = *i;
+
+        if (c.state == cstate_t::connecting){
+            if (FD_ISSET(c.fd, &wfds)){
+                int err = 0;
+                socklen_t elen = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+                if (err)
+                    disconnect(c);
+                else
+                    c.state = cstate_t::ready;
+            } else if (now > c.deadline_us)
+                disconnect(c);
+            continue;
+        }
+
+        if (c.state != cstate_t::ready)
+            continue;
+
+        if (FD_ISSET(c.fd, &rfds)){
+            TcpQ *owner = c.owner;
+            receive(c);
+            if (owner && !c.owner && c.state == cstate_t::ready)
+                ++delivered;
+        }
+
+        if (c.owner && c.len && c.proto == tcpq_proto_t::rtu && now - c.rx_us > TCPQ_FRAME_GAP * 1000LL){
+            deliver(c, c.buf, c.len);       // incomplete or corrupted frame, it will be flagged invalid
+            ++delivered;
+        }
+
+        if (c.owner && now > c.deadline_us){
+            ESP_LOGD(TAG_TCPQ, "%s:%u reply timeout", c.host.get(), c.port);
+            c.owner = nullptr;
+            c.len = 0;
+        }
+
+        // bus is free, do not wait for the next iteration
+        transmit(c);
+    }
+    bool rx = !ready.empty();
+    xSemaphoreGive(lock);
+
+    // RX handlers are called without the lock, so they could enqueue new requests or take long
+    if (rx){
+        xSemaphoreTake(dlock, portMAX_DELAY);
+        xSemaphoreTake(lock, portMAX_DELAY);
+        dispatching.swap(ready);        // vectors keep their capacity, no allocations on steady polling
+        xSemaphoreGive(lock);
+        dispatch(dispatching);
+        xSemaphoreGive(dlock);
+    }
+
+    // nothing to wait for, do not spin
+    if (maxfd < 0 && timeout_ms)
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+
+    return delivered;
+}
+
+
+// ****  TcpQ  **** //
+
+TcpQ::TcpQ(const char *host, uint16_t port, tcpq_proto_t proto, std::shared_ptr<TcpHub> h) : hub(h ? h : TcpHub::shared()) {
+    qlock = xSemaphoreCreateMutex();
+    conn = hub->attach(this, host, port, proto);
+}
+
+TcpQ::~TcpQ(){
+    hub->detach(this);                  // RX handler could be running in hub task until detached
+    rx_callback = nullptr;
+    stopQueues();
+    vSemaphoreDelete(qlock);
+}
+
+bool TcpQ::startQueues(){
+    if (!conn)
+        return false;
+
+    run = true;
+    return hub->start();
+}
+
+void TcpQ::stopQueues(){
+    xSemaphoreTake(qlock, portMAX_DELAY);
+    run = false;
+    for (auto m : txq)
+        delete m;
+    txq.clear();
+    xSemaphoreGive(qlock);
+}
+
+bool TcpQ::txenqueue(TX_msg *msg){
+    if (!msg)
+        return false;
+
+    xSemaphoreTake(qlock, portMAX_DELAY);
+    bool ok = run && txq.size() < TCPQ_Q_DEPTH;
+    if (ok){
+        txq.push_back(msg);
+        ++stats.tx;
+    } else
+        ++stats.tx_drop;
+    xSemaphoreGive(qlock);
+
+    if (!ok)
+        delete msg;
+    return ok;
+}
+
+TX_msg* TcpQ::dequeue(){
+    TX_msg *msg = nullptr;
+    xSemaphoreTake(qlock, portMAX_DELAY);
+    if (!txq.empty()){
+        msg = txq.front();
+        txq.pop_front();
+    }
+    xSemaphoreGive(qlock);
+    return msg;
+}
+
+bool TcpQ::connected() const {
+    return conn && conn->state == TcpHub::cstate_t::ready;
+}
@@ -0,0 +1,225 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "msgq.hpp"
+#include "freertos/semphr.h"
+#include <deque>
+#include <vector>
+
+#define TCPQ_REPLY_TIMEOUT      500     // ms, reply timeout including network round-trip
+#define TCPQ_CONNECT_TIMEOUT    3000    // ms
+#define TCPQ_RECONNECT          5000    // ms, delay before reconnecting a failed connection
+#define TCPQ_FRAME_GAP          50      // ms, incomplete RTU frame is delivered if no more data arrives
+#define TCPQ_POLL_PERIOD        10      // ms, hub loop select() timeout
+#define TCPQ_BUF_SIZE           264     // RX buffer, fits max Modbus-TCP ADU and RTU frame
+#define TCPQ_Q_DEPTH            tx_msg_q_DEPTH  // TX queue depth per TcpQ
+
+#define TCPQ_TASK_PRIO          3
+#define TCPQ_TASK_STACK         4096
+#define TCPQ_TASK_NAME          "TCPQ_HUB"
+
+/**
+ * @brief transport framing of a remote bus
+ */
+enum class tcpq_proto_t : uint8_t {
+    rtu = 0,            // raw RTU frames over TCP, i.e. transparent Ethernet-to-RS485 converters
+    mbtcp               // Modbus-TCP, frames are converted between RTU and MBAP
+};
+
+class TcpQ;
+
+/**
+ * @brief connection pool for TcpQ message queues
+ * One task services all connections with a single select() loop, so any number of remote buses
+ * could be aggregated by one controller. Queues to the same host:port share one connection,
+ * it is treated as one bus with at most one request in flight, next request is sent once reply has been
+ * received or has timed out. Connections are opened on demand and re-established after failures.
+ *
+ * Task is not required on host, poll() could be called from any loop.
+ */
+class TcpHub {
+    friend class TcpQ;
+
+    enum class cstate_t : uint8_t { closed, connecting, ready };
+
+    struct conn_t {
+        std::unique_ptr<char[]> host;
+        uint16_t port;
+        tcpq_proto_t proto;
+        int fd = -1;
+        cstate_t state = cstate_t::closed;
+        int64_t retry_us = 0;           // do not reconnect before this time
+        uint32_t ip = 0;                // resolved IPv4 address in network byte order, 0 - not resolved yet
+        std::vector<TcpQ*> users;       // queues sharing this connection
+        size_t next = 0;                // round-robin index over users
+        TcpQ *owner = nullptr;          // sender of the request in flight, nullptr if bus is idle
+        int64_t deadline_us = 0;        // reply or connect timeout
+        int64_t rx_us = 0;              // last RX chunk time
+        uint16_t tid = 0;               // Modbus-TCP transaction id
+        size_t len = 0;                 // bytes in buffer
+        uint8_t buf[TCPQ_BUF_SIZE];
+    };
+
+    // reply frame ready to be passed to the queue's RX handler
+    struct rx_t {
+        TcpQ *q;
+        RX_msg *msg;
+    };
+
+    std::vector< std::unique_ptr<conn_t> > conns;
+    std::vector<rx_t> ready;            // replies collected by poll() under the lock
+    std::vector<rx_t> dispatching;      // replies being passed to RX handlers, guarded by dlock
+    SemaphoreHandle_t lock;             // protects connections, held for the whole poll() iteration
+    SemaphoreHandle_t dlock;            // held while RX handlers are called, detach() waits for it
+    TaskHandle_t t_hub = nullptr;
+    volatile bool quit = false;         // hub task must exit
+
+    conn_t* attach(TcpQ *q, const char *host, uint16_t port, tcpq_proto_t proto);
+
+    void detach(TcpQ *q);
+
+    // resolve hosts of connections due to reconnect, name lookup is blocking so it is done without the lock
+    void resolve();
+
+    // start non-blocking connect to resolved address
+    void connect(conn_t &c);
+
+    void disconnect(conn_t &c);
+
+    // send next queued message if bus is idle
+    void transmit(conn_t &c);
+
+    void receive(conn_t &c);
+
+    // queue reply frame for the owner of the request in flight
+    void deliver(conn_t &c, uint8_t *frame, size_t len);
+
+    // pass collected replies to RX handlers, called without the lock
+    void dispatch(std::vector<rx_t> &rx);
+
+    // static wrapper for Task to call hub loop
+    static void hubTask(void* pvParams){
+        auto *self = reinterpret_cast<TcpHub*>(pvParams);
+        while (!self->quit)
+            self->poll(TCPQ_POLL_PERIOD);
+        self->t_hub = nullptr;
+        vTaskDelete(NULL);
+    }
+
+public:
+    TcpHub();
+    ~TcpHub();
+
+    // Copy semantics : forbidden
+    TcpHub(const TcpHub&) = delete;
+    TcpHub& operator=(const TcpHub&) = delete;
+
+    /**
+     * @brief default hub shared by all TcpQ created without an explicit hub
+     * it is destroyed with the last queue using it
+     */
+    static std::shared_ptr<TcpHub> shared();
+
+    /**
+     * @brief start hub task
+     *
+     * @return true if running
+     */
+    bool start();
+
+    /**
+     * @brief stop hub task, connections are kept open
+     * task exits on it's own once current poll() iteration is complete, this call waits for that
+     */
+    void stop();
+
+    /**
+     * @brief run one iteration of the hub loop
+     * connect, send pending requests, wait for socket events and dispatch replies.
+     * RX handlers are called after the hub lock is released, a queue is detached only after it's handler has returned.
+     * If there are no open sockets to wait for, it sleeps for timeout_ms
+     *
+     * @param timeout_ms - max time to wait for socket events
+     * @return size_t - number of replies delivered
+     */
+    size_t poll(uint32_t timeout_ms);
+
+    /**
+     * @brief number of remote endpoints
+     */
+    size_t connections() const { return conns.size(); }
+};
+
+
+/**
+ * @brief message queue for a remote serial bus behind a TCP serial server
+ * Plugs into PZPool like any other port:
+ *
+ *  pool.addPort(std::make_shared<PZPort>(2, new TcpQ("192.168.1.50", 4001), "Building B"));
+ *
+ * RTU frames are sent as-is for 'rtu' framing, for 'mbtcp' framing CRC is replaced by MBAP header
+ * and replies are converted back to RTU frames, so pool and other consumers see the same messages as from UART.
+ */
+class TcpQ : public MsgQ {
+    friend class TcpHub;
+
+    std::shared_ptr<TcpHub> hub;
+    TcpHub::conn_t *conn;
+    std::deque<TX_msg*> txq;
+    SemaphoreHandle_t qlock;
+    bool run = false;
+
+    // pop next message to transmit
+    TX_msg* dequeue();
+
+public:
+    /**
+     * @brief Construct a new TCP message queue
+     *
+     * @param host - serial server host name or IPv4 address
+     * @param port - TCP port
+     * @param proto - transport framing
+     * @param hub - connection pool, if not set the default shared hub is used
+     */
+    TcpQ(const char *host, uint16_t port, tcpq_proto_t proto = tcpq_proto_t::rtu, std::shared_ptr<TcpHub> hub = nullptr);
+    virtual ~TcpQ();
+
+    // Copy semantics : forbidden
+    TcpQ(const TcpQ&) = delete;
+    TcpQ& operator=(const TcpQ&) = delete;
+
+    /**
+     * @brief enable queue and start hub task if not running yet
+     */
+    bool startQueues() override;
+
+    /**
+     * @brief disable queue, pending messages are dropped, hub is shared and keeps running
+     */
+    void stopQueues() override;
+
+    /**
+     * @brief enqueue message to be sent once remote bus is idle
+     * this method will take ownership on TX_msg object and 'delete' it
+     *
+     * @return true - if mesage has been enqueue's successfully
+     * @return false - if queue is full or not running
+     */
+    bool txenqueue(TX_msg *msg) override;
+
+    /**
+     * @brief check if connection to the remote server is established
+     */
+    bool connected() const;
+};
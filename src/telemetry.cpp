@@ -0,0 +1,344 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "telemetry.hpp"
+
+#define TELEM_METERS            8       // number of meter_t fields
+#define TELEM_HDR_MAX           28      // magic, version, node, session, seq, tstamp, count
+#define TELEM_REC_MAX           54      // id, ref, mask, model, age, 8 values
+#define TELEM_KEY_FLAG          0x80
+
+namespace telem {
+
+static size_t put_varint(uint8_t *p, uint64_t v){
+    size_t n = 0;
+    while (v > 0x7f){
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static bool get_varint(const uint8_t *p, size_t len, size_t &pos, uint64_t &v){
+    v = 0;
+    for (uint8_t shift = 0; pos < len && shift < 64; shift += 7){
+        uint8_t b = p[pos++];
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline uint32_t zigzag(int32_t v){ return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31); }
+static inline int32_t unzigzag(uint32_t v){ return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1); }
+
+
+// ****  Encoder  **** //
+
+Encoder::slot_t* Encoder::slot(uint8_t id){
+    for (auto &s : slots)
+        if (s.id == id)
+            return &s;
+
+    slot_t s;
+    s.id = id;
+    slots.push_back(s);
+    return &slots.back();
+}
+
+void Encoder::begin(uint8_t *dst, size_t len, uint64_t tstamp){
+    buf = dst;
+    cap = len;
+    cnt = 0;
+    pos = 0;
+    if (!buf || cap < TELEM_HDR_MAX + 2){
+        cap = 0;
+        return;
+    }
+
+    buf[pos++] = TELEM_MAGIC;
+    buf[pos++] = TELEM_VERSION;
+    pos += put_varint(&buf[pos], node);
+    buf[pos++] = session & 0xff;
+    buf[pos++] = session >> 8;
+    pos += put_varint(&buf[pos], seq);
+    pos += put_varint(&buf[pos], tstamp);
+    cnt_pos = pos++;
+}
+
+bool Encoder::add(uint8_t id, pzmbus::pzmodel_t model, const pzmbus::metrics &m, uint32_t age){
+    if (!cap || cnt == UINT8_MAX)
+        return false;
+
+    uint32_t raw[TELEM_METERS];
+    uint8_t mask = 0;
+    for (uint8_t i = 0; i != TELEM_METERS; ++i){
+        auto meter = static_cast<pzmbus::meter_t>(i);
+        if (m.decimals(meter) < 0)
+            continue;
+        mask |= 1 << i;
+        raw[i] = m.asRaw(meter);
+    }
+
+    slot_t *s = slot(id);
+    bool key = !s->keyed || s->since + 1 >= keyperiod || s->mask != mask;
+    uint8_t ref = key ? (s->ref + 1) & ~TELEM_KEY_FLAG : s->ref;
+
+    // record is built aside, slot is updated only if it fits into datagram
+    uint8_t rec[TELEM_REC_MAX];
+    size_t n = 0;
+    rec[n++] = id;
+    rec[n++] = key ? ref | TELEM_KEY_FLAG : ref;
+    rec[n++] = mask;
+    if (key)
+        rec[n++] = static_cast<uint8_t>(model);
+    n += put_varint(&rec[n], age);
+    for (uint8_t i = 0; i != TELEM_METERS; ++i){
+        if (mask & (1 << i))
+            n += put_varint(&rec[n], key ? raw[i] : zigzag(static_cast<int32_t>(raw[i] - s->key[i])));
+    }
+
+    if (pos + n + 2 > cap)
+        return false;
+
+    memcpy(&buf[pos], rec, n);
+    pos += n;
+    ++cnt;
+
+    if (key){
+        s->keyed = true;
+        s->ref = ref;
+        s->mask = mask;
+        s->since = 0;
+        memcpy(s->key, raw, sizeof(raw));
+    } else
+        ++s->since;
+
+    return true;
+}
+
+bool Encoder::add(const PZEM *pz){
+    if (!pz)
+        return false;
+
+    const pzmbus::state *st = pz->getState();
+    int64_t age = st->dataAge();
+    if (!add(pz->id, st->model, *pz->getMetrics(), age > 0 ? age : 0))
+        return false;
+
+    slot(pz->id)->sent_us = st->update_us;
+    return true;
+}
+
+size_t Encoder::finish(){
+    if (!cap || !cnt)
+        return 0;
+
+    buf[cnt_pos] = cnt;
+    modbus::setcrc16(buf, pos + 2);
+    ++seq;
+
+    size_t len = pos + 2;
+    cap = 0;                                // datagram is sealed
+    return len;
+}
+
+void Encoder::forceKey(){
+    for (auto &s : slots)
+        s.keyed = false;
+}
+
+size_t Encoder::publish(const PZPool &pool, send_t f, uint64_t tstamp){
+    if (!f)
+        return 0;
+
+    uint8_t dgram[TELEM_MTU];
+    size_t sent = 0;
+    begin(dgram, sizeof(dgram), tstamp);
+
+    pool.forEachPZEM([&](const PZEM *pz){
+        const pzmbus::state *st = pz->getState();
+        if (!st->update_us || st->restored || slot(pz->id)->sent_us == st->update_us)
+            return true;                    // no new data
+
+        if (add(pz))
+            return true;
+
+        size_t len = finish();
+        if (len && f(dgram, len))
+            ++sent;
+        begin(dgram, sizeof(dgram), tstamp);
+        add(pz);
+        return true;
+    });
+
+    size_t len = finish();
+    if (len && f(dgram, len))
+        ++sent;
+
+    return sent;
+}
+
+
+// ****  Aggregator  **** //
+
+Aggregator::meter_t* Aggregator::meter(node_t &n, uint32_t node_id, uint8_t id){
+    for (auto &m : n.meters)
+        if (m.last.id == id)
+            return &m;
+
+    n.meters.emplace_back();
+    meter_t &m = n.meters.back();
+    m.last.node = node_id;
+    m.last.id = id;
+    return &m;
+}
+
+bool Aggregator::feed(const uint8_t *data, size_t len){
+    if (!data || len < 9 || data[0] != TELEM_MAGIC || data[1] != TELEM_VERSION || !modbus::checkcrc16(data, len)){
+        ++stats.bad;
+        return false;
+    }
+    len -= 2;                               // crc
+
+    size_t pos = 2;
+    uint64_t node_id, seq, tstamp;
+    if (!get_varint(data, len, pos, node_id) || pos + 2 > len){
+        ++stats.bad;
+        return false;
+    }
+    uint16_t session = data[pos] | (data[pos + 1] << 8);
+    pos += 2;
+    if (!get_varint(data, len, pos, seq) || !get_varint(data, len, pos, tstamp) || pos >= len){
+        ++stats.bad;
+        return false;
+    }
+    uint8_t cnt = data[pos++];
+
+    auto it = nodes.find(node_id);
+    if (it == nodes.end()){
+        it = nodes.emplace(node_id, node_t()).first;
+        it->second.session = session;
+        it->second.seq = seq - 1;
+    } else if (it->second.session != session){
+        // node has been restarted, it's key records are gone
+        ++stats.restarts;
+        it->second.meters.clear();
+        it->second.session = session;
+        it->second.seq = seq - 1;
+    }
+    node_t &n = it->second;
+
+    int32_t gap = static_cast<int32_t>(static_cast<uint32_t>(seq) - n.seq);
+    if (gap <= 0 && gap > -TELEM_REORDER_WINDOW){
+        ++stats.late;
+        return false;
+    }
+    if (gap > 1)
+        stats.lost += gap - 1;
+    n.seq = seq;
+    ++stats.frames;
+
+    bool ok = true;
+    for (; cnt; --cnt){
+        if (pos + 3 > len){
+            ok = false;
+            break;
+        }
+
+        uint8_t id = data[pos++];
+        uint8_t ref = data[pos++];
+        uint8_t mask = data[pos++];
+        bool key = ref & TELEM_KEY_FLAG;
+        ref &= ~TELEM_KEY_FLAG;
+
+        uint8_t model = 0;
+        if (key){
+            if (pos >= len){
+                ok = false;
+                break;
+            }
+            model = data[pos++];
+        }
+
+        uint64_t age;
+        uint32_t vals[TELEM_METERS] = {};
+        ok = get_varint(data, len, pos, age);
+        for (uint8_t i = 0; ok && i != TELEM_METERS; ++i){
+            uint64_t v;
+            if (mask & (1 << i)){
+                ok = get_varint(data, len, pos, v);
+                vals[i] = v;
+            }
+        }
+        if (!ok)
+            break;
+
+        meter_t *m = meter(n, node_id, id);
+        if (key){
+            m->keyed = true;
+            m->ref = ref;
+            m->last.model = static_cast<pzmbus::pzmodel_t>(model);
+            memcpy(m->key, vals, sizeof(vals));
+        } else if (!m->keyed || m->ref != ref || m->last.mask != mask){
+            ++stats.orphans;
+            continue;
+        } else {
+            for (uint8_t i = 0; i != TELEM_METERS; ++i)
+                if (mask & (1 << i))
+                    vals[i] = m->key[i] + unzigzag(vals[i]);
+        }
+
+        m->last.mask = mask;
+        m->last.tstamp = tstamp - age;
+        memcpy(m->last.raw, vals, sizeof(vals));
+        ++stats.records;
+
+        if (cb)
+            cb(m->last);
+    }
+
+    if (!ok)
+        ++stats.bad;                        // records are truncated, crc matched though
+
+    return true;
+}
+
+const sample_t* Aggregator::get(uint32_t node, uint8_t id) const {
+    auto it = nodes.find(node);
+    if (it == nodes.end())
+        return nullptr;
+
+    for (const auto &m : it->second.meters)
+        if (m.last.id == id && m.last.mask)
+            return &m.last;
+
+    return nullptr;
+}
+
+size_t Aggregator::forEach(std::function<bool (const sample_t &s)> f) const {
+    size_t cnt = 0;
+    for (const auto &n : nodes){
+        for (const auto &m : n.second.meters){
+            if (!m.last.mask)
+                continue;
+            ++cnt;
+            if (!f(m.last))
+                return cnt;
+        }
+    }
+    return cnt;
+}
+
+}   // namespace telem
@@ -0,0 +1,257 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+#include <unordered_map>
+#include <vector>
+
+#define TELEM_MAGIC             0xE7
+#define TELEM_VERSION           1
+#define TELEM_MTU               1200    // max datagram size, bytes
+#define TELEM_KEY_PERIOD        10      // every n-th record of a meter is a key record
+#define TELEM_REORDER_WINDOW    64      // datagrams with seq this far behind the last one are dropped as late
+
+/**
+ * @brief compact binary UDP telemetry of meter updates from edge nodes to an aggregator
+ *
+ * Datagram, all multibyte integers are LEB128 varints unless noted:
+ *  magic(1) | version(1) | node | session(2, LE) | seq | tstamp | count(1) | records... | crc16(2, modbus)
+ *
+ *  node    - node id, unique within aggregator
+ *  session - random value picked on node boot, aggregator resets node's state once it changes
+ *  seq     - datagram sequence number, used to count lost and to drop duplicate/late datagrams
+ *  tstamp  - node base timestamp, ms, any clock as long as it is monotonic during session
+ *
+ * Record:
+ *  id(1) | ref(1) | mask(1) | [model(1)] | age | value for each bit in mask...
+ *
+ *  ref     - bit 7 set for a key record, bits 0-6 - key record sequence of the meter
+ *  mask    - bitmask of pzmbus::meter_t values present
+ *  model   - pzmbus::pzmodel_t, key records only
+ *  age     - data age, ms before tstamp
+ *  value   - raw device integer, key records carry absolute values, delta records carry zigzag encoded
+ *            difference to the values of the key record with the same ref
+ *
+ * Delta records depend on a key record only, not on previous datagrams, so a lost datagram loses its own
+ * updates only. A lost key record makes following deltas of the meter undecodable until the next key record,
+ * which is sent every TELEM_KEY_PERIOD updates of the meter. Typical PZEM004 update takes ~10 bytes
+ * versus ~200 bytes of JSON.
+ */
+namespace telem {
+
+/**
+ * @brief node side datagram encoder
+ * Not thread-safe, use from one task, i.e. the one polling meters or a timer.
+ *
+ *  telem::Encoder enc(node_id, esp_random());
+ *  enc.publish(pool, [sock, &dst](const uint8_t *data, size_t len){
+ *      return sendto(sock, data, len, 0, (struct sockaddr*)&dst, sizeof(dst)) == len;
+ *  }, esp_timer_get_time() / 1000);
+ */
+class Encoder {
+
+public:
+    /**
+     * @brief datagram send call-back
+     * @return true if datagram has been sent
+     */
+    typedef std::function<bool (const uint8_t *data, size_t len)> send_t;
+
+private:
+    struct slot_t {
+        uint8_t id;
+        uint8_t ref = 0;                    // last key record sequence
+        uint8_t since = 0;                  // records since the key one
+        uint8_t mask = 0;                   // fields of the key record
+        bool keyed = false;                 // there is a key record to reference
+        int64_t sent_us = 0;                // update time of the last sent data
+        uint32_t key[8];                    // key record values
+    };
+
+    const uint32_t node;
+    const uint16_t session;
+    uint8_t keyperiod;
+    uint32_t seq = 0;
+    std::vector<slot_t> slots;
+
+    uint8_t *buf = nullptr;
+    size_t cap = 0;
+    size_t pos = 0;
+    uint8_t cnt = 0;
+    size_t cnt_pos = 0;
+
+    slot_t* slot(uint8_t id);
+
+public:
+    /**
+     * @brief Construct a new Encoder
+     *
+     * @param node_id - node id
+     * @param session_id - value that differs between node boots, i.e. esp_random()
+     * @param keyperiod - send key record every n updates of a meter
+     */
+    Encoder(uint32_t node_id, uint16_t session_id, uint8_t keyperiod = TELEM_KEY_PERIOD) : node(node_id), session(session_id), keyperiod(keyperiod ? keyperiod : 1) {}
+
+    /**
+     * @brief start a new datagram
+     *
+     * @param dst - buffer, TELEM_MTU bytes is enough
+     * @param len - buffer size
+     * @param tstamp - base timestamp, ms
+     */
+    void begin(uint8_t *dst, size_t len, uint64_t tstamp);
+
+    /**
+     * @brief add meter update to the datagram
+     *
+     * @param id - meter id
+     * @param model - meter model
+     * @param m - metrics
+     * @param age - data age relative to datagram tstamp, ms
+     * @return true - record added
+     * @return false - datagram is full, finish() and send it, then begin() a new one and repeat
+     */
+    bool add(uint8_t id, pzmbus::pzmodel_t model, const pzmbus::metrics &m, uint32_t age = 0);
+
+    /**
+     * @brief add PZEM's update to the datagram
+     */
+    bool add(const PZEM *pz);
+
+    /**
+     * @brief finalize datagram
+     *
+     * @return size_t - datagram length, 0 if there are no records
+     */
+    size_t finish();
+
+    /**
+     * @brief send key records for all meters on their next updates
+     * i.e. when aggregator has been restarted
+     */
+    void forceKey();
+
+    /**
+     * @brief encode and send updates of all pool's meters that have new data since the last publish
+     *
+     * @param pool - PZEM pool
+     * @param f - send call-back
+     * @param tstamp - base timestamp, ms
+     * @return size_t - number of datagrams sent
+     */
+    size_t publish(const PZPool &pool, send_t f, uint64_t tstamp);
+
+    /**
+     * @brief sequence number of the next datagram
+     */
+    uint32_t getSeq() const { return seq; }
+};
+
+
+/**
+ * @brief decoded meter sample
+ */
+struct sample_t {
+    uint32_t node;
+    uint8_t id;
+    pzmbus::pzmodel_t model = pzmbus::pzmodel_t::none;
+    uint8_t mask = 0;                       // fields present
+    uint64_t tstamp = 0;                    // sample time, ms, node's clock
+    uint32_t raw[8] = {};                   // raw values indexed by meter_t
+};
+
+struct agg_stats_t {
+    uint32_t frames = 0;                    // datagrams accepted
+    uint32_t bad = 0;                       // malformed datagrams
+    uint32_t late = 0;                      // duplicate or late datagrams
+    uint32_t lost = 0;                      // sequence gaps
+    uint32_t restarts = 0;                  // node session changes
+    uint32_t records = 0;                   // records decoded
+    uint32_t orphans = 0;                   // delta records without a matching key record
+};
+
+/**
+ * @brief host side aggregator
+ * Decodes datagrams from any number of nodes and keeps the latest sample of every meter.
+ * Not thread-safe, feed it from one thread, i.e. the one reading the socket.
+ */
+class Aggregator {
+
+public:
+    typedef std::function<void (const sample_t &s)> sample_cb_t;
+
+private:
+    struct meter_t {
+        uint8_t ref = 0;
+        bool keyed = false;
+        uint32_t key[8];
+        sample_t last;
+    };
+
+    struct node_t {
+        uint16_t session = 0;
+        uint32_t seq = 0;
+        std::vector<meter_t> meters;
+    };
+
+    std::unordered_map<uint32_t, node_t> nodes;
+    sample_cb_t cb = nullptr;
+    agg_stats_t stats;
+
+    meter_t* meter(node_t &n, uint32_t node_id, uint8_t id);
+
+public:
+    /**
+     * @brief decode a datagram
+     *
+     * @return true - datagram accepted
+     * @return false - malformed, duplicate or late datagram
+     */
+    bool feed(const uint8_t *data, size_t len);
+
+    /**
+     * @brief attach call-back, called for every decoded sample
+     *
+     * @param f callback function prototype: std::function<void (const sample_t &s)>
+     */
+    void attach_cb(sample_cb_t f){ if (f) cb = std::move(f); }
+
+    void detach_cb(){ cb = nullptr; }
+
+    /**
+     * @brief latest sample of a meter
+     *
+     * @return const sample_t* - nullptr if nothing has been received yet
+     */
+    const sample_t* get(uint32_t node, uint8_t id) const;
+
+    /**
+     * @brief iterate over latest samples of all meters
+     *
+     * @param f - visitor function, iteration stops once it returns false
+     * @return size_t - number of samples visited
+     */
+    size_t forEach(std::function<bool (const sample_t &s)> f) const;
+
+    /**
+     * @brief drop node's state
+     */
+    void forget(uint32_t node){ nodes.erase(node); }
+
+    size_t countNodes() const { return nodes.size(); }
+
+    const agg_stats_t& getStats() const { return stats; }
+};
+
+}   // namespace telem
@@ -0,0 +1,103 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "textfmt.hpp"
+
+namespace textfmt {
+
+static const char* const meter_names[] = { "voltage", "current", "power", "energy", "frequency", "pf", "alarmh", "alarml" };
+static const char* const meter_units[] = { "volts", "amperes", "watts", "watthours", "hertz", "ratio", "", "" };
+
+size_t fmt_uint(char *dst, uint64_t v){
+    char tmp[20];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    for (size_t i = 0; i != n; ++i)
+        dst[i] = tmp[n - 1 - i];
+    return n;
+}
+
+size_t fmt_int(char *dst, int64_t v){
+    if (v >= 0)
+        return fmt_uint(dst, v);
+
+    *dst = '-';
+    return 1 + fmt_uint(dst + 1, -(uint64_t)v);
+}
+
+size_t fmt_fixed(char *dst, int64_t raw, uint8_t dec){
+    if (!dec)
+        return fmt_int(dst, raw);
+
+    size_t n = 0;
+    uint64_t v = raw;
+    if (raw < 0){
+        dst[n++] = '-';
+        v = -(uint64_t)raw;
+    }
+
+    uint64_t div = 1;
+    for (uint8_t i = 0; i != dec; ++i)
+        div *= 10;
+
+    n += fmt_uint(&dst[n], v / div);
+    dst[n++] = '.';
+
+    // fractional part with leading zeroes
+    uint64_t frac = v % div;
+    for (uint8_t i = dec; i; --i){
+        dst[n + i - 1] = '0' + frac % 10;
+        frac /= 10;
+    }
+    return n + dec;
+}
+
+size_t fmt_meter(char *dst, const pzmbus::metrics &m, pzmbus::meter_t meter){
+    int8_t dec = m.decimals(meter);
+    if (dec < 0)
+        return 0;
+
+    return fmt_fixed(dst, m.asRaw(meter), dec);
+}
+
+size_t fmt_str(char *dst, const char *src, size_t max){
+    size_t n = 0;
+    while (src && src[n] && n != max){
+        dst[n] = src[n];
+        ++n;
+    }
+    return n;
+}
+
+const char* meter_name(pzmbus::meter_t m){
+    return meter_names[static_cast<uint8_t>(m) % (sizeof(meter_names) / sizeof(meter_names[0]))];
+}
+
+const char* meter_unit(pzmbus::meter_t m){
+    return meter_units[static_cast<uint8_t>(m) % (sizeof(meter_units) / sizeof(meter_units[0]))];
+}
+
+size_t LineSpool::drain(char *dst, size_t dlen){
+    size_t n = len - pos;
+    if (n > dlen)
+        n = dlen;
+
+    memcpy(dst, &line[pos], n);
+    pos += n;
+    return n;
+}
+
+}   // namespace textfmt
@@ -0,0 +1,129 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_modbus.hpp"
+
+#define TEXTFMT_LINE_MAX        512     // max length of a single record rendered by text encoders
+#define TEXTFMT_METERS_ALL      0xff    // field mask with all meter_t fields selected
+
+/**
+ * @brief allocation-free text formatting helpers for exporters
+ * Numbers are rendered from integers only, PZEM fixed-point values are printed with
+ * the decimal point placed according to metrics::decimals(), no float printf is involved.
+ * None of the functions writes a terminating '\0'
+ */
+namespace textfmt {
+
+/**
+ * @brief print unsigned integer
+ *
+ * @param dst - destination buffer, at least 20 bytes
+ * @return size_t - number of chars written
+ */
+size_t fmt_uint(char *dst, uint64_t v);
+
+/**
+ * @brief print signed integer
+ *
+ * @param dst - destination buffer, at least 21 bytes
+ * @return size_t - number of chars written
+ */
+size_t fmt_int(char *dst, int64_t v);
+
+/**
+ * @brief print fixed point value
+ * i.e. raw = 2301, dec = 1 is printed as "230.1", raw = 5, dec = 2 is printed as "0.05"
+ *
+ * @param dst - destination buffer, at least 22 bytes
+ * @param raw - integer value
+ * @param dec - number of decimal digits
+ * @return size_t - number of chars written
+ */
+size_t fmt_fixed(char *dst, int64_t raw, uint8_t dec);
+
+/**
+ * @brief print metric value from metrics struct as a decimal number
+ *
+ * @param dst - destination buffer, at least 22 bytes
+ * @return size_t - number of chars written, 0 if metric is not supported
+ */
+size_t fmt_meter(char *dst, const pzmbus::metrics &m, pzmbus::meter_t meter);
+
+/**
+ * @brief copy string
+ *
+ * @param dst - destination buffer
+ * @param src - null-terminated string
+ * @param max - max number of chars to copy
+ * @return size_t - number of chars written
+ */
+size_t fmt_str(char *dst, const char *src, size_t max = TEXTFMT_LINE_MAX);
+
+/**
+ * @brief return metric field name, i.e. "voltage"
+ */
+const char* meter_name(pzmbus::meter_t m);
+
+/**
+ * @brief return metric unit suffix, i.e. "volts", empty string for unitless metrics
+ */
+const char* meter_unit(pzmbus::meter_t m);
+
+/**
+ * @brief check if meter field is selected in a mask
+ */
+inline bool selected(uint8_t mask, pzmbus::meter_t m){ return mask & (1 << static_cast<uint8_t>(m)); }
+
+/**
+ * @brief record spooler for resumable encoders
+ * An encoder renders one record at a time into the spool, then it is drained into caller's
+ * buffers of any size, a record that does not fit a buffer is continued in the next one.
+ * This keeps memory usage constant regardless of the amount of data encoded.
+ */
+class LineSpool {
+    char line[TEXTFMT_LINE_MAX];
+    size_t len = 0;
+    size_t pos = 0;
+
+public:
+    /**
+     * @brief buffer to render next record into, TEXTFMT_LINE_MAX bytes
+     * it must not be used while spool has pending data
+     */
+    char* buf(){ return line; }
+
+    /**
+     * @brief commit rendered record of n bytes
+     */
+    void commit(size_t n){ len = n; pos = 0; }
+
+    /**
+     * @brief check if spool still has data to drain
+     */
+    bool pending() const { return pos < len; }
+
+    /**
+     * @brief drop any pending data
+     */
+    void reset(){ len = pos = 0; }
+
+    /**
+     * @brief copy pending data to destination buffer
+     *
+     * @return size_t - number of bytes copied
+     */
+    size_t drain(char *dst, size_t dlen);
+};
+
+}   // namespace textfmt
@@ -22,8 +22,10 @@ GitHub: https://github.com/vortigont/pzem-edl
 #include "no_c++14"
 #endif
 
+#include <algorithm>
 #include <cstdlib>
 #include <list>
+#include <new>
 
 // PSRAM support
 #include "esp_idf_version.h"
@@ -39,6 +41,7 @@ GitHub: https://github.com/vortigont/pzem-edl
 //#include "psalloc.hpp"
 
 #include "pzem_modbus.hpp"
+#include "memstat.hpp"
 
 // forward declarations
 template <typename T> class RingBuff;
@@ -123,6 +126,17 @@ struct RingIterator {
 };
 
 
+/**
+ * @brief two-tier ring buffer configuration
+ * the most recent samples are kept in a small 'hot' ring in internal RAM, once it is full the oldest 'batch'
+ * samples are moved in one block to the 'cold' ring in PSRAM. Pushes and reads of the recent window
+ * are served from internal RAM while the history still sits in large and slow PSRAM
+ */
+struct ringbuff_tier_t {
+    size_t hot;                     // hot ring size, elements
+    size_t batch = 0;               // elements moved to the cold ring at once, 0 - half of the hot ring
+};
+
 /**
  * @brief ring buffer container for arbitrary data
  * It tries to allocate memory from PSRAM if available, then falls back to malloc() if PSRAM fails
@@ -134,7 +148,45 @@ template <typename T>
 class RingBuff {
     int head = 0;
     std::unique_ptr<T[], decltype(free)*> data{nullptr, free};
-    inline int tail() const { return (head + size)%capacity; }
+    bool psram = false;
+    int cold_cap;                   // 'data' ring capacity, equals to total capacity unless buffer is tiered
+
+    // hot tier, keeps the newest elements in internal RAM, 'data' holds the older ones
+    std::unique_ptr<T[], decltype(free)*> hot{nullptr, free};
+    int hot_head = 0;
+    int hot_size = 0;
+    int hot_cap = 0;
+    int batch = 0;
+
+    inline int tail() const { return (head + size)%cold_cap; }
+    static void nofree(void*){}
+
+    // overwrite stored element, previous value is destroyed before the new one is constructed in place
+    static void put(T *p, const T &val){
+        if (p == &val)
+            return;
+        p->~T();
+        new (p) T(val);
+    }
+
+    // destroy elements constructed in storage
+    static void destroy(T *p, size_t s){
+        for (size_t i = 0; p && i != s; ++i)
+            p[i].~T();
+    }
+
+    /**
+     * @brief allocate and construct elements, PSRAM is tried first unless internal RAM is requested
+     *
+     * @return T* - storage or nullptr if allocation failed
+     */
+    T* mkstorage(size_t s, bool internal, bool &in_psram);
+
+    /**
+     * @brief move 'batch' oldest elements from hot to cold ring
+     * elements are copied in contiguous runs, oldest cold elements are overwritten if it is full
+     */
+    void spill();
 
     using Iterator = RingIterator<T, false>;
     using ConstIterator = RingIterator<T, true>;
@@ -152,20 +204,62 @@ public:
     const size_t capacity;          // max buffer capacity
 
     explicit RingBuff (size_t _s) :
-        capacity(_s) {
-            auto p = static_cast<T*>(heap_caps_malloc(_s*sizeof(T), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));     // try to alloc SPI ram first
+        cold_cap(_s), capacity(_s) {
+            data.reset(mkstorage(_s, false, psram));
+        }
 
-            if (!p)
-                p = static_cast<T*>(malloc(_s*sizeof(T)));      // try any available RAM otherwise
+    /**
+     * @brief use caller-provided storage, i.e. a static array, it is never released by the buffer
+     * elements are owned by the caller, they are overwritten in place but never destroyed by the buffer
+     *
+     * @param buf - array of _s elements
+     * @param _s - container size
+     */
+    RingBuff (T *buf, size_t _s) :
+        data(buf, nofree), cold_cap(_s), capacity(_s) {}
 
-            if (p){ // OK, we were able to allocate mem
-                data.reset(p);
+    /**
+     * @brief two-tier buffer, tier.hot elements in internal RAM and the rest in PSRAM
+     * falls back to a plain buffer if hot ring is not smaller than _s or can't be allocated.
+     * Once filled, buffer holds at least _s - batch elements
+     *
+     * @param tier - tiers configuration
+     * @param _s - container size, both tiers
+     */
+    RingBuff (const ringbuff_tier_t &tier, size_t _s) :
+        cold_cap(_s), capacity(_s) {
+            if (tier.hot && tier.hot < _s){
+                bool in_psram;
+                hot.reset(mkstorage(tier.hot, true, in_psram));
+            }
+            if (hot){
+                hot_cap = tier.hot;
+                batch = tier.batch && tier.batch <= tier.hot ? tier.batch : (tier.hot + 1) / 2;
+                cold_cap = _s - tier.hot;
             }
+            data.reset(mkstorage(cold_cap, false, psram));
         }
 
     // D-tor
-    virtual ~RingBuff(){};
+    virtual ~RingBuff(){
+        // all slots of own storage are constructed on allocation, caller-provided array is left to the caller
+        if (data && data.get_deleter() != nofree){
+            destroy(data.get(), cold_cap);
+            memstat::release(memstat::tag_t::series, cold_cap*sizeof(T), psram);
+        }
+        destroy(hot.get(), hot_cap);
+        if (hot)
+            memstat::release(memstat::tag_t::series, hot_cap*sizeof(T));
+    };
 
+    // storage has been allocated in PSRAM, the cold one for a tiered buffer
+    bool inPSRAM() const { return psram; }
+
+    /**
+     * @brief hot ring capacity, 0 for a plain buffer
+     * at least getHotCap() - batch newest elements are always served from internal RAM
+     */
+    int getHotCap() const { return hot_cap; }
 
     T *at(int offset) const {
         if (!size)
@@ -175,14 +269,18 @@ public:
         if (offset < 0)
             offset += size; 
 
-        return &data[(head + offset) % capacity];    // offset from head
+        int cold = size - hot_size;
+        if (offset >= cold)
+            return &hot[(hot_head + offset - cold) % hot_cap];
+
+        return &data[(head + offset) % cold_cap];    // offset from head
     }
 
     /**
      * @brief reset buffer to initial state
      * no data changed actually, only iterators and pointers are invalided
      */
-    void clear(){ head = 0; size = 0; };
+    void clear(){ head = 0; size = 0; hot_head = 0; hot_size = 0; };
 
     /**
      * @brief return current size of the buffer
@@ -237,10 +335,15 @@ public:
  */
 template <typename T>
 class TimeSeries : public RingBuff<T> {
+public:
+    typedef std::function<void (uint8_t id, const T &val, uint32_t time)> push_callback_t;
+
+private:
     uint32_t tstamp;                    // last update timestamp mark
     uint32_t interval;                  // time interval between series
     const char* _descr;                 // Mnemonic name for the instance
     std::unique_ptr< AveragingFunction<T> > _avg;  // averaging instance
+    push_callback_t _push_cb = nullptr;             // external callback to trigger on new sample stored
 
 
 public:
@@ -250,6 +353,16 @@ public:
      * Class constructor
      */
     TimeSeries (uint8_t id, size_t s, uint32_t start_time, uint32_t inverval = 1, const char *name = NULL) : RingBuff<T>(s), tstamp(start_time), interval(inverval), _descr(name), id(id) { }
+
+    /**
+     * Class constructor, series data is kept in caller-provided storage of s elements
+     */
+    TimeSeries (T *buf, uint8_t id, size_t s, uint32_t start_time, uint32_t inverval = 1, const char *name = NULL) : RingBuff<T>(buf, s), tstamp(start_time), interval(inverval), _descr(name), id(id) { }
+
+    /**
+     * Class constructor, two-tier series with recent samples in internal RAM, see ringbuff_tier_t
+     */
+    TimeSeries (const ringbuff_tier_t &tier, uint8_t id, size_t s, uint32_t start_time, uint32_t inverval = 1, const char *name = NULL) : RingBuff<T>(tier, s), tstamp(start_time), interval(inverval), _descr(name), id(id) { }
     //virtual ~TimeSeries(){};
 
     /**
@@ -278,6 +391,20 @@ public:
     void setInterval(uint32_t _interval, uint32_t newtime);
 
     void setAverager(std::unique_ptr< AveragingFunction<T> >&& rhs){ _avg = std::move(rhs); };
+
+    /**
+     * @brief external callback function
+     * it is fed with every new sample stored in the series (i.e. averaged value for the interval)
+     * along with TimeSeries ID and timestamp. Gap-filling samples are not reported
+     *
+     * @param f callback function prototype: std::function<void (uint8_t id, const T &val, uint32_t time)>
+     */
+    void attach_push_callback(push_callback_t f){ if (f) _push_cb = std::move(f); }
+
+    /**
+     * @brief detach external callback
+     */
+    void detach_push_callback(){ _push_cb = nullptr; }
 };
 
 template <typename T>
@@ -314,7 +441,27 @@ public:
      * @return uint8_t - assigned ID, returns 0 if TS has failed, possibly due to requested ID already exist.
      *                  If 0 is provided, then next available id will be autoassing
      */
-    uint8_t addTS(size_t s, uint32_t start_time, uint32_t period = 1, const char *descr = nullptr, uint8_t id = 0);
+    uint8_t addTS(size_t s, uint32_t start_time, uint32_t period = 1, const char *descr = nullptr, uint8_t id = 0){ return addTS(nullptr, s, start_time, period, descr, id); }
+
+    /**
+     * @brief add new TimeSeries object with caller-provided storage for series data
+     * i.e. a static array, so that series data does not take heap. Storage must outlive the series
+     *
+     * @param buf - storage for s entries, nullptr to allocate it
+     * see addTS() above for other params
+     */
+    uint8_t addTS(T *buf, size_t s, uint32_t start_time, uint32_t period = 1, const char *descr = nullptr, uint8_t id = 0);
+
+    /**
+     * @brief add new two-tier TimeSeries object
+     * 'hot' newest entries are kept in internal RAM, the rest of the series in PSRAM,
+     * a half of hot entries are moved to PSRAM at once when hot ring overflows
+     *
+     * @param s - number of entries to keep, both tiers
+     * @param hot - number of entries to keep in internal RAM
+     * see addTS() above for other params
+     */
+    uint8_t addTieredTS(size_t s, size_t hot, uint32_t start_time, uint32_t period = 1, const char *descr = nullptr, uint8_t id = 0);
 
     /**
      * @brief remove specific TS object
@@ -389,7 +536,18 @@ public:
     int getTScnt() const { return tschain.size(); };
 
 protected:
-    std::list< std::shared_ptr<TimeSeries<T>> > tschain;  // time-series chain
+    /**
+     * @brief check requested TS id or pick the next free one if it is 0
+     *
+     * @return uint8_t - id to use, 0 if requested id is taken or there are no free ids
+     */
+    uint8_t freeID(uint8_t id) const;
+
+    // series objects and chain nodes are accounted under memstat::tag_t::series
+    template <class U>
+    using ts_alloc = memstat::allocator<U, memstat::tag_t::series>;
+
+    std::list< std::shared_ptr<TimeSeries<T>>, ts_alloc<std::shared_ptr<TimeSeries<T>>> > tschain;  // time-series chain
 
 };
 
@@ -417,15 +575,63 @@ public:
 
 
 //  ===== Implementation follows below =====
+template <typename T>
+T* RingBuff<T>::mkstorage(size_t s, bool internal, bool &in_psram){
+    T *p = internal ? nullptr : static_cast<T*>(heap_caps_malloc(s*sizeof(T), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT));     // try to alloc SPI ram first
+    in_psram = p != nullptr;
+
+    if (!p)
+        p = static_cast<T*>(internal ? heap_caps_malloc(s*sizeof(T), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) : malloc(s*sizeof(T)));      // try any available RAM otherwise
+
+    if (p){ // OK, we were able to allocate mem
+        // construct elements in place, stored types could be polymorphic (i.e. metrics structs)
+        for (size_t i = 0; i != s; ++i)
+            new (&p[i]) T();
+        memstat::alloc(memstat::tag_t::series, s*sizeof(T), in_psram);
+    }
+    return p;
+}
+
+template <typename T>
+void RingBuff<T>::spill(){
+    int cold = size - hot_size;
+    for (int left = std::min(batch, hot_size); left; ){
+        int dst = (head + cold) % cold_cap;
+        int run = std::min(left, std::min(hot_cap - hot_head, cold_cap - dst));
+        for (int i = 0; i != run; ++i)
+            put(&data[dst + i], hot[hot_head + i]);
+
+        if (cold + run > cold_cap){         // oldest elements are overwritten
+            head = (head + cold + run - cold_cap) % cold_cap;
+            cold = cold_cap;
+        } else
+            cold += run;
+
+        hot_head = (hot_head + run) % hot_cap;
+        hot_size -= run;
+        left -= run;
+    }
+    size = cold + hot_size;
+}
+
 template <typename T>
 void RingBuff<T>::push_back(const T &val){
     if (!data)
         return;
 
-    data[tail()] = val;
-    if (size != capacity)
+    if (hot_cap){
+        if (hot_size == hot_cap)
+            spill();
+        put(&hot[(hot_head + hot_size) % hot_cap], val);
+        ++hot_size;
         ++size;
-    else if (++head == capacity)
+        return;
+    }
+
+    put(&data[tail()], val);
+    if (size != cold_cap)
+        ++size;
+    else if (++head == cold_cap)
         head = 0;
 }
 
@@ -470,6 +676,10 @@ void TimeSeries<T>::push(const T &val, uint32_t time){
         RingBuff<T>::push_back(val);
 
     tstamp = _t;                    // обновляем метку времени
+
+    const T* last = RingBuff<T>::at(-1);
+    if (_push_cb && last)
+        _push_cb(id, *last, _t);
 }
 
 template <typename T>
@@ -493,7 +703,7 @@ const TimeSeries<T>* TSContainer<T>::getTS(uint8_t id) const {
 }
 
 template <typename T>
-uint8_t TSContainer<T>::addTS(size_t s, uint32_t start_time, uint32_t period, const char *descr, uint8_t id){
+uint8_t TSContainer<T>::freeID(uint8_t id) const {
 
     if (id && getTS(id)){       // check if provided id is already exist
         return 0;
@@ -504,10 +714,34 @@ uint8_t TSContainer<T>::addTS(size_t s, uint32_t start_time, uint32_t period, co
         do {
             n = getTS(++id);
         } while (n && id);
-        if (!id) return 0;
     }
 
-    tschain.emplace_back(std::make_shared<TimeSeries<T>>(id, s, start_time, period, descr));
+    return id;
+}
+
+template <typename T>
+uint8_t TSContainer<T>::addTS(T *buf, size_t s, uint32_t start_time, uint32_t period, const char *descr, uint8_t id){
+
+    id = freeID(id);
+    if (!id) return 0;
+
+    if (buf)
+        tschain.emplace_back(std::allocate_shared<TimeSeries<T>>(ts_alloc<TimeSeries<T>>(), buf, id, s, start_time, period, descr));
+    else
+        tschain.emplace_back(std::allocate_shared<TimeSeries<T>>(ts_alloc<TimeSeries<T>>(), id, s, start_time, period, descr));
+    if (period > 1)
+        setAverager(id, std::make_unique<MeanAveragePZ004>());
+    return id;
+}
+
+template <typename T>
+uint8_t TSContainer<T>::addTieredTS(size_t s, size_t hot, uint32_t start_time, uint32_t period, const char *descr, uint8_t id){
+
+    id = freeID(id);
+    if (!id) return 0;
+
+    ringbuff_tier_t tier{hot};
+    tschain.emplace_back(std::allocate_shared<TimeSeries<T>>(ts_alloc<TimeSeries<T>>(), tier, id, s, start_time, period, descr));
     if (period > 1)
         setAverager(id, std::make_unique<MeanAveragePZ004>());
     return id;
@@ -0,0 +1,326 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "topology.hpp"
+#include <utility>
+#include <vector>
+
+#define TOPOLOGY_HEADER_LEN     12
+#define TOPOLOGY_PORT_UART      0x01    // port flag - created from UART_cfg
+
+namespace topology {
+
+// sequential LE writer, counts bytes only if dst is nullptr
+struct blob_writer {
+    uint8_t *dst;
+    size_t len;
+    size_t pos = 0;
+
+    blob_writer(uint8_t *d, size_t l) : dst(d), len(l) {}
+
+    void put(const void *data, size_t n){
+        if (dst && pos + n <= len)
+            memcpy(&dst[pos], data, n);
+        pos += n;
+    }
+    void u8(uint8_t v){ put(&v, 1); }
+    void u16(uint16_t v){ uint8_t b[2] = {static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8)}; put(b, 2); }
+    void u32(uint32_t v){ u16(v & 0xffff); u16(v >> 16); }
+    void str(const char *s, size_t n){ u8(n); put(s, n); }
+    void str(const char *s){ size_t n = s ? strlen(s) : 0; str(s, n > UINT8_MAX ? UINT8_MAX : n); }
+};
+
+// sequential LE reader, errors are sticky
+struct blob_reader {
+    const uint8_t *src;
+    size_t len;
+    size_t pos = 0;
+    bool ok = true;
+
+    blob_reader(const uint8_t *s, size_t l) : src(s), len(l) {}
+
+    const uint8_t* get(size_t n){
+        if (!ok || pos + n > len){
+            ok = false;
+            return nullptr;
+        }
+        pos += n;
+        return &src[pos - n];
+    }
+    uint8_t u8(){ auto p = get(1); return p ? p[0] : 0; }
+    uint16_t u16(){ auto p = get(2); return p ? p[0] | p[1] << 8 : 0; }
+    uint32_t u32(){ uint32_t v = u16(); return v | static_cast<uint32_t>(u16()) << 16; }
+    // length prefixed bytes
+    const uint8_t* lstr(uint8_t &n){ n = u8(); return get(n); }
+};
+
+struct port_rec {
+    uint8_t id;
+    uint8_t flags;
+    UART_cfg cfg;
+    const uint8_t *descr;
+    uint8_t descr_len;
+};
+
+struct meter_rec {
+    uint8_t id;
+    uint8_t port;
+    uint8_t addr;
+    uint8_t model;
+    const uint8_t *descr;
+    uint8_t descr_len;
+    const uint8_t *rhr;
+    uint8_t rhr_len;
+};
+
+struct blob_t {
+    uint32_t pollrate;
+    std::vector<port_rec> ports;
+    std::vector<meter_rec> meters;
+};
+
+size_t save(const PZPool &pool, uint8_t *dst, size_t len){
+    // pool could change while saving, so records are counted as written
+    size_t nports = 0, nmeters = 0;
+
+    blob_writer w(dst, len);
+    w.put("PZT", 3);
+    w.u8(TOPOLOGY_VERSION);
+    w.u16(0);                   // blob length, updated later
+    w.u8(0);                    // number of ports, updated later
+    w.u8(0);                    // number of meters, updated later
+    w.u32(pool.getPollrate());
+
+    pool.forEachPort([&w, &nports](const PZPort *p){
+        const UART_cfg *cfg = p->getUARTcfg();
+        w.u8(p->id);
+        w.u8(cfg ? TOPOLOGY_PORT_UART : 0);
+        if (cfg){
+            w.u8(cfg->p);
+            w.u8(static_cast<int8_t>(cfg->gpio_rx));
+            w.u8(static_cast<int8_t>(cfg->gpio_tx));
+            w.u32(cfg->uartcfg.baud_rate);
+            w.u8(cfg->uartcfg.data_bits);
+            w.u8(cfg->uartcfg.parity);
+            w.u8(cfg->uartcfg.stop_bits);
+        }
+        w.str(p->getDescr());
+        ++nports;
+        return true;
+    });
+
+    pool.forEachPZEM([&w, &pool, &nmeters](const PZEM *pz){
+        const auto *p_img = pz->getRegImage(CMD_RHR);
+        const pzmbus::regimage_t rhr = p_img ? p_img->snapshot() : pzmbus::regimage_t();
+        const auto *img = p_img ? &rhr : nullptr;
+        // PZEM could be removed from the pool while iterating over a snapshot
+        auto port = pool.getPZEMPort(pz->id);
+        if (!port)
+            return true;
+
+        w.u8(pz->id);
+        w.u8(port->id);
+        w.u8(pz->getaddr());
+        w.u8(static_cast<uint8_t>(pz->getState()->model));
+        w.str(pz->getDescr());
+        if (img)
+            w.str(reinterpret_cast<const char*>(img->data), img->len);
+        else
+            w.u8(0);
+        ++nmeters;
+        return true;
+    });
+
+    size_t size = w.pos + 2;
+    if (nports > TOPOLOGY_MAX_PORTS || nmeters > TOPOLOGY_MAX_METERS || size > UINT16_MAX || (dst && size > len))
+        return 0;
+
+    if (dst){
+        dst[4] = size & 0xff;
+        dst[5] = size >> 8;
+        dst[6] = nports;
+        dst[7] = nmeters;
+        uint16_t crc = modbus::crc16(dst, w.pos);
+        w.u16(crc);
+    }
+    return size;
+}
+
+// parse and validate blob
+static bool parse(const PZPool &pool, const uint8_t *src, size_t len, blob_t &blob){
+    if (!src || len < TOPOLOGY_HEADER_LEN + 2 || len > UINT16_MAX)
+        return false;
+
+    if (memcmp(src, "PZT", 3) || src[3] != TOPOLOGY_VERSION)
+        return false;
+
+    if (static_cast<size_t>(src[4] | src[5] << 8) != len || modbus::crc16(src, len - 2) != (src[len - 2] | src[len - 1] << 8))
+        return false;
+
+    blob_reader r(src, len - 2);
+    r.get(6);
+    uint8_t nports = r.u8();
+    uint8_t nmeters = r.u8();
+    blob.pollrate = r.u32();
+    if (nports > TOPOLOGY_MAX_PORTS || nmeters > TOPOLOGY_MAX_METERS)
+        return false;
+
+    blob.ports.resize(nports);
+    for (auto &p : blob.ports){
+        p.id = r.u8();
+        p.flags = r.u8();
+        if (p.flags & TOPOLOGY_PORT_UART){
+            p.cfg.p = static_cast<uart_port_t>(r.u8());
+            p.cfg.gpio_rx = static_cast<int8_t>(r.u8());
+            p.cfg.gpio_tx = static_cast<int8_t>(r.u8());
+            p.cfg.uartcfg.baud_rate = r.u32();
+            p.cfg.uartcfg.data_bits = static_cast<uart_word_length_t>(r.u8());
+            p.cfg.uartcfg.parity = static_cast<uart_parity_t>(r.u8());
+            p.cfg.uartcfg.stop_bits = static_cast<uart_stop_bits_t>(r.u8());
+        }
+        p.descr = r.lstr(p.descr_len);
+    }
+
+    blob.meters.resize(nmeters);
+    for (auto &m : blob.meters){
+        m.id = r.u8();
+        m.port = r.u8();
+        m.addr = r.u8();
+        m.model = r.u8();
+        m.descr = r.lstr(m.descr_len);
+        m.rhr = r.lstr(m.rhr_len);
+    }
+
+    // records must take exactly the whole blob
+    if (!r.ok || r.pos != r.len)
+        return false;
+
+    // ports
+    for (auto i = blob.ports.begin(); i != blob.ports.end(); ++i){
+        const PZPort *existing = nullptr;
+        bool uart_busy = false;
+        pool.forEachPort([&](const PZPort *p){
+            if (p->id == i->id)
+                existing = p;
+            if ((i->flags & TOPOLOGY_PORT_UART) && p->getUARTcfg() && p->getUARTcfg()->p == i->cfg.p)
+                uart_busy = true;
+            return true;
+        });
+
+        if (i->flags & TOPOLOGY_PORT_UART){
+            // UART port will be created, it's id and UART must be free
+            if (existing || uart_busy || i->cfg.p >= UART_NUM_MAX || !i->cfg.uartcfg.baud_rate)
+                return false;
+        } else if (!existing)
+            return false;       // external port must be added to the pool beforehand
+
+        for (auto j = blob.ports.begin(); j != i; ++j){
+            if (j->id == i->id)
+                return false;
+            if ((i->flags & j->flags & TOPOLOGY_PORT_UART) && i->cfg.p == j->cfg.p)
+                return false;
+        }
+    }
+
+    // meters
+    for (auto i = blob.meters.begin(); i != blob.meters.end(); ++i){
+        if (i->addr < ADDR_MIN || i->addr > ADDR_MAX || i->rhr_len > sizeof(pzmbus::regimage_t::data))
+            return false;
+
+        switch (static_cast<pzmbus::pzmodel_t>(i->model)){
+            case pzmbus::pzmodel_t::pzem004v3 :
+            case pzmbus::pzmodel_t::pzem003 :
+                break;
+            default:
+                return false;
+        }
+
+        bool port_found = false;
+        for (const auto &p : blob.ports)
+            if (p.id == i->port)
+                port_found = true;
+        if (!port_found)
+            return false;
+
+        if (pool.getPZEMPort(i->id))
+            return false;       // PZEM with this id already exist
+
+        // modbus addresses must be unique on a port, external ports could already have PZEMs attached
+        bool addr_busy = false;
+        pool.forEachPZEM([&](const PZEM *pz){
+            auto port = pool.getPZEMPort(pz->id);
+            if (port && pz->getaddr() == i->addr && port->id == i->port)
+                addr_busy = true;
+            return !addr_busy;
+        });
+        if (addr_busy)
+            return false;
+
+        for (auto j = blob.meters.begin(); j != i; ++j){
+            if (j->id == i->id || (j->port == i->port && j->addr == i->addr))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool validate(const PZPool &pool, const uint8_t *src, size_t len){
+    blob_t blob;
+    return parse(pool, src, len, blob);
+}
+
+bool load(PZPool &pool, const uint8_t *src, size_t len){
+    blob_t blob;
+    if (!parse(pool, src, len, blob))
+        return false;
+
+    char descr[UINT8_MAX + 1];
+    std::vector< std::shared_ptr<PZPort> > ports;
+    std::vector< std::pair<uint8_t, std::unique_ptr<PZEM>> > meters;
+
+    // whole topology is built first and published to the pool with a single update
+    for (auto &p : blob.ports){
+        if (!(p.flags & TOPOLOGY_PORT_UART))
+            continue;
+
+        memcpy(descr, p.descr, p.descr_len);
+        descr[p.descr_len] = 0;
+        ports.emplace_back(std::make_shared<PZPort>(p.id, p.cfg, descr));
+    }
+
+    for (const auto &m : blob.meters){
+        memcpy(descr, m.descr, m.descr_len);
+        descr[m.descr_len] = 0;
+
+        PZEM *pz;
+        if (static_cast<pzmbus::pzmodel_t>(m.model) == pzmbus::pzmodel_t::pzem003)
+            pz = new PZ003(m.id, m.addr, descr);
+        else
+            pz = new PZ004(m.id, m.addr, descr);
+
+        if (m.rhr_len)
+            pz->restoreRegImage(CMD_RHR, m.rhr, m.rhr_len);
+
+        meters.emplace_back(m.port, std::unique_ptr<PZEM>(pz));
+    }
+
+    if (!pool.addBatch(ports, std::move(meters)))
+        return false;
+
+    if (blob.pollrate)
+        pool.setPollrate(blob.pollrate);
+
+    return true;
+}
+
+}   // namespace topology
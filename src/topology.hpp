@@ -0,0 +1,73 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "pzem_edl.hpp"
+
+#define TOPOLOGY_VERSION        1
+#define TOPOLOGY_MAX_PORTS      16      // max ports in a blob
+#define TOPOLOGY_MAX_METERS     64      // max meters in a blob
+
+/**
+ * @brief save/load PZPool topology and configuration as a compact binary blob
+ * Blob contains ports with UART configuration, PZEM ids, addresses, models, descriptions,
+ * pool poll rate and the last known RHR image of each PZEM (alarm thresholds, shunt type, etc...),
+ * so that a pool could be rebuilt on boot without re-discovery.
+ *
+ * Layout, all values are little endian:
+ *  header  : "PZT", version, uint16 blob length, uint8 ports, uint8 meters, uint32 poll rate ms
+ *  port    : id, flags, [uart num, int8 gpio_rx, int8 gpio_tx, uint32 baud, data bits, parity, stop bits], descr
+ *  meter   : id, port id, modbus addr, model, descr, RHR image
+ *  trailer : uint16 modbus crc16 of all preceding bytes
+ * strings and images are stored as length byte followed by data.
+ *
+ * Ports that were not created from UART_cfg (i.e. NullQ or any other MsgQ) are stored by id only,
+ * such ports must be added to the pool before loading a blob.
+ */
+namespace topology {
+
+/**
+ * @brief serialize pool topology into buffer
+ *
+ * @param pool - PZPool object
+ * @param dst - destination buffer, could be nullptr to get required size
+ * @param len - buffer size
+ * @return size_t - blob size, 0 if buffer is too small or pool exceeds blob limits
+ */
+size_t save(const PZPool &pool, uint8_t *dst, size_t len);
+
+/**
+ * @brief check that blob is intact and could be loaded into pool
+ * checks version, length, CRC, records consistency and id/address/UART clashes with the objects
+ * that already exist in the pool
+ *
+ * @param pool - PZPool object blob would be loaded to
+ * @param src - blob data
+ * @param len - blob size
+ * @return true if blob is valid
+ */
+bool validate(const PZPool &pool, const uint8_t *src, size_t len);
+
+/**
+ * @brief create ports and PZEM objects from a blob
+ * blob is validated first, pool is not changed if validation fails.
+ * PZEM state is restored from saved RHR image, so thresholds and options are available without polling devices
+ *
+ * @param pool - PZPool object
+ * @param src - blob data
+ * @param len - blob size
+ * @return true on success
+ */
+bool load(PZPool &pool, const uint8_t *src, size_t len);
+
+}   // namespace topology
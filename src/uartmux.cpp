@@ -0,0 +1,211 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#include "uartmux.hpp"
+#include "driver/gpio.h"
+
+// keep disconnected TX line in idle (high) state
+static void tx_idle(int gpio){
+    if (gpio < 0)
+        return;
+
+    gpio_reset_pin(static_cast<gpio_num_t>(gpio));
+    gpio_set_direction(static_cast<gpio_num_t>(gpio), GPIO_MODE_OUTPUT);
+    gpio_set_level(static_cast<gpio_num_t>(gpio), 1);
+}
+
+// ****  UartMux  **** //
+
+UartMux::UartMux(const uart_port_t p, std::vector<uart_pins_t> gpios, size_t burst, uart_config_t cfg) :
+    pins(std::move(gpios)), chans(pins.size(), nullptr), txq(pins.size()), sched(pins.size(), burst) {
+
+    lock = xSemaphoreCreateMutex();
+    pending_sem = xSemaphoreCreateCounting(pins.size() * MUX_CH_Q_DEPTH, 0);
+    reply_sem = xSemaphoreCreateBinary();
+
+    for (size_t i = 1; i < pins.size(); ++i)
+        tx_idle(pins[i].gpio_tx);
+
+    // UART is connected to the first channel
+    uq.reset(new UartQ(p, cfg, pins.empty() ? UART_PIN_NO_CHANGE : pins[0].gpio_rx, pins.empty() ? UART_PIN_NO_CHANGE : pins[0].gpio_tx));
+    active = 0;
+    // only RX task is started, TX is done by mux task
+    uq->attach_RX_hndlr([this](RX_msg *msg){ rx_handler(msg); });
+}
+
+UartMux::~UartMux(){
+    stop();
+    uq.reset();
+
+    for (auto &q : txq){
+        for (auto m : q)
+            delete m;
+    }
+
+    vSemaphoreDelete(reply_sem);
+    vSemaphoreDelete(pending_sem);
+    vSemaphoreDelete(lock);
+}
+
+MsgQ* UartMux::channel(uint8_t idx){
+    if (idx >= pins.size())
+        return nullptr;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    MuxChannelQ *c = nullptr;
+    if (!chans[idx]){
+        c = new MuxChannelQ(shared_from_this(), idx);
+        chans[idx] = c;
+    }
+    xSemaphoreGive(lock);
+    return c;
+}
+
+void UartMux::detach(uint8_t ch){
+    xSemaphoreTake(lock, portMAX_DELAY);
+    chans[ch] = nullptr;
+    for (auto m : txq[ch])
+        delete m;
+    txq[ch].clear();
+    sched.clear(ch);
+    xSemaphoreGive(lock);
+}
+
+bool UartMux::start(){
+    if (t_mux)
+        return true;
+
+    return xTaskCreate(UartMux::muxTask, MUX_TASK_NAME, MUX_TASK_STACK, reinterpret_cast<void *>(this), MUX_TASK_PRIO, &t_mux) == pdPASS;
+}
+
+void UartMux::stop(){
+    if (!t_mux)
+        return;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    vTaskDelete(t_mux);
+    t_mux = nullptr;
+    xSemaphoreGive(lock);
+}
+
+bool UartMux::enqueue(uint8_t ch, TX_msg *msg){
+    if (!msg)
+        return false;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    MuxChannelQ *c = chans[ch];
+    bool ok = txq[ch].size() < MUX_CH_Q_DEPTH;
+    if (ok){
+        txq[ch].push_back(msg);
+        sched.push(ch);
+        ++c->stats.tx;
+    } else
+        ++c->stats.tx_drop;
+    xSemaphoreGive(lock);
+
+    if (!ok){
+        delete msg;
+        return false;
+    }
+
+    xSemaphoreGive(pending_sem);
+    return true;
+}
+
+void UartMux::select(uint8_t ch){
+    uart_wait_tx_done(uq->port, pdMS_TO_TICKS(PZEM_UART_TIMEOUT));
+    if (active >= 0)
+        tx_idle(pins[active].gpio_tx);
+
+    uart_set_pin(uq->port, pins[ch].gpio_tx, pins[ch].gpio_rx, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_flush_input(uq->port);     // drop any noise captured while switching
+    active = ch;
+}
+
+void UartMux::rx_handler(RX_msg *msg){
+    MsgQ::rxdatahandler_t cb;
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!rx_window){
+        // late reply or noise, active channel might not be the one it came from
+        xSemaphoreGive(lock);
+        ESP_LOGD(TAG, "mux RX out of transaction window, %u bytes dropped", static_cast<unsigned>(msg->len));
+        delete msg;
+        return;
+    }
+    rx_window = false;
+    MuxChannelQ *c = active >= 0 ? chans[active] : nullptr;
+    if (c){
+        ++c->stats.rx;
+        if (!msg->valid)
+            ++c->stats.rx_err;
+        cb = c->rx_callback;
+    }
+    xSemaphoreGive(lock);
+
+    xSemaphoreGive(reply_sem);          // transaction is complete, line could be switched
+
+    if (cb)
+        cb(msg);                        // handler takes ownership on the message
+    else
+        delete msg;
+}
+
+void UartMux::muxhndlr(){
+    for (;;){
+        // 'xSemaphoreTake' will "sleep" untill some message is enqueued to any channel
+        if (xSemaphoreTake(pending_sem, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        TX_msg *msg = nullptr;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        int ch = sched.next();
+        if (ch >= 0 && !txq[ch].empty()){
+            msg = txq[ch].front();
+            txq[ch].pop_front();
+        }
+        xSemaphoreGive(lock);
+
+        if (!msg)
+            continue;           // channel has been destroyed with pending messages
+
+        if (ch != active)
+            select(ch);
+
+        bool w4rx = msg->w4rx;
+        xSemaphoreTake(lock, portMAX_DELAY);
+        rx_window = w4rx;
+        xSemaphoreGive(lock);
+        xSemaphoreTake(reply_sem, 0);       // drop a late reply signal from previous transaction
+        uq->rx_prepare(msg);
+        uart_write_bytes(uq->port, (const char*)msg->data, msg->len);
+        delete msg;
+
+        // pins are not switched until reply is received or timed out
+        if (w4rx){
+            if (xSemaphoreTake(reply_sem, pdMS_TO_TICKS(PZEM_UART_TIMEOUT)) != pdTRUE){
+                xSemaphoreTake(lock, portMAX_DELAY);
+                rx_window = false;          // reply window is closed, anything received later is dropped
+                xSemaphoreGive(lock);
+            }
+        } else
+            uart_wait_tx_done(uq->port, pdMS_TO_TICKS(PZEM_UART_TIMEOUT));
+    }
+    // Task needs to self-terminate before returning (but we should not ever reach this point anyway)
+    vTaskDelete(NULL);
+}
+
+// ****  MuxChannelQ  **** //
+
+MuxChannelQ::~MuxChannelQ(){
+    mux->detach(ch);
+}
@@ -0,0 +1,174 @@
+/*
+PZEM EDL - PZEM Event Driven Library
+
+This code implements communication and data exchange with PZEM004T V3.0 module using MODBUS proto
+and provides an API for energy metrics monitoring and data processing.
+
+This file is part of the 'PZEM event-driven library' project.
+
+Copyright (C) Emil Muratov, 2024
+GitHub: https://github.com/vortigont/pzem-edl
+*/
+
+#pragma once
+
+#include "msgq.hpp"
+#include "muxsched.hpp"
+#include "freertos/semphr.h"
+#include <deque>
+
+#define MUX_CH_Q_DEPTH          tx_msg_q_DEPTH  // TX queue depth per channel
+#define MUX_TASK_PRIO           2
+#define MUX_TASK_STACK          2048
+#define MUX_TASK_NAME           "UART_MUX"
+
+/**
+ * @brief RX/TX GPIO pair of a multiplexed sub-bus
+ */
+struct uart_pins_t {
+    int gpio_rx;
+    int gpio_tx;
+};
+
+class MuxChannelQ;
+
+/**
+ * @brief time-sliced UART multiplexer
+ * Drives several sub-buses from one hardware UART by switching it's RX/TX GPIOs with uart_set_pin().
+ * Each sub-bus is presented as a separate MsgQ channel that could be wrapped into PZPort and added to PZPool,
+ * so that the number of meters per controller is no longer limited by the number of hardware UARTs.
+ *
+ * Transactions are serialized by the mux task, pins are switched only between transactions, i.e. after a reply
+ * has been received or has timed out. Replies are framed by UartQ, data received after transaction window
+ * has closed is dropped and is not charged to any channel. Order of channels is decided by MuxScheduler to minimize switches
+ * and keep sub-buses evenly refreshed.
+ *
+ *  auto mux = std::make_shared<UartMux>(UART_NUM_1, std::vector<uart_pins_t>{{16, 17}, {18, 19}, {21, 22}});
+ *  for (uint8_t i = 0; i != mux->channels(); ++i)
+ *      pool.addPort(std::make_shared<PZPort>(i, mux->channel(i)));
+ */
+class UartMux : public std::enable_shared_from_this<UartMux> {
+    friend class MuxChannelQ;
+
+    std::unique_ptr<UartQ> uq;                      // UART driver and RX handler, TX is done by mux task
+    std::vector<uart_pins_t> pins;
+    std::vector<MuxChannelQ*> chans;                // channel objects, nullptr if not created (yet)
+    std::vector< std::deque<TX_msg*> > txq;         // pending TX messages per channel
+    MuxScheduler sched;
+    int active = -1;                                // channel currently connected to UART pins
+    TaskHandle_t t_mux = nullptr;
+    SemaphoreHandle_t lock;                         // protects queues, channels and scheduler
+    SemaphoreHandle_t pending_sem;                  // counts pending TX messages
+    SemaphoreHandle_t reply_sem;                    // given on reply within transaction window
+    bool rx_window = false;                         // transaction is waiting for a reply, RX out of window is dropped
+
+    // enqueue message from a channel
+    bool enqueue(uint8_t ch, TX_msg *msg);
+
+    // channel object is destroyed
+    void detach(uint8_t ch);
+
+    // connect UART to a channel pins
+    void select(uint8_t ch);
+
+    void rx_handler(RX_msg *msg);
+
+    void muxhndlr();
+
+    // static wrapper for Task to call mux handler class member
+    static void muxTask(void* pvParams){
+        (reinterpret_cast<UartMux*>(pvParams))->muxhndlr();
+    }
+
+public:
+    /**
+     * @brief Construct a new UART multiplexer
+     *
+     * @param p - UART port
+     * @param gpios - RX/TX GPIO pairs, one per channel
+     * @param burst - max transactions per channel slice, see MuxScheduler
+     * @param cfg - UART configuration, same for all channels
+     */
+    UartMux(const uart_port_t p, std::vector<uart_pins_t> gpios, size_t burst = MUXSCHED_BURST,
+            uart_config_t cfg = {   // default values for PZEM004tv30
+                .baud_rate = PZEM_BAUD_RATE,
+                .data_bits = UART_DATA_8_BITS,
+                .parity = UART_PARITY_DISABLE,
+                .stop_bits = UART_STOP_BITS_1,
+                .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+                .rx_flow_ctrl_thresh = 0
+            });
+    ~UartMux();
+
+    // Copy semantics : forbidden
+    UartMux(const UartMux&) = delete;
+    UartMux& operator=(const UartMux&) = delete;
+
+    /**
+     * @brief create a message queue for a channel
+     * channel object keeps mux alive, so mux must be owned by a shared_ptr
+     *
+     * @param idx - channel index
+     * @return MsgQ* - new channel object, nullptr if index is out of range or channel already exist
+     */
+    MsgQ* channel(uint8_t idx);
+
+    /**
+     * @brief number of channels
+     */
+    size_t channels() const { return pins.size(); }
+
+    /**
+     * @brief start mux task
+     *
+     * @return true if running
+     */
+    bool start();
+
+    /**
+     * @brief stop mux task, pending messages are kept
+     */
+    void stop();
+
+    /**
+     * @brief number of pin switches made so far
+     */
+    uint32_t getSwitches() const { return sched.switches(); }
+};
+
+/**
+ * @brief message queue of a multiplexed UART channel
+ */
+class MuxChannelQ : public MsgQ {
+    friend class UartMux;               // mux feeds RX messages and counts stats
+    std::shared_ptr<UartMux> mux;
+
+public:
+    const uint8_t ch;
+
+    MuxChannelQ(std::shared_ptr<UartMux> m, uint8_t idx) : mux(m), ch(idx) {}
+    virtual ~MuxChannelQ();
+
+    // Copy semantics : forbidden
+    MuxChannelQ(const MuxChannelQ&) = delete;
+    MuxChannelQ& operator=(const MuxChannelQ&) = delete;
+
+    /**
+     * @brief starts mux task if it is not running yet
+     */
+    bool startQueues() override { return mux->start(); }
+
+    /**
+     * @brief mux is shared between channels and is not stopped
+     */
+    void stopQueues() override {}
+
+    /**
+     * @brief enqueue message to be sent once the mux switches to this channel
+     * this method will take ownership on TX_msg object and 'delete' it
+     *
+     * @return true - if mesage has been enqueue's successfully
+     * @return false - if channel queue is full
+     */
+    bool txenqueue(TX_msg *msg) override { return mux->enqueue(ch, msg); }
+};